@@ -0,0 +1,104 @@
+//
+// Created by maxim on 16.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Tiny microbenchmark harness. Each benchmark is calibrated to run for at least MIN_BATCH_TIME,
+// then measured REPETITIONS times; the median batch is reported. Allocations are counted by the
+// global operator new replacement in main_bench.cpp.
+namespace Bench
+{
+    inline std::atomic<uint64_t> allocation_count{0};
+
+    template<typename T>
+    inline void doNotOptimize(T const& value) {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "r,m"(value) : "memory");
+#else
+        static volatile const void* sink;
+        sink = &value;
+#endif
+    }
+
+    struct Result {
+        std::string name;
+        uint64_t iterations = 0;
+        double ns_per_op = 0.0;
+        double bytes_per_second = 0.0;
+        double allocations_per_op = 0.0;
+    };
+
+    class Runner {
+    public:
+        explicit Runner(std::string filter) : filter_(std::move(filter)) {}
+
+        // body() performs one operation; bytes_per_op is the payload it processes (0 if n/a).
+        template<typename Body>
+        void run(const std::string& name, size_t bytes_per_op, Body&& body) {
+            if (!filter_.empty() && name.find(filter_) == std::string::npos) {
+                return;
+            }
+
+            uint64_t iterations = 1;
+            while (batch_time(iterations, body) < MIN_BATCH_TIME && iterations < (uint64_t{1} << 40)) {
+                iterations *= 2;
+            }
+
+            std::vector<double> batches;
+            uint64_t allocations = 0;
+            for (int r = 0; r < REPETITIONS; ++r) {
+                uint64_t before = allocation_count.load(std::memory_order_relaxed);
+                batches.push_back(std::chrono::duration<double, std::nano>(batch_time(iterations, body)).count());
+                allocations += allocation_count.load(std::memory_order_relaxed) - before;
+            }
+            std::nth_element(batches.begin(), batches.begin() + REPETITIONS / 2, batches.end());
+            double median_ns = batches[REPETITIONS / 2];
+
+            Result result;
+            result.name = name;
+            result.iterations = iterations;
+            result.ns_per_op = median_ns / static_cast<double>(iterations);
+            result.bytes_per_second = bytes_per_op == 0 ? 0.0 : static_cast<double>(bytes_per_op) * 1e9 / result.ns_per_op;
+            result.allocations_per_op = static_cast<double>(allocations) / static_cast<double>(iterations * REPETITIONS);
+            print(result);
+            results_.push_back(result);
+        }
+
+        static void printHeader() {
+            std::printf("%-48s %12s %14s %12s %12s\n", "benchmark", "ns/op", "MB/s", "allocs/op", "iterations");
+        }
+
+        [[nodiscard]] const std::vector<Result>& results() const { return results_; }
+
+    private:
+        static constexpr auto MIN_BATCH_TIME = std::chrono::milliseconds(50);
+        static constexpr int REPETITIONS = 5;
+
+        template<typename Body>
+        static std::chrono::steady_clock::duration batch_time(uint64_t iterations, Body& body) {
+            auto start = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; i < iterations; ++i) {
+                body();
+            }
+            return std::chrono::steady_clock::now() - start;
+        }
+
+        static void print(const Result& result) {
+            std::printf("%-48s %12.1f %14.1f %12.2f %12llu\n", result.name.c_str(), result.ns_per_op,
+                        result.bytes_per_second / 1e6, result.allocations_per_op,
+                        static_cast<unsigned long long>(result.iterations));
+            std::fflush(stdout);
+        }
+
+        std::string filter_;
+        std::vector<Result> results_;
+    };
+}
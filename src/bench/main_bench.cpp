@@ -0,0 +1,1054 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <WebSocketSession.h>
+#include <WebSocketSessionRegistry.h>
+#include <BinaryData.h>
+#include <HashRing.h>
+#include <Logger.h>
+#include <RoomProtocol.h>
+#include <TimerWheel.h>
+#include <Utilities.h>
+
+#include "AudioMixer.h"
+#include "GainMatrix.h"
+#include "MatrixMixer.h"
+#include "Bench.h"
+
+// Count every heap allocation so benchmarks can report allocations/op. Every form of new is
+// replaced, aligned and nothrow ones included, and all of them allocate with malloc or
+// aligned_alloc, so every form of delete can free().
+namespace
+{
+    void* countedAllocate(std::size_t size, std::size_t alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__) noexcept {
+        Bench::allocation_count.fetch_add(1, std::memory_order_relaxed);
+        size = size == 0 ? 1 : size;
+        if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            return std::malloc(size);
+        }
+        // aligned_alloc wants a multiple of the alignment
+        return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    }
+
+    void* countedAllocateOrThrow(std::size_t size, std::size_t alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        if (void* p = countedAllocate(size, alignment)) {
+            return p;
+        }
+        throw std::bad_alloc();
+    }
+}
+
+void* operator new(std::size_t size) { return countedAllocateOrThrow(size); }
+void* operator new[](std::size_t size) { return countedAllocateOrThrow(size); }
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return countedAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return countedAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return countedAllocate(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return countedAllocate(size); }
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return countedAllocate(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return countedAllocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+
+namespace
+{
+    constexpr int SAMPLE_RATE = 44100;
+
+    std::vector<AudioPacket> make_packets(size_t count, size_t samples, std::mt19937& random) {
+        std::uniform_int_distribution<int> sample(INT16_MIN, INT16_MAX);
+        std::vector<AudioPacket> packets;
+        for (size_t p = 0; p < count; ++p) {
+            std::vector<int16_t> data(samples);
+            for (auto& s : data) {
+                s = static_cast<int16_t>(sample(random));
+            }
+            packets.emplace_back(reinterpret_cast<const uint8_t*>(data.data()), data.size() * sizeof(int16_t));
+        }
+        return packets;
+    }
+
+    // A packet of frames in format, full scale noise
+    AudioPacket make_pcm_packet(Pcm::Format format, size_t frames, std::mt19937& random) {
+        std::vector<uint8_t> bytes(frames * format.bytesPerFrame());
+        size_t samples = frames * format.channels;
+        if (format.sample == Pcm::SampleType::Float32) {
+            std::uniform_real_distribution<float> sample(-1.0f, 1.0f);
+            auto* out = reinterpret_cast<float*>(bytes.data());
+            for (size_t i = 0; i < samples; ++i) {
+                out[i] = sample(random);
+            }
+        } else {
+            std::uniform_int_distribution<int> sample(INT16_MIN, INT16_MAX);
+            auto* out = reinterpret_cast<int16_t*>(bytes.data());
+            for (size_t i = 0; i < samples; ++i) {
+                out[i] = static_cast<int16_t>(sample(random));
+            }
+        }
+        return AudioPacket(std::move(bytes));
+    }
+
+    const std::vector<Pcm::Format> PCM_FORMATS = {
+        {Pcm::SampleType::Int16, 1}, {Pcm::SampleType::Int16, 2},
+        {Pcm::SampleType::Float32, 1}, {Pcm::SampleType::Float32, 2},
+    };
+
+    std::vector<uint8_t> mask_frame(const std::vector<uint8_t>& payload, WebSocketOpCode opcode) {
+        // Client-to-server frames are masked, so parse the same shape a browser sends
+        auto frame = WebSocketSession::create_websocket_frame(payload, opcode);
+        size_t header = frame.size() - payload.size();
+        const uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+        frame[1] |= 0x80;
+        frame.insert(frame.begin() + static_cast<std::ptrdiff_t>(header), mask, mask + 4);
+        for (size_t i = 0; i < payload.size(); ++i) {
+            frame[header + 4 + i] ^= mask[i % 4];
+        }
+        return frame;
+    }
+
+    void bench_mixer(Bench::Runner& runner, std::mt19937& random) {
+        for (double frame_ms : {10.0, 20.0}) {
+            auto samples = static_cast<size_t>(SAMPLE_RATE * frame_ms / 1000.0);
+            for (size_t room_size : {2, 8, 32, 128}) {
+                // A listener mixes everyone but itself
+                auto packets = make_packets(room_size - 1, samples, random);
+                size_t bytes = (room_size - 1) * samples * sizeof(int16_t);
+                runner.run("mixer/room=" + std::to_string(room_size) + "/frame=" + std::to_string(static_cast<int>(frame_ms)) + "ms",
+                           bytes, [&packets]() {
+                    Bench::doNotOptimize(AudioMixer::mix(packets));
+                });
+            }
+        }
+    }
+
+    // Every listener of a room at once against one AudioMixer::mix() per listener, both over
+    // the packets of everyone else. Rooms where everyone talks: the matrix at its densest.
+    void bench_matrix_mixer(Bench::Runner& runner, std::mt19937& random) {
+        auto samples = static_cast<size_t>(SAMPLE_RATE * 20 / 1000);
+        for (size_t room_size : {8, 32, 128}) {
+            auto packets = make_packets(room_size, samples, random);
+            size_t bytes = room_size * (room_size - 1) * samples * sizeof(int16_t);
+            std::string suffix = "/room=" + std::to_string(room_size) + "/frame=20ms";
+            runner.run("mixer/per_listener" + suffix, bytes, [&packets, room_size]() {
+                for (size_t listener = 0; listener < room_size; ++listener) {
+                    std::vector<AudioPacket> others;
+                    for (size_t sender = 0; sender < room_size; ++sender) {
+                        if (sender != listener) {
+                            others.push_back(packets[sender]);
+                        }
+                    }
+                    Bench::doNotOptimize(AudioMixer::mix(others));
+                }
+            });
+            MatrixMixer mixer;
+            runner.run("mixer/matrix" + suffix, bytes, [&packets, &mixer, room_size]() {
+                mixer.begin(room_size);
+                for (size_t sender = 0; sender < room_size; ++sender) {
+                    mixer.addSource(std::span(&packets[sender], 1));
+                }
+                for (size_t listener = 0; listener < room_size; ++listener) {
+                    for (size_t sender = 0; sender < room_size; ++sender) {
+                        mixer.route(sender, listener, sender == listener ? 0.0f : 1.0f);
+                    }
+                }
+                mixer.mix();
+                for (size_t listener = 0; listener < room_size; ++listener) {
+                    Bench::doNotOptimize(mixer.output(listener));
+                }
+            });
+        }
+    }
+
+    // Each specialization of the sample pipeline against the loops for any frame length: a
+    // packet into a room of its channels, a mix out to a listener of the format, and a room of
+    // 32 all in the format mixing a tick.
+    void bench_pcm(Bench::Runner& runner, std::mt19937& random) {
+        for (const auto& format : PCM_FORMATS) {
+            for (size_t frames : {Pcm::FRAME_10MS, Pcm::FRAME_20MS}) {
+                auto packet = make_pcm_packet(format, frames, random);
+                std::vector<float> mix(format.channels * frames);
+                std::vector<uint8_t> out(packet.size());
+                std::string suffix = "/" + format.name() + "/frame=" + std::to_string(frames * 1000 / Pcm::SAMPLE_RATE) + "ms";
+                for (bool specialize : {true, false}) {
+                    std::string variant = specialize ? "/fixed" : "/generic";
+                    runner.run("pcm/accumulate" + suffix + variant, packet.size(), [&, specialize]() {
+                        Pcm::dispatch(format.sample, format.channels, format.channels, frames, specialize,
+                                      [&]<typename Sample, size_t In, size_t Out, size_t Frames>() {
+                                          Pcm::accumulate<Sample, In, Out, Frames>(packet.data(), frames, 1.0f,
+                                                                                  mix.data(), frames);
+                                      });
+                        Bench::doNotOptimize(mix.data());
+                    });
+                    runner.run("pcm/encode" + suffix + variant, packet.size(), [&, specialize]() {
+                        Pcm::dispatch(format.sample, format.channels, format.channels, frames, specialize,
+                                      [&]<typename Sample, size_t In, size_t Out, size_t Frames>() {
+                                          Pcm::encode<Sample, In, Out, Frames>(mix.data(), nullptr, 1.0f, frames,
+                                                                              frames, AudioMixer::HEADROOM, out.data());
+                                      });
+                        Bench::doNotOptimize(out.data());
+                    });
+                }
+
+                constexpr size_t ROOM = 32;
+                std::vector<AudioPacket> packets;
+                for (size_t sender = 0; sender < ROOM; ++sender) {
+                    packets.push_back(make_pcm_packet(format, frames, random));
+                }
+                for (bool specialize : {true, false}) {
+                    MatrixMixer mixer(specialize);
+                    runner.run("mixer/matrix" + suffix + (specialize ? "/fixed" : "/generic"),
+                               ROOM * (ROOM - 1) * packet.size(), [&]() {
+                        mixer.begin(ROOM, format.channels);
+                        for (const auto& sent : packets) {
+                            mixer.addSource(std::span(&sent, 1), format);
+                        }
+                        for (size_t listener = 0; listener < ROOM; ++listener) {
+                            for (size_t sender = 0; sender < ROOM; ++sender) {
+                                mixer.route(sender, listener, sender == listener ? 0.0f : 1.0f);
+                            }
+                        }
+                        mixer.mix();
+                        for (size_t listener = 0; listener < ROOM; ++listener) {
+                            Bench::doNotOptimize(mixer.output(listener, format));
+                        }
+                    });
+                }
+            }
+        }
+    }
+
+    void bench_websocket(Bench::Runner& runner, std::mt19937& random) {
+        for (size_t size : {64, 1764, 16384}) {
+            std::vector<uint8_t> payload(size);
+            for (auto& b : payload) {
+                b = static_cast<uint8_t>(random());
+            }
+            runner.run("websocket/create_frame/" + std::to_string(size) + "B", size, [&payload]() {
+                Bench::doNotOptimize(WebSocketSession::create_websocket_frame(payload, WebSocketOpCode::Binary));
+            });
+
+            // Includes copying the frame into the receive buffer, as a socket read would
+            auto frame = mask_frame(payload, WebSocketOpCode::Binary);
+            size_t delivered = 0;
+            WebSocketFrameParser parser;
+            parser.setMessageHandler([&delivered](WebSocketOpCode, std::span<const uint8_t> message) {
+                delivered += message.size();
+            });
+            runner.run("websocket/parse_frame/" + std::to_string(size) + "B", size, [&frame, &parser]() {
+                auto space = parser.prepare();
+                std::memcpy(space.data(), frame.data(), frame.size());
+                parser.commit(frame.size());
+            });
+            Bench::doNotOptimize(delivered);
+        }
+
+        // Unmasking alone, against the byte-at-a-time loop it replaced. The +1 offset makes the
+        // payload unaligned, as it is behind a 6 or 8 byte frame header.
+        const uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+        for (size_t size : {64, 1764, 16384}) {
+            std::vector<uint8_t> buffer(size + 1);
+            runner.run("websocket/unmask_bytewise/" + std::to_string(size) + "B", size, [&buffer, &mask, size]() {
+                uint8_t* data = buffer.data() + 1;
+                for (size_t i = 0; i < size; ++i) {
+                    data[i] ^= mask[i % 4];
+                }
+                Bench::doNotOptimize(buffer);
+            });
+            runner.run("websocket/unmask/" + std::to_string(size) + "B", size, [&buffer, &mask, size]() {
+                WebSocketFrameParser::unmask(buffer.data() + 1, size, mask, 0);
+                Bench::doNotOptimize(buffer);
+            });
+        }
+
+        const std::string key = "dGhlIHNhbXBsZSBub25jZQ==";
+        runner.run("websocket/accept_key", key.size(), [&key]() {
+            Bench::doNotOptimize(WebSocketSession::generate_websocket_accept(key));
+        });
+    }
+
+    // One 20 ms audio frame to 10k sessions. The sessions' sockets are never connected and the
+    // io_context never runs, so this measures framing and queueing, not syscalls; each queue
+    // sits at the send policy limit and drops its oldest frame per send, as for a stalled client.
+    void bench_broadcast(Bench::Runner& runner) {
+        constexpr size_t SESSIONS = 10000;
+        asio::io_context io_context;
+        WebSocketSessionRegistry registry;
+        std::vector<std::shared_ptr<WebSocketSession>> sessions;
+        for (size_t i = 0; i < SESSIONS; ++i) {
+            auto session = std::make_shared<WebSocketSession>(tcp::socket(io_context));
+            registry.add(session);
+            sessions.push_back(session);
+        }
+        const std::vector<uint8_t> message(1764, 0x5A);
+        const std::string name = "/" + std::to_string(SESSIONS) + "_sessions";
+
+        runner.run("websocket/broadcast_per_session" + name, message.size() * SESSIONS, [&sessions, &message]() {
+            for (const auto& session : sessions) {
+                session->send(message, WebSocketOpCode::Binary);
+            }
+        });
+        runner.run("websocket/broadcast_encode_once" + name, message.size() * SESSIONS, [&registry, &message]() {
+            registry.broadcast(message, WebSocketOpCode::Binary);
+        });
+    }
+
+    // The worked example from RFC 6455 section 1.3.
+    bool check_accept_key() {
+        std::string accept = WebSocketSession::generate_websocket_accept("dGhlIHNhbXBsZSBub25jZQ==");
+        if (accept != "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") {
+            std::cerr << "accept key mismatch: " << accept << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Adding a backend must only move rooms to it, about 1/n of them, and removing it again
+    // must give every room back to its previous owner.
+    bool check_hash_ring() {
+        constexpr size_t ROOMS = 100000;
+        HashRing ring;
+        for (int i = 1; i <= 10; ++i) {
+            ring.add("voice-" + std::to_string(i));
+        }
+        std::vector<std::string> before(ROOMS);
+        for (size_t room = 0; room < ROOMS; ++room) {
+            before[room] = *ring.lookup("room-" + std::to_string(room));
+        }
+        ring.add("voice-11");
+        size_t moved = 0;
+        for (size_t room = 0; room < ROOMS; ++room) {
+            const std::string& owner = *ring.lookup("room-" + std::to_string(room));
+            if (owner != before[room]) {
+                if (owner != "voice-11") {
+                    std::cerr << "hash ring moved room-" << room << " between existing backends" << std::endl;
+                    return false;
+                }
+                ++moved;
+            }
+        }
+        // 1/11 of the rooms, give or take the unevenness of 160 points per backend
+        if (moved < ROOMS / 11 / 2 || moved > ROOMS / 11 * 2) {
+            std::cerr << "hash ring moved " << moved << " of " << ROOMS << " rooms" << std::endl;
+            return false;
+        }
+        ring.remove("voice-11");
+        for (size_t room = 0; room < ROOMS; ++room) {
+            if (*ring.lookup("room-" + std::to_string(room)) != before[room]) {
+                std::cerr << "hash ring did not restore room-" << room << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Against a map of deadlines, the liveness wheel must fire every timer in the tick its
+    // deadline falls in, never before it, also when its deadline was moved later or earlier or
+    // lies past level 0, level 1 or the whole wheel; what fired must be gone from it.
+    bool check_timer_wheel(std::mt19937& random) {
+        using wheel_clock = std::chrono::steady_clock;
+        constexpr auto TICK = std::chrono::milliseconds(10);
+        constexpr size_t KEYS = 2000;
+        auto start = wheel_clock::now();
+        TimerWheel<uint32_t, uint32_t> wheel(TICK, start);
+        std::unordered_map<uint32_t, wheel_clock::time_point> deadlines;
+        auto now = start;
+        bool ok = true;
+        auto on_expired = [&](const uint32_t& key, uint32_t& value) {
+            auto it = deadlines.find(key);
+            if (it == deadlines.end() || value != key) {
+                std::cerr << "timer wheel fired unknown or cancelled key " << key << std::endl;
+                ok = false;
+                return;
+            }
+            if (it->second > now || it->second <= now - TICK) {
+                std::cerr << "timer wheel fired key " << key << " "
+                          << std::chrono::duration_cast<std::chrono::milliseconds>(now - it->second).count()
+                          << " ms from its deadline" << std::endl;
+                ok = false;
+            }
+            deadlines.erase(it);
+        };
+
+        // Up to 3 minutes ahead, which crosses levels 0 (2.56 s) and 1 (164 s), at random
+        // offsets within a tick
+        std::uniform_int_distribution<uint32_t> key(0, KEYS - 1);
+        std::uniform_int_distribution<int64_t> ahead(1, 180000000);  // microseconds
+        for (int step = 0; step < 30000 && ok; ++step) {
+            for (int op = 0; op < 4; ++op) {
+                uint32_t k = key(random);
+                auto deadline = now + std::chrono::microseconds(ahead(random) >> (random() % 12));
+                switch (random() % 4) {
+                    case 0:
+                        wheel.schedule(k, deadline, k);
+                        deadlines[k] = deadline;
+                        break;
+                    case 1:  // Active again: a later deadline, or an earlier one
+                        if (wheel.reschedule(k, deadline) != nullptr) {
+                            deadlines[k] = deadline;
+                        } else if (deadlines.count(k) != 0) {
+                            std::cerr << "timer wheel lost key " << k << std::endl;
+                            return false;
+                        }
+                        break;
+                    case 2:
+                        if (wheel.cancel(k) != (deadlines.erase(k) != 0)) {
+                            std::cerr << "timer wheel cancelled key " << k << " wrongly" << std::endl;
+                            return false;
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+            now += TICK;
+            wheel.advance(now, on_expired);
+            for (const auto& [k, deadline] : deadlines) {
+                if (deadline <= now) {
+                    std::cerr << "timer wheel did not fire key " << k << " by its deadline" << std::endl;
+                    return false;
+                }
+            }
+            if (wheel.size() != deadlines.size()) {
+                std::cerr << "timer wheel holds " << wheel.size() << " timers, not " << deadlines.size() << std::endl;
+                return false;
+            }
+        }
+        for (const auto& [k, deadline] : deadlines) {
+            if (wheel.find(k) == nullptr) {
+                std::cerr << "timer wheel lost key " << k << std::endl;
+                return false;
+            }
+        }
+
+        // Past the whole wheel (2^26 ticks), the deadline is parked and re-filed until in range
+        deadlines.clear();
+        TimerWheel<uint32_t, uint32_t> far(TICK, now);
+        auto beyond = now + TICK * ((uint64_t{1} << 26) + 300) + std::chrono::milliseconds(3);
+        far.schedule(7, beyond, 7);
+        deadlines[7] = beyond;
+        now = beyond - TICK;
+        if (far.advance(now, on_expired) != 0) {
+            std::cerr << "timer wheel fired a deadline past the wheel early" << std::endl;
+            return false;
+        }
+        now += TICK;
+        if (far.advance(now, on_expired) != 1 || far.size() != 0 || far.find(7) != nullptr) {
+            std::cerr << "timer wheel did not fire a deadline past the wheel" << std::endl;
+            return false;
+        }
+        return ok;
+    }
+
+    // Arguments survive the trip through a record and are formatted on the logger thread with
+    // the time of the log() call; a string too long for the record is cut, not the ones after it.
+    bool check_logger() {
+        struct Capture : AsyncLogger::LogDestination {
+            std::mutex mutex;
+            std::vector<AsyncLogger::LogEntry> entries;
+            void write(const AsyncLogger::LogEntry& entry) override {
+                std::lock_guard<std::mutex> lock(mutex);
+                entries.push_back(entry);
+            }
+        };
+        auto capture = std::make_shared<Capture>();
+        auto before = std::chrono::system_clock::now();
+        {
+            AsyncLogger logger(16);
+            logger.addDestination(capture);
+            std::string owned = "session";
+            logger.log(AsyncLogger::LogLevel::INFO_LOG, "f.cpp", 1, "%s %d %.1f %s %llu", owned, -7, 2.5,
+                       "literal", 1ULL << 40);
+            logger.log(AsyncLogger::LogLevel::INFO_LOG, "f.cpp", 2, "%s|%s", std::string(500, 'x'), "tail");
+            logger.log(AsyncLogger::LogLevel::DEBUG_LOG, "f.cpp", 3, "below the level");
+        }
+        auto after = std::chrono::system_clock::now();
+        if (capture->entries.size() != 2 ||
+            capture->entries[0].message != "session -7 2.5 literal 1099511627776" ||
+            capture->entries[1].message.size() > 192 || !capture->entries[1].message.ends_with("x|tail") ||
+            capture->entries[0].timestamp < before || capture->entries[1].timestamp > after) {
+            std::cerr << "logger records came out wrong" << std::endl;
+            return false;
+        }
+
+        AsyncLogger::RateLimit limit(5, std::chrono::hours(1));
+        uint32_t suppressed = 0;
+        size_t allowed = 0;
+        for (int i = 0; i < 100; ++i) {
+            allowed += limit.allow(suppressed);
+        }
+        if (allowed != 5 || suppressed != 0) {
+            std::cerr << "rate limit let " << allowed << " of 100 through" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Control messages come from any client: well-formed ones must parse, and malformed ones,
+    // fields of the wrong type included, must be turned down without an exception.
+    bool check_control() {
+        auto volume = RoomProtocol::parseControl(R"({"type": "volume", "speaker": "a", "volume": 0.5})");
+        auto mute = RoomProtocol::parseControl(R"({"type": "mute", "speaker": "b", "muted": true})");
+        auto subscribe = RoomProtocol::parseControl(R"({"type": "subscribe", "speakers": ["a", "c"]})");
+        auto everyone = RoomProtocol::parseControl(R"({"type": "subscribe", "speakers": null})");
+        if (!volume || volume->type != RoomProtocol::Control::Type::Volume || volume->speaker != "a" ||
+            volume->volume != 0.5f || !mute || mute->type != RoomProtocol::Control::Type::Mute ||
+            mute->speaker != "b" || !mute->muted || !subscribe ||
+            subscribe->speakers != std::vector<std::string>{"a", "c"} || !everyone ||
+            everyone->type != RoomProtocol::Control::Type::Subscribe || everyone->speakers) {
+            std::cerr << "control messages parsed wrongly" << std::endl;
+            return false;
+        }
+        for (const char* malformed : {R"({"type": 1})", R"({"type": null, "speaker": "a"})",
+                                      R"({"type": "volume", "speaker": 2, "volume": 0.5})",
+                                      R"({"type": "volume", "speaker": "a", "volume": "loud"})",
+                                      R"({"type": "mute", "speaker": "a", "muted": 1})",
+                                      R"({"type": "subscribe", "speakers": ["a", 3]})",
+                                      R"({"type": "subscribe", "speakers": "a"})", R"({"type": "kick"})",
+                                      R"(["volume"])", "not json", ""}) {
+            try {
+                if (RoomProtocol::parseControl(malformed)) {
+                    std::cerr << "control message accepted: " << malformed << std::endl;
+                    return false;
+                }
+            } catch (const std::exception& e) {
+                std::cerr << "control message " << malformed << " threw: " << e.what() << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The matrix mixer must give each listener what AudioMixer::mix() gives of the packets it
+    // hears, with senders of several packets, mixes of several sources and packets that end
+    // early; with gains, what the formula gives, give or take float rounding. The gains are
+    // set through a GainMatrix, as a room's clients set them, which must route them as intended.
+    bool check_matrix_mixer(std::mt19937& random) {
+        constexpr size_t SENDERS = 6;
+        std::vector<std::vector<AudioPacket>> senders(SENDERS);
+        for (size_t s = 0; s < SENDERS; ++s) {
+            size_t length = s == 3 ? 441 : 882;
+            senders[s] = make_packets(s == 1 ? 2 : 1, length, random);
+        }
+        senders[4][0].set_sources(3);
+
+        // Listener l hears sender s at gains[l][s]
+        std::vector<std::vector<float>> gains(SENDERS + 1, std::vector<float>(SENDERS, 1.0f));
+        for (size_t l = 0; l < SENDERS; ++l) {
+            gains[l][l] = 0.0f;
+        }
+        gains[0][2] = 0.0f;  // Muted
+        gains[5] = {0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f};  // Subscribed to the short one only
+        gains[6] = {0.5f, 2.0f, 1.0f, 0.25f, 1.0f, 0.0f};
+
+        GainMatrix matrix;
+        matrix.setMuted("0", "2", true);
+        matrix.setVolume("5", "0", 3.0f);
+        matrix.setSubscriptions("5", std::vector<std::string>{"3"});
+        matrix.setVolume("6", "0", 0.5f);
+        matrix.setVolume("6", "1", 2.0f);
+        matrix.setVolume("6", "3", 0.25f);
+        matrix.setVolume("6", "5", 3.0f);
+        matrix.setMuted("6", "5", true);
+        matrix.setMuted("6", "4", true);
+        matrix.setMuted("6", "4", false);
+        matrix.setVolume("2", "1", 0.5f);
+        matrix.setVolume("2", "1", 1.0f);
+        for (size_t l = 0; l < gains.size(); ++l) {
+            if (matrix.isDefault(std::to_string(l)) != (l >= 1 && l <= 4)) {
+                std::cerr << "gain matrix keeps the wrong row for listener " << l << std::endl;
+                return false;
+            }
+            for (size_t s = 0; s < SENDERS; ++s) {
+                if (matrix.gain(std::to_string(l), std::to_string(s)) != gains[l][s]) {
+                    std::cerr << "gain matrix routes sender " << s << " to listener " << l << " at "
+                              << matrix.gain(std::to_string(l), std::to_string(s)) << " instead of "
+                              << gains[l][s] << std::endl;
+                    return false;
+                }
+            }
+        }
+        if (matrix.remoteGain("5") != 0.0f || matrix.remoteGain("6") != 1.0f) {
+            std::cerr << "gain matrix routes remote mixes wrongly" << std::endl;
+            return false;
+        }
+
+        MatrixMixer mixer;
+        for (int round = 0; round < 2; ++round) {  // The second reuses the buffers
+            mixer.begin(gains.size());
+            for (const auto& packets : senders) {
+                mixer.addSource(packets);
+            }
+            for (size_t l = 0; l < gains.size(); ++l) {
+                for (size_t s = 0; s < SENDERS; ++s) {
+                    mixer.route(s, l, matrix.gain(std::to_string(l), std::to_string(s)));
+                }
+            }
+            mixer.mix();
+            for (size_t l = 0; l < gains.size(); ++l) {
+                bool unity = true;
+                std::vector<AudioPacket> heard;
+                std::vector<float> heard_gains;
+                for (size_t s = 0; s < SENDERS; ++s) {
+                    if (gains[l][s] != 0.0f) {
+                        unity = unity && gains[l][s] == 1.0f;
+                        heard.insert(heard.end(), senders[s].begin(), senders[s].end());
+                        heard_gains.insert(heard_gains.end(), senders[s].size(), gains[l][s]);
+                    }
+                }
+                AudioPacket actual = mixer.output(l);
+                AudioPacket expected = AudioMixer::mix(heard);
+                if (actual.size() != expected.size() || actual.sources() != expected.sources()) {
+                    std::cerr << "matrix mixer listener " << l << " got the wrong shape" << std::endl;
+                    return false;
+                }
+                auto* a = reinterpret_cast<const int16_t*>(actual.data());
+                auto* e = reinterpret_cast<const int16_t*>(expected.data());
+                for (size_t i = 0; i < actual.size() / sizeof(int16_t); ++i) {
+                    int reference = e[i];
+                    if (!unity) {
+                        double sum = 0;
+                        double count = 0;
+                        for (size_t p = 0; p < heard.size(); ++p) {
+                            if (i < heard[p].size() / sizeof(int16_t)) {
+                                sum += heard_gains[p] * heard[p].sources() *
+                                       reinterpret_cast<const int16_t*>(heard[p].data())[i];
+                                count += heard[p].sources();
+                            }
+                        }
+                        reference = std::clamp(static_cast<int>(std::trunc(std::trunc(sum / count) * AudioMixer::HEADROOM)),
+                                               INT16_MIN, INT16_MAX);
+                    }
+                    if (unity ? a[i] != reference : std::abs(a[i] - reference) > 1) {
+                        std::cerr << "matrix mixer listener " << l << " sample " << i << ": " << a[i]
+                                  << " instead of " << reference << std::endl;
+                        return false;
+                    }
+                }
+            }
+        }
+
+        // A sender of frames shorter than a tick is heard one frame after another, as sent
+        auto short_frames = make_packets(8, MatrixMixer::TICK_FRAMES / 8, random);
+        mixer.begin(1);
+        mixer.route(mixer.addSource(short_frames), 0, 1.0f);
+        mixer.mix();
+        AudioPacket played = mixer.output(0, {}, 1.0f);
+        std::vector<uint8_t> sent;
+        for (const auto& packet : short_frames) {
+            sent.insert(sent.end(), packet.data(), packet.data() + packet.size());
+        }
+        if (played.sources() != 1 || played.size() != sent.size() ||
+            std::memcmp(played.data(), sent.data(), sent.size()) != 0) {
+            std::cerr << "matrix mixer does not play short frames in order" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // The specialized sample loops must give what the loops for any length give, and int16
+    // must survive a round trip through float32 and stereo unchanged.
+    bool check_pcm(std::mt19937& random) {
+        for (const auto& format : PCM_FORMATS) {
+            for (size_t frames : {Pcm::FRAME_10MS, Pcm::FRAME_20MS, size_t{500}}) {
+                std::vector<AudioPacket> packets = {make_pcm_packet(format, frames, random),
+                                                    make_pcm_packet(format, frames - 100, random)};
+                for (size_t channels : {1, 2}) {
+                    AudioPacket outputs[2];
+                    for (bool specialize : {true, false}) {
+                        MatrixMixer mixer(specialize);
+                        mixer.begin(1, channels);
+                        mixer.route(mixer.addSource(packets, format), 0, 0.5f);
+                        mixer.mix();
+                        outputs[specialize] = mixer.output(0, format);
+                    }
+                    if (outputs[0].size() != outputs[1].size() ||
+                        std::memcmp(outputs[0].data(), outputs[1].data(), outputs[0].size()) != 0) {
+                        std::cerr << "pcm " << format.name() << " in a room of " << channels << " channels, "
+                                  << frames << " frames: specialized mix differs" << std::endl;
+                        return false;
+                    }
+                }
+            }
+        }
+
+        // Through a stereo room at full scale, as a listener of format hears a speaker of from
+        auto pass = [](const AudioPacket& packet, Pcm::Format from, Pcm::Format format) {
+            MatrixMixer mixer;
+            mixer.begin(1, 2);
+            mixer.route(mixer.addSource(std::span(&packet, 1), from), 0, 1.0f);
+            mixer.mix();
+            return mixer.output(0, format, 1.0f);
+        };
+        const Pcm::Format browser{Pcm::SampleType::Float32, 2};
+        auto original = make_pcm_packet({}, Pcm::FRAME_20MS, random);
+        auto packet = pass(pass(original, {}, browser), browser, {});
+        if (packet.size() != original.size() || std::memcmp(packet.data(), original.data(), packet.size()) != 0) {
+            std::cerr << "pcm int16 through float32 stereo and back changed" << std::endl;
+            return false;
+        }
+
+        // Out of range and non-finite float input is clipped or silenced, not passed on
+        const float hostile[] = {NAN, INFINITY, -INFINITY, 1e30f, -1e30f, 2.0f, 0.5f, -0.5f};
+        const float expected[] = {0.0f, 0.0f, 0.0f, 1.0f, -1.0f, 1.0f, 0.5f, -0.5f};
+        const Pcm::Format mono_float{Pcm::SampleType::Float32, 1};
+        AudioPacket bad(reinterpret_cast<const uint8_t*>(hostile), sizeof(hostile));
+        auto as_float = pass(bad, mono_float, mono_float);
+        auto as_int16 = pass(bad, mono_float, {});
+        for (size_t i = 0; i < std::size(hostile); ++i) {
+            float f = reinterpret_cast<const float*>(as_float.data())[i];
+            int16_t n = reinterpret_cast<const int16_t*>(as_int16.data())[i];
+            if (f != expected[i] || n != std::clamp(static_cast<int>(expected[i] * Pcm::INT16_SCALE), INT16_MIN, INT16_MAX)) {
+                std::cerr << "pcm float32 input " << hostile[i] << " came out as " << f << " and " << n << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Compares unmask with the scalar definition at every pointer alignment, mask phase and tail
+    // length the vector loops can produce; timing a wrong kernel would be pointless.
+    bool check_unmask(std::mt19937& random) {
+        const uint8_t mask[4] = {0xA1, 0x07, 0x5C, 0xF3};
+        std::vector<uint8_t> input(1024 + 64);
+        for (auto& b : input) {
+            b = static_cast<uint8_t>(random());
+        }
+        for (size_t alignment = 0; alignment < 32; ++alignment) {
+            for (size_t offset = 0; offset < 4; ++offset) {
+                for (size_t length : {0, 1, 3, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 1000}) {
+                    std::vector<uint8_t> actual = input;
+                    WebSocketFrameParser::unmask(actual.data() + alignment, length, mask, offset);
+                    for (size_t i = 0; i < actual.size(); ++i) {
+                        bool inside = i >= alignment && i < alignment + length;
+                        uint8_t expected = inside ? input[i] ^ mask[(offset + i - alignment) % 4] : input[i];
+                        if (actual[i] != expected) {
+                            std::cerr << "unmask mismatch: alignment " << alignment << ", offset " << offset
+                                      << ", length " << length << ", byte " << i << std::endl;
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // A frame of a fragmented message: opcode is that of the message on the first fragment and
+    // Continuation after it
+    std::vector<uint8_t> mask_fragment(const std::vector<uint8_t>& payload, WebSocketOpCode opcode, bool fin) {
+        auto frame = mask_frame(payload, opcode);
+        frame[0] = static_cast<uint8_t>((fin ? 0x80 : 0x00) | static_cast<uint8_t>(opcode));
+        return frame;
+    }
+
+    // Feeds stream to parser through prepare()/commit() in pieces of 1 to max_piece bytes;
+    // false if the parser rejected it.
+    bool feed(WebSocketFrameParser& parser, const std::vector<uint8_t>& stream, size_t max_piece,
+              std::mt19937& random) {
+        std::uniform_int_distribution<size_t> piece(1, max_piece);
+        for (size_t offset = 0; offset < stream.size();) {
+            auto space = parser.prepare();
+            size_t length = std::min({piece(random), space.size(), stream.size() - offset});
+            std::memcpy(space.data(), stream.data() + offset, length);
+            offset += length;
+            if (!parser.commit(length)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The parser must deliver every message of a stream of masked frames, whole and in order,
+    // however the stream is cut into reads: a byte at a time, across headers and payloads, or
+    // several frames per read. Covered are fragmented messages with a ping between fragments,
+    // messages larger than the buffer, the stream handler's chunks, the size limit and the
+    // bytes handed over by unparsed().
+    bool check_frame_parser(std::mt19937& random) {
+        using Message = std::pair<WebSocketOpCode, std::vector<uint8_t>>;
+        auto payload = [&random](size_t size) {
+            std::vector<uint8_t> bytes(size);
+            for (auto& b : bytes) {
+                b = static_cast<uint8_t>(random());
+            }
+            return bytes;
+        };
+
+        std::vector<uint8_t> stream;
+        std::vector<Message> sent;
+        auto whole = [&](WebSocketOpCode opcode, size_t size) {
+            auto message = payload(size);
+            auto frame = mask_frame(message, opcode);
+            stream.insert(stream.end(), frame.begin(), frame.end());
+            sent.emplace_back(opcode, std::move(message));
+        };
+        // Three fragments with a ping after the first; the ping is delivered first
+        auto fragmented = [&](WebSocketOpCode opcode, size_t size) {
+            auto message = payload(size);
+            size_t cuts[] = {0, size / 3, size / 2, size};
+            auto ping = payload(5);
+            for (size_t f = 0; f < 3; ++f) {
+                std::vector<uint8_t> part(message.begin() + static_cast<std::ptrdiff_t>(cuts[f]),
+                                          message.begin() + static_cast<std::ptrdiff_t>(cuts[f + 1]));
+                auto frame = mask_fragment(part, f == 0 ? opcode : WebSocketOpCode::Continuation, f == 2);
+                stream.insert(stream.end(), frame.begin(), frame.end());
+                if (f == 0) {
+                    auto control = mask_frame(ping, WebSocketOpCode::Ping);
+                    stream.insert(stream.end(), control.begin(), control.end());
+                    sent.emplace_back(WebSocketOpCode::Ping, ping);
+                }
+            }
+            sent.emplace_back(opcode, std::move(message));
+        };
+        whole(WebSocketOpCode::Binary, 0);
+        whole(WebSocketOpCode::Text, 1);
+        whole(WebSocketOpCode::Binary, 125);
+        whole(WebSocketOpCode::Binary, 126);
+        whole(WebSocketOpCode::Binary, 1764);
+        fragmented(WebSocketOpCode::Text, 300);
+        whole(WebSocketOpCode::Binary, 70000);  // 64-bit length, larger than any buffer here
+        fragmented(WebSocketOpCode::Binary, 5000);
+        whole(WebSocketOpCode::Pong, 0);
+        whole(WebSocketOpCode::Binary, 3);
+
+        for (size_t buffer_size : {size_t{256}, size_t{4096}, WebSocketFrameParser::DEFAULT_BUFFER_SIZE}) {
+            for (size_t max_piece : {size_t{1}, size_t{7}, size_t{1500}, stream.size()}) {
+                for (bool stream_large : {false, true}) {
+                    std::vector<Message> received;
+                    bool open = false;  // a streamed message is partly delivered
+                    size_t streamed = 0;  // its place in received; control frames may follow it
+                    bool bad_chunks = false;
+                    WebSocketFrameParser parser(buffer_size);
+                    parser.setMessageHandler([&](WebSocketOpCode opcode, std::span<const uint8_t> message) {
+                        received.emplace_back(opcode, std::vector<uint8_t>(message.begin(), message.end()));
+                    });
+                    if (stream_large) {
+                        parser.setStreamHandler(
+                            [&](WebSocketOpCode opcode, std::span<const uint8_t> chunk, bool last) {
+                                if (!open) {
+                                    streamed = received.size();
+                                    received.emplace_back(opcode, std::vector<uint8_t>());
+                                } else if (received[streamed].first != opcode) {
+                                    bad_chunks = true;
+                                }
+                                auto& message = received[streamed].second;
+                                message.insert(message.end(), chunk.begin(), chunk.end());
+                                open = !last;
+                            }, 1000);
+                    }
+                    std::string setup = "frame parser with a " + std::to_string(buffer_size) + " byte buffer, reads of up to " +
+                                        std::to_string(max_piece) + (stream_large ? " bytes, streaming" : " bytes");
+                    if (!feed(parser, stream, max_piece, random)) {
+                        std::cerr << setup << ": rejected a valid stream" << std::endl;
+                        return false;
+                    }
+                    // Streamed messages are recorded at their first chunk, ahead of a ping that
+                    // comes between their fragments
+                    auto expected = sent;
+                    if (stream_large) {
+                        for (size_t i = 1; i < expected.size(); ++i) {
+                            if (expected[i - 1].first == WebSocketOpCode::Ping && expected[i].first != WebSocketOpCode::Ping) {
+                                std::swap(expected[i - 1], expected[i]);
+                                ++i;
+                            }
+                        }
+                    }
+                    if (bad_chunks || open || received != expected) {
+                        std::cerr << setup << ": delivered other messages than were sent" << std::endl;
+                        return false;
+                    }
+                }
+            }
+        }
+
+        // Past max_message_size the connection is failed, whole or fragmented
+        for (bool split : {false, true}) {
+            WebSocketFrameParser parser(256, 1000);
+            auto message = payload(1500);
+            std::vector<uint8_t> oversized;
+            if (split) {
+                std::vector<uint8_t> half(message.begin(), message.begin() + 750);
+                oversized = mask_fragment(half, WebSocketOpCode::Binary, false);
+                auto rest = mask_fragment(half, WebSocketOpCode::Continuation, true);
+                oversized.insert(oversized.end(), rest.begin(), rest.end());
+            } else {
+                oversized = mask_frame(message, WebSocketOpCode::Binary);
+            }
+            if (feed(parser, oversized, 100, random)) {
+                std::cerr << "frame parser accepted a message over max_message_size" << std::endl;
+                return false;
+            }
+        }
+
+        // A partly received frame is handed over and finished by a new parser
+        auto first = payload(200);
+        auto second = payload(300);
+        std::vector<uint8_t> frames = mask_frame(first, WebSocketOpCode::Binary);
+        auto next = mask_frame(second, WebSocketOpCode::Binary);
+        size_t cut = frames.size() + next.size() / 2;
+        frames.insert(frames.end(), next.begin(), next.end());
+        std::vector<Message> received;
+        auto record = [&received](WebSocketOpCode opcode, std::span<const uint8_t> message) {
+            received.emplace_back(opcode, std::vector<uint8_t>(message.begin(), message.end()));
+        };
+        WebSocketFrameParser before;
+        before.setMessageHandler(record);
+        if (!feed(before, std::vector<uint8_t>(frames.begin(), frames.begin() + static_cast<std::ptrdiff_t>(cut)), 64, random)) {
+            std::cerr << "frame parser rejected a valid stream before handing it over" << std::endl;
+            return false;
+        }
+        auto unparsed = before.unparsed();
+        if (!unparsed || unparsed->size() != cut - (frames.size() - next.size())) {
+            std::cerr << "frame parser did not hand over the partial frame" << std::endl;
+            return false;
+        }
+        std::vector<uint8_t> rest(unparsed->begin(), unparsed->end());
+        rest.insert(rest.end(), frames.begin() + static_cast<std::ptrdiff_t>(cut), frames.end());
+        WebSocketFrameParser after;
+        after.setMessageHandler(record);
+        if (!feed(after, rest, 64, random) ||
+            received != std::vector<Message>{{WebSocketOpCode::Binary, first}, {WebSocketOpCode::Binary, second}}) {
+            std::cerr << "frame parser lost a frame across the handover" << std::endl;
+            return false;
+        }
+        // A frame assembled outside the buffer cannot be handed over
+        WebSocketFrameParser small(256);
+        auto large = mask_frame(payload(1000), WebSocketOpCode::Binary);
+        if (!feed(small, std::vector<uint8_t>(large.begin(), large.begin() + 500), 64, random) || small.unparsed()) {
+            std::cerr << "frame parser handed over a partly assembled message" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void bench_serialization(Bench::Runner& runner) {
+        for (size_t length : {16, 256}) {
+            NetworkMessages::Error error;
+            error.ErrorMessage = std::string(length, 'x');
+            auto message = NetworkMessages::MessageFactory::createMessage(NetworkMessages::MessageType::Error, error);
+            auto bytes = message->serialize();
+
+            runner.run("binarydata/serialize/" + std::to_string(length) + "B", bytes.size(), [&message]() {
+                Bench::doNotOptimize(message->serialize());
+            });
+
+            NetworkMessages::BinaryMessage<NetworkMessages::Error> decoded(0, NetworkMessages::Error{});
+            runner.run("binarydata/deserialize/" + std::to_string(length) + "B", bytes.size(), [&bytes, &decoded]() {
+                size_t offset = 0;
+                decoded.deserialize(bytes, offset);
+                Bench::doNotOptimize(decoded);
+            });
+        }
+    }
+
+    // Liveness bookkeeping for 10k clients: the per-packet deadline push, and a 100 ms tick in
+    // which every client was heard from once and nothing is due.
+    void bench_timer_wheel(Bench::Runner& runner) {
+        constexpr size_t CLIENTS = 10000;
+        using wheel_clock = std::chrono::steady_clock;
+        auto start = wheel_clock::now();
+        TimerWheel<std::string, int> wheel(std::chrono::milliseconds(100), start);
+        std::vector<std::string> keys;
+        for (size_t i = 0; i < CLIENTS; ++i) {
+            keys.push_back("127.0.0.1:" + std::to_string(20000 + i));
+            wheel.schedule(keys.back(), start + std::chrono::seconds(30), 0);
+        }
+        size_t next = 0;
+        auto now = start;
+        runner.run("timer_wheel/reschedule/10k", 0, [&]() {
+            now += std::chrono::microseconds(1);
+            wheel.reschedule(keys[next], now + std::chrono::seconds(30));
+            next = next + 1 == CLIENTS ? 0 : next + 1;
+        });
+        runner.run("timer_wheel/tick_all_active/10k", 0, [&]() {
+            now += std::chrono::milliseconds(100);
+            for (const auto& key : keys) {
+                wheel.reschedule(key, now + std::chrono::seconds(30));
+            }
+            Bench::doNotOptimize(wheel.advance(now, [](const std::string&, int&) {}));
+        });
+    }
+
+    void bench_hash_ring(Bench::Runner& runner) {
+        HashRing ring;
+        for (int i = 1; i <= 16; ++i) {
+            ring.add("voice-" + std::to_string(i));
+        }
+        std::vector<std::string> rooms;
+        for (int i = 0; i < 1024; ++i) {
+            rooms.push_back("room-" + std::to_string(i));
+        }
+        size_t next = 0;
+        runner.run("hash_ring/lookup/16_backends", 0, [&]() {
+            Bench::doNotOptimize(ring.lookup(rooms[next]));
+            next = (next + 1) & 1023;
+        });
+    }
+
+    // An error path that fires once per packet costs this once its site is over the limit.
+    void bench_logger(Bench::Runner& runner) {
+        AsyncLogger::RateLimit limit;
+        uint32_t suppressed = 0;
+        runner.run("logger/rate_limited_suppressed", 0, [&]() {
+            Bench::doNotOptimize(limit.allow(suppressed));
+        });
+    }
+
+    void bench_utilities(Bench::Runner& runner) {
+        runner.run("utilities/generate_uuid", 0, []() {
+            Bench::doNotOptimize(Utilities::generateUuid());
+        });
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 2) {
+        std::cerr << "Usage: " << argv[0] << " [name_filter]" << std::endl;
+        return 1;
+    }
+    Bench::Runner runner(argc == 2 ? argv[1] : "");
+
+    // Fixed seed so every run measures the same inputs
+    std::mt19937 random(12345);
+
+    if (!check_unmask(random) || !check_frame_parser(random) || !check_accept_key() || !check_hash_ring() || !check_timer_wheel(random) || !check_logger() ||
+        !check_control() || !check_matrix_mixer(random) || !check_pcm(random)) {
+        return 1;
+    }
+
+    Bench::Runner::printHeader();
+    bench_mixer(runner, random);
+    bench_matrix_mixer(runner, random);
+    bench_pcm(runner, random);
+    bench_websocket(runner, random);
+    bench_broadcast(runner);
+    bench_serialization(runner);
+    bench_timer_wheel(runner);
+    bench_hash_ring(runner);
+    bench_logger(runner);
+    bench_utilities(runner);
+    return 0;
+}
@@ -0,0 +1,24 @@
+//
+// Created by maxim on 14.09.2024.
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// Source and sink of mono int16 audio for AudioManager. A backend calls the input callback
+// with every captured buffer and the output callback whenever it needs samples to play;
+// both may be invoked from a backend-owned thread.
+class AudioBackend {
+public:
+    using input_callback = std::function<void(const int16_t* samples, size_t frames)>;
+    using output_callback = std::function<void(int16_t* samples, size_t frames)>;
+
+    virtual ~AudioBackend() = default;
+
+    virtual bool start(int sample_rate, int frames_per_buffer,
+                       input_callback on_input, output_callback on_output) = 0;
+
+    virtual void stop() = 0;
+};
@@ -1,41 +1,60 @@
 #pragma once
 
 #include <AudioPacket.h>
+#include <MpscRing.h>
+#include <array>
+#include <atomic>
 #include <mutex>
-#include <portaudio.h>
+#include <memory>
 #include <deque>
 #include <chrono>
 #include <cstring>
+#include <functional>
+#include <iostream>
+
+#include "AudioBackend.h"
+#include "PortAudioBackend.h"
 
 class AudioManager {
 public:
-    AudioManager() : input_stream_(nullptr), output_stream_(nullptr) {}
+    static constexpr int SAMPLE_RATE = 44100;
+    static constexpr int FRAMES_PER_BUFFER = 4096;  // Default buffer size for the timer-polled mode
+    static constexpr size_t MAX_CAPTURE_FRAMES = SAMPLE_RATE / 50;  // Longest low-latency frame, 20 ms
+    static constexpr size_t CAPTURE_RING_SIZE = 64;  // Captured frames waiting for the network thread
 
-    bool initialize() {
-        PaError err = Pa_Initialize();
-        if (err != paNoError) {
-            std::cerr << "PortAudio error: " << Pa_GetErrorText(err) << std::endl;
-            return false;
-        }
+    explicit AudioManager(int frames_per_buffer = FRAMES_PER_BUFFER,
+                          std::unique_ptr<AudioBackend> backend = std::make_unique<PortAudioBackend>())
+        : backend_(std::move(backend)), frames_per_buffer_(frames_per_buffer) {}
 
-        err = Pa_OpenDefaultStream(&input_stream_, 1, 0, paInt16, SAMPLE_RATE, FRAMES_PER_BUFFER,
-                                   inputCallback, this);
-        if (err != paNoError) {
-            std::cerr << "PortAudio input error: " << Pa_GetErrorText(err) << std::endl;
-            Pa_Terminate();
-            return false;
-        }
+    // Number of frames in a buffer of the given duration, e.g. 2.5 ms -> 110 frames at 44.1 kHz.
+    static int framesForDuration(double milliseconds) {
+        return static_cast<int>(SAMPLE_RATE * milliseconds / 1000.0);
+    }
 
-        err = Pa_OpenDefaultStream(&output_stream_, 0, 1, paInt16, SAMPLE_RATE, FRAMES_PER_BUFFER,
-                                   outputCallback, this);
-        if (err != paNoError) {
-            std::cerr << "PortAudio output error: " << Pa_GetErrorText(err) << std::endl;
-            Pa_CloseStream(input_stream_);
-            Pa_Terminate();
-            return false;
-        }
+    // Low-latency mode: every captured buffer is timestamped and copied into a preallocated ring
+    // for popCaptured() instead of being accumulated for getInputData(). The backend callback
+    // then neither allocates nor locks; when the ring is full the buffer is dropped.
+    void enableCaptureRing() {
+        capture_ring_ = std::make_unique<MpscRing<CapturedFrame>>(CAPTURE_RING_SIZE);
+    }
+
+    // Consumer side of the capture ring, for one thread only: the oldest captured buffer, if any.
+    bool popCaptured(AudioPacket& packet) {
+        return capture_ring_ && capture_ring_->pop([&packet](CapturedFrame& frame) {
+            packet = AudioPacket(reinterpret_cast<const uint8_t*>(frame.samples.data()),
+                                 frame.frames * sizeof(int16_t), frame.captured);
+        });
+    }
 
-        return startStreams();
+    // Buffers dropped because the network thread fell behind
+    uint64_t droppedCaptures() const {
+        return dropped_captures_.load(std::memory_order_relaxed);
+    }
+
+    bool initialize() {
+        return backend_->start(SAMPLE_RATE, frames_per_buffer_,
+                               [this](const int16_t* samples, size_t frames) { handleInput(samples, frames); },
+                               [this](int16_t* samples, size_t frames) { handleOutput(samples, frames); });
     }
 
     void addOutputData(const AudioPacket& packet) {
@@ -43,6 +62,7 @@ public:
         output_buffer_.push_back(packet);
         while (output_buffer_.size() > MAX_BUFFER_SIZE) {
             output_buffer_.pop_front();
+            output_offset_ = 0;
         }
     }
 
@@ -54,97 +74,82 @@ public:
     }
 
     ~AudioManager() {
-        if (input_stream_) {
-            Pa_StopStream(input_stream_);
-            Pa_CloseStream(input_stream_);
-        }
-        if (output_stream_) {
-            Pa_StopStream(output_stream_);
-            Pa_CloseStream(output_stream_);
-        }
-        Pa_Terminate();
+        backend_->stop();
     }
 
 private:
-    static constexpr int SAMPLE_RATE = 44100;
-    static constexpr int FRAMES_PER_BUFFER = 4096;  // Fixed buffer size
     static constexpr int MAX_BUFFER_SIZE = 10;  // Maximum number of packets to buffer
     static constexpr float SMOOTHING_FACTOR = 0.1f;  // Smoothing factor for cross-fading
 
-    bool startStreams() {
-        PaError err = Pa_StartStream(input_stream_);
-        if (err != paNoError) {
-            std::cerr << "PortAudio input start error: " << Pa_GetErrorText(err) << std::endl;
-            Pa_CloseStream(input_stream_);
-            Pa_CloseStream(output_stream_);
-            Pa_Terminate();
-            return false;
-        }
-
-        err = Pa_StartStream(output_stream_);
-        if (err != paNoError) {
-            std::cerr << "PortAudio output start error: " << Pa_GetErrorText(err) << std::endl;
-            Pa_StopStream(input_stream_);
-            Pa_CloseStream(input_stream_);
-            Pa_CloseStream(output_stream_);
-            Pa_Terminate();
-            return false;
+    struct CapturedFrame {
+        std::array<int16_t, MAX_CAPTURE_FRAMES> samples;
+        size_t frames = 0;
+        AudioPacket::clock::time_point captured;
+    };
+
+    void handleInput(const int16_t* in, size_t frames) {
+        if (capture_ring_) {
+            auto now = AudioPacket::clock::now();
+            // Buffers longer than a slot, which the supported frame sizes never are, go in pieces
+            for (size_t offset = 0; offset < frames; offset += MAX_CAPTURE_FRAMES) {
+                size_t count = std::min(frames - offset, MAX_CAPTURE_FRAMES);
+                bool queued = capture_ring_->push([&](CapturedFrame& frame) {
+                    std::memcpy(frame.samples.data(), in + offset, count * sizeof(int16_t));
+                    frame.frames = count;
+                    frame.captured = now;
+                });
+                if (!queued) {
+                    dropped_captures_.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            return;
         }
 
-        return true;
-    }
-
-    static int inputCallback(const void* inputBuffer, void* outputBuffer,
-                             unsigned long framesPerBuffer,
-                             const PaStreamCallbackTimeInfo* timeInfo,
-                             PaStreamCallbackFlags statusFlags,
-                             void* userData) {
-        AudioManager* manager = static_cast<AudioManager*>(userData);
-        const int16_t* in = static_cast<const int16_t*>(inputBuffer);
-
-        std::lock_guard<std::mutex> lock(manager->input_mutex_);
-        manager->input_buffer_.insert(manager->input_buffer_.end(),
-                                      reinterpret_cast<const char*>(in),
-                                      reinterpret_cast<const char*>(in + framesPerBuffer));
-
-        return paContinue;
+        std::lock_guard<std::mutex> lock(input_mutex_);
+        input_buffer_.insert(input_buffer_.end(),
+                             reinterpret_cast<const char*>(in),
+                             reinterpret_cast<const char*>(in + frames));
     }
 
-    static int outputCallback(const void* inputBuffer, void* outputBuffer,
-                              unsigned long framesPerBuffer,
-                              const PaStreamCallbackTimeInfo* timeInfo,
-                              PaStreamCallbackFlags statusFlags,
-                              void* userData) {
-        AudioManager* manager = static_cast<AudioManager*>(userData);
-        int16_t* out = static_cast<int16_t*>(outputBuffer);
-
-        std::lock_guard<std::mutex> lock(manager->output_mutex_);
-        if (!manager->output_buffer_.empty()) {
-            const AudioPacket& packet = manager->output_buffer_.front();
-            size_t bytesToCopy = std::min(packet.size(), framesPerBuffer * sizeof(int16_t));
+    void handleOutput(int16_t* out, size_t frames) {
+        std::lock_guard<std::mutex> lock(output_mutex_);
+        size_t written = 0;
+        while (written < frames && !output_buffer_.empty()) {
+            const AudioPacket& packet = output_buffer_.front();
+            const int16_t* samples = reinterpret_cast<const int16_t*>(packet.data());
+            size_t available = packet.size() / sizeof(int16_t) - output_offset_;
+            size_t count = std::min(available, frames - written);
 
             // Apply smoothing to reduce clicking
-            for (size_t i = 0; i < bytesToCopy / sizeof(int16_t); ++i) {
-                float current = static_cast<float>(reinterpret_cast<const int16_t*>(packet.data())[i]);
-                float prev = (i > 0) ? static_cast<float>(out[i-1]) : 0.0f;
-                out[i] = static_cast<int16_t>(prev + SMOOTHING_FACTOR * (current - prev));
+            for (size_t i = 0; i < count; ++i) {
+                float current = static_cast<float>(samples[output_offset_ + i]);
+                float prev = static_cast<float>(last_output_sample_);
+                last_output_sample_ = static_cast<int16_t>(prev + SMOOTHING_FACTOR * (current - prev));
+                out[written + i] = last_output_sample_;
             }
 
-            if (bytesToCopy < framesPerBuffer * sizeof(int16_t)) {
-                memset(reinterpret_cast<char*>(out) + bytesToCopy, 0, framesPerBuffer * sizeof(int16_t) - bytesToCopy);
+            written += count;
+            output_offset_ += count;
+            if (output_offset_ >= packet.size() / sizeof(int16_t)) {
+                output_buffer_.pop_front();
+                output_offset_ = 0;
             }
-            manager->output_buffer_.pop_front();
-        } else {
-            memset(out, 0, framesPerBuffer * sizeof(int16_t));
         }
 
-        return paContinue;
+        if (written < frames) {
+            memset(out + written, 0, (frames - written) * sizeof(int16_t));
+            last_output_sample_ = 0;
+        }
     }
 
-    PaStream* input_stream_;
-    PaStream* output_stream_;
+    std::unique_ptr<AudioBackend> backend_;
+    int frames_per_buffer_;
+    std::unique_ptr<MpscRing<CapturedFrame>> capture_ring_;
+    std::atomic<uint64_t> dropped_captures_{0};
     std::vector<char> input_buffer_;
     std::deque<AudioPacket> output_buffer_;
+    size_t output_offset_ = 0;  // Samples of output_buffer_.front() already played
+    int16_t last_output_sample_ = 0;
     std::mutex input_mutex_;
     std::mutex output_mutex_;
 };
\ No newline at end of file
@@ -0,0 +1,132 @@
+//
+// Created by maxim on 14.09.2024.
+//
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <WavFile.h>
+
+#include "AudioBackend.h"
+
+// Audio backend without sound hardware. Capture comes from a WAV file (looped), a generated
+// tone or silence; playback goes to a WAV file or is discarded. A dedicated thread paces the
+// callbacks against absolute deadlines so the stream does not drift over long runs.
+class HeadlessAudioBackend : public AudioBackend {
+public:
+    struct Settings {
+        std::string capture_file;     // 16-bit PCM WAV, looped; takes precedence over the tone
+        double tone_frequency = 0.0;  // Sine tone in Hz when no capture file is set, 0 for silence
+        double tone_amplitude = 0.25;
+        std::string playback_file;    // Received audio is written here; empty discards it
+    };
+
+    explicit HeadlessAudioBackend(Settings settings) : settings_(std::move(settings)), running_(false) {}
+
+    ~HeadlessAudioBackend() override {
+        stop();
+    }
+
+    bool start(int sample_rate, int frames_per_buffer,
+               input_callback on_input, output_callback on_output) override {
+        sample_rate_ = sample_rate;
+        frames_per_buffer_ = frames_per_buffer;
+        on_input_ = std::move(on_input);
+        on_output_ = std::move(on_output);
+
+        if (!settings_.capture_file.empty()) {
+            WavFile::Format format;
+            std::vector<int16_t> samples;
+            if (!WavFile::read(settings_.capture_file, samples, format)) {
+                return false;
+            }
+            if (format.sample_rate != static_cast<uint32_t>(sample_rate)) {
+                std::cerr << "Capture file sample rate " << format.sample_rate << " Hz differs from stream rate "
+                          << sample_rate << " Hz; playing it unresampled." << std::endl;
+            }
+            // Keep the first channel only, the stream is mono
+            capture_samples_.reserve(samples.size() / format.channels);
+            for (size_t i = 0; i < samples.size(); i += format.channels) {
+                capture_samples_.push_back(samples[i]);
+            }
+        }
+
+        if (!settings_.playback_file.empty() &&
+            !playback_writer_.open(settings_.playback_file, {1, static_cast<uint32_t>(sample_rate)})) {
+            return false;
+        }
+
+        running_ = true;
+        thread_ = std::thread(&HeadlessAudioBackend::run, this);
+        return true;
+    }
+
+    void stop() override {
+        running_ = false;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        playback_writer_.close();
+    }
+
+private:
+    static constexpr double TWO_PI = 6.283185307179586;
+
+    void run() {
+        using clock = std::chrono::steady_clock;
+
+        std::vector<int16_t> input(frames_per_buffer_);
+        std::vector<int16_t> output(frames_per_buffer_);
+        const auto start = clock::now();
+        uint64_t buffers = 0;
+
+        while (running_) {
+            fill_capture(input);
+            on_input_(input.data(), input.size());
+
+            on_output_(output.data(), output.size());
+            playback_writer_.write(output.data(), output.size());
+
+            // Deadlines derive from the start time and frame count, so neither oversleeping nor
+            // period rounding accumulates
+            ++buffers;
+            std::chrono::duration<double> elapsed(static_cast<double>(buffers * frames_per_buffer_) / sample_rate_);
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<clock::duration>(elapsed));
+        }
+    }
+
+    void fill_capture(std::vector<int16_t>& buffer) {
+        if (!capture_samples_.empty()) {
+            for (auto& sample : buffer) {
+                sample = capture_samples_[capture_position_];
+                capture_position_ = (capture_position_ + 1) % capture_samples_.size();
+            }
+        } else if (settings_.tone_frequency > 0.0) {
+            const double step = TWO_PI * settings_.tone_frequency / sample_rate_;
+            for (auto& sample : buffer) {
+                sample = static_cast<int16_t>(std::sin(tone_phase_) * settings_.tone_amplitude * 32767.0);
+                tone_phase_ = std::fmod(tone_phase_ + step, TWO_PI);
+            }
+        } else {
+            std::fill(buffer.begin(), buffer.end(), 0);
+        }
+    }
+
+    Settings settings_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+    int sample_rate_ = 0;
+    int frames_per_buffer_ = 0;
+    input_callback on_input_;
+    output_callback on_output_;
+    std::vector<int16_t> capture_samples_;
+    size_t capture_position_ = 0;
+    double tone_phase_ = 0.0;
+    WavFile::Writer playback_writer_;
+};
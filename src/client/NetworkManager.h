@@ -2,6 +2,7 @@
 
 #include <asio.hpp>
 #include <AudioPacket.h>
+#include <RoomProtocol.h>
 #include <iostream>
 #include <chrono>
 #include <memory>
@@ -16,6 +17,7 @@ public:
           resolver_(io_context),
           send_timer_(io_context),
           jitter_buffer_timer_(io_context),
+          capture_timer_(io_context),
           strand_(io_context) {
         auto endpoints = resolver_.resolve(udp::v4(), host, std::to_string(port));
         server_endpoint_ = *endpoints.begin();
@@ -30,6 +32,27 @@ public:
         start_jitter_buffer();
     }
 
+    // Moves this client into the named room on the server; without it the server uses its default room.
+    void join_room(const std::string& room) {
+        auto join = RoomProtocol::makeJoin(room);
+        send(AudioPacket(join.data(), join.size()));
+    }
+
+    // Low-latency mode: no send timer, every drain_interval the captured frames capture_source
+    // hands out (the audio thread's ring) are sent, and received packets go straight to the
+    // callback (the audio output queue already smooths arrival jitter). The audio thread never
+    // has to wake this one, so it neither allocates nor locks.
+    void start_low_latency(std::function<void(const AudioPacket&)> receive_callback,
+                           std::function<bool(AudioPacket&)> capture_source,
+                           std::chrono::microseconds drain_interval) {
+        receive_callback_ = std::move(receive_callback);
+        capture_source_ = std::move(capture_source);
+        drain_interval_ = drain_interval;
+        low_latency_ = true;
+        start_receive();
+        start_capture_drain();
+    }
+
 private:
     static constexpr int JITTER_BUFFER_SIZE = 3;  // Number of packets to buffer
     static constexpr int PACKET_INTERVAL = 20;    // Milliseconds between packets
@@ -42,7 +65,11 @@ private:
             strand_.wrap([this, self](std::error_code ec, std::size_t bytes_recvd) {
                 if (!ec && bytes_recvd > 0) {
                     AudioPacket packet(recv_buffer_.data(), bytes_recvd);
-                    jitter_buffer_.push(packet);
+                    if (low_latency_) {
+                        receive_callback_(packet);
+                    } else {
+                        jitter_buffer_.push(packet);
+                    }
                 } else if (ec != asio::error::operation_aborted) {
                     std::cerr << "Receive error: " << ec.message() << std::endl;
                 }
@@ -64,6 +91,20 @@ private:
         }));
     }
 
+    void start_capture_drain() {
+        auto self(shared_from_this());
+        capture_timer_.expires_after(drain_interval_);
+        capture_timer_.async_wait(strand_.wrap([this, self](std::error_code ec) {
+            if (!ec) {
+                AudioPacket packet;
+                while (capture_source_(packet)) {
+                    send(packet);
+                }
+                start_capture_drain();
+            }
+        }));
+    }
+
     void start_jitter_buffer() {
         auto self(shared_from_this());
         jitter_buffer_timer_.expires_after(std::chrono::milliseconds(PACKET_INTERVAL));
@@ -80,9 +121,11 @@ private:
 
     void send(const AudioPacket& packet) {
         auto self(shared_from_this());
+        // Keep the payload alive until the asynchronous send completes
+        auto data = std::make_shared<std::vector<uint8_t>>(packet.bytes().begin(), packet.bytes().end());
         socket_.async_send_to(
-            asio::buffer(packet.data(), packet.size()), server_endpoint_,
-            strand_.wrap([this, self](std::error_code ec, std::size_t bytes_sent) {
+            asio::buffer(*data), server_endpoint_,
+            strand_.wrap([this, self, data](std::error_code ec, std::size_t bytes_sent) {
                 if (ec && ec != asio::error::operation_aborted) {
                     std::cerr << "Send error: " << ec.message() << std::endl;
                 }
@@ -94,9 +137,13 @@ private:
     udp::endpoint server_endpoint_;
     asio::steady_timer send_timer_;
     asio::steady_timer jitter_buffer_timer_;
+    asio::steady_timer capture_timer_;
     asio::io_context::strand strand_;
     std::vector<uint8_t> recv_buffer_;
     std::function<void(const AudioPacket&)> receive_callback_;
     std::function<AudioPacket()> send_callback_;
+    std::function<bool(AudioPacket&)> capture_source_;
+    std::chrono::microseconds drain_interval_{0};
     std::queue<AudioPacket> jitter_buffer_;
+    bool low_latency_ = false;
 };
\ No newline at end of file
@@ -0,0 +1,111 @@
+//
+// Created by maxim on 14.09.2024.
+//
+#pragma once
+
+#include <iostream>
+#include <portaudio.h>
+
+#include "AudioBackend.h"
+
+class PortAudioBackend : public AudioBackend {
+public:
+    PortAudioBackend() : input_stream_(nullptr), output_stream_(nullptr), initialized_(false) {}
+
+    ~PortAudioBackend() override {
+        stop();
+    }
+
+    bool start(int sample_rate, int frames_per_buffer,
+               input_callback on_input, output_callback on_output) override {
+        on_input_ = std::move(on_input);
+        on_output_ = std::move(on_output);
+
+        PaError err = Pa_Initialize();
+        if (err != paNoError) {
+            std::cerr << "PortAudio error: " << Pa_GetErrorText(err) << std::endl;
+            return false;
+        }
+        initialized_ = true;
+
+        err = Pa_OpenDefaultStream(&input_stream_, 1, 0, paInt16, sample_rate, frames_per_buffer,
+                                   inputCallback, this);
+        if (err != paNoError) {
+            std::cerr << "PortAudio input error: " << Pa_GetErrorText(err) << std::endl;
+            stop();
+            return false;
+        }
+
+        err = Pa_OpenDefaultStream(&output_stream_, 0, 1, paInt16, sample_rate, frames_per_buffer,
+                                   outputCallback, this);
+        if (err != paNoError) {
+            std::cerr << "PortAudio output error: " << Pa_GetErrorText(err) << std::endl;
+            stop();
+            return false;
+        }
+
+        err = Pa_StartStream(input_stream_);
+        if (err != paNoError) {
+            std::cerr << "PortAudio input start error: " << Pa_GetErrorText(err) << std::endl;
+            stop();
+            return false;
+        }
+
+        err = Pa_StartStream(output_stream_);
+        if (err != paNoError) {
+            std::cerr << "PortAudio output start error: " << Pa_GetErrorText(err) << std::endl;
+            stop();
+            return false;
+        }
+
+        return true;
+    }
+
+    void stop() override {
+        if (input_stream_) {
+            Pa_StopStream(input_stream_);
+            Pa_CloseStream(input_stream_);
+            input_stream_ = nullptr;
+        }
+        if (output_stream_) {
+            Pa_StopStream(output_stream_);
+            Pa_CloseStream(output_stream_);
+            output_stream_ = nullptr;
+        }
+        if (initialized_) {
+            Pa_Terminate();
+            initialized_ = false;
+        }
+    }
+
+private:
+    static int inputCallback(const void* inputBuffer, void* outputBuffer,
+                             unsigned long framesPerBuffer,
+                             const PaStreamCallbackTimeInfo* timeInfo,
+                             PaStreamCallbackFlags statusFlags,
+                             void* userData) {
+        // No input buffer when the device underflowed or has nothing to give
+        if (inputBuffer == nullptr) {
+            return paContinue;
+        }
+        auto* backend = static_cast<PortAudioBackend*>(userData);
+        backend->on_input_(static_cast<const int16_t*>(inputBuffer), framesPerBuffer);
+        return paContinue;
+    }
+
+    static int outputCallback(const void* inputBuffer, void* outputBuffer,
+                              unsigned long framesPerBuffer,
+                              const PaStreamCallbackTimeInfo* timeInfo,
+                              PaStreamCallbackFlags statusFlags,
+                              void* userData) {
+        auto* backend = static_cast<PortAudioBackend*>(userData);
+        backend->on_output_(static_cast<int16_t*>(outputBuffer), framesPerBuffer);
+        return paContinue;
+    }
+
+    PaStream* input_stream_;
+    PaStream* output_stream_;
+    bool initialized_;
+    input_callback on_input_;
+    output_callback on_output_;
+};
@@ -11,14 +11,41 @@
 using asio::ip::udp;
 class VoiceChatClient {
 public:
-    VoiceChatClient(asio::io_context& io_context, const std::string& host, short port)
-        : network_manager_(std::make_shared<NetworkManager>(io_context, host, port)) {}
+    // frame_duration_ms is only used in low-latency mode, where each captured buffer of that
+    // length is sent within half a frame instead of being polled by the 20 ms send timer.
+    VoiceChatClient(asio::io_context& io_context, const std::string& host, short port,
+                    bool low_latency = false, double frame_duration_ms = 20.0,
+                    std::unique_ptr<AudioBackend> backend = std::make_unique<PortAudioBackend>())
+        : audio_manager_(low_latency ? AudioManager::framesForDuration(frame_duration_ms)
+                                     : AudioManager::FRAMES_PER_BUFFER,
+                         std::move(backend)),
+          network_manager_(std::make_shared<NetworkManager>(io_context, host, port)),
+          low_latency_(low_latency),
+          frame_duration_ms_(frame_duration_ms) {}
+
+    void joinRoom(const std::string& room) {
+        network_manager_->join_room(room);
+    }
 
     bool start() {
+        if (low_latency_) {
+            audio_manager_.enableCaptureRing();
+        }
+
         if (!audio_manager_.initialize()) {
             return false;
         }
 
+        if (low_latency_) {
+            // Half a frame: a captured frame waits at most that long for the network thread
+            auto drain_interval = std::chrono::microseconds(static_cast<int64_t>(frame_duration_ms_ * 500.0));
+            network_manager_->start_low_latency(
+                [this](const AudioPacket& packet) { audio_manager_.addOutputData(packet); },
+                [this](AudioPacket& packet) { return audio_manager_.popCaptured(packet); },
+                drain_interval);
+            return true;
+        }
+
         network_manager_->start(
             [this](const AudioPacket& packet) { audio_manager_.addOutputData(packet); },
             [this]() { return audio_manager_.getInputData(); }
@@ -30,4 +57,6 @@ public:
 private:
     AudioManager audio_manager_;
     std::shared_ptr<NetworkManager> network_manager_;
+    bool low_latency_;
+    double frame_duration_ms_;
 };
@@ -1,10 +1,30 @@
 #include <iostream>
+#include <array>
+#include <algorithm>
 
 #include <Config.h>
 #include <asio.hpp>
 
+#include "HeadlessAudioBackend.h"
 #include "VoiceChatClient.h"
 
+// "portaudio" (default) uses the sound devices; "headless" needs no hardware and takes its
+// capture from capture_file or capture_tone_hz and writes playback to playback_file.
+std::unique_ptr<AudioBackend> create_audio_backend(const Config& config) {
+    auto backend = config.get<std::string>("audio_backend", "portaudio");
+    if (backend == "headless") {
+        HeadlessAudioBackend::Settings settings;
+        settings.capture_file = config.get<std::string>("capture_file", "");
+        settings.tone_frequency = config.get<double>("capture_tone_hz", 0.0);
+        settings.playback_file = config.get<std::string>("playback_file", "");
+        return std::make_unique<HeadlessAudioBackend>(settings);
+    }
+    if (backend != "portaudio") {
+        std::cerr << "Unknown audio_backend '" << backend << "'. Using portaudio." << std::endl;
+    }
+    return std::make_unique<PortAudioBackend>();
+}
+
 
 int main(int argc, char* argv[]) {
     if (argc != 2) {
@@ -18,14 +38,36 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    bool low_latency = config.get<bool>("low_latency", false);
+    double frame_duration_ms = config.get<double>("frame_duration_ms", 20.0);
+    static constexpr std::array<double, 4> SUPPORTED_FRAME_DURATIONS = {2.5, 5.0, 10.0, 20.0};
+    if (std::find(SUPPORTED_FRAME_DURATIONS.begin(), SUPPORTED_FRAME_DURATIONS.end(), frame_duration_ms) ==
+        SUPPORTED_FRAME_DURATIONS.end()) {
+        std::cerr << "Unsupported frame_duration_ms " << frame_duration_ms
+                  << " (use 2.5, 5, 10 or 20). Using 20 ms." << std::endl;
+        frame_duration_ms = 20.0;
+    }
+
     try {
         asio::io_context io_context;
         VoiceChatClient client(
             io_context,
             config.get<std::string>("server_ip", "127.0.0.1"),
-            config.get<short>("server_port", 12345)
+            config.get<short>("server_port", 12345),
+            low_latency,
+            frame_duration_ms,
+            create_audio_backend(config)
         );
 
+        // Stop cleanly so the audio backend can finalize its output (e.g. the WAV header)
+        asio::signal_set signals(io_context, SIGINT, SIGTERM);
+        signals.async_wait([&io_context](std::error_code, int) { io_context.stop(); });
+
+        auto room = config.get<std::string>("room", "");
+        if (!room.empty()) {
+            client.joinRoom(room);
+        }
+
         if (client.start()) {
             std::cout << "Connected to voice chat server. Start speaking..." << std::endl;
             io_context.run();
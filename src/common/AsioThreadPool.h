@@ -30,6 +30,18 @@ public:
         }
     }
 
+    // Runs the io_context on thread_count background threads and returns immediately.
+    void start() {
+        if (threads_.empty()) {
+            threads_.reserve(thread_count_);
+            for (size_t i = 0; i < thread_count_; ++i) {
+                threads_.emplace_back([this]() {
+                    io_context_.run();
+                });
+            }
+        }
+    }
+
     void run() {
         if (threads_.empty()) {
             threads_.reserve(thread_count_);
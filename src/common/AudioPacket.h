@@ -3,22 +3,98 @@
 //
 #pragma once
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
 #include <vector>
 
 
+// Audio bytes plus local metadata. A packet normally owns its bytes; borrow() creates a view of
+// someone else's buffer (a socket receive buffer, say) that is valid only while that buffer is.
+// Copying always produces an owning packet, so storing a borrowed packet is the single copy.
 class AudioPacket {
 public:
+    using clock = std::chrono::steady_clock;
+
     AudioPacket() = default;
-    AudioPacket(const uint8_t* data, size_t size) : data_(data, data + size) {}
+    AudioPacket(const uint8_t* data, size_t size) : data_(data, data + size), view_(data_) {}
+    AudioPacket(const uint8_t* data, size_t size, clock::time_point timestamp)
+        : data_(data, data + size), view_(data_), timestamp_(timestamp) {}
+
+    // Takes ownership of bytes without copying them.
+    explicit AudioPacket(std::vector<uint8_t>&& bytes) : data_(std::move(bytes)), view_(data_) {}
+
+    static AudioPacket borrow(std::span<const std::byte> bytes) {
+        AudioPacket packet;
+        packet.view_ = {reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size()};
+        return packet;
+    }
+
+    AudioPacket(const AudioPacket& other)
+        : data_(other.view_.begin(), other.view_.end()), view_(data_),
+          timestamp_(other.timestamp_), enqueued_(other.enqueued_), traced_(other.traced_),
+          sources_(other.sources_) {}
+
+    // Moving a vector keeps its buffer, so the view stays valid for owned and borrowed packets alike.
+    AudioPacket(AudioPacket&& other) noexcept
+        : data_(std::move(other.data_)), view_(std::exchange(other.view_, {})),
+          timestamp_(other.timestamp_), enqueued_(other.enqueued_), traced_(other.traced_),
+          sources_(other.sources_) {}
+
+    AudioPacket& operator=(const AudioPacket& other) {
+        if (this != &other) {
+            *this = AudioPacket(other);
+        }
+        return *this;
+    }
+
+    AudioPacket& operator=(AudioPacket&& other) noexcept {
+        data_ = std::move(other.data_);
+        view_ = std::exchange(other.view_, {});
+        timestamp_ = other.timestamp_;
+        enqueued_ = other.enqueued_;
+        traced_ = other.traced_;
+        sources_ = other.sources_;
+        return *this;
+    }
+
+    [[nodiscard]] const uint8_t* data() const { return view_.data(); }
+
+    [[nodiscard]] std::span<const uint8_t> bytes() const { return view_; }
+
+    [[nodiscard]] size_t size() const { return view_.size(); }
+
+    [[nodiscard]] bool empty() const { return view_.empty(); }
+
+    [[nodiscard]] bool owns_data() const { return view_.data() == data_.data(); }
+
+    // Local capture time (client) or arrival time (server), not part of the wire format.
+    [[nodiscard]] clock::time_point timestamp() const { return timestamp_; }
+
+    void set_timestamp(clock::time_point timestamp) { timestamp_ = timestamp; }
+
+    // Server pipeline tracing, only set on sampled packets (see LatencyTracer).
+    [[nodiscard]] bool traced() const { return traced_; }
+
+    void set_traced(bool traced) { traced_ = traced; }
 
-    [[nodiscard]] const uint8_t* data() const { return data_.data(); }
+    [[nodiscard]] clock::time_point enqueued() const { return enqueued_; }
 
-    [[nodiscard]] const std::vector<uint8_t>& data_vector() const { return data_; }
+    void set_enqueued(clock::time_point enqueued) { enqueued_ = enqueued; }
 
-    [[nodiscard]] size_t size() const { return data_.size(); }
+    // Speakers averaged into this packet: 1 for a client's audio, more for a partial mix from
+    // a federated node. The mixer weights packets by it.
+    [[nodiscard]] uint16_t sources() const { return sources_; }
 
-    [[nodiscard]] bool empty() const { return data_.empty(); }
+    void set_sources(uint16_t sources) { sources_ = sources; }
 
 private:
     std::vector<uint8_t> data_;
-};
\ No newline at end of file
+    std::span<const uint8_t> view_;
+    clock::time_point timestamp_{};
+    clock::time_point enqueued_{};
+    bool traced_ = false;
+    uint16_t sources_ = 1;
+};
@@ -0,0 +1,288 @@
+//
+// Created by maxim on 28.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Logger.h"
+
+// Binary log segments: AsyncLogger entries appended as compact records to preallocated,
+// memory-mapped files, so writing one is a memcpy instead of a formatted, flushed line.
+// Segments rotate by size or age and the oldest are deleted past a limit; voice_logdump
+// decodes and filters them.
+namespace BinaryLog
+{
+    // Segment layout, native byte order: SegmentHeader, then records, each a RecordHeader and
+    // its body padded to 8 bytes. The file is preallocated with zeros, so a record size of 0
+    // ends a segment that was not closed (the process died); a closed one is cut to its length.
+    constexpr uint32_t SEGMENT_MAGIC = 0x4C424356;  // "VCBL"
+    constexpr uint32_t SEGMENT_VERSION = 1;
+    constexpr const char* SEGMENT_EXTENSION = ".vcbl";
+
+    struct SegmentHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t sequence;     // counts segments since the writer started
+        int64_t created_unix_ns;
+        uint64_t reserved;
+    };
+    static_assert(sizeof(SegmentHeader) == 32);
+
+    enum class RecordType : uint16_t {
+        FileName = 1,  // body: the name; Entry records refer to it by its number in the segment
+        Entry,         // body: message, then context_count x (uint16 key length, uint16 value length, key, value)
+    };
+
+    struct RecordHeader {
+        uint32_t size;  // header and body, padded to 8
+        RecordType type;
+        uint16_t file;
+        int64_t unix_ns;
+        uint32_t line;
+        uint32_t suppressed;
+        uint32_t body_length;  // FileName: the name; Entry: the message
+        uint8_t level;
+        uint8_t context_count;
+        uint16_t reserved;
+    };
+    static_assert(sizeof(RecordHeader) == 32);
+
+    constexpr size_t align8(size_t size) {
+        return (size + 7) & ~size_t{7};
+    }
+
+    struct Settings {
+        std::string directory = ".";
+        std::string prefix = "voice";
+        size_t segment_size = 64 * 1024 * 1024;
+        std::chrono::seconds rotate_interval{0};  // 0: rotate by size only
+        size_t max_segments = 0;                  // segments kept, the current one included; 0 keeps all
+    };
+
+    // Writes on the AsyncLogger thread, so rotating (allocating and mapping the next file, cutting
+    // the last one to length) never holds up a thread that logs.
+    class Destination : public AsyncLogger::LogDestination {
+    public:
+        explicit Destination(Settings settings) : settings_(std::move(settings)) {
+            settings_.segment_size = std::max<size_t>(settings_.segment_size, 64 * 1024);
+            std::error_code ec;
+            std::filesystem::create_directories(settings_.directory, ec);
+            openSegment();
+        }
+
+        ~Destination() override {
+            closeSegment();
+        }
+
+        Destination(const Destination&) = delete;
+        Destination& operator=(const Destination&) = delete;
+
+        void write(const AsyncLogger::LogEntry& entry) override {
+            auto now = std::chrono::steady_clock::now();
+            if (data_ == nullptr) {
+                // The last segment could not be created; try again now and then
+                if (now < retry_at_) {
+                    return;
+                }
+                openSegment();
+            } else if (settings_.rotate_interval.count() > 0 && now - opened_ >= settings_.rotate_interval) {
+                rotate();
+            }
+            if (data_ == nullptr) {
+                retry_at_ = now + std::chrono::seconds(1);
+                return;
+            }
+            // Whatever a record cannot fit in an empty segment is cut from its message
+            size_t context_size = 0;
+            for (const auto& [key, value] : entry.context) {
+                context_size += 4 + std::min<size_t>(key.size(), UINT16_MAX) + std::min<size_t>(value.size(), UINT16_MAX);
+            }
+            size_t file_record = sizeof(RecordHeader) + align8(entry.file.size());
+            size_t overhead = sizeof(SegmentHeader) + file_record + sizeof(RecordHeader) + context_size + 8;
+            if (overhead > settings_.segment_size) {
+                return;
+            }
+            size_t limit = settings_.segment_size - overhead;
+            std::string_view message = entry.message;
+            if (message.size() > limit) {
+                message = message.substr(0, limit);
+            }
+            size_t size = sizeof(RecordHeader) + align8(message.size() + context_size);
+
+            auto file = files_.find(entry.file);
+            if (file == files_.end() || offset_ + size > settings_.segment_size) {
+                if (offset_ + file_record + size > settings_.segment_size || files_.size() > UINT16_MAX) {
+                    rotate();
+                }
+                if (data_ == nullptr) {
+                    retry_at_ = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+                    return;
+                }
+                file = files_.emplace(entry.file, static_cast<uint16_t>(files_.size())).first;
+                RecordHeader header{};
+                header.type = RecordType::FileName;
+                header.file = file->second;
+                header.body_length = static_cast<uint32_t>(entry.file.size());
+                append(header, file_record, [&](uint8_t* body) {
+                    std::memcpy(body, entry.file.data(), entry.file.size());
+                });
+            }
+
+            RecordHeader header{};
+            header.type = RecordType::Entry;
+            header.file = file->second;
+            header.unix_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                entry.timestamp.time_since_epoch()).count();
+            header.line = static_cast<uint32_t>(entry.line);
+            header.suppressed = entry.suppressed;
+            header.body_length = static_cast<uint32_t>(message.size());
+            header.level = static_cast<uint8_t>(entry.level);
+            header.context_count = static_cast<uint8_t>(std::min<size_t>(entry.context.size(), UINT8_MAX));
+            append(header, size, [&](uint8_t* body) {
+                std::memcpy(body, message.data(), message.size());
+                body += message.size();
+                size_t written = 0;
+                for (const auto& [key, value] : entry.context) {
+                    if (written++ == header.context_count) {
+                        break;
+                    }
+                    auto key_length = static_cast<uint16_t>(std::min<size_t>(key.size(), UINT16_MAX));
+                    auto value_length = static_cast<uint16_t>(std::min<size_t>(value.size(), UINT16_MAX));
+                    std::memcpy(body, &key_length, 2);
+                    std::memcpy(body + 2, &value_length, 2);
+                    std::memcpy(body + 4, key.data(), key_length);
+                    std::memcpy(body + 4 + key_length, value.data(), value_length);
+                    body += 4 + key_length + value_length;
+                }
+            });
+        }
+
+    private:
+        // The size goes in last, so a reader of a live segment never sees half a record.
+        template<typename Body>
+        void append(RecordHeader header, size_t size, Body&& body) {
+            if (data_ == nullptr) {
+                return;
+            }
+            uint8_t* record = data_ + offset_;
+            header.size = 0;
+            std::memcpy(record, &header, sizeof(header));
+            body(record + sizeof(header));
+            auto record_size = static_cast<uint32_t>(size);
+            __atomic_store_n(reinterpret_cast<uint32_t*>(record), record_size, __ATOMIC_RELEASE);
+            offset_ += size;
+        }
+
+        void rotate() {
+            closeSegment();
+            openSegment();
+        }
+
+        void openSegment() {
+            auto now = std::chrono::system_clock::now();
+            std::time_t seconds = std::chrono::system_clock::to_time_t(now);
+            std::tm tm{};
+            gmtime_r(&seconds, &tm);
+            char stamp[32];
+            std::strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+            // The sequence number keeps names unique and ordered within a second
+            char name[96];
+            std::snprintf(name, sizeof(name), "-%s-%06llu", stamp, static_cast<unsigned long long>(sequence_));
+            path_ = (std::filesystem::path(settings_.directory) / (settings_.prefix + name + SEGMENT_EXTENSION)).string();
+
+            fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd_ < 0) {
+                std::cerr << "Failed to create log segment " << path_ << ": " << std::strerror(errno) << std::endl;
+                return;
+            }
+            // Allocated up front, so appending never extends the file or finds the disk full
+            int error = ::posix_fallocate(fd_, 0, static_cast<off_t>(settings_.segment_size));
+            if (error == EOPNOTSUPP || error == EINVAL) {
+                // The file system cannot preallocate: sparse then, pages allocated as they are
+                // written. Any other failure, ENOSPC above all, fails the segment, as writing
+                // into an unbacked page of the mapping would raise SIGBUS.
+                error = ::ftruncate(fd_, static_cast<off_t>(settings_.segment_size)) == 0 ? 0 : errno;
+            }
+            void* mapping = error == 0 ? ::mmap(nullptr, settings_.segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0)
+                                       : MAP_FAILED;
+            if (mapping == MAP_FAILED) {
+                std::cerr << "Failed to map log segment " << path_ << ": " << std::strerror(error ? error : errno)
+                          << std::endl;
+                ::close(fd_);
+                fd_ = -1;
+                ::unlink(path_.c_str());
+                return;
+            }
+            data_ = static_cast<uint8_t*>(mapping);
+            SegmentHeader header{SEGMENT_MAGIC, SEGMENT_VERSION, sequence_++,
+                                 std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count(), 0};
+            std::memcpy(data_, &header, sizeof(header));
+            offset_ = sizeof(header);
+            opened_ = std::chrono::steady_clock::now();
+            files_.clear();
+            pruneSegments();
+        }
+
+        void closeSegment() {
+            if (data_ != nullptr) {
+                ::munmap(data_, settings_.segment_size);
+                data_ = nullptr;
+            }
+            if (fd_ >= 0) {
+                if (::ftruncate(fd_, static_cast<off_t>(offset_)) != 0) {
+                    std::cerr << "Failed to trim log segment " << path_ << ": " << std::strerror(errno) << std::endl;
+                }
+                ::close(fd_);
+                fd_ = -1;
+            }
+        }
+
+        // Names sort by creation time, so the oldest come first.
+        void pruneSegments() {
+            if (settings_.max_segments == 0) {
+                return;
+            }
+            std::vector<std::filesystem::path> segments;
+            std::error_code ec;
+            for (const auto& file : std::filesystem::directory_iterator(settings_.directory, ec)) {
+                auto name = file.path().filename().string();
+                if (name.starts_with(settings_.prefix + "-") && name.ends_with(SEGMENT_EXTENSION)) {
+                    segments.push_back(file.path());
+                }
+            }
+            if (segments.size() <= settings_.max_segments) {
+                return;
+            }
+            std::sort(segments.begin(), segments.end());
+            for (size_t i = 0; i + settings_.max_segments < segments.size(); ++i) {
+                std::filesystem::remove(segments[i], ec);
+            }
+        }
+
+        Settings settings_;
+        std::string path_;
+        int fd_ = -1;
+        uint8_t* data_ = nullptr;
+        size_t offset_ = 0;
+        uint64_t sequence_ = 0;
+        std::chrono::steady_clock::time_point opened_;
+        std::chrono::steady_clock::time_point retry_at_;
+        std::unordered_map<std::string, uint16_t> files_;
+    };
+}
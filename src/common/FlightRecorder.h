@@ -0,0 +1,299 @@
+//
+// Created by maxim on 19.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Always-on binary event log. Every thread writes fixed-size events into its own ring, so
+// recording is a clock read plus a few stores with no locks or allocation. The rings are
+// written to a file on demand (SIGUSR1 in voice_server) or, by a thread of their own, when an
+// anomaly is reported, and voice_flightdump turns such a file into a readable timeline.
+//
+// Dumps copy the rings while their threads keep writing; the oldest few events of a busy
+// thread may be torn. That is acceptable for a post-mortem aid and keeps record() wait-free.
+namespace FlightRecorder
+{
+    enum class EventType : uint32_t {
+        PacketReceived = 1,  // a: client, b: bytes
+        TickStarted,         // a: room, b: lateness in ns
+        TickFinished,        // a: room, b: duration in ns
+        TickOverrun,         // a: room, b: tick start to finish past the deadline, in ns
+        SendQueued,          // a: client, b: bytes
+        ClientAdded,         // a: room, b: client
+        ClientRemoved,       // a: room, b: client
+        QueueOverflow,       // a: room, b: client
+        Dump,                // a: reason
+    };
+
+    inline const char* eventName(EventType type) {
+        switch (type) {
+            case EventType::PacketReceived: return "packet_received";
+            case EventType::TickStarted: return "tick_started";
+            case EventType::TickFinished: return "tick_finished";
+            case EventType::TickOverrun: return "tick_overrun";
+            case EventType::SendQueued: return "send_queued";
+            case EventType::ClientAdded: return "client_added";
+            case EventType::ClientRemoved: return "client_removed";
+            case EventType::QueueOverflow: return "queue_overflow";
+            case EventType::Dump: return "dump";
+            default: return "unknown";
+        }
+    }
+
+    struct Event {
+        uint64_t timestamp_ns;  // steady clock
+        EventType type;
+        uint32_t reserved;
+        uint64_t a;
+        uint64_t b;
+    };
+    static_assert(sizeof(Event) == 32);
+
+    // Dump file layout, native byte order:
+    //   FileHeader, label_count x (uint64 id, uint16 length, bytes),
+    //   ring_count x (uint32 thread, uint32 event_count, event_count x Event), oldest event first
+    constexpr uint32_t FILE_MAGIC = 0x52464356;  // "VCFR"
+    constexpr uint32_t FILE_VERSION = 1;
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        int64_t realtime_offset_ns;  // add to a timestamp to get nanoseconds since the Unix epoch
+        uint32_t label_count;
+        uint32_t ring_count;
+    };
+
+    constexpr size_t RING_EVENTS = 8192;  // per thread, power of two
+
+    // FNV-1a; ids are what events carry, labels map them back to names in the dump.
+    inline uint64_t labelId(std::string_view name) {
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : name) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    class Recorder {
+    public:
+        static Recorder& get() {
+            static Recorder instance;
+            return instance;
+        }
+
+        void record(EventType type, uint64_t a = 0, uint64_t b = 0) {
+            Ring& ring = localRing();
+            uint64_t head = ring.head.load(std::memory_order_relaxed);
+            Event& event = ring.events[head & (RING_EVENTS - 1)];
+            event.timestamp_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+            event.type = type;
+            event.a = a;
+            event.b = b;
+            ring.head.store(head + 1, std::memory_order_release);
+        }
+
+        // Registers a name for the dump and returns its id. Call where names are created
+        // (rooms, clients), not per packet.
+        uint64_t label(const std::string& name) {
+            uint64_t id = labelId(name);
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& label = labels_[id];
+            label.name = name;
+            label.retired = false;
+            return id;
+        }
+
+        // The name is no longer in use (its client left). It is kept for the most recent
+        // MAX_RETIRED_LABELS such names, whose events may still be in the rings, then forgotten.
+        void retire(uint64_t id) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = labels_.find(id);
+            if (it == labels_.end() || it->second.retired) {
+                return;
+            }
+            it->second.retired = true;
+            it->second.generation = ++retirements_;
+            retired_.emplace_back(id, retirements_);
+            while (retired_.size() > MAX_RETIRED_LABELS) {
+                auto [oldest, generation] = retired_.front();
+                retired_.pop_front();
+                // Unless it was labelled again, or retired again later
+                auto label = labels_.find(oldest);
+                if (label != labels_.end() && label->second.retired && label->second.generation == generation) {
+                    labels_.erase(label);
+                }
+            }
+        }
+
+        void setDirectory(const std::string& directory) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            directory_ = directory;
+        }
+
+        // Writes all rings to <directory>/flight-<unix ms>-<reason>.vcfr; returns the path or
+        // an empty string on failure.
+        std::string dump(const std::string& reason) {
+            record(EventType::Dump, label(reason));
+            auto realtime = std::chrono::system_clock::now().time_since_epoch();
+            auto steady = std::chrono::steady_clock::now().time_since_epoch();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::string path = directory_ + "/flight-" +
+                std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(realtime).count()) +
+                "-" + reason + ".vcfr";
+            std::ofstream file(path, std::ios::binary);
+            if (!file.is_open()) {
+                std::cerr << "Failed to open flight recorder dump: " << path << std::endl;
+                return "";
+            }
+
+            FileHeader header{FILE_MAGIC, FILE_VERSION,
+                              std::chrono::duration_cast<std::chrono::nanoseconds>(realtime - steady).count(),
+                              static_cast<uint32_t>(labels_.size()), static_cast<uint32_t>(rings_.size())};
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            for (const auto& [id, label] : labels_) {
+                auto length = static_cast<uint16_t>(std::min<size_t>(label.name.size(), UINT16_MAX));
+                file.write(reinterpret_cast<const char*>(&id), sizeof(id));
+                file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+                file.write(label.name.data(), length);
+            }
+
+            std::vector<Event> events;
+            for (const auto& ring : rings_) {
+                uint64_t head = ring->head.load(std::memory_order_acquire);
+                uint64_t first = head > RING_EVENTS ? head - RING_EVENTS : 0;
+                events.clear();
+                for (uint64_t i = first; i < head; ++i) {
+                    events.push_back(ring->events[i & (RING_EVENTS - 1)]);
+                }
+                auto count = static_cast<uint32_t>(events.size());
+                file.write(reinterpret_cast<const char*>(&ring->thread), sizeof(ring->thread));
+                file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+                file.write(reinterpret_cast<const char*>(events.data()),
+                           static_cast<std::streamsize>(events.size() * sizeof(Event)));
+            }
+            if (!file) {
+                std::cerr << "Failed to write flight recorder dump: " << path << std::endl;
+                return "";
+            }
+            return path;
+        }
+
+        // Dump triggered by the server itself; rate limited so a persistent fault does not
+        // fill the disk. Written by the dump thread, so the caller (a late mix tick, say) is
+        // not held up by the file.
+        void dumpOnAnomaly(const std::string& reason) {
+            auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+            auto last = last_anomaly_dump_.load(std::memory_order_relaxed);
+            auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(ANOMALY_DUMP_INTERVAL).count();
+            if (last != 0 && now - last < interval) {
+                return;
+            }
+            if (!last_anomaly_dump_.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(dump_mutex_);
+            pending_dump_ = reason;
+            if (!dump_thread_.joinable()) {
+                dump_thread_ = std::thread(&Recorder::dumpThread, this);
+            }
+            dump_wakeup_.notify_one();
+        }
+
+        ~Recorder() {
+            {
+                std::lock_guard<std::mutex> lock(dump_mutex_);
+                stopping_ = true;
+            }
+            dump_wakeup_.notify_one();
+            if (dump_thread_.joinable()) {
+                dump_thread_.join();
+            }
+        }
+
+    private:
+        static constexpr auto ANOMALY_DUMP_INTERVAL = std::chrono::seconds(10);
+        static constexpr size_t MAX_RETIRED_LABELS = 4096;
+
+        struct Label {
+            std::string name;
+            bool retired = false;
+            uint64_t generation = 0;  // of its last retirement
+        };
+
+        // Writes the anomaly dumps; at most one is pending, as they are rate limited.
+        void dumpThread() {
+            std::unique_lock<std::mutex> lock(dump_mutex_);
+            while (true) {
+                dump_wakeup_.wait(lock, [this] { return stopping_ || !pending_dump_.empty(); });
+                if (pending_dump_.empty()) {
+                    return;
+                }
+                std::string reason = std::move(pending_dump_);
+                pending_dump_.clear();
+                lock.unlock();
+                std::string path = dump(reason);
+                if (!path.empty()) {
+                    std::cerr << "Flight recorder dumped to " << path << " (" << reason << ")" << std::endl;
+                }
+                lock.lock();
+            }
+        }
+
+        struct Ring {
+            explicit Ring(uint32_t thread) : thread(thread) {}
+
+            uint32_t thread;
+            std::atomic<uint64_t> head{0};
+            std::array<Event, RING_EVENTS> events{};
+        };
+
+        Recorder() = default;
+
+        // Rings stay registered after their thread exits so its last events still appear in dumps.
+        Ring& localRing() {
+            thread_local Ring* ring = nullptr;
+            if (ring == nullptr) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                rings_.push_back(std::make_unique<Ring>(static_cast<uint32_t>(rings_.size())));
+                ring = rings_.back().get();
+            }
+            return *ring;
+        }
+
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<Ring>> rings_;
+        std::unordered_map<uint64_t, Label> labels_;
+        std::deque<std::pair<uint64_t, uint64_t>> retired_;  // id and generation, oldest first
+        uint64_t retirements_ = 0;
+        std::string directory_ = ".";
+        std::atomic<std::chrono::steady_clock::rep> last_anomaly_dump_{0};
+        std::mutex dump_mutex_;
+        std::condition_variable dump_wakeup_;
+        std::string pending_dump_;
+        bool stopping_ = false;
+        std::thread dump_thread_;
+    };
+
+    inline void record(EventType type, uint64_t a = 0, uint64_t b = 0) {
+        Recorder::get().record(type, a, b);
+    }
+}
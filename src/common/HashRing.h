@@ -0,0 +1,96 @@
+//
+// Created by maxim on 26.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Consistent hashing of keys (room ids) onto named nodes (backends). Every node owns
+// `replicas` points on a 64-bit ring and a key belongs to the first point at or after its
+// hash. Adding a node only takes over the keys that now fall just before its points, about
+// 1/n of them, all from other nodes to the new one; removing a node only moves its own keys.
+// Lookups are a binary search over the points and never allocate.
+class HashRing {
+public:
+    explicit HashRing(size_t replicas = 160) : replicas_(replicas == 0 ? 1 : replicas) {}
+
+    void add(const std::string& node) {
+        if (std::find(nodes_.begin(), nodes_.end(), node) != nodes_.end()) {
+            return;
+        }
+        nodes_.push_back(node);
+        rebuild();
+    }
+
+    bool remove(const std::string& node) {
+        auto it = std::find(nodes_.begin(), nodes_.end(), node);
+        if (it == nodes_.end()) {
+            return false;
+        }
+        nodes_.erase(it);
+        rebuild();
+        return true;
+    }
+
+    // Node owning key, or nullptr if the ring is empty.
+    [[nodiscard]] const std::string* lookup(std::string_view key) const {
+        if (points_.empty()) {
+            return nullptr;
+        }
+        uint64_t h = hash(key);
+        auto it = std::lower_bound(points_.begin(), points_.end(), h,
+                                   [](const Point& point, uint64_t value) { return point.hash < value; });
+        if (it == points_.end()) {
+            it = points_.begin();
+        }
+        return &nodes_[it->node];
+    }
+
+    [[nodiscard]] const std::vector<std::string>& nodes() const { return nodes_; }
+
+    [[nodiscard]] bool empty() const { return nodes_.empty(); }
+
+    // FNV-1a with a final avalanche, so similar names ("room-1", "room-2") spread over the ring.
+    static uint64_t hash(std::string_view key) {
+        uint64_t h = 14695981039346656037ull;
+        for (char c : key) {
+            h = (h ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+private:
+    struct Point {
+        uint64_t hash;
+        uint32_t node;  // index into nodes_
+    };
+
+    // Points depend only on the node names, so every router builds the same ring whatever
+    // the order the nodes were added in.
+    void rebuild() {
+        points_.clear();
+        points_.reserve(nodes_.size() * replicas_);
+        for (uint32_t node = 0; node < nodes_.size(); ++node) {
+            for (size_t replica = 0; replica < replicas_; ++replica) {
+                points_.push_back({hash(nodes_[node] + "#" + std::to_string(replica)), node});
+            }
+        }
+        std::sort(points_.begin(), points_.end(), [this](const Point& a, const Point& b) {
+            return a.hash != b.hash ? a.hash < b.hash : nodes_[a.node] < nodes_[b.node];
+        });
+    }
+
+    size_t replicas_;
+    std::vector<std::string> nodes_;
+    std::vector<Point> points_;
+};
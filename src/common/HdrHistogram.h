@@ -0,0 +1,90 @@
+//
+// Created by maxim on 18.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+
+// Lock-free log-linear histogram in the style of HdrHistogram: every power-of-two range is
+// split into SUB_BUCKETS linear buckets, giving ~3% relative precision from 1 to 2^MAX_EXPONENT.
+// record() is a couple of relaxed atomic increments and may be called from any thread.
+class HdrHistogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 5;
+    static constexpr uint64_t SUB_BUCKETS = uint64_t{1} << SUB_BUCKET_BITS;
+    static constexpr unsigned MAX_EXPONENT = 40;  // ~18 minutes when recording nanoseconds
+    static constexpr size_t BUCKET_COUNT = SUB_BUCKETS * (MAX_EXPONENT - SUB_BUCKET_BITS + 2);
+
+    void record(uint64_t value) {
+        value = std::min(value, (uint64_t{1} << (MAX_EXPONENT + 1)) - 1);
+        counts_[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        total_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        uint64_t current = max_.load(std::memory_order_relaxed);
+        while (value > current && !max_.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    [[nodiscard]] uint64_t count() const { return total_.load(std::memory_order_relaxed); }
+
+    [[nodiscard]] uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    [[nodiscard]] double mean() const {
+        uint64_t total = count();
+        return total == 0 ? 0.0 : static_cast<double>(sum_.load(std::memory_order_relaxed)) / static_cast<double>(total);
+    }
+
+    // Highest value equivalent to the bucket holding the q-th quantile, q in [0, 1].
+    [[nodiscard]] uint64_t percentile(double q) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+        auto target = std::max<uint64_t>(1, static_cast<uint64_t>(q * static_cast<double>(total) + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                return std::min(bucketUpperBound(i), max());
+            }
+        }
+        return max();
+    }
+
+    void reset() {
+        for (auto& c : counts_) {
+            c.store(0, std::memory_order_relaxed);
+        }
+        total_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    static size_t bucketIndex(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return static_cast<size_t>(value);
+        }
+        unsigned exponent = 63 - static_cast<unsigned>(std::countl_zero(value));
+        unsigned shift = exponent - SUB_BUCKET_BITS;
+        return static_cast<size_t>(SUB_BUCKETS * (shift + 1) + ((value >> shift) - SUB_BUCKETS));
+    }
+
+    static uint64_t bucketUpperBound(size_t index) {
+        if (index < 2 * SUB_BUCKETS) {
+            return index;
+        }
+        uint64_t shift = index / SUB_BUCKETS - 1;
+        uint64_t lower = (SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+        return lower + (uint64_t{1} << shift) - 1;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKET_COUNT> counts_{};
+    std::atomic<uint64_t> total_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
@@ -0,0 +1,113 @@
+//
+// Created by maxim on 17.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Plain HTTP requests that arrive on the WebSocket port without an upgrade.
+struct HttpRequest {
+    std::string method;
+    std::string target;
+    std::string raw;  // Request line and headers as received
+
+    // Case-insensitive header lookup; empty if absent.
+    [[nodiscard]] std::string header(const std::string& name) const {
+        size_t line = raw.find("\r\n");
+        while (line != std::string::npos && line + 2 < raw.size()) {
+            size_t start = line + 2;
+            size_t end = raw.find("\r\n", start);
+            if (end == std::string::npos || end == start) {
+                break;
+            }
+            size_t colon = raw.find(':', start);
+            if (colon != std::string::npos && colon < end && colon - start == name.size() &&
+                std::equal(name.begin(), name.end(), raw.begin() + static_cast<std::ptrdiff_t>(start),
+                           [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) ==
+                                                       std::tolower(static_cast<unsigned char>(b)); })) {
+                size_t value = raw.find_first_not_of(' ', colon + 1);
+                return value < end ? raw.substr(value, end - value) : "";
+            }
+            line = end;
+        }
+        return "";
+    }
+
+    static HttpRequest parse(const std::string& raw) {
+        HttpRequest request;
+        request.raw = raw;
+        size_t method_end = raw.find(' ');
+        if (method_end == std::string::npos) {
+            return request;
+        }
+        size_t target_end = raw.find(' ', method_end + 1);
+        request.method = raw.substr(0, method_end);
+        if (target_end != std::string::npos) {
+            request.target = raw.substr(method_end + 1, target_end - method_end - 1);
+        }
+        return request;
+    }
+};
+
+struct HttpResponse {
+    int status = 200;
+    std::string reason = "OK";
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    // Alternatives to body: a shared buffer written without copying (a cached asset), or a file
+    // of file_size bytes sent with sendfile(2) where the transport allows it.
+    std::shared_ptr<const std::string> shared_body;
+    std::string file_path;
+    size_t file_size = 0;
+    bool head_only = false;  // HEAD: Content-Length describes the body, which is not sent
+
+    [[nodiscard]] size_t bodySize() const {
+        if (shared_body) {
+            return shared_body->size();
+        }
+        return file_path.empty() ? body.size() : file_size;
+    }
+
+    [[nodiscard]] const std::string& bodyData() const {
+        return shared_body ? *shared_body : body;
+    }
+
+    [[nodiscard]] std::string serializeHead() const {
+        std::string head = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n";
+        for (const auto& [name, value] : headers) {
+            head += name + ": " + value + "\r\n";
+        }
+        if (status != 304) {  // A 304 would have to repeat the 200 length; leaving it out is allowed
+            head += "Content-Length: " + std::to_string(bodySize()) + "\r\n";
+        }
+        head += "Connection: close\r\n\r\n";
+        return head;
+    }
+
+    static HttpResponse notFound() {
+        HttpResponse response;
+        response.status = 404;
+        response.reason = "Not Found";
+        response.headers.emplace_back("Content-Type", "text/plain");
+        response.body = "Not Found\n";
+        return response;
+    }
+
+    static HttpResponse headersTooLarge() {
+        HttpResponse response;
+        response.status = 431;
+        response.reason = "Request Header Fields Too Large";
+        response.headers.emplace_back("Content-Type", "text/plain");
+        response.body = "Request Header Fields Too Large\n";
+        return response;
+    }
+};
+
+// Returns true and fills the response if the handler serves the request.
+using http_handler = std::function<bool(const HttpRequest&, HttpResponse&)>;
@@ -1,17 +1,37 @@
 #pragma once
 
-#include <queue>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
 #include <thread>
-#include <condition_variable>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 #include <vector>
 #include <unordered_map>
 #include <functional>
 #include <filesystem>
-#include <memory>
 #include <iostream>
 #include <fstream>
 
+#include "MpscRing.h"
+
+// Logging that is cheap enough for I/O threads. log() copies the format pointer, the raw
+// arguments and a timestamp into a fixed-size record of a lock-free ring and returns; the logger
+// thread formats the record, adds the context and hands it to the destinations. The format must
+// be a string literal (the macros below only take those), since only its pointer is kept.
 class AsyncLogger {
 public:
     enum class LogLevel {
@@ -29,6 +49,7 @@ public:
         std::string message;
         std::chrono::system_clock::time_point timestamp;
         std::unordered_map<std::string, std::string> context;
+        uint32_t suppressed = 0;  // messages from the same site dropped by its RateLimit before this one
     };
 
     class LogDestination {
@@ -37,10 +58,11 @@ public:
         virtual void write(const LogEntry& entry) = 0;
     };
 
+    // Warnings and worse go to stderr, the rest to stdout.
     class ConsoleDestination : public LogDestination {
     public:
         void write(const LogEntry& entry) override {
-            std::cout << formatLogEntry(entry) << std::endl;
+            (entry.level >= LogLevel::WARNING_LOG ? std::cerr : std::cout) << formatLogEntry(entry) << std::endl;
         }
     };
 
@@ -51,11 +73,14 @@ public:
             openLogFile();
         }
 
+        // Lines are buffered by the stream rather than flushed one by one; the file is renamed
+        // aside and started afresh once it reaches maxFileSize (0: never).
         void write(const LogEntry& entry) override {
-            /*if (m_logFile.tellp() >= m_maxFileSize) {
-                //rotateLogFile();
-            }*/
-            m_logFile << formatLogEntry(entry) << std::endl;
+            auto position = m_logFile.tellp();
+            if (m_maxFileSize > 0 && position >= 0 && static_cast<size_t>(position) >= m_maxFileSize) {
+                rotateLogFile();
+            }
+            m_logFile << formatLogEntry(entry) << '\n';
         }
 
     private:
@@ -66,10 +91,11 @@ public:
         void rotateLogFile() {
             m_logFile.close();
             std::filesystem::path logPath(m_filename);
-            std::string newName = logPath.stem().string() + "_" +
+            auto newName = logPath.parent_path() / (logPath.stem().string() + "_" +
                                   std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) +
-                                  logPath.extension().string();
-            std::filesystem::rename(m_filename, newName);
+                                  logPath.extension().string());
+            std::error_code ec;
+            std::filesystem::rename(m_filename, newName, ec);
             openLogFile();
         }
 
@@ -78,19 +104,52 @@ public:
         size_t m_maxFileSize;
     };
 
-    AsyncLogger() : m_logLevel(LogLevel::INFO_LOG), m_stopFlag(false) {
+    // Lets up to burst messages per interval through from one call site and counts the rest; the
+    // next message let through reports how many were dropped. Lock-free, for error paths that may
+    // fire once per packet.
+    class RateLimit {
+    public:
+        explicit RateLimit(uint32_t burst = 5, std::chrono::milliseconds interval = std::chrono::seconds(1))
+            : m_burst(burst), m_interval(std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count()) {}
+
+        bool allow(uint32_t& suppressed) {
+            int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+            int64_t windowStart = m_windowStart.load(std::memory_order_relaxed);
+            if (now - windowStart >= m_interval &&
+                m_windowStart.compare_exchange_strong(windowStart, now, std::memory_order_relaxed)) {
+                m_inWindow.store(0, std::memory_order_relaxed);
+            }
+            if (m_inWindow.fetch_add(1, std::memory_order_relaxed) >= m_burst) {
+                m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+            return true;
+        }
+
+    private:
+        const uint32_t m_burst;
+        const int64_t m_interval;
+        std::atomic<int64_t> m_windowStart{INT64_MIN / 2};
+        std::atomic<uint32_t> m_inWindow{0};
+        std::atomic<uint32_t> m_suppressed{0};
+    };
+
+    // capacity is rounded up to a power of two; when the ring is full, messages are dropped and
+    // counted rather than blocking the caller.
+    explicit AsyncLogger(size_t capacity = 4096)
+        : m_logLevel(LogLevel::INFO_LOG),
+          m_ring(capacity) {
         m_loggerThread = std::thread(&AsyncLogger::loggerThreadFunction, this);
     }
 
     AsyncLogger(const AsyncLogger&) = delete;
     AsyncLogger& operator=(const AsyncLogger&) = delete;
 
+    // Writes out everything logged before it returns.
     ~AsyncLogger() {
-        {
-            std::lock_guard<std::mutex> lock(m_queueMutex);
-            m_stopFlag = true;
-        }
-        m_condition.notify_one();
+        m_stopFlag.store(true, std::memory_order_release);
+        wake();
         if (m_loggerThread.joinable()) {
             m_loggerThread.join();
         }
@@ -102,7 +161,11 @@ public:
     }
 
     void setLogLevel(LogLevel level) {
-        m_logLevel = level;
+        m_logLevel.store(level, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] bool enabled(LogLevel level) const {
+        return level >= m_logLevel.load(std::memory_order_relaxed);
     }
 
     static LogLevel parseLogLevel(const std::string& level) {
@@ -116,67 +179,272 @@ public:
         return LogLevel::INFO_LOG;
     }
 
+    // Without any destination, entries go to a ConsoleDestination.
     void addDestination(std::shared_ptr<LogDestination> destination) {
         std::lock_guard<std::mutex> lock(m_destinationsMutex);
         m_destinations.push_back(std::move(destination));
     }
 
+    // Runs on the logger thread, after formatting.
     void setLogFilter(std::function<bool(const LogEntry&)> filter) {
+        std::lock_guard<std::mutex> lock(m_destinationsMutex);
         m_logFilter = std::move(filter);
     }
 
+    // Attached to the entries the logger thread writes from now on.
     void setContextValue(const std::string& key, const std::string& value) {
         std::lock_guard<std::mutex> lock(m_contextMutex);
         m_context[key] = value;
     }
 
+    // Messages lost to a full ring so far.
+    [[nodiscard]] uint64_t dropped() const {
+        return m_droppedTotal.load(std::memory_order_relaxed);
+    }
+
+    // printf-style. Arithmetic and pointer arguments are stored as they are; C strings,
+    // std::string and std::string_view are copied, the longest ones cut short when they do not
+    // all fit in a record's PAYLOAD_SIZE bytes.
     template<typename... Args>
-    void log(LogLevel level, const char* file, int line, const char* format, Args... args) {
-        if (level >= m_logLevel) {
-            LogEntry entry{
-                    level,
-                    file,
-                    line,
-                    formatString(format, args...),
-                    std::chrono::system_clock::now(),
-                    {}
-            };
-
-            {
-                std::lock_guard<std::mutex> lock(m_contextMutex);
-                entry.context = m_context;
-            }
+    void log(LogLevel level, const char* file, int line, const char* format, const Args&... args) {
+        logSuppressed(level, file, line, 0, format, args...);
+    }
+
+    // log() for the rate-limited macros; suppressed is what RateLimit::allow() reported.
+    template<typename... Args>
+    void logSuppressed(LogLevel level, const char* file, int line, uint32_t suppressed, const char* format,
+                       const Args&... args) {
+        static_assert(fixedSize<std::decay_t<Args>...>() + (isString<std::decay_t<Args>> + ... + 0) <= PAYLOAD_SIZE,
+                      "Too many log arguments for one record");
+        if (!enabled(level)) {
+            return;
+        }
+        auto timestamp = std::chrono::system_clock::now();
+        bool queued = m_ring.push([&](Record& record) {
+            record.level = level;
+            record.line = line;
+            record.file = file;
+            record.format = format;
+            record.suppressed = suppressed;
+            record.timestamp = timestamp;
+            record.formatter = &formatRecord<std::decay_t<Args>...>;
+            encode<std::decay_t<Args>...>(record.payload, args...);
+        });
+        if (!queued) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            m_droppedTotal.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        // The push's publishing store is seq_cst, so it is ordered before this load of m_sleeping
+        // (see loggerThreadFunction)
+        if (m_sleeping.load(std::memory_order_seq_cst) && m_sleeping.exchange(false, std::memory_order_seq_cst)) {
+            wake();
+        }
+    }
+
+private:
+    static constexpr size_t PAYLOAD_SIZE = 192;
+    static constexpr std::chrono::milliseconds BATCH_INTERVAL{1};
+
+    struct Record {
+        LogLevel level;
+        int line;
+        const char* file;
+        const char* format;
+        uint32_t suppressed;
+        std::chrono::system_clock::time_point timestamp;
+        std::string (*formatter)(const char* format, const unsigned char* payload);
+        alignas(8) unsigned char payload[PAYLOAD_SIZE];
+    };
+
+    // Arguments are laid out as all fixed-size values first, in order, then all strings, each
+    // NUL-terminated; so the string area can be shared out at encoding time.
+    template<typename T>
+    static constexpr bool isString = std::is_same_v<T, const char*> || std::is_same_v<T, char*> ||
+                                     std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>;
+
+    template<typename... Args>
+    static constexpr size_t fixedSize() {
+        return ((isString<Args> ? 0 : sizeof(Args)) + ... + 0);
+    }
+
+    template<typename T>
+    using Decoded = std::conditional_t<isString<T>, const char*, T>;
+
+    template<typename T, typename Arg>
+    static std::string_view textOf(const Arg& arg) {
+        if constexpr (std::is_array_v<Arg>) {
+            return std::string_view(arg);  // A literal, never null
+        } else if constexpr (std::is_pointer_v<T>) {
+            return arg ? std::string_view(arg) : std::string_view("(null)");
+        } else if constexpr (isString<T>) {
+            return arg;
+        } else {
+            return {};
+        }
+    }
 
-            if (m_logFilter && !m_logFilter(entry)) {
-                return;
+    // Longest a string may be so that all of them fit in room: the short ones whole, the long
+    // ones cut to an equal share of what is left.
+    template<size_t Count>
+    static size_t stringLimit(std::array<size_t, Count> lengths, size_t room) {
+        std::sort(lengths.begin(), lengths.end());
+        for (size_t i = 0; i < Count; ++i) {
+            size_t share = room / (Count - i);
+            if (lengths[i] > share) {
+                return share;
             }
+            room -= lengths[i];
+        }
+        return SIZE_MAX;
+    }
+
+    template<typename T, typename Arg>
+    static void encodeArg(const Arg& arg, unsigned char*& fixed, unsigned char*& strings, size_t limit) {
+        if constexpr (isString<T>) {
+            auto text = textOf<T>(arg);
+            size_t length = std::min(text.size(), limit);
+            std::memcpy(strings, text.data(), length);
+            strings[length] = '\0';
+            strings += length + 1;
+        } else {
+            static_assert(std::is_trivially_copyable_v<T>, "Log arguments must be strings or trivially copyable");
+            std::memcpy(fixed, &arg, sizeof(T));
+            fixed += sizeof(T);
+        }
+    }
+
+    template<typename... Args, typename... Values>
+    static void encode([[maybe_unused]] unsigned char* payload, [[maybe_unused]] const Values&... values) {
+        // Nothing to lay out without arguments
+        if constexpr (sizeof...(Args) > 0) {
+            constexpr size_t stringCount = (isString<Args> + ... + 0);
+            std::array<size_t, stringCount> lengths{};
+            size_t next = 0;
+            ((isString<Args> ? void(lengths[next++] = textOf<Args>(values).size()) : void()), ...);
+            size_t limit = stringLimit(lengths, PAYLOAD_SIZE - fixedSize<Args...>() - stringCount);
+
+            unsigned char* fixed = payload;
+            unsigned char* strings = payload + fixedSize<Args...>();
+            (encodeArg<Args>(values, fixed, strings, limit), ...);
+        }
+    }
+
+    template<typename T>
+    static Decoded<T> decodeArg(const unsigned char*& fixed, const unsigned char*& strings) {
+        if constexpr (isString<T>) {
+            auto text = reinterpret_cast<const char*>(strings);
+            strings += std::strlen(text) + 1;
+            return text;
+        } else {
+            T value;
+            std::memcpy(&value, fixed, sizeof(T));
+            fixed += sizeof(T);
+            return value;
+        }
+    }
+
+    template<typename... Args>
+    static std::string formatRecord(const char* format, [[maybe_unused]] const unsigned char* payload) {
+        if constexpr (sizeof...(Args) == 0) {
+            return formatString(format);
+        } else {
+            const unsigned char* fixed = payload;
+            const unsigned char* strings = payload + fixedSize<Args...>();
+            // Braced initialization decodes left to right
+            std::tuple<Decoded<Args>...> values{decodeArg<Args>(fixed, strings)...};
+            return std::apply([format](const auto&... decoded) { return formatString(format, decoded...); }, values);
+        }
+    }
 
-            {
-                std::lock_guard<std::mutex> lock(m_queueMutex);
-                m_logQueue.push(std::move(entry));
+    void wake() {
+        m_wakeups.fetch_add(1, std::memory_order_release);
+        m_wakeups.notify_one();
+    }
+
+    // Drains the ring in batches: after writing anything it sleeps BATCH_INTERVAL, during which
+    // producers do not wake it; only when the ring is found empty does it wait for a producer's
+    // wake-up. So a burst costs one wake-up per batch, not a system call per message.
+    void loggerThreadFunction() {
+        while (true) {
+            bool stopping = m_stopFlag.load(std::memory_order_acquire);
+            size_t written = 0;
+            LogEntry entry;
+            while (m_ring.pop([&](Record& record) {
+                entry = {record.level,
+                         record.file,
+                         record.line,
+                         record.formatter(record.format, record.payload),
+                         record.timestamp,
+                         {},
+                         record.suppressed};
+            })) {
+                write(std::move(entry));
+                ++written;
+            }
+            if (uint64_t dropped = m_dropped.exchange(0, std::memory_order_relaxed)) {
+                write({LogLevel::WARNING_LOG, __FILE__, __LINE__,
+                       std::to_string(dropped) + " log messages dropped, the log ring was full",
+                       std::chrono::system_clock::now(), {}, 0});
             }
-            m_condition.notify_one();
+            if (written > 0) {
+                std::this_thread::sleep_for(BATCH_INTERVAL);
+                continue;
+            }
+            if (stopping) {
+                break;
+            }
+            // Announce the wait, then look once more: a producer either sees m_sleeping set, or
+            // published before it was set and the record is found here
+            uint32_t wakeups = m_wakeups.load(std::memory_order_acquire);
+            m_sleeping.store(true, std::memory_order_seq_cst);
+            if (m_ring.ready()) {
+                m_sleeping.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            m_wakeups.wait(wakeups, std::memory_order_acquire);
+            m_sleeping.store(false, std::memory_order_relaxed);
         }
     }
 
-private:
-    void loggerThreadFunction();
+    void write(LogEntry entry) {
+        {
+            std::lock_guard<std::mutex> lock(m_contextMutex);
+            entry.context = m_context;
+        }
+        std::lock_guard<std::mutex> lock(m_destinationsMutex);
+        if (m_logFilter && !m_logFilter(entry)) {
+            return;
+        }
+        if (m_destinations.empty()) {
+            static ConsoleDestination console;
+            console.write(entry);
+        }
+        for (const auto& dest : m_destinations) {
+            dest->write(entry);
+        }
+    }
 
     static std::string formatLogEntry(const LogEntry& entry) {
         std::ostringstream oss;
-        auto now = std::chrono::system_clock::now();
-        auto now_c = std::chrono::system_clock::to_time_t(now);
+        auto time = std::chrono::system_clock::to_time_t(entry.timestamp);
+        auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                entry.timestamp.time_since_epoch()).count() % 1000;
 
         std::tm time_info{};
 #if defined(_WIN32)
-        localtime_s(&time_info, &now_c);
+        localtime_s(&time_info, &time);
 #else
-        localtime_r(&now_c, &time_info);
+        localtime_r(&time, &time_info);
 #endif
-        oss << std::put_time(&time_info, "%Y-%m-%d %H:%M:%S") << " ";
+        oss << std::put_time(&time_info, "%Y-%m-%d %H:%M:%S") << "." << std::setfill('0') << std::setw(3)
+            << milliseconds << " ";
         oss << "[" << getLevelString(entry.level) << "] ";
         oss << "[" << entry.file << ":" << entry.line << "] ";
         oss << entry.message;
+        if (entry.suppressed > 0) {
+            oss << " (" << entry.suppressed << " similar suppressed)";
+        }
 
         if (!entry.context.empty()) {
             oss << " {";
@@ -204,19 +472,25 @@ private:
     template<typename... Args>
     static std::string formatString(const char* format, Args... args) {
         int size = snprintf(nullptr, 0, format, args...);
+        if (size <= 0) {
+            return {};
+        }
         std::string result(size + 1, '\0');
         snprintf(&result[0], size + 1, format, args...);
+        result.resize(size);
         return result;
     }
 
-    LogLevel m_logLevel;
-    std::queue<LogEntry> m_logQueue;
+    std::atomic<LogLevel> m_logLevel;
+    MpscRing<Record> m_ring;
+    alignas(64) std::atomic<uint32_t> m_wakeups{0};
+    std::atomic<bool> m_sleeping{false};
+    std::atomic<uint64_t> m_dropped{0};
+    std::atomic<uint64_t> m_droppedTotal{0};
+    std::atomic<bool> m_stopFlag{false};
     std::thread m_loggerThread;
-    std::mutex m_queueMutex;
     std::mutex m_destinationsMutex;
     std::mutex m_contextMutex;
-    std::condition_variable m_condition;
-    bool m_stopFlag;
     std::vector<std::shared_ptr<LogDestination>> m_destinations;
     std::function<bool(const LogEntry&)> m_logFilter;
     std::unordered_map<std::string, std::string> m_context;
@@ -227,4 +501,17 @@ private:
 #define LOG_INFO(format, ...) AsyncLogger::getInstance().log(AsyncLogger::LogLevel::INFO_LOG, __FILE__, __LINE__, format, ##__VA_ARGS__)
 #define LOG_WARNING(format, ...) AsyncLogger::getInstance().log(AsyncLogger::LogLevel::WARNING_LOG, __FILE__, __LINE__, format, ##__VA_ARGS__)
 #define LOG_ERROR(format, ...) AsyncLogger::getInstance().log(AsyncLogger::LogLevel::ERROR_LOG, __FILE__, __LINE__, format, ##__VA_ARGS__)
-#define LOG_FATAL(format, ...) AsyncLogger::getInstance().log(AsyncLogger::LogLevel::FATAL_LOG, __FILE__, __LINE__, format, ##__VA_ARGS__)
\ No newline at end of file
+#define LOG_FATAL(format, ...) AsyncLogger::getInstance().log(AsyncLogger::LogLevel::FATAL_LOG, __FILE__, __LINE__, format, ##__VA_ARGS__)
+
+// At most a few messages per second from one call site, for paths that can fail once per packet
+#define LOG_RATE_LIMITED(level, format, ...)                                                           \
+    do {                                                                                               \
+        static AsyncLogger::RateLimit log_rate_limit_;                                                 \
+        uint32_t log_suppressed_ = 0;                                                                  \
+        if (AsyncLogger::getInstance().enabled(level) && log_rate_limit_.allow(log_suppressed_)) {     \
+            AsyncLogger::getInstance().logSuppressed(level, __FILE__, __LINE__, log_suppressed_, format, \
+                                                     ##__VA_ARGS__);                                   \
+        }                                                                                              \
+    } while (0)
+#define LOG_WARNING_LIMITED(format, ...) LOG_RATE_LIMITED(AsyncLogger::LogLevel::WARNING_LOG, format, ##__VA_ARGS__)
+#define LOG_ERROR_LIMITED(format, ...) LOG_RATE_LIMITED(AsyncLogger::LogLevel::ERROR_LOG, format, ##__VA_ARGS__)
@@ -0,0 +1,223 @@
+//
+// Created by maxim on 17.09.2024.
+//
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Process-wide counters, gauges and histograms rendered in the Prometheus text format.
+// Updates are relaxed atomics (counters are additionally sharded per thread), so they are
+// safe to call from any I/O thread; only registration and rendering take a lock.
+namespace Metrics
+{
+    using Labels = std::vector<std::pair<std::string, std::string>>;
+
+    class Counter {
+    public:
+        void inc(uint64_t amount = 1) {
+            shards_[shardIndex()].value.fetch_add(amount, std::memory_order_relaxed);
+        }
+
+        [[nodiscard]] uint64_t value() const {
+            uint64_t total = 0;
+            for (const auto& shard : shards_) {
+                total += shard.value.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+    private:
+        static constexpr size_t SHARDS = 16;
+
+        struct alignas(64) Shard {
+            std::atomic<uint64_t> value{0};
+        };
+
+        static size_t shardIndex() {
+            static std::atomic<size_t> next_index{0};
+            thread_local size_t index = next_index.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+            return index;
+        }
+
+        std::array<Shard, SHARDS> shards_;
+    };
+
+    class Gauge {
+    public:
+        void set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+
+        void add(int64_t amount) { value_.fetch_add(amount, std::memory_order_relaxed); }
+
+        [[nodiscard]] int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<int64_t> value_{0};
+    };
+
+    class Histogram {
+    public:
+        explicit Histogram(std::vector<double> bounds)
+            : bounds_(std::move(bounds)), counts_(bounds_.size() + 1) {}
+
+        void observe(double value) {
+            size_t bucket = 0;
+            while (bucket < bounds_.size() && value > bounds_[bucket]) {
+                ++bucket;
+            }
+            counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+            sum_.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        [[nodiscard]] const std::vector<double>& bounds() const { return bounds_; }
+
+        // Non-cumulative count of bucket i; the last bucket is +Inf.
+        [[nodiscard]] uint64_t bucketCount(size_t i) const { return counts_[i].load(std::memory_order_relaxed); }
+
+        [[nodiscard]] double sum() const { return sum_.load(std::memory_order_relaxed); }
+
+    private:
+        std::vector<double> bounds_;
+        std::deque<std::atomic<uint64_t>> counts_;
+        std::atomic<double> sum_{0.0};
+    };
+
+    // Samples produced at scrape time, e.g. one gauge per room.
+    using collector = std::function<std::vector<std::pair<Labels, double>>()>;
+
+    class Registry {
+    public:
+        Counter& counter(const std::string& name, const std::string& help, const Labels& labels = {}) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& family = getFamily(name, help, "counter");
+            family.counters.emplace_back(labels, std::make_unique<Counter>());
+            return *family.counters.back().second;
+        }
+
+        Gauge& gauge(const std::string& name, const std::string& help, const Labels& labels = {}) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& family = getFamily(name, help, "gauge");
+            family.gauges.emplace_back(labels, std::make_unique<Gauge>());
+            return *family.gauges.back().second;
+        }
+
+        Histogram& histogram(const std::string& name, const std::string& help, std::vector<double> bounds,
+                             const Labels& labels = {}) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& family = getFamily(name, help, "histogram");
+            family.histograms.emplace_back(labels, std::make_unique<Histogram>(std::move(bounds)));
+            return *family.histograms.back().second;
+        }
+
+        void addCollector(const std::string& name, const std::string& help, const std::string& type, collector fn) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            getFamily(name, help, type).collectors.push_back(std::move(fn));
+        }
+
+        [[nodiscard]] std::string render() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::ostringstream out;
+            for (const auto& [name, family] : families_) {
+                out << "# HELP " << name << " " << family.help << "\n";
+                out << "# TYPE " << name << " " << family.type << "\n";
+                for (const auto& [labels, counter] : family.counters) {
+                    out << name << formatLabels(labels) << " " << counter->value() << "\n";
+                }
+                for (const auto& [labels, gauge] : family.gauges) {
+                    out << name << formatLabels(labels) << " " << gauge->value() << "\n";
+                }
+                for (const auto& [labels, histogram] : family.histograms) {
+                    uint64_t cumulative = 0;
+                    for (size_t i = 0; i <= histogram->bounds().size(); ++i) {
+                        cumulative += histogram->bucketCount(i);
+                        Labels bucket_labels = labels;
+                        bucket_labels.emplace_back("le", i < histogram->bounds().size()
+                                                             ? formatNumber(histogram->bounds()[i]) : "+Inf");
+                        out << name << "_bucket" << formatLabels(bucket_labels) << " " << cumulative << "\n";
+                    }
+                    out << name << "_sum" << formatLabels(labels) << " " << formatNumber(histogram->sum()) << "\n";
+                    out << name << "_count" << formatLabels(labels) << " " << cumulative << "\n";
+                }
+                for (const auto& fn : family.collectors) {
+                    for (const auto& [labels, value] : fn()) {
+                        out << name << formatLabels(labels) << " " << formatNumber(value) << "\n";
+                    }
+                }
+            }
+            return out.str();
+        }
+
+    private:
+        struct Family {
+            std::string help;
+            std::string type;
+            std::vector<std::pair<Labels, std::unique_ptr<Counter>>> counters;
+            std::vector<std::pair<Labels, std::unique_ptr<Gauge>>> gauges;
+            std::vector<std::pair<Labels, std::unique_ptr<Histogram>>> histograms;
+            std::vector<collector> collectors;
+        };
+
+        Family& getFamily(const std::string& name, const std::string& help, const std::string& type) {
+            auto& family = families_[name];
+            if (family.type.empty()) {
+                family.help = help;
+                family.type = type;
+            }
+            return family;
+        }
+
+        static std::string formatNumber(double value) {
+            std::ostringstream out;
+            out << value;
+            return out.str();
+        }
+
+        static std::string formatLabels(const Labels& labels) {
+            if (labels.empty()) {
+                return "";
+            }
+            std::string out = "{";
+            for (const auto& [key, value] : labels) {
+                if (out.size() > 1) {
+                    out += ",";
+                }
+                out += key + "=\"";
+                for (char c : value) {
+                    if (c == '"' || c == '\\') {
+                        out += '\\';
+                        out += c;
+                    } else if (c == '\n') {
+                        out += "\\n";
+                    } else {
+                        out += c;
+                    }
+                }
+                out += "\"";
+            }
+            return out + "}";
+        }
+
+        std::mutex mutex_;
+        std::map<std::string, Family> families_;
+    };
+
+    inline Registry& registry() {
+        static Registry instance;
+        return instance;
+    }
+
+    // Default buckets for durations in seconds, 50 us to 1 s.
+    inline std::vector<double> latencyBuckets() {
+        return {0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0};
+    }
+}
@@ -0,0 +1,101 @@
+//
+// Created by maxim on 29.09.2024.
+//
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bounded lock-free queue for many producers and one consumer, after Vyukov's bounded MPMC
+// queue: every slot carries a sequence number that says whose turn it is, so claiming a slot is
+// one compare-and-swap and nothing is allocated. A producer that finds the ring full gets false
+// rather than waiting. T is filled and read in place.
+template<typename T>
+class MpscRing {
+public:
+    // capacity is rounded up to a power of two.
+    explicit MpscRing(size_t capacity)
+        : capacity_(std::bit_ceil(capacity < 2 ? size_t{2} : capacity)), slots_(new Slot[capacity_]) {
+        for (size_t i = 0; i < capacity_; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    [[nodiscard]] size_t capacity() const { return capacity_; }
+
+    // Claims a slot, runs fill(T&) on it and publishes it. The publishing store is seq_cst, so a
+    // producer's later load is ordered after it; consumers that sleep rely on that to be woken.
+    template<typename Fill>
+    bool push(Fill&& fill) {
+        uint64_t position = enqueue_.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots_[position & (capacity_ - 1)];
+            uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<int64_t>(sequence - position);
+            if (difference == 0) {
+                if (enqueue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;  // Full
+            } else {
+                position = enqueue_.load(std::memory_order_relaxed);
+            }
+        }
+        fill(slot->value);
+        slot->sequence.store(position + 1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    // Consumer only: runs consume(T&) on the oldest published slot and frees it.
+    template<typename Consume>
+    bool pop(Consume&& consume) {
+        uint64_t position = dequeue_.load(std::memory_order_relaxed);
+        Slot& slot = slots_[position & (capacity_ - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+            return false;
+        }
+        consume(slot.value);
+        slot.sequence.store(position + capacity_, std::memory_order_release);
+        dequeue_.store(position + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Consumer only: whether pop() would find something. seq_cst, the counterpart of push().
+    [[nodiscard]] bool ready() const {
+        uint64_t position = dequeue_.load(std::memory_order_relaxed);
+        return slots_[position & (capacity_ - 1)].sequence.load(std::memory_order_seq_cst) == position + 1;
+    }
+
+    // Slots ever claimed. Whatever a thread pushed before reading this has been consumed once
+    // consumed() reaches it.
+    [[nodiscard]] uint64_t claimed() const { return enqueue_.load(std::memory_order_relaxed); }
+
+    // Consumer only: slots ever consumed.
+    [[nodiscard]] uint64_t consumed() const { return dequeue_.load(std::memory_order_relaxed); }
+
+    // Slots claimed and not consumed yet; approximate while producers are running.
+    [[nodiscard]] size_t size() const {
+        uint64_t enqueued = enqueue_.load(std::memory_order_relaxed);
+        uint64_t dequeued = dequeue_.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? static_cast<size_t>(enqueued - dequeued) : 0;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> sequence;
+        T value;
+    };
+
+    const size_t capacity_;
+    std::unique_ptr<Slot[]> slots_;
+    alignas(64) std::atomic<uint64_t> enqueue_{0};
+    alignas(64) std::atomic<uint64_t> dequeue_{0};
+};
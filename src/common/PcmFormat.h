@@ -0,0 +1,189 @@
+//
+// Created by maxim on 02.10.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Sample layouts clients send and receive audio in. A packet is one frame of PCM at SAMPLE_RATE:
+//
+//     Int16    interleaved (L R L R ...), the native clients' and the original wire format
+//     Float32  planar (every L, then every R), what Web Audio hands an AudioWorklet, in -1..1
+//
+// Mixing happens in float planar at int16 scale. accumulate() brings a packet into that form and
+// encode() takes a mix out of it, converting channels on the way (mono is duplicated into
+// stereo, stereo averaged into mono). Both are templates over the sample type, the channel
+// counts and the frame length, so the usual 10 and 20ms frames get loops of a length known at
+// compile time; dispatch() picks the instantiation for a packet.
+namespace Pcm
+{
+    constexpr uint32_t SAMPLE_RATE = 44100;
+    constexpr size_t FRAME_10MS = SAMPLE_RATE / 100;
+    constexpr size_t FRAME_20MS = SAMPLE_RATE / 50;
+    constexpr size_t MAX_CHANNELS = 2;
+    constexpr float INT16_SCALE = 32768.0f;
+
+    enum class SampleType : uint8_t {
+        Int16 = 0,
+        Float32 = 1,
+    };
+
+    struct Format {
+        SampleType sample = SampleType::Int16;
+        uint8_t channels = 1;
+
+        [[nodiscard]] size_t bytesPerFrame() const {
+            return (sample == SampleType::Float32 ? sizeof(float) : sizeof(int16_t)) * channels;
+        }
+
+        [[nodiscard]] size_t frames(size_t bytes) const { return bytes / bytesPerFrame(); }
+
+        [[nodiscard]] bool valid() const {
+            return (sample == SampleType::Int16 || sample == SampleType::Float32) &&
+                   channels >= 1 && channels <= MAX_CHANNELS;
+        }
+
+        [[nodiscard]] std::string name() const {
+            return std::string(sample == SampleType::Float32 ? "float32" : "int16") +
+                   (channels == 2 ? "/stereo" : "/mono");
+        }
+
+        bool operator==(const Format&) const = default;
+    };
+
+    // Adds weight times the packet's frames, at int16 scale and in OutChannels, to the planar
+    // buffer out, whose channel c starts at out + c * stride. Frames is the frame count when
+    // known at compile time, 0 for any. Float samples are clipped to -1..1 and non-finite ones
+    // taken as silence, so no client can push the mix out of range (int16 is by its type).
+    template<typename Sample, size_t InChannels, size_t OutChannels, size_t Frames = 0>
+    void accumulate(const uint8_t* bytes, size_t frames, float weight, float* out, size_t stride) {
+        const size_t n = Frames ? Frames : frames;
+        const auto* in = reinterpret_cast<const Sample*>(bytes);
+        // Interleaved int16 is read channel by channel; planar float channels are contiguous
+        auto at = [&](size_t channel, size_t i) {
+            if constexpr (std::is_same_v<Sample, float>) {
+                float sample = in[channel * n + i];
+                sample = std::isfinite(sample) ? std::clamp(sample, -1.0f, 1.0f) : 0.0f;
+                return sample * (INT16_SCALE * weight);
+            } else {
+                return static_cast<float>(in[i * InChannels + channel]) * weight;
+            }
+        };
+        for (size_t c = 0; c < OutChannels; ++c) {
+            float* __restrict channel = out + c * stride;
+            if constexpr (InChannels == OutChannels) {
+                for (size_t i = 0; i < n; ++i) {
+                    channel[i] += at(c, i);
+                }
+            } else if constexpr (InChannels == 1) {
+                for (size_t i = 0; i < n; ++i) {
+                    channel[i] += at(0, i);
+                }
+            } else {
+                for (size_t i = 0; i < n; ++i) {
+                    channel[i] += (at(0, i) + at(1, i)) * 0.5f;
+                }
+            }
+        }
+    }
+
+    // Writes frames of a planar mix (channel c at mix + c * stride) as OutChannels of Sample.
+    // Each sample is divided by the weight mixed into it, full_weight plus covered (null if
+    // none) at the same place, and scaled by gain; int16 is truncated and clipped exactly like
+    // AudioMixer::mix(), float32 scaled to -1..1 and clipped there.
+    template<typename Sample, size_t InChannels, size_t OutChannels, size_t Frames = 0>
+    void encode(const float* mix, const float* covered, float full_weight, size_t stride, size_t frames,
+                float gain, uint8_t* bytes) {
+        const size_t n = Frames ? Frames : frames;
+        auto* out = reinterpret_cast<Sample*>(bytes);
+        // In double, so truncating divides exactly like the integer mixer
+        auto average = [&](size_t channel, size_t i) {
+            double count = full_weight + (covered ? covered[channel * stride + i] : 0.0f);
+            return count > 0 ? static_cast<double>(mix[channel * stride + i]) / count : 0.0;
+        };
+        auto store = [&](size_t channel, size_t i, double value) {
+            if constexpr (std::is_same_v<Sample, float>) {
+                auto sample = static_cast<float>(value) * (gain / INT16_SCALE);
+                out[channel * n + i] = std::clamp(sample, -1.0f, 1.0f);
+            } else {
+                auto sample = static_cast<int32_t>(value);
+                auto scaled = static_cast<int32_t>(static_cast<float>(sample) * gain);
+                out[i * OutChannels + channel] = static_cast<int16_t>(
+                    std::clamp(scaled, INT16_MIN, static_cast<int32_t>(INT16_MAX)));
+            }
+        };
+        for (size_t c = 0; c < OutChannels; ++c) {
+            for (size_t i = 0; i < n; ++i) {
+                if constexpr (InChannels == OutChannels) {
+                    store(c, i, average(c, i));
+                } else if constexpr (InChannels == 1) {
+                    store(c, i, average(0, i));
+                } else {
+                    store(c, i, (average(0, i) + average(1, i)) / 2);
+                }
+            }
+        }
+    }
+
+    namespace detail
+    {
+        template<typename Sample, size_t InChannels, size_t OutChannels, typename F>
+        void dispatchFrames(size_t frames, bool specialize, F& f) {
+            if (specialize && frames == FRAME_10MS) {
+                f.template operator()<Sample, InChannels, OutChannels, FRAME_10MS>();
+            } else if (specialize && frames == FRAME_20MS) {
+                f.template operator()<Sample, InChannels, OutChannels, FRAME_20MS>();
+            } else {
+                f.template operator()<Sample, InChannels, OutChannels, 0>();
+            }
+        }
+
+        template<typename Sample, size_t InChannels, typename F>
+        void dispatchOut(size_t out_channels, size_t frames, bool specialize, F& f) {
+            if (out_channels == 2) {
+                dispatchFrames<Sample, InChannels, 2>(frames, specialize, f);
+            } else {
+                dispatchFrames<Sample, InChannels, 1>(frames, specialize, f);
+            }
+        }
+
+        template<typename Sample, typename F>
+        void dispatchIn(size_t in_channels, size_t out_channels, size_t frames, bool specialize, F& f) {
+            if (in_channels == 2) {
+                dispatchOut<Sample, 2>(out_channels, frames, specialize, f);
+            } else {
+                dispatchOut<Sample, 1>(out_channels, frames, specialize, f);
+            }
+        }
+    }
+
+    // Calls f.template operator()<Sample, InChannels, OutChannels, Frames>() for sample, with
+    // Frames the frame count if it is a 10 or 20ms frame and specialize is set, 0 otherwise. In
+    // and out are a client's channels and a room's, one way or the other.
+    template<typename F>
+    void dispatch(SampleType sample, size_t in_channels, size_t out_channels, size_t frames, bool specialize, F&& f) {
+        if (sample == SampleType::Float32) {
+            detail::dispatchIn<float>(in_channels, out_channels, frames, specialize, f);
+        } else {
+            detail::dispatchIn<int16_t>(in_channels, out_channels, frames, specialize, f);
+        }
+    }
+
+    // The frames of a packet in format as mono int16, for what only takes that (recordings).
+    inline std::vector<int16_t> toMonoInt16(const uint8_t* bytes, size_t size, Format format) {
+        size_t frames = format.frames(size);
+        std::vector<float> mix(frames);
+        std::vector<int16_t> out(frames);
+        dispatch(format.sample, format.channels, 1, frames, true, [&]<typename Sample, size_t In, size_t Out, size_t Frames>() {
+            accumulate<Sample, In, Out, Frames>(bytes, frames, 1.0f, mix.data(), frames);
+        });
+        encode<int16_t, 1, 1>(mix.data(), nullptr, 1.0f, frames, frames, 1.0f, reinterpret_cast<uint8_t*>(out.data()));
+        return out;
+    }
+}
@@ -0,0 +1,174 @@
+//
+// Created by maxim on 15.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "PcmFormat.h"
+
+// Room selection on the wire. UDP clients send a join datagram ("VCJR", name length, name)
+// before or between audio packets; WebSocket clients pass the room in the upgrade request as
+// "/?room=<name>" or "/rooms/<name>". Clients that never choose a room land in DEFAULT_ROOM.
+// WebSocket clients may also choose their audio format there, "&format=float32&channels=2";
+// UDP clients send and receive mono int16.
+//
+// WebSocket clients change what they hear with JSON text messages, speakers named by client id:
+//
+//     {"type": "volume", "speaker": "<id>", "volume": 0.5}    0 to 4, 1 being unchanged
+//     {"type": "mute", "speaker": "<id>", "muted": true}
+//     {"type": "subscribe", "speakers": ["<id>", ...]}       only these; null for everyone
+namespace RoomProtocol
+{
+    inline constexpr const char* DEFAULT_ROOM = "default";
+    inline constexpr std::array<uint8_t, 4> JOIN_MAGIC = {'V', 'C', 'J', 'R'};
+    inline constexpr size_t MAX_ROOM_NAME = 255;
+
+    inline std::vector<uint8_t> makeJoin(const std::string& room) {
+        size_t length = std::min(room.size(), MAX_ROOM_NAME);
+        std::vector<uint8_t> packet(JOIN_MAGIC.begin(), JOIN_MAGIC.end());
+        packet.push_back(static_cast<uint8_t>(length));
+        packet.insert(packet.end(), room.begin(), room.begin() + static_cast<std::ptrdiff_t>(length));
+        return packet;
+    }
+
+    inline bool parseJoin(const uint8_t* data, size_t size, std::string& room) {
+        if (size < JOIN_MAGIC.size() + 1 || std::memcmp(data, JOIN_MAGIC.data(), JOIN_MAGIC.size()) != 0) {
+            return false;
+        }
+        size_t length = data[JOIN_MAGIC.size()];
+        if (size != JOIN_MAGIC.size() + 1 + length || length == 0) {
+            return false;
+        }
+        room.assign(reinterpret_cast<const char*>(data) + JOIN_MAGIC.size() + 1, length);
+        return true;
+    }
+
+    // Value of a query parameter of an HTTP request target, empty if it has none.
+    inline std::string queryValue(const std::string& target, const std::string& name) {
+        auto query = target.find('?');
+        if (query == std::string::npos) {
+            return {};
+        }
+        std::string key_text = name + "=";
+        auto key = target.find(key_text, query);
+        while (key != std::string::npos && target[key - 1] != '?' && target[key - 1] != '&') {
+            key = target.find(key_text, key + 1);
+        }
+        if (key == std::string::npos) {
+            return {};
+        }
+        auto value = key + key_text.size();
+        return target.substr(value, target.find('&', value) - value);
+    }
+
+    // Extracts the room from an HTTP request target, falling back to DEFAULT_ROOM.
+    inline std::string roomFromTarget(const std::string& target) {
+        std::string room;
+        static const std::string rooms_prefix = "/rooms/";
+        auto query = target.find('?');
+        if (target.compare(0, rooms_prefix.size(), rooms_prefix) == 0) {
+            room = target.substr(rooms_prefix.size(), query == std::string::npos ? std::string::npos
+                                                                                 : query - rooms_prefix.size());
+        } else {
+            room = queryValue(target, "room");
+        }
+        if (room.empty() || room.size() > MAX_ROOM_NAME) {
+            return DEFAULT_ROOM;
+        }
+        return room;
+    }
+
+    // Extracts the audio format from an HTTP request target: "format" int16 (the default) or
+    // float32, "channels" 1 (the default) or 2. Anything else is the default.
+    inline Pcm::Format formatFromTarget(const std::string& target) {
+        Pcm::Format format;
+        if (queryValue(target, "format") == "float32") {
+            format.sample = Pcm::SampleType::Float32;
+        }
+        if (queryValue(target, "channels") == "2") {
+            format.channels = 2;
+        }
+        return format;
+    }
+
+    // A control message from a WebSocket client, as listed above.
+    struct Control {
+        enum class Type { Volume, Mute, Subscribe };
+
+        Type type = Type::Volume;
+        std::string speaker;
+        float volume = 1.0f;
+        bool muted = false;
+        std::optional<std::vector<std::string>> speakers;
+    };
+
+    // nullopt for anything but a well-formed control message. Never throws: every field is
+    // type-checked before it is read, so a client cannot get an exception out of this.
+    inline std::optional<Control> parseControl(std::string_view text) {
+        auto message = nlohmann::json::parse(text.begin(), text.end(), nullptr, false);
+        if (!message.is_object()) {
+            return std::nullopt;
+        }
+        auto type = message.find("type");
+        if (type == message.end() || !type->is_string()) {
+            return std::nullopt;
+        }
+        Control control;
+        const auto& name = type->get_ref<const std::string&>();
+        if (name == "volume" || name == "mute") {
+            auto speaker = message.find("speaker");
+            if (speaker == message.end() || !speaker->is_string()) {
+                return std::nullopt;
+            }
+            control.speaker = speaker->get<std::string>();
+            if (name == "volume") {
+                auto volume = message.find("volume");
+                if (volume == message.end() || !volume->is_number()) {
+                    return std::nullopt;
+                }
+                control.type = Control::Type::Volume;
+                control.volume = volume->get<float>();
+            } else {
+                auto muted = message.find("muted");
+                if (muted == message.end() || !muted->is_boolean()) {
+                    return std::nullopt;
+                }
+                control.type = Control::Type::Mute;
+                control.muted = muted->get<bool>();
+            }
+            return control;
+        }
+        if (name == "subscribe") {
+            auto speakers = message.find("speakers");
+            if (speakers == message.end()) {
+                return std::nullopt;
+            }
+            control.type = Control::Type::Subscribe;
+            if (speakers->is_null()) {
+                return control;
+            }
+            if (!speakers->is_array()) {
+                return std::nullopt;
+            }
+            control.speakers.emplace();
+            for (const auto& speaker : *speakers) {
+                if (!speaker.is_string()) {
+                    return std::nullopt;
+                }
+                control.speakers->push_back(speaker.get<std::string>());
+            }
+            return control;
+        }
+        return std::nullopt;
+    }
+}
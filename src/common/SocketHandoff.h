@@ -0,0 +1,92 @@
+//
+// Created by maxim on 27.09.2024.
+//
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <span>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Passes file descriptors to another process over a Unix domain socket (SCM_RIGHTS). The socket
+// must be SOCK_SEQPACKET, so every message arrives whole, with the descriptors sent alongside it.
+// The receiver gets its own copies; the sender still has to close its descriptors.
+namespace SocketHandoff
+{
+    // Linux refuses more than SCM_MAX_FD (253) descriptors per message
+    inline constexpr size_t MAX_FDS = 250;
+    // Comfortably below the default socket buffer, which bounds a SOCK_SEQPACKET message
+    inline constexpr size_t MAX_MESSAGE = 64 * 1024;
+
+    inline bool send(int socket, std::span<const uint8_t> message, std::span<const int> fds) {
+        if (message.empty() || message.size() > MAX_MESSAGE || fds.size() > MAX_FDS) {
+            std::cerr << "Handoff message too large: " << message.size() << " bytes, " << fds.size()
+                      << " descriptors" << std::endl;
+            return false;
+        }
+        iovec vector{const_cast<uint8_t*>(message.data()), message.size()};
+        msghdr header{};
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+        std::vector<uint8_t> control(CMSG_SPACE(sizeof(int) * MAX_FDS));
+        if (!fds.empty()) {
+            header.msg_control = control.data();
+            header.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        }
+        ssize_t sent;
+        do {
+            sent = ::sendmsg(socket, &header, MSG_NOSIGNAL);
+        } while (sent < 0 && errno == EINTR);
+        if (sent != static_cast<ssize_t>(message.size())) {
+            std::cerr << "Handoff send failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Blocks until a message arrives. Received descriptors belong to the caller, also when the
+    // message turns out to be unusable.
+    inline bool receive(int socket, std::vector<uint8_t>& message, std::vector<int>& fds) {
+        message.resize(MAX_MESSAGE);
+        iovec vector{message.data(), message.size()};
+        msghdr header{};
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+        std::vector<uint8_t> control(CMSG_SPACE(sizeof(int) * MAX_FDS));
+        header.msg_control = control.data();
+        header.msg_controllen = control.size();
+        ssize_t received;
+        do {
+            received = ::recvmsg(socket, &header, MSG_CMSG_CLOEXEC);
+        } while (received < 0 && errno == EINTR);
+        if (received <= 0) {
+            std::cerr << "Handoff receive failed: " << (received < 0 ? std::strerror(errno) : "peer closed")
+                      << std::endl;
+            return false;
+        }
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                size_t first = fds.size();
+                fds.resize(first + count);
+                std::memcpy(fds.data() + first, CMSG_DATA(cmsg), sizeof(int) * count);
+            }
+        }
+        message.resize(static_cast<size_t>(received));
+        if (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+            std::cerr << "Handoff message truncated" << std::endl;
+            return false;
+        }
+        return true;
+    }
+}
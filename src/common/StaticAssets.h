@@ -0,0 +1,351 @@
+//
+// Created by maxim on 23.09.2024.
+//
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#if defined(VOICE_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(VOICE_HAVE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#include "HttpMessage.h"
+
+// Static files (the browser voice client) served on the WebSocket port. The directory is read
+// once at startup: every file up to max_cached_file_size is kept in memory together with gzip
+// and brotli variants, so a request costs a map lookup and the response body is written
+// straight from the shared buffer. Larger files are left on disk and sent with sendfile(2), or
+// in chunks where TLS runs in user space.
+//
+// Compressed variants come from a sibling "<file>.gz"/"<file>.br" when one exists, otherwise
+// they are built here if the server was compiled with zlib/brotli. They are only kept when
+// smaller than the original. Assets are immutable after load(), so serve() may be called from
+// any thread.
+class StaticAssets {
+public:
+    struct Options {
+        size_t max_cached_file_size = 8 * 1024 * 1024;
+        int gzip_level = 9;
+        int brotli_quality = 11;
+    };
+
+    StaticAssets() = default;
+    explicit StaticAssets(const Options& options) : options_(options) {}
+
+    // Returns false if directory cannot be read.
+    bool load(const std::string& directory) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        fs::path root = fs::canonical(directory, ec);
+        if (ec || !fs::is_directory(root, ec)) {
+            std::cerr << "Static directory not found: " << directory << std::endl;
+            return false;
+        }
+
+        for (fs::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec)) {
+            if (!it->is_regular_file(ec)) {
+                continue;
+            }
+            const fs::path& path = it->path();
+            std::string extension = path.extension().string();
+            if ((extension == ".gz" || extension == ".br") && fs::exists(fs::path(path).replace_extension(), ec)) {
+                continue;  // Precompressed variant, picked up with its original
+            }
+            loadFile(path, "/" + path.lexically_relative(root).generic_string());
+        }
+        if (ec) {
+            std::cerr << "Failed to read static directory " << directory << ": " << ec.message() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Answers GET and HEAD for a known asset, including 304 for a matching If-None-Match.
+    bool serve(const HttpRequest& request, HttpResponse& response) const {
+        if (request.method != "GET" && request.method != "HEAD") {
+            return false;
+        }
+        std::string path = decodePath(request.target);
+        if (path.empty()) {
+            return false;
+        }
+        if (path.back() == '/') {
+            path += "index.html";
+        }
+        auto it = assets_.find(path);
+        if (it == assets_.end()) {
+            return false;
+        }
+        const Asset& asset = it->second;
+
+        std::string accept_encoding = request.header("Accept-Encoding");
+        const Variant* variant = &asset.identity;
+        if (asset.brotli.data && accepts(accept_encoding, "br")) {
+            variant = &asset.brotli;
+        } else if (asset.gzip.data && accepts(accept_encoding, "gzip")) {
+            variant = &asset.gzip;
+        }
+
+        response.headers.emplace_back("ETag", variant->etag);
+        response.headers.emplace_back("Cache-Control", "no-cache");
+        if (asset.gzip.data || asset.brotli.data) {
+            response.headers.emplace_back("Vary", "Accept-Encoding");
+        }
+        if (matches(request.header("If-None-Match"), variant->etag)) {
+            response.status = 304;
+            response.reason = "Not Modified";
+            return true;
+        }
+
+        response.headers.emplace_back("Content-Type", asset.content_type);
+        response.headers.emplace_back("X-Content-Type-Options", "nosniff");
+        if (!variant->encoding.empty()) {
+            response.headers.emplace_back("Content-Encoding", variant->encoding);
+        }
+        if (variant->data) {
+            response.shared_body = variant->data;
+        } else {
+            response.file_path = asset.file_path;
+            response.file_size = asset.file_size;
+        }
+        response.head_only = request.method == "HEAD";
+        return true;
+    }
+
+    [[nodiscard]] size_t size() const { return assets_.size(); }
+
+    // Bytes held in memory, compressed variants included.
+    [[nodiscard]] size_t cachedBytes() const { return cached_bytes_; }
+
+    static std::string contentType(const std::string& extension) {
+        static const std::unordered_map<std::string, std::string> types = {
+            {".html", "text/html; charset=utf-8"},
+            {".htm", "text/html; charset=utf-8"},
+            {".css", "text/css; charset=utf-8"},
+            {".js", "text/javascript; charset=utf-8"},
+            {".mjs", "text/javascript; charset=utf-8"},
+            {".json", "application/json"},
+            {".map", "application/json"},
+            {".txt", "text/plain; charset=utf-8"},
+            {".svg", "image/svg+xml"},
+            {".png", "image/png"},
+            {".jpg", "image/jpeg"},
+            {".jpeg", "image/jpeg"},
+            {".gif", "image/gif"},
+            {".ico", "image/x-icon"},
+            {".webp", "image/webp"},
+            {".wasm", "application/wasm"},
+            {".woff2", "font/woff2"},
+            {".wav", "audio/wav"},
+        };
+        auto it = types.find(extension);
+        return it != types.end() ? it->second : "application/octet-stream";
+    }
+
+private:
+    struct Variant {
+        std::shared_ptr<const std::string> data;  // Null for files served from disk
+        std::string encoding;
+        std::string etag;
+    };
+
+    struct Asset {
+        std::string content_type;
+        Variant identity;
+        Variant gzip;
+        Variant brotli;
+        std::string file_path;
+        size_t file_size = 0;
+    };
+
+    void loadFile(const std::filesystem::path& path, const std::string& url_path) {
+        std::error_code ec;
+        auto file_size = static_cast<size_t>(std::filesystem::file_size(path, ec));
+        if (ec) {
+            std::cerr << "Failed to stat static file " << path << ": " << ec.message() << std::endl;
+            return;
+        }
+
+        Asset asset;
+        asset.content_type = contentType(path.extension().string());
+        asset.file_path = path.string();
+        asset.file_size = file_size;
+
+        if (file_size > options_.max_cached_file_size) {
+            auto modified = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+            asset.identity.etag = makeEtag(std::to_string(file_size) + ":" + std::to_string(modified), "");
+            assets_.emplace(url_path, std::move(asset));
+            return;
+        }
+
+        std::string content;
+        if (!readFile(path, content)) {
+            std::cerr << "Failed to read static file " << path << std::endl;
+            return;
+        }
+        asset.identity.etag = makeEtag(content, "");
+        asset.identity.data = std::make_shared<const std::string>(std::move(content));
+        cached_bytes_ += asset.identity.data->size();
+
+        const std::string& original = *asset.identity.data;
+        std::string compressed;
+        if (readFile(path.string() + ".gz", compressed) || (compressible(asset.content_type) && gzip(original, compressed))) {
+            setVariant(asset, asset.gzip, "gzip", std::move(compressed));
+        }
+        compressed.clear();
+        if (readFile(path.string() + ".br", compressed) || (compressible(asset.content_type) && brotli(original, compressed))) {
+            setVariant(asset, asset.brotli, "br", std::move(compressed));
+        }
+        assets_.emplace(url_path, std::move(asset));
+    }
+
+    void setVariant(const Asset& asset, Variant& variant, const std::string& encoding, std::string data) {
+        if (data.size() >= asset.identity.data->size()) {
+            return;
+        }
+        // Each representation needs its own strong validator
+        variant.etag = makeEtag(*asset.identity.data, "-" + encoding);
+        variant.encoding = encoding;
+        variant.data = std::make_shared<const std::string>(std::move(data));
+        cached_bytes_ += variant.data->size();
+    }
+
+    static bool readFile(const std::filesystem::path& path, std::string& content) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return !file.bad();
+    }
+
+    static bool compressible(const std::string& content_type) {
+        return content_type.starts_with("text/") || content_type.starts_with("application/json") ||
+               content_type == "image/svg+xml" || content_type == "application/wasm";
+    }
+
+    bool gzip(const std::string& input, std::string& output) const {
+#if defined(VOICE_HAVE_ZLIB)
+        z_stream stream{};
+        // 15 window bits + 16 selects the gzip wrapper
+        if (deflateInit2(&stream, options_.gzip_level, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        output.resize(deflateBound(&stream, static_cast<uLong>(input.size())));
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+        stream.avail_in = static_cast<uInt>(input.size());
+        stream.next_out = reinterpret_cast<Bytef*>(output.data());
+        stream.avail_out = static_cast<uInt>(output.size());
+        int result = deflate(&stream, Z_FINISH);
+        output.resize(stream.total_out);
+        deflateEnd(&stream);
+        return result == Z_STREAM_END;
+#else
+        (void)input;
+        (void)output;
+        return false;
+#endif
+    }
+
+    bool brotli(const std::string& input, std::string& output) const {
+#if defined(VOICE_HAVE_BROTLI)
+        size_t length = BrotliEncoderMaxCompressedSize(input.size());
+        if (length == 0) {
+            return false;
+        }
+        output.resize(length);
+        if (!BrotliEncoderCompress(options_.brotli_quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                   input.size(), reinterpret_cast<const uint8_t*>(input.data()),
+                                   &length, reinterpret_cast<uint8_t*>(output.data()))) {
+            return false;
+        }
+        output.resize(length);
+        return true;
+#else
+        (void)input;
+        (void)output;
+        return false;
+#endif
+    }
+
+    // FNV-1a of the content; a validator only has to change when the content does.
+    static std::string makeEtag(std::string_view content, const std::string& suffix) {
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : content) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+        }
+        char buffer[24];
+        std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(hash));
+        return "\"" + std::string(buffer) + suffix + "\"";
+    }
+
+    // Path of a request target with query stripped and percent-escapes decoded; empty if invalid.
+    // Only loaded files are ever looked up, so ".." cannot escape the directory.
+    static std::string decodePath(const std::string& target) {
+        std::string_view raw(target);
+        raw = raw.substr(0, raw.find_first_of("?#"));
+        if (raw.empty() || raw.front() != '/') {
+            return "";
+        }
+        std::string path;
+        path.reserve(raw.size());
+        for (size_t i = 0; i < raw.size(); ++i) {
+            if (raw[i] != '%') {
+                path += raw[i];
+                continue;
+            }
+            if (i + 2 >= raw.size() || !std::isxdigit(static_cast<unsigned char>(raw[i + 1])) ||
+                !std::isxdigit(static_cast<unsigned char>(raw[i + 2]))) {
+                return "";
+            }
+            path += static_cast<char>(std::stoi(std::string(raw.substr(i + 1, 2)), nullptr, 16));
+            i += 2;
+        }
+        return path;
+    }
+
+    // True if the Accept-Encoding list names coding with a non-zero q value.
+    static bool accepts(const std::string& accept_encoding, const std::string& coding) {
+        std::stringstream list(accept_encoding);
+        std::string item;
+        while (std::getline(list, item, ',')) {
+            size_t start = item.find_first_not_of(" \t");
+            if (start == std::string::npos) {
+                continue;
+            }
+            size_t semicolon = item.find(';', start);
+            std::string token = item.substr(start, semicolon == std::string::npos ? std::string::npos : semicolon - start);
+            token.erase(token.find_last_not_of(" \t") + 1);
+            if (token != coding && token != "*") {
+                continue;
+            }
+            size_t q = item.find("q=", semicolon == std::string::npos ? item.size() : semicolon);
+            return q == std::string::npos || std::strtod(item.c_str() + q + 2, nullptr) > 0.0;
+        }
+        return false;
+    }
+
+    static bool matches(const std::string& if_none_match, const std::string& etag) {
+        // Weak comparison, as RFC 9110 requires for If-None-Match: W/"x" matches "x"
+        return if_none_match.find('*') != std::string::npos || if_none_match.find(etag) != std::string::npos;
+    }
+
+    Options options_;
+    std::unordered_map<std::string, Asset> assets_;
+    size_t cached_bytes_ = 0;
+};
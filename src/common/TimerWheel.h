@@ -0,0 +1,206 @@
+//
+// Created by maxim on 24.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Hierarchical hashed timer wheel keyed by Key, each timer carrying a Value. Scheduling,
+// cancelling and moving a deadline are O(1); advance() only visits the slots of the ticks
+// that passed. Deadlines are rounded up to whole ticks, so timers fire up to one tick late.
+//
+// Pushing a deadline later (the common case: a client was active again) only updates the
+// timer in place; it is filed into the right slot when its old slot comes up. Four levels of
+// 256/64/64/64 slots cover 2^26 ticks; longer deadlines are re-filed until they are in range.
+// Not thread-safe.
+template<typename Key, typename Value>
+class TimerWheel {
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit TimerWheel(clock::duration tick, clock::time_point start = clock::now())
+        : tick_(tick), origin_(start) {}
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Adds a timer or moves an existing one to deadline, replacing its value.
+    void schedule(const Key& key, clock::time_point deadline, Value value) {
+        auto [it, inserted] = timers_.try_emplace(key);
+        Timer& timer = it->second;
+        timer.key = &it->first;
+        timer.value = std::move(value);
+        setDeadline(timer, inserted, deadline);
+    }
+
+    // Moves an existing timer's deadline and returns its value; nullptr if there is no timer
+    // for key.
+    Value* reschedule(const Key& key, clock::time_point deadline) {
+        auto it = timers_.find(key);
+        if (it == timers_.end()) {
+            return nullptr;
+        }
+        setDeadline(it->second, false, deadline);
+        return &it->second.value;
+    }
+
+    bool cancel(const Key& key) {
+        auto it = timers_.find(key);
+        if (it == timers_.end()) {
+            return false;
+        }
+        unlink(it->second);
+        timers_.erase(it);
+        return true;
+    }
+
+    Value* find(const Key& key) {
+        auto it = timers_.find(key);
+        return it != timers_.end() ? &it->second.value : nullptr;
+    }
+
+    [[nodiscard]] size_t size() const { return timers_.size(); }
+
+    // Fires every timer due by now: the timer is removed, then on_expired(key, value) runs.
+    // on_expired may schedule or cancel timers, including the one that fired.
+    template<typename Handler>
+    size_t advance(clock::time_point now, Handler&& on_expired) {
+        uint64_t target = tickAt(now);
+        size_t fired = 0;
+        std::vector<std::pair<Key, Value>> expired;
+        while (current_ < target) {
+            ++current_;
+            cascade();
+            Timer* timer = detach(slots_[0][current_ & LEVEL0_MASK]);
+            while (timer != nullptr) {
+                Timer* next = timer->next;
+                if (timer->deadline <= current_) {
+                    auto it = timers_.find(*timer->key);
+                    expired.emplace_back(it->first, std::move(timer->value));
+                    timers_.erase(it);
+                } else {
+                    file(*timer);
+                }
+                timer = next;
+            }
+            for (auto& [key, value] : expired) {
+                on_expired(key, value);
+            }
+            fired += expired.size();
+            expired.clear();
+        }
+        return fired;
+    }
+
+private:
+    static constexpr unsigned LEVEL0_BITS = 8;
+    static constexpr unsigned LEVEL_BITS = 6;
+    static constexpr unsigned LEVELS = 4;
+    static constexpr uint64_t LEVEL0_MASK = (uint64_t{1} << LEVEL0_BITS) - 1;
+    static constexpr uint64_t LEVEL_MASK = (uint64_t{1} << LEVEL_BITS) - 1;
+    static constexpr size_t SLOTS = size_t{1} << LEVEL0_BITS;  // level 0; upper levels use 64 of them
+
+    struct Timer {
+        const Key* key = nullptr;
+        Value value{};
+        uint64_t deadline = 0;  // tick
+        uint64_t filed = 0;     // tick the slot it is in comes up
+        Timer* prev = nullptr;
+        Timer* next = nullptr;
+        Timer** head = nullptr;  // slot it is linked into
+    };
+
+    static constexpr unsigned shift(unsigned level) {
+        return level == 0 ? 0 : LEVEL0_BITS + (level - 1) * LEVEL_BITS;
+    }
+
+    uint64_t tickAt(clock::time_point time) const {
+        if (time <= origin_) {
+            return 0;
+        }
+        // Rounded up, so a timer never fires before its deadline
+        return static_cast<uint64_t>((time - origin_ + tick_ - clock::duration(1)) / tick_);
+    }
+
+    void setDeadline(Timer& timer, bool is_new, clock::time_point deadline) {
+        timer.deadline = std::max(tickAt(deadline), current_ + 1);
+        if (is_new) {
+            file(timer);
+        } else if (timer.deadline < timer.filed) {
+            unlink(timer);
+            file(timer);
+        }
+        // A later deadline stays where it is until its slot comes up
+    }
+
+    void file(Timer& timer) {
+        uint64_t delta = timer.deadline - current_;
+        unsigned level = 0;
+        while (level + 1 < LEVELS && delta >= (uint64_t{1} << shift(level + 1))) {
+            ++level;
+        }
+        uint64_t at = timer.deadline;
+        if (level == LEVELS - 1) {
+            // Beyond the wheel: park it as far out as possible and re-file from there
+            uint64_t span = uint64_t{1} << (shift(LEVELS - 1) + LEVEL_BITS);
+            at = std::min(at, current_ + span - (uint64_t{1} << shift(LEVELS - 1)));
+        }
+        uint64_t mask = level == 0 ? LEVEL0_MASK : LEVEL_MASK;
+        Timer*& head = slots_[level][(at >> shift(level)) & mask];
+        // An upper-level slot comes up when its range starts; that is where the timer is re-filed
+        timer.filed = level == 0 ? at : (at >> shift(level)) << shift(level);
+        timer.head = &head;
+        timer.prev = nullptr;
+        timer.next = head;
+        if (head != nullptr) {
+            head->prev = &timer;
+        }
+        head = &timer;
+    }
+
+    void unlink(Timer& timer) {
+        if (timer.prev != nullptr) {
+            timer.prev->next = timer.next;
+        } else {
+            *timer.head = timer.next;
+        }
+        if (timer.next != nullptr) {
+            timer.next->prev = timer.prev;
+        }
+        timer.prev = timer.next = nullptr;
+        timer.head = nullptr;
+    }
+
+    static Timer* detach(Timer*& head) {
+        Timer* list = head;
+        head = nullptr;
+        return list;
+    }
+
+    // When a level's range starts, its timers move down to finer levels, highest level first.
+    void cascade() {
+        for (unsigned level = LEVELS - 1; level >= 1; --level) {
+            if ((current_ & ((uint64_t{1} << shift(level)) - 1)) != 0) {
+                continue;
+            }
+            Timer* timer = detach(slots_[level][(current_ >> shift(level)) & LEVEL_MASK]);
+            while (timer != nullptr) {
+                Timer* next = timer->next;
+                file(*timer);
+                timer = next;
+            }
+        }
+    }
+
+    clock::duration tick_;
+    clock::time_point origin_;
+    uint64_t current_ = 0;  // last tick processed
+    std::array<std::array<Timer*, SLOTS>, LEVELS> slots_{};
+    std::unordered_map<Key, Timer> timers_;
+};
@@ -0,0 +1,181 @@
+//
+// Created by maxim on 22.09.2024.
+//
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <asio.hpp>
+#include <asio/ssl.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "AsioThreadPool.h"
+#include "VoiceMetrics.h"
+
+using asio::ip::tcp;
+
+struct TlsSettings {
+    std::string certificate_chain_file;
+    std::string private_key_file;
+    std::string dh_params_file;            // optional; ECDHE needs none
+    long session_cache_size = 20480;       // server-side session ids
+    long session_timeout_s = 3600;         // lifetime of cached sessions and tickets
+    size_t session_tickets = 2;            // TLS 1.3 tickets issued per handshake
+    bool ktls = false;                     // hand record encryption to the Linux kernel
+    size_t handshake_threads = 1;
+};
+
+// Runs TLS handshakes on a thread pool of its own, so a storm of new connections costs
+// handshake threads rather than the audio I/O threads. OpenSSL reads and writes the socket
+// directly here, which lets it enable kernel TLS once the handshake is done; the socket is then
+// moved back to the caller's io_context:
+//   - kernel TLS in both directions: the socket carries plaintext and ssl is null;
+//   - otherwise: ssl is the established connection, to be wrapped in an asio::ssl::stream.
+// OpenSSL 3.0 only offloads receive for TLS 1.2, so full offload needs clients on TLS 1.2.
+class TlsHandshaker {
+public:
+    using done_handler = std::function<void(tcp::socket socket, SSL* ssl)>;
+
+    // Handshakes not done within timeout (zero: no limit) are abandoned and their socket closed.
+    TlsHandshaker(size_t threads, std::chrono::milliseconds timeout)
+        : pool_(threads == 0 ? 1 : threads), timeout_(timeout) {
+        pool_.start();
+    }
+
+    // Session caching, tickets and kernel TLS for a server context.
+    static void configure(asio::ssl::context& context, const TlsSettings& settings) {
+        context.set_options(asio::ssl::context::default_workarounds
+                            | asio::ssl::context::no_sslv2
+                            | asio::ssl::context::no_sslv3
+                            | asio::ssl::context::single_dh_use);
+        context.use_certificate_chain_file(settings.certificate_chain_file);
+        context.use_private_key_file(settings.private_key_file, asio::ssl::context::pem);
+        if (!settings.dh_params_file.empty()) {
+            context.use_tmp_dh_file(settings.dh_params_file);
+        }
+
+        SSL_CTX* ctx = context.native_handle();
+        static const unsigned char session_id_context[] = "voice_chat";
+        SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, settings.session_cache_size);
+        SSL_CTX_set_timeout(ctx, settings.session_timeout_s);
+        SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_num_tickets(ctx, settings.session_tickets);
+        if (settings.ktls) {
+            SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+        }
+    }
+
+    // Takes over socket; done runs on the socket's original executor, and only on success.
+    void handshake(tcp::socket socket, SSL_CTX* ctx, done_handler done) {
+        auto handshake = std::make_shared<Handshake>(pool_.get_io_context(), std::move(socket), ctx, std::move(done));
+        asio::post(handshake->strand_, [handshake, timeout = timeout_]() {
+            handshake->start(timeout);
+        });
+    }
+
+private:
+    // Socket and deadline share a strand, as the pool may run several threads.
+    struct Handshake : std::enable_shared_from_this<Handshake> {
+        Handshake(asio::io_context& io_context, tcp::socket socket, SSL_CTX* ctx, done_handler done)
+            : io_context_(socket.get_executor()),
+              protocol_(tcp::v4()),
+              strand_(asio::make_strand(io_context)),
+              socket_(strand_),
+              deadline_(strand_),
+              ssl_(SSL_new(ctx)),
+              done_(std::move(done)) {
+            std::error_code ec;
+            auto endpoint = socket.local_endpoint(ec);
+            if (!ec) {
+                protocol_ = endpoint.protocol();
+            }
+            socket_.assign(protocol_, socket.release());
+            socket_.native_non_blocking(true);
+            SSL_set_fd(ssl_, static_cast<int>(socket_.native_handle()));
+        }
+
+        ~Handshake() {
+            if (ssl_) {
+                SSL_free(ssl_);
+            }
+        }
+
+        void start(std::chrono::milliseconds timeout) {
+            if (timeout.count() > 0) {
+                deadline_.expires_after(timeout);
+                deadline_.async_wait([self = this->shared_from_this()](std::error_code ec) {
+                    if (!ec) {
+                        VoiceMetrics::get().tls_handshake_timeouts.inc();
+                        std::error_code ignored;
+                        self->socket_.close(ignored);  // Aborts the pending wait, which ends the handshake
+                    }
+                });
+            }
+            step();
+        }
+
+        void step() {
+            ERR_clear_error();
+            int result = SSL_accept(ssl_);
+            if (result == 1) {
+                finish();
+                return;
+            }
+            int error = SSL_get_error(ssl_, result);
+            if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+                auto wait = error == SSL_ERROR_WANT_READ ? tcp::socket::wait_read : tcp::socket::wait_write;
+                socket_.async_wait(wait, [self = this->shared_from_this()](std::error_code ec) {
+                    if (!ec) {
+                        self->step();
+                    }
+                });
+                return;
+            }
+            char reason[256];
+            ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+            std::cerr << "TLS handshake error: " << reason << "\n";
+            VoiceMetrics::get().tls_handshake_failures.inc();
+            deadline_.cancel();
+        }
+
+        void finish() {
+            deadline_.cancel();
+            auto& metrics = VoiceMetrics::get();
+            (SSL_session_reused(ssl_) ? metrics.tls_handshakes_resumed : metrics.tls_handshakes_full).inc();
+
+            bool kernel_tls = BIO_get_ktls_send(SSL_get_wbio(ssl_)) && BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+            SSL* ssl = ssl_;
+            ssl_ = nullptr;
+            if (kernel_tls) {
+                // The kernel now does the record layer; the socket BIO leaves the descriptor open
+                SSL_free(ssl);
+                ssl = nullptr;
+                metrics.tls_ktls_sessions.inc();
+            }
+
+            auto native = socket_.release();
+            asio::post(io_context_, [executor = io_context_, protocol = protocol_, native, ssl, done = std::move(done_)]() {
+                tcp::socket socket(executor, protocol, native);
+                done(std::move(socket), ssl);
+            });
+        }
+
+        tcp::socket::executor_type io_context_;
+        tcp protocol_;
+        asio::strand<asio::io_context::executor_type> strand_;
+        tcp::socket socket_;
+        asio::steady_timer deadline_;
+        SSL* ssl_;
+        done_handler done_;
+    };
+
+    AsioThreadPool pool_;
+    std::chrono::milliseconds timeout_;
+};
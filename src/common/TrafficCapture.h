@@ -0,0 +1,233 @@
+//
+// Created by maxim on 30.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "MpscRing.h"
+#include "PcmFormat.h"
+#include "VoiceMetrics.h"
+
+// Captures of the traffic rooms see: who joined which room, who left, and every audio payload
+// with its arrival time. voice_server writes them while serving (capture_file), voice_replay
+// feeds them back into rooms to benchmark the mixer on real traffic shapes.
+namespace TrafficCapture
+{
+    // File layout, native byte order: FileHeader, then records, each a RecordHeader followed by
+    // the client id, the room id (Join only) and the payload (Audio only), padded to 8 bytes.
+    constexpr uint32_t FILE_MAGIC = 0x43544356;  // "VCTC"
+    constexpr uint32_t FILE_VERSION = 1;
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        int64_t started_unix_ns;
+        uint64_t reserved[2];
+    };
+    static_assert(sizeof(FileHeader) == 32);
+
+    enum class EventType : uint8_t {
+        Join = 1,
+        Leave,
+        Audio,
+    };
+
+    struct RecordHeader {
+        uint32_t size;  // header and body, padded to 8
+        EventType type;
+        uint8_t client_length;
+        uint8_t room_length;
+        uint8_t sample_type;  // Join: the client's Pcm::SampleType
+        int64_t offset_ns;  // since the capture started, by the steady clock
+        uint32_t payload_length;
+        uint32_t channels;  // Join: the client's channels; 0 (captures made before formats) is 1
+    };
+    static_assert(sizeof(RecordHeader) == 24);
+
+    constexpr size_t MAX_ID = 255;
+    constexpr size_t MAX_PAYLOAD = 16384;  // voice_server's largest datagram
+
+    struct Event {
+        EventType type;
+        std::chrono::nanoseconds offset;
+        std::string client;
+        std::string room;
+        std::vector<uint8_t> payload;
+        Pcm::Format format;  // Join only
+    };
+
+    // Reads a whole capture; false if path is not one. A capture cut short by a crash reads up
+    // to its last complete record, and so does one with a malformed record.
+    inline bool read(const std::string& path, std::vector<Event>& events) {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        FileHeader header{};
+        if (data.size() >= sizeof(header)) {
+            std::memcpy(&header, data.data(), sizeof(header));
+        }
+        if (header.magic != FILE_MAGIC || header.version != FILE_VERSION) {
+            std::cerr << "Not a traffic capture: " << path << std::endl;
+            return false;
+        }
+        size_t offset = sizeof(header);
+        while (offset + sizeof(RecordHeader) <= data.size()) {
+            RecordHeader record{};
+            std::memcpy(&record, data.data() + offset, sizeof(record));
+            size_t body = size_t{record.client_length} + record.room_length + record.payload_length;
+            if (record.size < sizeof(record) + body || offset + record.size > data.size()) {
+                break;
+            }
+            Pcm::Format format;
+            if (record.type == EventType::Join) {
+                format = {static_cast<Pcm::SampleType>(record.sample_type),
+                          static_cast<uint8_t>(std::clamp<uint32_t>(record.channels, 1, UINT8_MAX))};
+                if (!format.valid()) {
+                    break;
+                }
+            }
+            auto bytes = reinterpret_cast<const char*>(data.data() + offset + sizeof(record));
+            Event event{record.type, std::chrono::nanoseconds(record.offset_ns),
+                        std::string(bytes, record.client_length),
+                        std::string(bytes + record.client_length, record.room_length), {}, format};
+            auto payload = reinterpret_cast<const uint8_t*>(bytes) + record.client_length + record.room_length;
+            event.payload.assign(payload, payload + record.payload_length);
+            events.push_back(std::move(event));
+            offset += record.size;
+        }
+        return true;
+    }
+
+    // Appends events from any thread without blocking it: they are copied into a lock-free ring
+    // and written out by the capture's own thread. Events that find the ring full are dropped
+    // and counted, as are ids and payloads too large for a record.
+    class Writer {
+    public:
+        Writer(const std::string& path, size_t queue_records)
+            : ring_(queue_records), started_(std::chrono::steady_clock::now()) {
+            file_ = std::fopen(path.c_str(), "wb");
+            if (file_ == nullptr) {
+                std::cerr << "Failed to create traffic capture " << path << ": " << std::strerror(errno) << std::endl;
+                return;
+            }
+            std::setvbuf(file_, nullptr, _IOFBF, 1024 * 1024);
+            FileHeader header{FILE_MAGIC, FILE_VERSION,
+                              std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                  std::chrono::system_clock::now().time_since_epoch()).count(), {}};
+            std::fwrite(&header, sizeof(header), 1, file_);
+            thread_ = std::thread(&Writer::writerThread, this);
+        }
+
+        ~Writer() {
+            stop_.store(true, std::memory_order_release);
+            if (thread_.joinable()) {
+                thread_.join();
+            }
+            if (file_ != nullptr) {
+                std::fclose(file_);
+            }
+        }
+
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+
+        void join(std::string_view client, std::string_view room, Pcm::Format format = {}) {
+            push(EventType::Join, client, room, {}, format);
+        }
+
+        void leave(std::string_view client) {
+            push(EventType::Leave, client, {}, {});
+        }
+
+        void audio(std::string_view client, std::span<const uint8_t> payload) {
+            push(EventType::Audio, client, {}, payload);
+        }
+
+    private:
+        static constexpr auto POLL_INTERVAL = std::chrono::milliseconds(10);
+
+        struct Slot {
+            RecordHeader header;
+            char ids[2 * MAX_ID];
+            uint8_t payload[MAX_PAYLOAD];
+        };
+
+        void push(EventType type, std::string_view client, std::string_view room, std::span<const uint8_t> payload,
+                  Pcm::Format format = {}) {
+            auto& metrics = VoiceMetrics::get();
+            if (file_ == nullptr) {
+                return;
+            }
+            if (client.size() > MAX_ID || room.size() > MAX_ID || payload.size() > MAX_PAYLOAD) {
+                metrics.capture_dropped_events.inc();
+                return;
+            }
+            auto offset = std::chrono::steady_clock::now() - started_;
+            bool queued = ring_.push([&](Slot& slot) {
+                size_t body = client.size() + room.size() + payload.size();
+                slot.header = {static_cast<uint32_t>((sizeof(RecordHeader) + body + 7) & ~size_t{7}),
+                               type,
+                               static_cast<uint8_t>(client.size()),
+                               static_cast<uint8_t>(room.size()),
+                               static_cast<uint8_t>(format.sample),
+                               std::chrono::duration_cast<std::chrono::nanoseconds>(offset).count(),
+                               static_cast<uint32_t>(payload.size()),
+                               format.channels};
+                std::memcpy(slot.ids, client.data(), client.size());
+                std::memcpy(slot.ids + client.size(), room.data(), room.size());
+                std::memcpy(slot.payload, payload.data(), payload.size());
+            });
+            if (!queued) {
+                metrics.capture_dropped_events.inc();
+            }
+        }
+
+        void writerThread() {
+            auto& metrics = VoiceMetrics::get();
+            static constexpr char padding[8] = {};
+            while (true) {
+                bool stopping = stop_.load(std::memory_order_acquire);
+                size_t written = 0;
+                while (ring_.pop([&](Slot& slot) {
+                    const RecordHeader& header = slot.header;
+                    size_t ids = size_t{header.client_length} + header.room_length;
+                    std::fwrite(&header, sizeof(header), 1, file_);
+                    std::fwrite(slot.ids, 1, ids, file_);
+                    std::fwrite(slot.payload, 1, header.payload_length, file_);
+                    std::fwrite(padding, 1, header.size - sizeof(header) - ids - header.payload_length, file_);
+                    metrics.capture_bytes_written.inc(header.size);
+                })) {
+                    ++written;
+                }
+                // Whatever was written reaches the file within a poll interval
+                if (written > 0) {
+                    std::fflush(file_);
+                }
+                if (stopping) {
+                    break;
+                }
+                std::this_thread::sleep_for(POLL_INTERVAL);
+            }
+        }
+
+        MpscRing<Slot> ring_;
+        std::chrono::steady_clock::time_point started_;
+        std::FILE* file_ = nullptr;
+        std::atomic<bool> stop_{false};
+        std::thread thread_;
+    };
+}
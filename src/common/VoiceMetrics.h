@@ -0,0 +1,90 @@
+//
+// Created by maxim on 17.09.2024.
+//
+#pragma once
+
+#include "Metrics.h"
+
+// The metrics exported by voice_server. Hot paths keep a reference to the instance and
+// update counters directly; registration happens once on first use.
+struct TransportMetrics {
+    Metrics::Counter& packets_in;
+    Metrics::Counter& bytes_in;
+    Metrics::Counter& packets_out;
+    Metrics::Counter& bytes_out;
+
+    explicit TransportMetrics(const std::string& transport)
+        : packets_in(Metrics::registry().counter("voice_packets_received_total", "Audio packets received from clients",
+                                                 {{"transport", transport}})),
+          bytes_in(Metrics::registry().counter("voice_bytes_received_total", "Audio payload bytes received from clients",
+                                               {{"transport", transport}})),
+          packets_out(Metrics::registry().counter("voice_packets_sent_total", "Audio packets sent to clients",
+                                                  {{"transport", transport}})),
+          bytes_out(Metrics::registry().counter("voice_bytes_sent_total", "Audio payload bytes sent to clients",
+                                                {{"transport", transport}})) {}
+};
+
+struct VoiceMetrics {
+    TransportMetrics udp{"udp"};
+    TransportMetrics websocket{"websocket"};
+    TransportMetrics federation{"federation"};
+
+    Metrics::Histogram& mix_tick_duration = Metrics::registry().histogram(
+        "voice_mix_tick_duration_seconds", "Time spent mixing and sending one room tick", Metrics::latencyBuckets());
+    Metrics::Histogram& mix_tick_lateness = Metrics::registry().histogram(
+        "voice_mix_tick_lateness_seconds", "Delay between a mix tick's deadline and its start", Metrics::latencyBuckets());
+    Metrics::Counter& dropped_frames = Metrics::registry().counter(
+        "voice_dropped_frames_total", "Frames discarded because a sender's buffer exceeded MAX_BUFFER_SIZE");
+    Metrics::Counter& websocket_dropped_frames = Metrics::registry().counter(
+        "voice_websocket_dropped_frames_total", "Audio frames dropped from WebSocket send queues of slow clients");
+    Metrics::Gauge& websocket_write_queue = Metrics::registry().gauge(
+        "voice_websocket_write_queue_frames", "Frames waiting in WebSocket write queues across all sessions");
+
+    Metrics::Counter& evicted_udp_idle = Metrics::registry().counter(
+        "voice_clients_evicted_total", "Clients removed by the liveness checks", {{"reason", "udp_idle"}});
+    Metrics::Counter& evicted_pong_timeout = Metrics::registry().counter(
+        "voice_clients_evicted_total", "Clients removed by the liveness checks", {{"reason", "pong_timeout"}});
+    Metrics::Counter& websocket_pings = Metrics::registry().counter(
+        "voice_websocket_pings_sent_total", "Keepalive pings sent to idle WebSocket clients");
+    Metrics::Counter& federation_rejected = Metrics::registry().counter(
+        "voice_federation_rejected_datagrams_total", "Trunk datagrams dropped for not coming from a configured peer");
+
+    Metrics::Counter& websocket_accepted = Metrics::registry().counter(
+        "voice_websocket_connections_accepted_total", "TCP connections accepted on the WebSocket port");
+    Metrics::Counter& websocket_handshakes = Metrics::registry().counter(
+        "voice_websocket_handshakes_total", "Completed WebSocket upgrades");
+    Metrics::Counter& websocket_handshake_timeouts = Metrics::registry().counter(
+        "voice_handshake_timeouts_total", "Connections closed for not finishing their handshake in time",
+        {{"stage", "upgrade"}});
+    Metrics::Counter& tls_handshake_timeouts = Metrics::registry().counter(
+        "voice_handshake_timeouts_total", "Connections closed for not finishing their handshake in time",
+        {{"stage", "tls"}});
+
+    Metrics::Counter& tls_handshakes_full = Metrics::registry().counter(
+        "voice_tls_handshakes_total", "Completed TLS handshakes", {{"type", "full"}});
+    Metrics::Counter& tls_handshakes_resumed = Metrics::registry().counter(
+        "voice_tls_handshakes_total", "Completed TLS handshakes", {{"type", "resumed"}});
+    Metrics::Counter& tls_handshake_failures = Metrics::registry().counter(
+        "voice_tls_handshake_failures_total", "TLS handshakes that failed");
+    Metrics::Counter& tls_ktls_sessions = Metrics::registry().counter(
+        "voice_tls_ktls_sessions_total", "TLS connections handed to kernel TLS after the handshake");
+
+    Metrics::Gauge& recording_backlog = Metrics::registry().gauge(
+        "voice_recording_backlog_frames", "Recording frames queued for the writer thread");
+    Metrics::Counter& recording_bytes_written = Metrics::registry().counter(
+        "voice_recording_bytes_written_total", "Bytes of room recordings written to disk");
+    Metrics::Counter& recording_dropped_frames = Metrics::registry().counter(
+        "voice_recording_dropped_frames_total", "Recording frames dropped because the writer's queue was full");
+    Metrics::Histogram& recording_write_duration = Metrics::registry().histogram(
+        "voice_recording_write_duration_seconds", "Time taken by one recording write to disk", Metrics::latencyBuckets());
+
+    Metrics::Counter& capture_bytes_written = Metrics::registry().counter(
+        "voice_capture_bytes_written_total", "Bytes of traffic capture written to disk");
+    Metrics::Counter& capture_dropped_events = Metrics::registry().counter(
+        "voice_capture_dropped_events_total", "Traffic capture events dropped for a full queue or an oversized payload");
+
+    static VoiceMetrics& get() {
+        static VoiceMetrics instance;
+        return instance;
+    }
+};
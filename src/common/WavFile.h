@@ -0,0 +1,187 @@
+//
+// Created by maxim on 14.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Minimal RIFF/WAVE support for 16-bit PCM, enough for test fixtures and recordings.
+namespace WavFile
+{
+    struct Format {
+        uint16_t channels = 1;
+        uint32_t sample_rate = 44100;
+    };
+
+    namespace detail
+    {
+        inline void put_u16(uint8_t*& p, uint16_t value) {
+            p[0] = static_cast<uint8_t>(value & 0xFF);
+            p[1] = static_cast<uint8_t>(value >> 8);
+            p += 2;
+        }
+
+        inline void put_u32(uint8_t*& p, uint32_t value) {
+            put_u16(p, static_cast<uint16_t>(value & 0xFFFF));
+            put_u16(p, static_cast<uint16_t>(value >> 16));
+        }
+
+        inline void put_tag(uint8_t*& p, const char* tag) {
+            std::memcpy(p, tag, 4);
+            p += 4;
+        }
+
+        inline uint16_t read_u16(const uint8_t* p) {
+            return static_cast<uint16_t>(p[0] | (p[1] << 8));
+        }
+
+        inline uint32_t read_u32(const uint8_t* p) {
+            return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+                   (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+        }
+    }
+
+    // Reads a whole 16-bit PCM file into interleaved samples.
+    inline bool read(const std::string& filename, std::vector<int16_t>& samples, Format& format) {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open WAV file: " << filename << std::endl;
+            return false;
+        }
+
+        std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (bytes.size() < 12 || std::memcmp(bytes.data(), "RIFF", 4) != 0 ||
+            std::memcmp(bytes.data() + 8, "WAVE", 4) != 0) {
+            std::cerr << "Not a RIFF/WAVE file: " << filename << std::endl;
+            return false;
+        }
+
+        bool have_format = false;
+        size_t offset = 12;
+        while (offset + 8 <= bytes.size()) {
+            const uint8_t* chunk = bytes.data() + offset;
+            uint32_t chunk_size = detail::read_u32(chunk + 4);
+            size_t body = offset + 8;
+            size_t available = std::min<size_t>(chunk_size, bytes.size() - body);
+
+            if (std::memcmp(chunk, "fmt ", 4) == 0 && available >= 16) {
+                uint16_t audio_format = detail::read_u16(bytes.data() + body);
+                uint16_t bits_per_sample = detail::read_u16(bytes.data() + body + 14);
+                if (audio_format != 1 || bits_per_sample != 16) {
+                    std::cerr << "Only 16-bit PCM WAV files are supported: " << filename << std::endl;
+                    return false;
+                }
+                format.channels = detail::read_u16(bytes.data() + body + 2);
+                format.sample_rate = detail::read_u32(bytes.data() + body + 4);
+                if (format.channels == 0 || format.sample_rate == 0) {
+                    std::cerr << "WAV file has no channels or no sample rate: " << filename << std::endl;
+                    return false;
+                }
+                have_format = true;
+            } else if (std::memcmp(chunk, "data", 4) == 0) {
+                if (!have_format) {
+                    std::cerr << "WAV data chunk precedes fmt chunk: " << filename << std::endl;
+                    return false;
+                }
+                samples.resize(available / sizeof(int16_t));
+                for (size_t i = 0; i < samples.size(); ++i) {
+                    samples[i] = static_cast<int16_t>(detail::read_u16(bytes.data() + body + i * 2));
+                }
+                return true;
+            }
+
+            offset = body + chunk_size + (chunk_size & 1);
+        }
+
+        std::cerr << "WAV file has no data chunk: " << filename << std::endl;
+        return false;
+    }
+
+    constexpr size_t HEADER_SIZE = 44;
+
+    // The canonical 44-byte header of a 16-bit PCM file holding data_bytes of samples.
+    inline std::array<uint8_t, HEADER_SIZE> header(Format format, uint64_t data_bytes) {
+        auto data_size = static_cast<uint32_t>(std::min<uint64_t>(data_bytes, UINT32_MAX - 36));
+        std::array<uint8_t, HEADER_SIZE> bytes{};
+        uint8_t* p = bytes.data();
+        detail::put_tag(p, "RIFF");
+        detail::put_u32(p, 36 + data_size);
+        detail::put_tag(p, "WAVE");
+        detail::put_tag(p, "fmt ");
+        detail::put_u32(p, 16);
+        detail::put_u16(p, 1);  // PCM
+        detail::put_u16(p, format.channels);
+        detail::put_u32(p, format.sample_rate);
+        detail::put_u32(p, format.sample_rate * format.channels * sizeof(int16_t));
+        detail::put_u16(p, static_cast<uint16_t>(format.channels * sizeof(int16_t)));
+        detail::put_u16(p, 16);
+        detail::put_tag(p, "data");
+        detail::put_u32(p, data_size);
+        return bytes;
+    }
+
+    // Streams 16-bit PCM to disk; the RIFF sizes are patched in on close().
+    class Writer {
+    public:
+        Writer() = default;
+
+        ~Writer() {
+            close();
+        }
+
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+
+        bool open(const std::string& filename, Format format) {
+            close();
+            file_.open(filename, std::ios::binary | std::ios::trunc);
+            if (!file_.is_open()) {
+                std::cerr << "Failed to open WAV file for writing: " << filename << std::endl;
+                return false;
+            }
+            format_ = format;
+            data_bytes_ = 0;
+            write_header();
+            return true;
+        }
+
+        void write(const int16_t* samples, size_t count) {
+            if (!file_.is_open()) {
+                return;
+            }
+            file_.write(reinterpret_cast<const char*>(samples), static_cast<std::streamsize>(count * sizeof(int16_t)));
+            data_bytes_ += count * sizeof(int16_t);
+        }
+
+        [[nodiscard]] bool is_open() const { return file_.is_open(); }
+
+        [[nodiscard]] uint64_t data_bytes() const { return data_bytes_; }
+
+        void close() {
+            if (!file_.is_open()) {
+                return;
+            }
+            file_.seekp(0);
+            write_header();
+            file_.close();
+        }
+
+    private:
+        void write_header() {
+            auto bytes = header(format_, data_bytes_);
+            file_.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+        }
+
+        std::ofstream file_;
+        Format format_;
+        uint64_t data_bytes_ = 0;
+    };
+}
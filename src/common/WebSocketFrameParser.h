@@ -0,0 +1,338 @@
+//
+// Created by maxim on 20.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <span>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define WEBSOCKET_UNMASK_X86 1
+#include <immintrin.h>
+#else
+#define WEBSOCKET_UNMASK_X86 0
+#endif
+
+enum class WebSocketOpCode : uint8_t {
+    Continuation = 0x0,
+    Text = 0x1,
+    Binary = 0x2,
+    Close = 0x8,
+    Ping = 0x9,
+    Pong = 0xA
+};
+
+// Incremental RFC 6455 frame parser that owns the session's receive buffer. The session reads
+// into prepare() and hands the byte count to commit(); any number of frames, or any part of
+// one, may arrive per read.
+//
+// Payloads are unmasked in place and delivered as spans into the receive buffer, valid only for
+// the duration of the callback. A message is copied only when it is fragmented or larger than
+// the buffer; then it is assembled in a separate buffer capped at max_message_size. With a
+// stream handler set, such messages are delivered chunk by chunk instead, so memory stays
+// bounded regardless of message size. Control frames may arrive between fragments.
+class WebSocketFrameParser {
+public:
+    using message_handler = std::function<void(WebSocketOpCode, std::span<const uint8_t>)>;
+    // last is true on the final chunk of a message; opcode is that of the message's first frame.
+    using stream_handler = std::function<void(WebSocketOpCode, std::span<const uint8_t>, bool last)>;
+
+    static constexpr size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+    static constexpr size_t DEFAULT_MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+    static constexpr size_t MAX_HEADER_SIZE = 14;
+    static constexpr size_t MAX_CONTROL_PAYLOAD = 125;
+
+    explicit WebSocketFrameParser(size_t buffer_size = DEFAULT_BUFFER_SIZE,
+                                  size_t max_message_size = DEFAULT_MAX_MESSAGE_SIZE)
+        : buffer_(std::max(buffer_size, MAX_HEADER_SIZE + MAX_CONTROL_PAYLOAD)),
+          max_message_size_(max_message_size) {}
+
+    void setMessageHandler(const message_handler& handler) {
+        on_message_ = handler;
+    }
+
+    // Stream fragmented messages and frames with a payload above threshold bytes.
+    void setStreamHandler(const stream_handler& handler, size_t threshold) {
+        on_stream_ = handler;
+        stream_threshold_ = threshold;
+    }
+
+    // Free space to read into. Never empty: unconsumed bytes are moved to the front first.
+    std::span<uint8_t> prepare() {
+        if (begin_ > 0 && (end_ == buffer_.size() || begin_ == end_)) {
+            std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        return {buffer_.data() + end_, buffer_.size() - end_};
+    }
+
+    // Parses the bytes just read into prepare(). Returns false on a protocol violation, after
+    // which the connection should be closed.
+    bool commit(size_t length) {
+        end_ += length;
+        while (true) {
+            if (!in_payload_ && !parseHeader()) {
+                return !failed_;
+            }
+            if (!consumePayload()) {
+                return !failed_;
+            }
+        }
+    }
+
+    // Bytes received but not parsed yet, as long as no message is partly delivered; a new parser
+    // fed with them carries on where this one stopped.
+    [[nodiscard]] std::optional<std::span<const uint8_t>> unparsed() const {
+        if (fragmented_ || streaming_ || (in_payload_ && !direct_)) {
+            return std::nullopt;
+        }
+        // A direct frame's header and payload stay untouched in the buffer until it is complete
+        return std::span<const uint8_t>(buffer_.data() + begin_, end_ - begin_);
+    }
+
+    // Keeps bytes read into prepare() without parsing them, for a connection being handed over.
+    void append(size_t length) {
+        end_ += length;
+    }
+
+    // Unmasks data in place; offset is the position of data[0] within the frame payload. Works
+    // 32 bytes at a time with AVX2 where the CPU has it, 16 with SSE2, then 8 and finally single
+    // bytes, with no alignment requirement on data.
+    static void unmask(uint8_t* data, size_t length, const uint8_t mask[4], size_t offset) {
+        // The mask rotated so that pattern[j % 4] applies to data[j]
+        uint8_t pattern[8];
+        for (size_t j = 0; j < 8; ++j) {
+            pattern[j] = mask[(offset + j) & 3];
+        }
+
+        size_t i = 0;
+#if WEBSOCKET_UNMASK_X86
+        uint32_t pattern32;
+        std::memcpy(&pattern32, pattern, 4);
+        if (length >= 32 && hasAvx2()) {
+            i = unmaskAvx2(data, length, pattern32);
+        }
+        i += unmaskSse2(data + i, length - i, pattern32);
+#endif
+        uint64_t pattern64;
+        std::memcpy(&pattern64, pattern, 8);
+        for (; i + 8 <= length; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            word ^= pattern64;
+            std::memcpy(data + i, &word, 8);
+        }
+        for (; i < length; ++i) {
+            data[i] ^= pattern[i & 3];
+        }
+    }
+
+private:
+#if WEBSOCKET_UNMASK_X86
+    // Vector loops return the number of bytes processed, always a multiple of 4 so the
+    // pattern's phase is unchanged for the remainder.
+    __attribute__((target("avx2")))
+    static size_t unmaskAvx2(uint8_t* data, size_t length, uint32_t pattern) {
+        const __m256i key = _mm256_set1_epi32(static_cast<int>(pattern));
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            auto* p = reinterpret_cast<__m256i*>(data + i);
+            _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key));
+        }
+        return i;
+    }
+
+    static size_t unmaskSse2(uint8_t* data, size_t length, uint32_t pattern) {
+        const __m128i key = _mm_set1_epi32(static_cast<int>(pattern));
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            auto* p = reinterpret_cast<__m128i*>(data + i);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key));
+        }
+        return i;
+    }
+
+    static bool hasAvx2() {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+#endif
+
+    // Decodes the next frame header once it is complete; false if more bytes are needed.
+    bool parseHeader() {
+        const uint8_t* p = buffer_.data() + begin_;
+        size_t available = end_ - begin_;
+        if (available < 2) {
+            return false;
+        }
+
+        bool fin = (p[0] & 0x80) != 0;
+        auto opcode = static_cast<WebSocketOpCode>(p[0] & 0x0F);
+        masked_ = (p[1] & 0x80) != 0;
+        uint64_t payload_length = p[1] & 0x7F;
+        size_t header_length = 2;
+
+        if (payload_length == 126) {
+            header_length += 2;
+            if (available < header_length) {
+                return false;
+            }
+            payload_length = (static_cast<uint16_t>(p[2]) << 8) | p[3];
+        } else if (payload_length == 127) {
+            header_length += 8;
+            if (available < header_length) {
+                return false;
+            }
+            payload_length = 0;
+            for (int i = 0; i < 8; ++i) {
+                payload_length = (payload_length << 8) | p[2 + i];
+            }
+            if (payload_length >> 63) {
+                return fail("Payload length has the most significant bit set");
+            }
+        }
+        if (masked_) {
+            if (available < header_length + 4) {
+                return false;
+            }
+            std::memcpy(mask_, p + header_length, 4);
+            header_length += 4;
+        }
+
+        bool control = (static_cast<uint8_t>(opcode) & 0x08) != 0;
+        if (control) {
+            if (!fin || payload_length > MAX_CONTROL_PAYLOAD) {
+                return fail("Control frame fragmented or longer than 125 bytes");
+            }
+        } else if (opcode == WebSocketOpCode::Continuation) {
+            if (!fragmented_) {
+                return fail("Continuation frame without a message to continue");
+            }
+        } else if (opcode == WebSocketOpCode::Text || opcode == WebSocketOpCode::Binary) {
+            if (fragmented_) {
+                return fail("New data frame before the fragmented message finished");
+            }
+            message_opcode_ = opcode;
+            message_.clear();
+            // Decided once per message so all of its fragments take the same path
+            streaming_ = on_stream_ && (!fin || payload_length > stream_threshold_);
+        } else {
+            return fail("Reserved opcode");
+        }
+
+        if (!control && !streaming_ && message_.size() + payload_length > max_message_size_) {
+            return fail("Message exceeds the maximum size");
+        }
+
+        fin_ = fin;
+        opcode_ = opcode;
+        control_ = control;
+        payload_remaining_ = payload_length;
+        payload_offset_ = 0;
+        header_length_ = header_length;
+        // Whole frame fits in the buffer and needs no assembly: deliver it where it lies
+        direct_ = (control || (fin && !fragmented_ && !streaming_)) && header_length + payload_length <= buffer_.size();
+        in_payload_ = true;
+        return true;
+    }
+
+    // Delivers what is available of the current payload; false if more bytes are needed.
+    bool consumePayload() {
+        size_t available = end_ - begin_ - header_length_;
+        uint8_t* payload = buffer_.data() + begin_ + header_length_;
+
+        if (direct_) {
+            if (available < payload_remaining_) {
+                return false;
+            }
+            auto length = static_cast<size_t>(payload_remaining_);
+            if (masked_) {
+                unmask(payload, length, mask_, 0);
+            }
+            begin_ += header_length_ + length;
+            in_payload_ = false;
+            if (on_message_) {
+                on_message_(control_ ? opcode_ : message_opcode_, {payload, length});
+            }
+            return true;
+        }
+
+        // Partial payload: hand over what is here so the buffer can be reused
+        auto length = static_cast<size_t>(std::min<uint64_t>(available, payload_remaining_));
+        if (length == 0 && payload_remaining_ > 0) {
+            return false;
+        }
+        if (masked_) {
+            unmask(payload, length, mask_, static_cast<size_t>(payload_offset_));
+        }
+        payload_offset_ += length;
+        payload_remaining_ -= length;
+        bool frame_done = payload_remaining_ == 0;
+        bool message_done = frame_done && fin_;
+
+        if (streaming_) {
+            if (on_stream_ && (length > 0 || message_done)) {
+                on_stream_(message_opcode_, {payload, length}, message_done);
+            }
+        } else {
+            message_.insert(message_.end(), payload, payload + length);
+            if (message_done && on_message_) {
+                on_message_(message_opcode_, message_);
+            }
+        }
+
+        // The header only stays in the buffer until its first payload bytes are consumed
+        begin_ += header_length_ + length;
+        header_length_ = 0;
+        if (frame_done) {
+            in_payload_ = false;
+            fragmented_ = !fin_;
+            if (message_done) {
+                message_.clear();
+                streaming_ = false;
+            }
+        }
+        return frame_done;
+    }
+
+    bool fail(const char* reason) {
+        std::cerr << "WebSocket protocol error: " << reason << std::endl;
+        failed_ = true;
+        return false;
+    }
+
+    std::vector<uint8_t> buffer_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+
+    // Current frame
+    bool in_payload_ = false;
+    bool fin_ = false;
+    bool masked_ = false;
+    bool control_ = false;
+    bool direct_ = false;
+    WebSocketOpCode opcode_ = WebSocketOpCode::Binary;
+    uint8_t mask_[4] = {};
+    size_t header_length_ = 0;
+    uint64_t payload_remaining_ = 0;
+    uint64_t payload_offset_ = 0;
+
+    // Current message
+    bool fragmented_ = false;
+    bool streaming_ = false;
+    WebSocketOpCode message_opcode_ = WebSocketOpCode::Binary;
+    std::vector<uint8_t> message_;
+    size_t max_message_size_;
+
+    message_handler on_message_;
+    stream_handler on_stream_;
+    size_t stream_threshold_ = 0;
+    bool failed_ = false;
+};
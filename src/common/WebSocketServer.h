@@ -5,87 +5,375 @@
 
 #include <asio.hpp>
 #include <asio/ssl.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <memory>
+#include <unistd.h>
 
+#include "HttpMessage.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "StaticAssets.h"
+#include "TlsHandshaker.h"
 #include "WebSocketSession.h"
+#include "WebSocketSessionRegistry.h"
 
 using asio::ip::tcp;
 
+// How the server takes connections off the listen queue; tuned for thousands of clients
+// reconnecting at once.
+struct AcceptSettings {
+    int backlog = 4096;                    // listen(2) queue; Linux caps it at net.core.somaxconn
+    size_t acceptors = 1;                  // listening sockets on the port, balanced by SO_REUSEPORT
+    size_t max_accepts_per_wakeup = 64;    // connections drained from the queue per completion
+    std::chrono::milliseconds handshake_timeout{5000};  // TLS plus upgrade request; 0 disables
+};
+
 class WebSocketServer {
 public:
     using new_client_handler = std::function<void(std::shared_ptr<WebSocketSession>)>;
     using message_handler = std::function<void(std::shared_ptr<WebSocketSession>, WebSocketOpCode, const std::string&)>;
+    using span_message_handler = std::function<void(std::shared_ptr<WebSocketSession>, WebSocketOpCode,
+                                                    std::span<const std::byte>)>;
+    using close_handler = std::function<void(std::shared_ptr<WebSocketSession>)>;
 
-    WebSocketServer(asio::io_context& io_context, short port, bool use_ssl = false)
-        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
-          timer_(io_context),
-          ssl_context_(asio::ssl::context::sslv23),
-          use_ssl_(use_ssl) {
-        if (use_ssl_) {
-            configure_ssl();
+    WebSocketServer(asio::io_context& io_context, short port, bool use_ssl = false, const TlsSettings& tls = {},
+                    const AcceptSettings& accept = {})
+        : ssl_context_(asio::ssl::context::sslv23),
+          use_ssl_(use_ssl),
+          accept_settings_(accept) {
+        setup_tls(tls);
+        open_acceptors(io_context, port);
+    }
+
+    // Accepts on listening sockets inherited from a previous process (see release_acceptors()).
+    WebSocketServer(asio::io_context& io_context, const std::vector<int>& listening_fds, bool use_ssl = false,
+                    const TlsSettings& tls = {}, const AcceptSettings& accept = {})
+        : ssl_context_(asio::ssl::context::sslv23),
+          use_ssl_(use_ssl),
+          accept_settings_(accept) {
+        setup_tls(tls);
+        for (int fd : listening_fds) {
+            auto acceptor = std::make_unique<Acceptor>(io_context);
+            acceptor->acceptor.assign(tcp::v4(), fd);
+            acceptor->acceptor.non_blocking(true);
+            acceptors_.push_back(std::move(acceptor));
+        }
+        for (auto& acceptor : acceptors_) {
+            do_accept(*acceptor);
         }
-        do_accept();
     }
 
     void set_message_handler(message_handler handler) {
         message_handler_ = std::move(handler);
     }
 
+    // Zero-copy alternative to set_message_handler: the payload is a view into the session's
+    // receive buffer, valid only during the call. Replaces the message handler when set.
+    void set_span_message_handler(span_message_handler handler) {
+        span_message_handler_ = std::move(handler);
+    }
+
     void set_new_client_handler(new_client_handler handler) {
         new_client_handler_ = std::move(handler);
     }
 
+    // Called when a session's connection ends, after it has left the session registry.
+    void set_close_handler(close_handler handler) {
+        close_handler_ = std::move(handler);
+    }
+
+    // Handles plain HTTP GETs on the WebSocket port. "/metrics" is always answered with the
+    // Prometheus text exposition of Metrics::registry(); everything else goes to this handler,
+    // then to the static directory.
+    void set_http_handler(http_handler handler) {
+        http_handler_ = std::move(handler);
+    }
+
+    // Serves the files below directory for GET and HEAD requests no other handler takes. The
+    // files are loaded now, so changes on disk need a restart. Returns false if the directory
+    // cannot be read.
+    bool set_static_directory(const std::string& directory, const StaticAssets::Options& options = {}) {
+        auto assets = std::make_shared<StaticAssets>(options);
+        if (!assets->load(directory)) {
+            return false;
+        }
+        std::cout << "Serving " << assets->size() << " static files from " << directory << " ("
+                  << assets->cachedBytes() << " bytes cached)" << std::endl;
+        static_assets_ = std::move(assets);
+        return true;
+    }
+
+    // Applied to sessions accepted from now on.
+    void set_send_policy(const WebSocketSession::SendPolicy& policy) {
+        send_policy_ = policy;
+    }
+
+    // On the io_context thread only; see WebSocketSessionRegistry::broadcast().
     void broadcast(const std::string& message, WebSocketOpCode opcode = WebSocketOpCode::Text) {
-        for (auto& session : sessions_) {
-            session->send(message, opcode);
+        sessions_.broadcast({reinterpret_cast<const uint8_t*>(message.data()), message.size()}, opcode);
+    }
+
+    WebSocketSessionRegistry& sessions() { return sessions_; }
+
+    // The port actually listened on, for servers created with port 0.
+    unsigned short port() const { return acceptors_.front()->acceptor.local_endpoint().port(); }
+
+    // Stops accepting and returns duplicates of the listening sockets for a successor process.
+    // Connections still in the listen queue stay there for it.
+    std::vector<int> release_acceptors() {
+        std::vector<int> fds;
+        for (auto& acceptor : acceptors_) {
+            int fd = ::dup(acceptor->acceptor.native_handle());
+            if (fd < 0) {
+                std::cerr << "Failed to duplicate listening socket: " << std::strerror(errno) << "\n";
+            } else {
+                fds.push_back(fd);
+            }
+            std::error_code ignored;
+            acceptor->retry_timer.cancel();
+            acceptor->acceptor.close(ignored);
+        }
+        return fds;
+    }
+
+    // Takes back listening sockets release_acceptors() gave up, when the successor did not take
+    // them over. Closed acceptors are reused, as their aborted accepts may still hold them.
+    void resume_acceptors(asio::io_context& io_context, const std::vector<int>& listening_fds) {
+        size_t next = 0;
+        for (int fd : listening_fds) {
+            while (next < acceptors_.size() && acceptors_[next]->acceptor.is_open()) {
+                ++next;
+            }
+            if (next == acceptors_.size()) {
+                acceptors_.push_back(std::make_unique<Acceptor>(io_context));
+            }
+            Acceptor& acceptor = *acceptors_[next++];
+            std::error_code ec;
+            acceptor.acceptor.assign(tcp::v4(), fd, ec);
+            if (!ec) {
+                acceptor.acceptor.non_blocking(true, ec);
+            }
+            if (ec) {
+                std::cerr << "Failed to resume listening socket: " << ec.message() << "\n";
+                std::error_code ignored;
+                acceptor.acceptor.close(ignored);
+                ::close(fd);
+                continue;
+            }
+            do_accept(acceptor);
+        }
+    }
+
+    // Hands every upgraded plain (or kernel TLS) session over, see WebSocketSession::release();
+    // done gets the handovers once the last one is in. Sessions that cannot move are asked to
+    // reconnect with 1012 (service restart); requests still being served are left to finish.
+    void release_sessions(std::function<void(std::vector<WebSocketSession::Handover>)> done) {
+        struct Collector {
+            std::vector<WebSocketSession::Handover> handovers;
+            size_t pending = 1;  // released below, so done runs once even with no sessions
+            std::function<void(std::vector<WebSocketSession::Handover>)> done;
+
+            void finish_one() {
+                if (--pending == 0) {
+                    done(std::move(handovers));
+                }
+            }
+        };
+        auto collector = std::make_shared<Collector>();
+        collector->done = std::move(done);
+        for (const auto& session : sessions_.snapshot()) {
+            ++collector->pending;
+            bool releasing = session->release([collector](std::optional<WebSocketSession::Handover> handover) {
+                if (handover) {
+                    collector->handovers.push_back(std::move(*handover));
+                }
+                collector->finish_one();
+            });
+            if (!releasing) {
+                session->sendClose(1012);
+                collector->finish_one();
+            }
         }
+        collector->finish_one();
+    }
+
+    // Resumes a session released by a previous process; it goes through the new client handler
+    // like a freshly upgraded one.
+    void resume_session(asio::io_context& io_context, WebSocketSession::Handover handover) {
+        tcp::socket socket(io_context);
+        std::error_code ec;
+        socket.assign(tcp::v4(), handover.fd, ec);
+        if (ec) {
+            std::cerr << "Failed to resume session " << handover.uuid << ": " << ec.message() << "\n";
+            ::close(handover.fd);
+            return;
+        }
+        start_session(std::make_shared<WebSocketSession>(std::move(socket), std::move(handover)));
     }
 
 private:
-    void configure_ssl() {
-        ssl_context_.set_options(
-            asio::ssl::context::default_workarounds
-            | asio::ssl::context::no_sslv2
-            | asio::ssl::context::single_dh_use);
-        ssl_context_.use_certificate_chain_file("/etc/letsencrypt/live/holistic-games.com/fullchain.pem");
-        ssl_context_.use_private_key_file("/etc/letsencrypt/live/holistic-games.com/privkey.pem", asio::ssl::context::pem);
-        ssl_context_.use_tmp_dh_file("dh2048.pem");
-    }
-
-    void do_accept() {
-        acceptor_.async_accept(
-            [this](std::error_code ec, tcp::socket socket) {
-                if (!ec) {
-                    std::shared_ptr<WebSocketSession> session;
-                    if (use_ssl_) {
-                        session = std::make_shared<WebSocketSession>(std::move(socket), ssl_context_);
-                    } else {
-                        session = std::make_shared<WebSocketSession>(std::move(socket));
-                    }
+    void setup_tls(const TlsSettings& tls) {
+        if (use_ssl_) {
+            TlsHandshaker::configure(ssl_context_, tls);
+            tls_handshaker_ = std::make_unique<TlsHandshaker>(tls.handshake_threads, accept_settings_.handshake_timeout);
+        }
+    }
 
-                    if (new_client_handler_) {
-                        new_client_handler_(session);
+    bool handle_http(const HttpRequest& request, HttpResponse& response) {
+        if (request.method == "GET" && request.target == "/metrics") {
+            response.headers.emplace_back("Content-Type", "text/plain; version=0.0.4");
+            response.body = Metrics::registry().render();
+            return true;
+        }
+        if (http_handler_ && http_handler_(request, response)) {
+            return true;
+        }
+        return static_assets_ && static_assets_->serve(request, response);
+    }
+
+    struct Acceptor {
+        explicit Acceptor(asio::io_context& io_context) : acceptor(io_context), retry_timer(io_context) {}
+
+        tcp::acceptor acceptor;
+        asio::steady_timer retry_timer;
+    };
+
+    // Extra acceptors need SO_REUSEPORT; without it the server listens on one socket.
+    void open_acceptors(asio::io_context& io_context, short port) {
+        size_t count = std::max<size_t>(accept_settings_.acceptors, 1);
+#if !defined(SO_REUSEPORT)
+        count = 1;
+#endif
+        tcp::endpoint endpoint(tcp::v4(), port);
+        for (size_t i = 0; i < count; ++i) {
+            auto acceptor = std::make_unique<Acceptor>(io_context);
+            acceptor->acceptor.open(endpoint.protocol());
+            acceptor->acceptor.set_option(tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+            if (count > 1) {
+                acceptor->acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+            }
+#endif
+            acceptor->acceptor.bind(endpoint);
+            acceptor->acceptor.listen(accept_settings_.backlog);
+            // Lets the drain loop's synchronous accept() return would_block instead of waiting
+            acceptor->acceptor.non_blocking(true);
+            if (i == 0) {
+                // Port 0 picks a free port; the other acceptors must share that one
+                endpoint = acceptor->acceptor.local_endpoint();
+            }
+            acceptors_.push_back(std::move(acceptor));
+        }
+        for (auto& acceptor : acceptors_) {
+            do_accept(*acceptor);
+        }
+    }
+
+    // One completion per wakeup, then whatever else is already queued, so a reconnect storm
+    // does not cost a trip through the reactor per connection.
+    void do_accept(Acceptor& acceptor) {
+        acceptor.acceptor.async_accept(
+            [this, &acceptor](std::error_code ec, tcp::socket socket) {
+                if (ec) {
+                    if (ec == asio::error::operation_aborted) {
+                        return;
                     }
-                    session->setMessageHandler([this, session](WebSocketOpCode opcode, const std::string& message) {
-                        if (session && message_handler_) {
-                            message_handler_(session, opcode, message);
+                    // Typically out of descriptors: back off instead of spinning on the error
+                    LOG_ERROR_LIMITED("Accept error: %s", ec.message());
+                    acceptor.retry_timer.expires_after(ACCEPT_RETRY_DELAY);
+                    acceptor.retry_timer.async_wait([this, &acceptor](std::error_code timer_ec) {
+                        if (!timer_ec) {
+                            do_accept(acceptor);
                         }
                     });
-                    sessions_.push_back(session);
-                    session->start();
+                    return;
+                }
+                on_accept(std::move(socket));
+                for (size_t i = 1; i < accept_settings_.max_accepts_per_wakeup; ++i) {
+                    std::error_code drain_ec;
+                    tcp::socket next = acceptor.acceptor.accept(drain_ec);
+                    if (drain_ec) {
+                        break;
+                    }
+                    on_accept(std::move(next));
                 }
-                do_accept();
+                do_accept(acceptor);
             });
     }
 
-    tcp::acceptor acceptor_;
-    asio::steady_timer timer_;
+    void on_accept(tcp::socket socket) {
+        VoiceMetrics::get().websocket_accepted.inc();
+        if (use_ssl_) {
+            tls_handshaker_->handshake(std::move(socket), ssl_context_.native_handle(),
+                [this](tcp::socket established, SSL* ssl) {
+                    // Without an SSL object the kernel handles TLS and the socket carries plaintext
+                    start_session(ssl ? std::make_shared<WebSocketSession>(std::move(established), ssl)
+                                      : std::make_shared<WebSocketSession>(std::move(established)));
+                });
+        } else {
+            start_session(std::make_shared<WebSocketSession>(std::move(socket)));
+        }
+    }
+
+    void start_session(const std::shared_ptr<WebSocketSession>& session) {
+        session->setSendPolicy(send_policy_);
+        session->setHandshakeTimeout(accept_settings_.handshake_timeout);
+        // Handlers must not own the session, or session and handlers keep each other alive
+        std::weak_ptr<WebSocketSession> weak_session = session;
+        session->setOpenHandler([this, weak_session]() {
+            auto opened = weak_session.lock();
+            if (opened && new_client_handler_) {
+                new_client_handler_(opened);
+            }
+        });
+        session->setHttpHandler([this](const HttpRequest& request, HttpResponse& response) {
+            return handle_http(request, response);
+        });
+        session->setMessageHandler([this, weak_session](WebSocketOpCode opcode, const std::string& message) {
+            auto receiver = weak_session.lock();
+            if (receiver && message_handler_) {
+                message_handler_(receiver, opcode, message);
+            }
+        });
+        if (span_message_handler_) {
+            session->setSpanMessageHandler(
+                [this, weak_session](WebSocketOpCode opcode, std::span<const std::byte> payload) {
+                    if (auto receiver = weak_session.lock()) {
+                        span_message_handler_(receiver, opcode, payload);
+                    }
+                });
+        }
+        session->setCloseHandler([this, weak_session]() {
+            if (auto closed = weak_session.lock()) {
+                sessions_.remove(closed->getUuid());
+                if (close_handler_) {
+                    close_handler_(closed);
+                }
+            }
+        });
+        sessions_.add(session);
+        session->start();
+    }
+
+    static constexpr auto ACCEPT_RETRY_DELAY = std::chrono::milliseconds(100);
+
     asio::ssl::context ssl_context_;
     bool use_ssl_;
+    AcceptSettings accept_settings_;
+    std::vector<std::unique_ptr<Acceptor>> acceptors_;
+    std::unique_ptr<TlsHandshaker> tls_handshaker_;
     message_handler message_handler_;
+    span_message_handler span_message_handler_;
     new_client_handler new_client_handler_;
-    std::vector<std::shared_ptr<WebSocketSession>> sessions_;
+    http_handler http_handler_;
+    std::shared_ptr<const StaticAssets> static_assets_;
+    WebSocketSession::SendPolicy send_policy_;
+    close_handler close_handler_;
+    WebSocketSessionRegistry sessions_;
 };
\ No newline at end of file
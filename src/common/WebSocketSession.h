@@ -4,41 +4,109 @@
 #pragma once
 #include <asio.hpp>
 #include <asio/ssl.hpp>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
 #include <deque>
-#include "sha1.hpp"
-#include <thread>
+#include <fstream>
 #include <iostream>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include "HttpMessage.h"
+#include "Logger.h"
 #include "Utilities.h"
+#include "VoiceMetrics.h"
+#include "WebSocketFrameParser.h"
+
+#if defined(__linux__)
+#define WEBSOCKET_SENDFILE 1
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#else
+#define WEBSOCKET_SENDFILE 0
+#endif
 
 using asio::ip::tcp;
 
-enum class WebSocketOpCode : uint8_t {
-    Continuation = 0x0,
-    Text = 0x1,
-    Binary = 0x2,
-    Close = 0x8,
-    Ping = 0x9,
-    Pong = 0xA
-};
-
-
 class WebSocketSession : public std::enable_shared_from_this<WebSocketSession> {
 public:
     using message_handler = std::function<void(WebSocketOpCode, const std::string&)>;
+    // Receives the payload in place in the receive buffer; it is only valid during the call.
+    using span_message_handler = std::function<void(WebSocketOpCode, std::span<const std::byte>)>;
+    using open_handler = std::function<void()>;
+    using close_handler = std::function<void()>;
+    using stream_handler = WebSocketFrameParser::stream_handler;
+
+    // An upgraded connection given up by one process for another to resume (see release()).
+    struct Handover {
+        int fd = -1;  // a duplicate, owned by whoever holds the handover
+        std::string uuid;
+        std::string request_target;
+        std::vector<uint8_t> unparsed;  // received bytes the parser had not consumed
+    };
+    using release_handler = std::function<void(std::optional<Handover>)>;
 
     WebSocketSession(tcp::socket socket)
-        : socket_(std::move(socket)), ssl_socket_(nullptr), use_ssl_(false), uuid(Utilities::generateUuid()) {}
+        : socket_(std::move(socket)), ssl_socket_(nullptr), use_ssl_(false), uuid(Utilities::generateUuid()) {
+        init_parser();
+    }
 
     WebSocketSession(tcp::socket socket, asio::ssl::context& ssl_context)
         : socket_(std::move(socket)),
           ssl_socket_(new asio::ssl::stream<tcp::socket>(std::move(socket_), ssl_context)),
           use_ssl_(true),
-          uuid(Utilities::generateUuid()) {}
+          uuid(Utilities::generateUuid()) {
+        init_parser();
+    }
+
+    // Wraps a connection whose TLS handshake is already done (see TlsHandshaker); takes ownership of ssl.
+    WebSocketSession(tcp::socket socket, SSL* ssl)
+        : socket_(std::move(socket)),
+          ssl_socket_(new asio::ssl::stream<tcp::socket>(std::move(socket_), ssl)),
+          use_ssl_(true),
+          tls_established_(true),
+          uuid(Utilities::generateUuid()) {
+        init_parser();
+    }
+
+    // Continues a connection another process released: start() skips the upgrade, runs the open
+    // handler and parses the bytes that were left over before reading on.
+    WebSocketSession(tcp::socket socket, Handover handover)
+        : socket_(std::move(socket)),
+          ssl_socket_(nullptr),
+          use_ssl_(false),
+          uuid(std::move(handover.uuid)),
+          request_target_(std::move(handover.request_target)),
+          resumed_bytes_(std::move(handover.unparsed)),
+          resumed_(true) {
+        init_parser();
+    }
+
+    ~WebSocketSession() {
+        VoiceMetrics::get().websocket_write_queue.add(-static_cast<int64_t>(write_queue_.size() + writing_.size()));
+    }
 
     void start() {
-        if (use_ssl_) {
+        if (resumed_) {
+            resume();
+            return;
+        }
+        if (handshake_timeout_.count() > 0) {
+            handshake_timer_.emplace(lowest_layer().get_executor());
+            handshake_timer_->expires_after(handshake_timeout_);
+            handshake_timer_->async_wait([this, self = shared_from_this()](std::error_code ec) {
+                if (!ec && !closed_) {
+                    VoiceMetrics::get().websocket_handshake_timeouts.inc();
+                    close();
+                }
+            });
+        }
+        if (use_ssl_ && !tls_established_) {
             do_ssl_handshake();
         } else {
             do_handshake();
@@ -49,20 +117,187 @@ public:
         on_message_ = msg_handler;
     }
 
-    void send(const std::vector<uint8_t>& message, WebSocketOpCode opcode = WebSocketOpCode::Binary) {
-        auto frame = create_websocket_frame(message, opcode);
-        bool write_in_progress = !write_queue_.empty();
-        write_queue_.push_back(std::make_shared<std::vector<uint8_t>>(std::move(frame)));
-        if (!write_in_progress) {
+    // Takes precedence over the message handler and avoids copying the payload into a string.
+    void setSpanMessageHandler(const span_message_handler &handler) {
+        on_span_message_ = handler;
+    }
+
+    // Called once the upgrade handshake has completed and the session can send.
+    void setOpenHandler(const open_handler &handler) {
+        on_open_ = handler;
+    }
+
+    // Delivers fragmented messages and frames above threshold bytes in chunks instead of
+    // assembling them; set it from the open handler, before the first read.
+    void setStreamHandler(const stream_handler &handler, size_t threshold) {
+        parser_.setStreamHandler(handler, threshold);
+    }
+
+    // Called once when the connection ends, whichever side closed it.
+    void setCloseHandler(const close_handler &handler) {
+        on_close_ = handler;
+    }
+
+    // Serves requests without a WebSocket upgrade; the connection is closed after the response.
+    void setHttpHandler(const http_handler &handler) {
+        on_http_ = handler;
+    }
+
+    // A frame encoded once and shared by every session it is sent to.
+    struct EncodedFrame {
+        std::vector<uint8_t> bytes;
+        size_t payload_size;
+        WebSocketOpCode opcode;
+    };
+    using shared_frame = std::shared_ptr<const EncodedFrame>;
+
+    static shared_frame encode(std::span<const uint8_t> message, WebSocketOpCode opcode) {
+        return std::make_shared<const EncodedFrame>(
+            EncodedFrame{create_websocket_frame(message, opcode), message.size(), opcode});
+    }
+
+    // on_sent, if set, runs once the frame has been written to the socket. Binary frames carry
+    // real-time audio and may be dropped under the send policy; other frames are always sent.
+    // Frames sent before the upgrade completed are dropped: the connection may still be in its
+    // TLS or HTTP handshake, or be serving a plain HTTP response.
+    void send(const shared_frame& frame, std::function<void()> on_sent = {}) {
+        if (closed_ || releasing_ || !upgraded_) {
+            return;
+        }
+        auto& metrics = VoiceMetrics::get();
+        metrics.websocket.packets_out.inc();
+        metrics.websocket.bytes_out.inc(frame->payload_size);
+        metrics.websocket_write_queue.add(1);
+        auto now = std::chrono::steady_clock::now();
+        queued_bytes_ += frame->bytes.size();
+        write_queue_.push_back({frame, std::move(on_sent), frame->opcode == WebSocketOpCode::Binary, now});
+        enforce_send_policy(now);
+        if (writing_.empty()) {
             do_write();
         }
     }
 
+    void send(std::span<const uint8_t> message, WebSocketOpCode opcode = WebSocketOpCode::Binary,
+              std::function<void()> on_sent = {}) {
+        send(encode(message, opcode), std::move(on_sent));
+    }
+
     void send(const std::string& message, WebSocketOpCode opcode = WebSocketOpCode::Text) {
-        send(std::vector<uint8_t>(message.begin(), message.end()), opcode);
+        send({reinterpret_cast<const uint8_t*>(message.data()), message.size()}, opcode);
+    }
+
+    const std::string& getUuid() const { return uuid; }
+
+    // Ends the connection without a closing handshake, e.g. when the peer stopped answering
+    // pings. Idempotent; the close handler runs on the first call.
+    void close() {
+        if (closed_) {
+            return;
+        }
+        std::error_code ignored;
+        lowest_layer().shutdown(tcp::socket::shutdown_both, ignored);
+        finish(std::nullopt);
+    }
+
+    // Starts the closing handshake with status, e.g. 1012 (service restart) to make clients
+    // reconnect, and closes once the frame is out. Only for upgraded sessions.
+    void sendClose(uint16_t status) {
+        if (!upgraded_ || closed_) {
+            return;
+        }
+        const uint8_t payload[2] = {static_cast<uint8_t>(status >> 8), static_cast<uint8_t>(status & 0xFF)};
+        send(payload, WebSocketOpCode::Close, [this, self = shared_from_this()]() { close(); });
+    }
+
+    // Gives the connection up so that another process can resume it from a Handover. Queued
+    // audio is dropped, a write in progress is let finish so no frame is cut short, then the
+    // pending read is cancelled. done receives the handover, or nullopt if a message was only
+    // partly received; that session is closed with 1012 instead. Either way the session ends
+    // here, without touching the connection, and the close handler runs.
+    //
+    // Returns false, without calling done, if the session cannot be handed over: TLS in user
+    // space (kernel TLS sessions can), or no upgrade yet.
+    bool release(release_handler done) {
+        if (closed_ || releasing_ || !upgraded_ || use_ssl_) {
+            return false;
+        }
+        releasing_ = true;
+        on_released_ = std::move(done);
+        VoiceMetrics::get().websocket_write_queue.add(-static_cast<int64_t>(write_queue_.size()));
+        write_queue_.clear();
+        queued_bytes_ = 0;
+        if (writing_.empty()) {
+            std::error_code ignored;
+            socket_.cancel(ignored);
+        }
+        // Otherwise the write's completion cancels the read
+        return true;
+    }
+
+    // Limits on frames waiting behind the one being written. When a client falls behind,
+    // the oldest audio frames are dropped so it hears current audio instead of seconds-old audio.
+    struct SendPolicy {
+        size_t max_queued_bytes = 256 * 1024;
+        std::chrono::milliseconds max_queue_age{500};
+    };
+
+    void setSendPolicy(const SendPolicy& policy) {
+        send_policy_ = policy;
+    }
+
+    // Time from start() until the request (upgrade or plain HTTP) must have been read,
+    // TLS handshake included; the connection is closed when it runs out. Zero disables it.
+    void setHandshakeTimeout(std::chrono::milliseconds timeout) {
+        handshake_timeout_ = timeout;
     }
 
-    std::string getUuid() { return uuid; }
+    [[nodiscard]] uint64_t getDroppedFrames() const { return dropped_frames_; }
+
+    [[nodiscard]] uint64_t getDroppedBytes() const { return dropped_bytes_; }
+
+    // Request target of the upgrade request, e.g. "/?room=lobby". Empty before the handshake.
+    const std::string& getRequestTarget() const { return request_target_; }
+
+    // Sec-WebSocket-Accept for a client key; empty if the key is implausibly long. Hashes on the
+    // stack with OpenSSL's SHA-1, so the only allocation is the returned string.
+    static std::string generate_websocket_accept(std::string_view key) {
+        static constexpr std::string_view GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        char input[128];
+        if (key.size() > sizeof(input) - GUID.size()) {
+            return "";
+        }
+        std::memcpy(input, key.data(), key.size());
+        std::memcpy(input + key.size(), GUID.data(), GUID.size());
+
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        SHA1(reinterpret_cast<const unsigned char*>(input), key.size() + GUID.size(), digest);
+
+        unsigned char encoded[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+        int length = EVP_EncodeBlock(encoded, digest, SHA_DIGEST_LENGTH);
+        return {reinterpret_cast<const char*>(encoded), static_cast<size_t>(length)};
+    }
+
+    static std::vector<uint8_t> create_websocket_frame(std::span<const uint8_t> message, WebSocketOpCode opcode) {
+        std::vector<uint8_t> frame;
+        frame.reserve(message.size() + 10);
+        frame.push_back(0x80 | static_cast<uint8_t>(opcode));  // FIN bit set, opcode
+
+        if (message.size() <= 125) {
+            frame.push_back(message.size());
+        } else if (message.size() <= 65535) {
+            frame.push_back(126);
+            frame.push_back((message.size() >> 8) & 0xFF);
+            frame.push_back(message.size() & 0xFF);
+        } else {
+            frame.push_back(127);
+            for (int i = 7; i >= 0; --i) {
+                frame.push_back((message.size() >> (i * 8)) & 0xFF);
+            }
+        }
+
+        frame.insert(frame.end(), message.begin(), message.end());
+        return frame;
+    }
 
 private:
     void do_ssl_handshake() {
@@ -73,6 +308,7 @@ private:
                     do_handshake();
                 } else {
                     std::cerr << "SSL handshake error: " << ec.message() << "\n";
+                    close();
                 }
             });
     }
@@ -85,14 +321,28 @@ private:
                     std::string request(asio::buffers_begin(buffer_.data()),
                                         asio::buffers_begin(buffer_.data()) + length);
                     buffer_.consume(length);
+                    if (handshake_timer_) {
+                        handshake_timer_->cancel();
+                    }
 
                     std::string key = extract_websocket_key(request);
                     if (key.empty()) {
-                        std::cerr << "Invalid WebSocket handshake request\n";
+                        if (on_http_) {
+                            respond_http(HttpRequest::parse(request));
+                        } else {
+                            std::cerr << "Invalid WebSocket handshake request\n";
+                            close();
+                        }
                         return;
                     }
 
+                    request_target_ = extract_request_target(request);
                     std::string accept = generate_websocket_accept(key);
+                    if (accept.empty()) {
+                        std::cerr << "Invalid Sec-WebSocket-Key\n";
+                        close();
+                        return;
+                    }
 
                     std::string response = "HTTP/1.1 101 Switching Protocols\r\n"
                                            "Upgrade: websocket\r\n"
@@ -103,131 +353,363 @@ private:
                     async_write(asio::buffer(*msg),
                         [this, msg, self](std::error_code ec, std::size_t /*length*/) {
                             if (!ec) {
+                                upgraded_ = true;
+                                VoiceMetrics::get().websocket_handshakes.inc();
+                                if (on_open_) {
+                                    on_open_();
+                                }
+                                // Frames the client sent right behind the upgrade request
+                                if (!parse_received(buffer_)) {
+                                    return;
+                                }
                                 do_read();
                             } else {
                                 std::cerr << "Handshake write error: " << ec.message() << "\n";
+                                close();
                             }
                         });
+                } else if (ec == asio::error::not_found) {  // The head outgrew MAX_REQUEST_HEAD
+                    if (handshake_timer_) {
+                        handshake_timer_->cancel();
+                    }
+                    auto response = std::make_shared<HttpResponse>(HttpResponse::headersTooLarge());
+                    auto head = std::make_shared<std::string>(response->serializeHead());
+                    std::array<asio::const_buffer, 2> buffers = {asio::buffer(*head), asio::buffer(response->body)};
+                    async_write(buffers, [this, self, head, response](std::error_code, std::size_t) {
+                        close();
+                    });
                 } else {
-                    std::cerr << "Handshake read error: " << ec.message() << "\n";
+                    if (ec != asio::error::operation_aborted) {  // Aborted: the handshake timed out
+                        std::cerr << "Handshake read error: " << ec.message() << "\n";
+                    }
+                    close();
                 }
             });
     }
 
-    void do_read() {
+    void respond_http(const HttpRequest& request) {
         auto self(shared_from_this());
-        read_buffer_ = std::make_shared<std::vector<uint8_t>>();
-        read_buffer_->resize(65536);
-        async_read_some(asio::buffer(*read_buffer_),
-            [this, self](std::error_code ec, std::size_t length) {
-                if (!ec) {
-                    handle_frame(*read_buffer_, length);
-                    do_read();
-                } else {
-                    std::cerr << "Read error: " << ec.message() << "\n";
-                }
-            });
+        auto response = std::make_shared<HttpResponse>();
+        if (!on_http_(request, *response)) {
+            *response = HttpResponse::notFound();
+        }
+        bool send_file = !response->file_path.empty() && !response->head_only;
+        std::shared_ptr<std::ifstream> stream;
+        if (send_file && (use_ssl_ || !WEBSOCKET_SENDFILE)) {
+            send_file = false;
+            stream = open_file_body(*response);
+            if (!stream) {
+                *response = HttpResponse::notFound();
+            }
+        }
+        auto head = std::make_shared<std::string>(response->serializeHead());
+        std::array<asio::const_buffer, 2> buffers = {asio::buffer(*head), asio::buffer(response->bodyData())};
+        if (response->head_only || !response->file_path.empty()) {
+            buffers[1] = asio::const_buffer();
+        }
+        async_write(buffers, [this, self, head, response, send_file, stream](std::error_code ec, std::size_t /*length*/) {
+            if (ec) {
+                std::cerr << "HTTP response write error: " << ec.message() << "\n";
+            } else if (send_file) {
+                send_file_body(response);
+                return;
+            } else if (stream) {
+                stream_file_chunk(stream, std::make_shared<std::vector<char>>(FILE_CHUNK_SIZE), response->file_size);
+                return;
+            }
+            close();
+        });
     }
 
-    void do_write() {
-        auto self(shared_from_this());
-        if (!write_queue_.empty()) {
-            async_write(asio::buffer(*write_queue_.front()),
-                [this, self](std::error_code ec, std::size_t /*length*/) {
-                    if (!ec) {
-                        write_queue_.pop_front();
-                        if (!write_queue_.empty()) {
-                            do_write();
-                        }
-                    } else {
-                        std::cerr << "Write error: " << ec.message() << "\n";
-                    }
-                });
+    // TLS in user space has to see the plaintext, so the file is read instead of sent. Also the
+    // fallback where sendfile(2) is not available.
+    static std::shared_ptr<std::ifstream> open_file_body(const HttpResponse& response) {
+        auto file = std::make_shared<std::ifstream>(response.file_path, std::ios::binary);
+        if (!file->is_open()) {
+            std::cerr << "Failed to open " << response.file_path << "\n";
+            return nullptr;
         }
+        return file;
     }
 
-    void do_write_frame() {
+    // One FILE_CHUNK_SIZE read and write at a time, so a large file neither stalls the
+    // io_context thread nor takes its size in memory per download.
+    void stream_file_chunk(const std::shared_ptr<std::ifstream>& file, const std::shared_ptr<std::vector<char>>& chunk,
+                           size_t remaining) {
+        if (remaining == 0) {
+            close();
+            return;
+        }
+        size_t count = std::min(remaining, chunk->size());
+        file->read(chunk->data(), static_cast<std::streamsize>(count));
+        if (static_cast<size_t>(file->gcount()) != count) {  // The file shrank since startup
+            std::cerr << "Static file read error\n";
+            close();
+            return;
+        }
         auto self(shared_from_this());
-        std::shared_ptr<std::vector<unsigned char>> msg = write_queue_.front();
-        asio::async_write(socket_, asio::buffer(*msg),
-            [this, msg, self](std::error_code ec, std::size_t /*length*/) {
-                if (!ec) {
-                    write_queue_.pop_front();
-                    if (!write_queue_.empty()) {
-                        do_write_frame();
-                    } else {
-                        std::this_thread::sleep_for(std::chrono::seconds(1));
-                        do_write();  // Schedule next message
-                    }
-                } else {
-                    std::cerr << "Write error: " << ec.message() << "\n";
+        async_write(asio::buffer(chunk->data(), count),
+            [this, self, file, chunk, remaining, count](std::error_code ec, std::size_t /*length*/) {
+                if (ec) {
+                    std::cerr << "HTTP response write error: " << ec.message() << "\n";
+                    close();
+                    return;
                 }
+                stream_file_chunk(file, chunk, remaining - count);
             });
     }
 
+#if WEBSOCKET_SENDFILE
+    // Plain TCP (or kernel TLS): the kernel copies the file straight to the socket.
+    void send_file_body(const std::shared_ptr<HttpResponse>& response) {
+        int fd = ::open(response->file_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Failed to open " << response->file_path << ": " << std::strerror(errno) << "\n";
+            close();
+            return;
+        }
+        socket_.native_non_blocking(true);
+        auto file = std::shared_ptr<int>(new int(fd), [](int* descriptor) {
+            ::close(*descriptor);
+            delete descriptor;
+        });
+        send_file_chunk(file, 0, response->file_size);
+    }
 
-        void handle_frame(const std::vector<unsigned char>& buffer, std::size_t length) {
-        if (length < 2) return;
-
-        bool fin = (buffer[0] & 0x80) != 0;
-        WebSocketOpCode opcode = static_cast<WebSocketOpCode>(buffer[0] & 0x0F);
-        bool masked = (buffer[1] & 0x80) != 0;
-        uint64_t payload_length = buffer[1] & 0x7F;
-        size_t header_length = 2;
-
-        // Handle different payload length scenarios
-        if (payload_length == 126) {
-            if (length < 4) return;
-            payload_length = (static_cast<uint16_t>(buffer[2]) << 8) | buffer[3];
-            header_length += 2;
-        } else if (payload_length == 127) {
-            if (length < 10) return;
-            payload_length = 0;
-            for (int i = 0; i < 8; ++i) {
-                payload_length = (payload_length << 8) | buffer[2 + i];
+    void send_file_chunk(const std::shared_ptr<int>& file, off_t offset, size_t remaining) {
+        while (remaining > 0) {
+            ssize_t sent = ::sendfile(socket_.native_handle(), *file, &offset, remaining);
+            if (sent > 0) {
+                remaining -= static_cast<size_t>(sent);
+                continue;
             }
-            header_length += 8;
+            if (sent < 0 && (errno == EAGAIN || errno == EINTR)) {
+                auto self(shared_from_this());
+                socket_.async_wait(tcp::socket::wait_write,
+                    [this, self, file, offset, remaining](std::error_code ec) {
+                        if (ec) {
+                            close();
+                            return;
+                        }
+                        send_file_chunk(file, offset, remaining);
+                    });
+                return;
+            }
+            // The file shrank since startup, or the peer went away
+            if (sent < 0) {
+                std::cerr << "sendfile error: " << std::strerror(errno) << "\n";
+            }
+            break;
+        }
+        close();
+    }
+#else
+    void send_file_body(const std::shared_ptr<HttpResponse>& /*response*/) {
+        close();
+    }
+#endif
+
+    tcp::socket& lowest_layer() {
+        return use_ssl_ ? ssl_socket_->next_layer() : socket_;
+    }
 
-            // Check for protocol violation: payload length exceeds maximum allowed
-            if (payload_length > 0x7FFFFFFFFFFFFFFF) {
-                // Handle error: payload too large
-                std::cerr << "Error: Payload length exceeds maximum allowed by WebSocket protocol." << std::endl;
+    void resume() {
+        upgraded_ = true;
+        if (on_open_) {
+            on_open_();
+        }
+        std::span<const uint8_t> pending = resumed_bytes_;
+        while (!pending.empty()) {
+            auto space = parser_.prepare();
+            size_t length = std::min(space.size(), pending.size());
+            std::memcpy(space.data(), pending.data(), length);
+            pending = pending.subspan(length);
+            if (!parser_.commit(length)) {
+                close();
                 return;
             }
         }
+        resumed_bytes_ = {};
+        do_read();
+    }
 
-        // Sanity check: ensure payload length is reasonable
-        const uint64_t MAX_REASONABLE_PAYLOAD = 1024 * 1024 * 100;  // 100 MB, adjust as needed
-        if (payload_length > MAX_REASONABLE_PAYLOAD) {
-            // Handle error: payload too large
-            std::cerr << "Error: Payload length " << payload_length << " exceeds maximum reasonable size." << std::endl;
+    // Ends the session after release(), once no read or write is in flight.
+    void finish_release(std::error_code ec, std::size_t length) {
+        if (!ec) {
+            parser_.append(length);  // Completed just before the cancel; pass the bytes on
+        }
+        auto unparsed = parser_.unparsed();
+        if (!unparsed) {
+            releasing_ = false;
+            if (on_released_) {
+                std::exchange(on_released_, {})(std::nullopt);
+            }
+            sendClose(1012);
             return;
         }
-
-        // Ensure we have enough data for the full frame
-        if (length < header_length + payload_length) {
-            // Handle error: incomplete frame
-            std::cerr << "Error: Incomplete WebSocket frame." << std::endl;
+        Handover handover{::dup(socket_.native_handle()), uuid, request_target_,
+                          std::vector<uint8_t>(unparsed->begin(), unparsed->end())};
+        if (handover.fd < 0) {
+            std::cerr << "Failed to duplicate session socket: " << std::strerror(errno) << "\n";
+            releasing_ = false;
+            if (on_released_) {
+                std::exchange(on_released_, {})(std::nullopt);
+            }
+            close();
             return;
         }
+        // Closing our descriptor leaves the connection to the duplicate
+        finish(std::move(handover));
+    }
 
-        if (masked) {
-            if (length < header_length + 4) return;
-            std::vector<unsigned char> mask(buffer.begin() + header_length, buffer.begin() + header_length + 4);
-            header_length += 4;
+    void finish(std::optional<Handover> handover) {
+        closed_ = true;
+        if (handshake_timer_) {
+            handshake_timer_->cancel();
+        }
+        std::error_code ignored;
+        lowest_layer().close(ignored);
+        if (on_released_) {
+            std::exchange(on_released_, {})(std::move(handover));
+        }
+        if (on_close_) {
+            on_close_();
+        }
+    }
 
-            std::vector<unsigned char> payload(buffer.begin() + header_length, buffer.begin() + header_length + payload_length);
-            for (size_t i = 0; i < payload.size(); ++i) {
-                payload[i] ^= mask[i % 4];
+    void do_read() {
+        auto self(shared_from_this());
+        auto space = parser_.prepare();
+        async_read_some(asio::buffer(space.data(), space.size()),
+            [this, self](std::error_code ec, std::size_t length) {
+                if (releasing_ && !closed_) {
+                    finish_release(ec, length);
+                    return;
+                }
+                if (!ec) {
+                    if (!parser_.commit(length)) {
+                        close();
+                        return;
+                    }
+                    do_read();
+                } else {
+                    if (ec != asio::error::eof && ec != asio::error::operation_aborted) {
+                        LOG_WARNING_LIMITED("Read error: %s", ec.message());
+                    }
+                    close();
+                }
+            });
+    }
+
+    bool parse_received(asio::streambuf& received) {
+        while (received.size() > 0) {
+            auto space = parser_.prepare();
+            size_t length = asio::buffer_copy(asio::buffer(space.data(), space.size()), received.data());
+            received.consume(length);
+            if (!parser_.commit(length)) {
+                close();
+                return false;
             }
+        }
+        return true;
+    }
 
-            on_message_(opcode, std::string(payload.begin(), payload.end()));
-        } else {
-            std::vector<unsigned char> payload(buffer.begin() + header_length, buffer.begin() + header_length + payload_length);
-            on_message_(opcode, std::string(payload.begin(), payload.end()));
+
+    // Writes everything queued in one gathered write, so a burst of frames costs one syscall.
+    void do_write() {
+        auto self(shared_from_this());
+        if (write_queue_.empty()) {
+            return;
+        }
+        size_t count = std::min(write_queue_.size(), MAX_FRAMES_PER_WRITE);
+        std::vector<asio::const_buffer> buffers;
+        buffers.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            queued_bytes_ -= write_queue_.front().data->bytes.size();
+            writing_.push_back(std::move(write_queue_.front()));
+            write_queue_.pop_front();
+            buffers.emplace_back(asio::buffer(writing_.back().data->bytes));
+        }
+        async_write(buffers,
+            [this, self](std::error_code ec, std::size_t /*length*/) {
+                VoiceMetrics::get().websocket_write_queue.add(-static_cast<int64_t>(writing_.size()));
+                if (!ec) {
+                    for (auto& frame : writing_) {
+                        if (frame.on_sent) {
+                            frame.on_sent();
+                        }
+                    }
+                    writing_.clear();
+                    if (releasing_) {
+                        std::error_code ignored;
+                        socket_.cancel(ignored);
+                        return;
+                    }
+                    do_write();
+                } else {
+                    writing_.clear();
+                    if (ec != asio::error::operation_aborted) {
+                        LOG_WARNING_LIMITED("Write error: %s", ec.message());
+                    }
+                    close();
+                }
+            });
+    }
+
+    // Drops queued audio frames, oldest first, that are past the age limit or exceed the byte
+    // limit. Frames already handed to the socket are never touched.
+    void enforce_send_policy(std::chrono::steady_clock::time_point now) {
+        auto it = write_queue_.begin();
+        while (it != write_queue_.end()) {
+            bool too_old = now - it->enqueued > send_policy_.max_queue_age;
+            bool too_large = queued_bytes_ > send_policy_.max_queued_bytes;
+            if (!too_old && !too_large) {
+                break;
+            }
+            if (!it->droppable) {
+                ++it;
+                continue;
+            }
+            size_t size = it->data->bytes.size();
+            queued_bytes_ -= size;
+            ++dropped_frames_;
+            dropped_bytes_ += size;
+            auto& metrics = VoiceMetrics::get();
+            metrics.websocket_dropped_frames.inc();
+            metrics.websocket_write_queue.add(-1);
+            it = write_queue_.erase(it);
         }
     }
 
+    void init_parser() {
+        parser_.setMessageHandler([this](WebSocketOpCode opcode, std::span<const uint8_t> payload) {
+            auto& metrics = VoiceMetrics::get().websocket;
+            metrics.packets_in.inc();
+            metrics.bytes_in.inc(payload.size());
+            if (opcode == WebSocketOpCode::Ping) {
+                send(payload, WebSocketOpCode::Pong);
+            } else if (opcode == WebSocketOpCode::Close) {
+                // Echo the status code and close once the reply is out
+                send(payload.first(std::min<size_t>(payload.size(), 2)), WebSocketOpCode::Close,
+                     [this, self = shared_from_this()]() { close(); });
+            }
+            if (on_span_message_) {
+                on_span_message_(opcode, std::as_bytes(payload));
+            } else if (on_message_) {
+                on_message_(opcode, std::string(payload.begin(), payload.end()));
+            }
+        });
+    }
+
+    std::string extract_request_target(const std::string& request) {
+        // Request line: "GET <target> HTTP/1.1"
+        auto start = request.find(' ');
+        if (start == std::string::npos) return "";
+        auto end = request.find(' ', start + 1);
+        if (end == std::string::npos) return "";
+        return request.substr(start + 1, end - start - 1);
+    }
+
     std::string extract_websocket_key(const std::string& request) {
         std::string key_header = "Sec-WebSocket-Key: ";
         auto key_pos = request.find(key_header);
@@ -238,38 +720,6 @@ private:
     }
 
 
-    std::string generate_websocket_accept(const std::string& key) {
-        std::string magic_string = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-        std::string concatenated = key + magic_string;
-
-        // Generate SHA1 hash
-        SHA1Custom::SHA1 sha1;
-        sha1.update(concatenated);
-        std::string hash = sha1.final();
-
-        return Base64Utilities::to_base_64(hash);
-    }
-
-    std::vector<uint8_t> create_websocket_frame(const std::vector<uint8_t>& message, WebSocketOpCode opcode) {
-        std::vector<uint8_t> frame;
-        frame.push_back(0x80 | static_cast<uint8_t>(opcode));  // FIN bit set, opcode
-
-        if (message.size() <= 125) {
-            frame.push_back(message.size());
-        } else if (message.size() <= 65535) {
-            frame.push_back(126);
-            frame.push_back((message.size() >> 8) & 0xFF);
-            frame.push_back(message.size() & 0xFF);
-        } else {
-            frame.push_back(127);
-            for (int i = 7; i >= 0; --i) {
-                frame.push_back((message.size() >> (i * 8)) & 0xFF);
-            }
-        }
-
-        frame.insert(frame.end(), message.begin(), message.end());
-        return frame;
-    }
     template<typename AsyncReadStream, typename ReadHandler>
       void async_read_until(AsyncReadStream& s, asio::streambuf& b,
                             const std::string& delim, ReadHandler handler) {
@@ -298,12 +748,44 @@ private:
         }
     }
 
-    std::string uuid;
     tcp::socket socket_;
     std::unique_ptr<asio::ssl::stream<tcp::socket>> ssl_socket_;
     bool use_ssl_;
-    asio::streambuf buffer_;
-    std::shared_ptr<std::vector<uint8_t>> read_buffer_;
-    std::deque<std::shared_ptr<std::vector<uint8_t>>> write_queue_;
+    bool tls_established_ = false;
+    std::string uuid;
+    // The upgrade or HTTP request head is read into it, up to MAX_REQUEST_HEAD, so a client that
+    // never ends its head cannot hold more than that until the handshake deadline
+    asio::streambuf buffer_{MAX_REQUEST_HEAD};
+    WebSocketFrameParser parser_;
+    struct PendingFrame {
+        shared_frame data;
+        std::function<void()> on_sent;
+        bool droppable;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    static constexpr size_t MAX_FRAMES_PER_WRITE = 64;
+    static constexpr size_t MAX_REQUEST_HEAD = 8192;  // as the router accepts
+    static constexpr size_t FILE_CHUNK_SIZE = 64 * 1024;
+
+    std::deque<PendingFrame> write_queue_;
+    std::vector<PendingFrame> writing_;  // frames of the write in progress
+    size_t queued_bytes_ = 0;
+    SendPolicy send_policy_;
+    std::chrono::milliseconds handshake_timeout_{0};
+    std::optional<asio::steady_timer> handshake_timer_;
+    uint64_t dropped_frames_ = 0;
+    uint64_t dropped_bytes_ = 0;
     message_handler on_message_;
+    span_message_handler on_span_message_;
+    open_handler on_open_;
+    close_handler on_close_;
+    bool closed_ = false;
+    http_handler on_http_;
+    std::string request_target_;
+    bool upgraded_ = false;
+    std::vector<uint8_t> resumed_bytes_;
+    bool resumed_ = false;
+    bool releasing_ = false;
+    release_handler on_released_;
 };
@@ -0,0 +1,67 @@
+//
+// Created by maxim on 21.09.2024.
+//
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "WebSocketSession.h"
+
+// Live sessions of a WebSocketServer, keyed by uuid. Sessions are added on accept and removed
+// from their close handler, so the registry never holds dead connections. Sessions that have not
+// finished their upgrade are listed too, but drop whatever is sent to them. All methods but
+// broadcast() may be called from any thread.
+class WebSocketSessionRegistry {
+public:
+    void add(const std::shared_ptr<WebSocketSession>& session) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sessions_[session->getUuid()] = session;
+    }
+
+    void remove(const std::string& uuid) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sessions_.erase(uuid);
+    }
+
+    std::shared_ptr<WebSocketSession> find(const std::string& uuid) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = sessions_.find(uuid);
+        return it != sessions_.end() ? it->second : nullptr;
+    }
+
+    std::vector<std::shared_ptr<WebSocketSession>> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::shared_ptr<WebSocketSession>> sessions;
+        sessions.reserve(sessions_.size());
+        for (const auto& [uuid, session] : sessions_) {
+            sessions.push_back(session);
+        }
+        return sessions;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return sessions_.size();
+    }
+
+    // Frames the message once and queues the same buffer on every session. Sessions only queue
+    // and start writes here, they never call back into the registry, so holding the lock is safe.
+    // WebSocketSession::send() is not thread-safe, so this must run on the thread of the
+    // sessions' io_context, like every other send.
+    void broadcast(std::span<const uint8_t> message, WebSocketOpCode opcode) {
+        auto frame = WebSocketSession::encode(message, opcode);
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& [uuid, session] : sessions_) {
+            session->send(frame);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<WebSocketSession>> sessions_;
+};
@@ -0,0 +1,138 @@
+//
+// Created by maxim on 19.09.2024.
+//
+// Decodes a flight recorder dump into a timeline, all threads merged and sorted by time.
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "FlightRecorder.h"
+
+using namespace FlightRecorder;
+
+struct ThreadEvent {
+    uint32_t thread;
+    Event event;
+};
+
+static std::string formatTime(int64_t unix_ns) {
+    std::time_t seconds = unix_ns / 1000000000;
+    std::tm tm{};
+    gmtime_r(&seconds, &tm);
+    char buffer[64];
+    size_t length = std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &tm);
+    std::snprintf(buffer + length, sizeof(buffer) - length, ".%09lldZ",
+                  static_cast<long long>(unix_ns % 1000000000));
+    return buffer;
+}
+
+static std::string formatDuration(uint64_t ns) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.1fus", static_cast<double>(ns) / 1000.0);
+    return buffer;
+}
+
+static std::string describe(const Event& event, const std::unordered_map<uint64_t, std::string>& labels) {
+    auto name = [&labels](uint64_t id) {
+        auto it = labels.find(id);
+        if (it != labels.end()) {
+            return it->second;
+        }
+        char buffer[24];
+        std::snprintf(buffer, sizeof(buffer), "#%016llx", static_cast<unsigned long long>(id));
+        return std::string(buffer);
+    };
+
+    switch (event.type) {
+        case EventType::PacketReceived:
+            return "client=" + name(event.a) + " bytes=" + std::to_string(event.b);
+        case EventType::TickStarted:
+            return "room=" + name(event.a) + " lateness=" + formatDuration(event.b);
+        case EventType::TickFinished:
+            return "room=" + name(event.a) + " duration=" + formatDuration(event.b);
+        case EventType::TickOverrun:
+            return "room=" + name(event.a) + " over_deadline=" + formatDuration(event.b);
+        case EventType::SendQueued:
+            return "client=" + name(event.a) + " bytes=" + std::to_string(event.b);
+        case EventType::ClientAdded:
+        case EventType::ClientRemoved:
+        case EventType::QueueOverflow:
+            return "room=" + name(event.a) + " client=" + name(event.b);
+        case EventType::Dump:
+            return "reason=" + name(event.a);
+        default:
+            return "a=" + std::to_string(event.a) + " b=" + std::to_string(event.b);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <dump.vcfr>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open " << argv[1] << std::endl;
+        return 1;
+    }
+
+    FileHeader header{};
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file || header.magic != FILE_MAGIC) {
+        std::cerr << "Not a flight recorder dump: " << argv[1] << std::endl;
+        return 1;
+    }
+    if (header.version != FILE_VERSION) {
+        std::cerr << "Unsupported dump version " << header.version << std::endl;
+        return 1;
+    }
+
+    std::unordered_map<uint64_t, std::string> labels;
+    for (uint32_t i = 0; i < header.label_count && file; ++i) {
+        uint64_t id = 0;
+        uint16_t length = 0;
+        file.read(reinterpret_cast<char*>(&id), sizeof(id));
+        file.read(reinterpret_cast<char*>(&length), sizeof(length));
+        std::string name(length, '\0');
+        file.read(name.data(), length);
+        labels[id] = std::move(name);
+    }
+
+    std::vector<ThreadEvent> timeline;
+    for (uint32_t i = 0; i < header.ring_count && file; ++i) {
+        uint32_t thread = 0;
+        uint32_t count = 0;
+        file.read(reinterpret_cast<char*>(&thread), sizeof(thread));
+        file.read(reinterpret_cast<char*>(&count), sizeof(count));
+        std::vector<Event> events(count);
+        file.read(reinterpret_cast<char*>(events.data()), static_cast<std::streamsize>(count * sizeof(Event)));
+        for (const auto& event : events) {
+            timeline.push_back({thread, event});
+        }
+    }
+    if (!file) {
+        std::cerr << "Truncated dump: " << argv[1] << std::endl;
+        return 1;
+    }
+
+    std::stable_sort(timeline.begin(), timeline.end(), [](const ThreadEvent& lhs, const ThreadEvent& rhs) {
+        return lhs.event.timestamp_ns < rhs.event.timestamp_ns;
+    });
+
+    uint64_t previous = timeline.empty() ? 0 : timeline.front().event.timestamp_ns;
+    for (const auto& [thread, event] : timeline) {
+        int64_t unix_ns = static_cast<int64_t>(event.timestamp_ns) + header.realtime_offset_ns;
+        std::printf("%s +%-9s t%-2u %-16s %s\n", formatTime(unix_ns).c_str(),
+                    formatDuration(event.timestamp_ns - previous).c_str(), thread,
+                    eventName(event.type), describe(event, labels).c_str());
+        previous = event.timestamp_ns;
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+//
+// Created by maxim on 23.09.2024.
+//
+#pragma once
+
+#include <asio.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "LoadClient.h"
+#include "LoadStats.h"
+
+// Reconnect storm against the WebSocket port: every worker connects, upgrades, disconnects and
+// starts over as fast as the server lets it, so the completed upgrades in the window measure
+// handshakes per second. Stalled clients connect and never send a byte, like half-open
+// connections after a network blip; the server should reap them at its handshake deadline.
+struct StormStats {
+    uint64_t handshakes = 0;
+    uint64_t errors = 0;
+    std::vector<double> handshake_ms;  // connect until the 101 response is read
+};
+
+class StormWorker : public std::enable_shared_from_this<StormWorker> {
+public:
+    StormWorker(asio::io_context& io_context, const LoadSettings& settings, const LoadWindow& window)
+        : settings_(settings),
+          window_(window),
+          strand_(io_context),
+          socket_(io_context),
+          request_("GET /?room=storm HTTP/1.1\r\n"
+                   "Host: " + settings.server_ip + "\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                   "Sec-WebSocket-Version: 13\r\n"
+                   "\r\n") {}
+
+    void start() {
+        if (load_clock::now() >= window_.end) {
+            return;
+        }
+        auto self(shared_from_this());
+        started_ = load_clock::now();
+        asio::ip::tcp::endpoint endpoint(asio::ip::make_address(settings_.server_ip), settings_.websocket_port);
+        socket_.async_connect(endpoint, strand_.wrap([this, self](std::error_code ec) {
+            if (ec) {
+                restart(true);
+                return;
+            }
+            asio::async_write(socket_, asio::buffer(request_), strand_.wrap([this, self](std::error_code ec, std::size_t) {
+                if (ec) {
+                    restart(true);
+                    return;
+                }
+                asio::async_read_until(socket_, response_, "\r\n\r\n",
+                    strand_.wrap([this, self](std::error_code ec, std::size_t length) {
+                        bool upgraded = !ec && length >= 12 &&
+                            std::string(asio::buffers_begin(response_.data()),
+                                        asio::buffers_begin(response_.data()) + 12) == "HTTP/1.1 101";
+                        if (upgraded && window_.contains(started_)) {
+                            ++stats_.handshakes;
+                            stats_.handshake_ms.push_back(
+                                std::chrono::duration<double, std::milli>(load_clock::now() - started_).count());
+                        }
+                        restart(!upgraded);
+                    }));
+            }));
+        }));
+    }
+
+    [[nodiscard]] const StormStats& stats() const { return stats_; }
+
+private:
+    void restart(bool failed) {
+        if (failed && window_.contains(started_)) {
+            ++stats_.errors;
+        }
+        std::error_code ignored;
+        socket_.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+        socket_.close(ignored);
+        response_.consume(response_.size());
+        start();
+    }
+
+    const LoadSettings& settings_;
+    const LoadWindow& window_;
+    asio::io_context::strand strand_;
+    asio::ip::tcp::socket socket_;
+    std::string request_;
+    asio::streambuf response_;
+    load_clock::time_point started_;
+    StormStats stats_;
+};
+
+class StalledClient : public std::enable_shared_from_this<StalledClient> {
+public:
+    StalledClient(asio::io_context& io_context, const LoadSettings& settings)
+        : settings_(settings), socket_(io_context) {}
+
+    void start() {
+        auto self(shared_from_this());
+        asio::ip::tcp::endpoint endpoint(asio::ip::make_address(settings_.server_ip), settings_.websocket_port);
+        socket_.async_connect(endpoint, [this, self](std::error_code ec) {
+            if (ec) {
+                return;
+            }
+            connected_ = load_clock::now();
+            // Nothing is ever sent; the read only completes when the server gives up on us
+            socket_.async_read_some(asio::buffer(byte_, 1), [this, self](std::error_code, std::size_t) {
+                reaped_ms_ = std::chrono::duration<double, std::milli>(load_clock::now() - connected_).count();
+            });
+        });
+    }
+
+    // Negative while the server still holds the connection.
+    [[nodiscard]] double reaped_ms() const { return reaped_ms_; }
+
+private:
+    const LoadSettings& settings_;
+    asio::ip::tcp::socket socket_;
+    char byte_[1] = {};
+    load_clock::time_point connected_;
+    double reaped_ms_ = -1.0;
+};
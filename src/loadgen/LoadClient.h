@@ -0,0 +1,354 @@
+//
+// Created by maxim on 15.09.2024.
+//
+#pragma once
+
+#include <asio.hpp>
+#include <array>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <RoomProtocol.h>
+
+#include "LoadStats.h"
+
+struct LoadSettings {
+    std::string server_ip = "127.0.0.1";
+    short udp_port = 12345;
+    short websocket_port = 8080;
+    int frame_ms = 20;
+    int sample_rate = 44100;
+    int mix_interval_ms = 20;
+    int probe_interval_ms = 200;
+};
+
+// One simulated participant: sends a frame every frame_ms on an absolute schedule and records
+// what the server delivers back. Transport specifics live in the subclasses.
+class LoadClient : public std::enable_shared_from_this<LoadClient> {
+public:
+    LoadClient(asio::io_context& io_context, const LoadSettings& settings, std::string room,
+               std::shared_ptr<LoadRoom> room_state, bool is_probe, const LoadWindow& window)
+        : settings_(settings),
+          room_(std::move(room)),
+          room_state_(std::move(room_state)),
+          is_probe_(is_probe),
+          window_(window),
+          strand_(io_context),
+          send_timer_(io_context),
+          silence_(static_cast<size_t>(settings.sample_rate) * settings.frame_ms / 1000, 0),
+          probe_(silence_.size(), INT16_MAX) {}
+
+    virtual ~LoadClient() = default;
+
+    virtual void start(load_clock::time_point first_send) = 0;
+
+    [[nodiscard]] const LoadClientStats& stats() const { return stats_; }
+
+protected:
+    virtual void send_frame(const std::vector<int16_t>& frame) = 0;
+
+    void schedule_sends(load_clock::time_point first_send) {
+        next_send_ = first_send;
+        schedule_next_send();
+    }
+
+    void on_audio(const uint8_t* data, size_t size) {
+        auto now = load_clock::now();
+        if (!window_.contains(now)) {
+            last_arrival_ = load_clock::time_point{};
+            return;
+        }
+
+        ++stats_.packets_received;
+        stats_.bytes_received += size;
+        if (last_arrival_ != load_clock::time_point{}) {
+            stats_.inter_arrival_ms.push_back(std::chrono::duration<double, std::milli>(now - last_arrival_).count());
+        }
+        last_arrival_ = now;
+
+        const auto* samples = reinterpret_cast<const int16_t*>(data);
+        bool has_signal = std::any_of(samples, samples + size / sizeof(int16_t), [](int16_t s) { return s != 0; });
+        uint64_t sequence = room_state_->probe_sequence.load(std::memory_order_acquire);
+        if (has_signal && sequence != last_probe_seen_) {
+            last_probe_seen_ = sequence;
+            ++stats_.probes_seen;
+            auto sent_ns = room_state_->probe_sent_ns.load(std::memory_order_relaxed);
+            auto now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+            stats_.latency_ms.push_back(static_cast<double>(now_ns - sent_ns) / 1e6);
+        }
+    }
+
+    void on_error(const std::error_code& ec) {
+        if (ec != asio::error::operation_aborted && stats_.errors++ == 0) {
+            std::cerr << "Load client error (" << room_ << "): " << ec.message() << std::endl;
+        }
+    }
+
+    LoadSettings settings_;
+    std::string room_;
+    std::shared_ptr<LoadRoom> room_state_;
+    bool is_probe_;
+    const LoadWindow& window_;
+    asio::io_context::strand strand_;
+    LoadClientStats stats_;
+
+private:
+    void schedule_next_send() {
+        auto self(shared_from_this());
+        send_timer_.expires_at(next_send_);
+        send_timer_.async_wait(strand_.wrap([this, self](std::error_code ec) {
+            if (ec) {
+                return;
+            }
+            auto now = load_clock::now();
+            bool measuring = window_.contains(now);
+
+            bool probe = false;
+            if (is_probe_ && measuring && now - last_probe_ >= std::chrono::milliseconds(settings_.probe_interval_ms)) {
+                probe = true;
+                last_probe_ = now;
+                ++stats_.probes_sent;
+                auto now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+                room_state_->probe_sent_ns.store(now_ns, std::memory_order_relaxed);
+                room_state_->probe_sequence.fetch_add(1, std::memory_order_release);
+            }
+
+            send_frame(probe ? probe_ : silence_);
+            if (measuring) {
+                ++stats_.frames_sent;
+            }
+
+            next_send_ += std::chrono::milliseconds(settings_.frame_ms);
+            schedule_next_send();
+        }));
+    }
+
+    asio::steady_timer send_timer_;
+    load_clock::time_point next_send_;
+    load_clock::time_point last_arrival_{};
+    load_clock::time_point last_probe_{};
+    uint64_t last_probe_seen_ = 0;
+    std::vector<int16_t> silence_;
+    std::vector<int16_t> probe_;
+};
+
+class UdpLoadClient : public LoadClient {
+public:
+    UdpLoadClient(asio::io_context& io_context, const LoadSettings& settings, std::string room,
+                  std::shared_ptr<LoadRoom> room_state, bool is_probe, const LoadWindow& window)
+        : LoadClient(io_context, settings, std::move(room), std::move(room_state), is_probe, window),
+          socket_(io_context, asio::ip::udp::endpoint(asio::ip::udp::v4(), 0)) {
+        socket_.connect(asio::ip::udp::endpoint(asio::ip::make_address(settings.server_ip), settings.udp_port));
+    }
+
+    void start(load_clock::time_point first_send) override {
+        auto join = std::make_shared<std::vector<uint8_t>>(RoomProtocol::makeJoin(room_));
+        socket_.async_send(asio::buffer(*join), [join](std::error_code, std::size_t) {});
+        start_receive();
+        schedule_sends(first_send);
+    }
+
+protected:
+    void send_frame(const std::vector<int16_t>& frame) override {
+        auto self(shared_from_this());
+        // The frame vectors live as long as the client, which the handler keeps alive
+        socket_.async_send(asio::buffer(frame), strand_.wrap([this, self](std::error_code ec, std::size_t) {
+            if (ec) {
+                on_error(ec);
+            }
+        }));
+    }
+
+private:
+    void start_receive() {
+        auto self(shared_from_this());
+        socket_.async_receive(asio::buffer(recv_buffer_), strand_.wrap([this, self](std::error_code ec, std::size_t length) {
+            if (!ec) {
+                on_audio(recv_buffer_.data(), length);
+            } else {
+                on_error(ec);
+                if (ec == asio::error::operation_aborted) {
+                    return;
+                }
+            }
+            start_receive();
+        }));
+    }
+
+    asio::ip::udp::socket socket_;
+    std::array<uint8_t, 16384> recv_buffer_{};
+};
+
+class WebSocketLoadClient : public LoadClient {
+public:
+    WebSocketLoadClient(asio::io_context& io_context, const LoadSettings& settings, std::string room,
+                        std::shared_ptr<LoadRoom> room_state, bool is_probe, const LoadWindow& window)
+        : LoadClient(io_context, settings, std::move(room), std::move(room_state), is_probe, window),
+          socket_(io_context),
+          read_buffer_(16384) {}
+
+    void start(load_clock::time_point first_send) override {
+        auto self(shared_from_this());
+        asio::ip::tcp::endpoint endpoint(asio::ip::make_address(settings_.server_ip), settings_.websocket_port);
+        socket_.async_connect(endpoint, strand_.wrap([this, self, first_send](std::error_code ec) {
+            if (ec) {
+                on_error(ec);
+                return;
+            }
+            socket_.set_option(asio::ip::tcp::no_delay(true));
+            send_upgrade(first_send);
+        }));
+    }
+
+protected:
+    void send_frame(const std::vector<int16_t>& frame) override {
+        if (!open_) {
+            return;
+        }
+        size_t length = frame.size() * sizeof(int16_t);
+        auto bytes = std::make_shared<std::vector<uint8_t>>();
+        bytes->reserve(length + 14);
+        bytes->push_back(0x82);  // FIN, binary
+        if (length <= 125) {
+            bytes->push_back(static_cast<uint8_t>(0x80 | length));
+        } else if (length <= 65535) {
+            bytes->push_back(0x80 | 126);
+            bytes->push_back(static_cast<uint8_t>(length >> 8));
+            bytes->push_back(static_cast<uint8_t>(length & 0xFF));
+        } else {
+            bytes->push_back(0x80 | 127);
+            for (int i = 7; i >= 0; --i) {
+                bytes->push_back(static_cast<uint8_t>((static_cast<uint64_t>(length) >> (i * 8)) & 0xFF));
+            }
+        }
+        std::array<uint8_t, 4> mask{};
+        for (auto& m : mask) {
+            m = static_cast<uint8_t>(random_());
+        }
+        bytes->insert(bytes->end(), mask.begin(), mask.end());
+        const auto* payload = reinterpret_cast<const uint8_t*>(frame.data());
+        for (size_t i = 0; i < length; ++i) {
+            bytes->push_back(payload[i] ^ mask[i % 4]);
+        }
+        write(bytes);
+    }
+
+private:
+    void send_upgrade(load_clock::time_point first_send) {
+        auto self(shared_from_this());
+        auto request = std::make_shared<std::string>(
+            "GET /?room=" + room_ + " HTTP/1.1\r\n"
+            "Host: " + settings_.server_ip + "\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+            "Sec-WebSocket-Version: 13\r\n"
+            "\r\n");
+        asio::async_write(socket_, asio::buffer(*request), strand_.wrap([this, self, request, first_send](std::error_code ec, std::size_t) {
+            if (ec) {
+                on_error(ec);
+                return;
+            }
+            asio::async_read_until(socket_, handshake_buffer_, "\r\n\r\n",
+                strand_.wrap([this, self, first_send](std::error_code ec, std::size_t length) {
+                    if (ec) {
+                        on_error(ec);
+                        return;
+                    }
+                    std::string response(asio::buffers_begin(handshake_buffer_.data()),
+                                         asio::buffers_begin(handshake_buffer_.data()) + static_cast<std::ptrdiff_t>(length));
+                    handshake_buffer_.consume(length);
+                    if (response.compare(0, 12, "HTTP/1.1 101") != 0) {
+                        on_error(asio::error::connection_refused);
+                        return;
+                    }
+                    // Bytes read past the handshake already belong to the frame stream
+                    auto extra = handshake_buffer_.data();
+                    pending_.insert(pending_.end(), asio::buffers_begin(extra), asio::buffers_end(extra));
+                    handshake_buffer_.consume(handshake_buffer_.size());
+                    open_ = true;
+                    parse_frames();
+                    start_read();
+                    schedule_sends(std::max(first_send, load_clock::now()));
+                }));
+        }));
+    }
+
+    void start_read() {
+        auto self(shared_from_this());
+        socket_.async_read_some(asio::buffer(read_buffer_), strand_.wrap([this, self](std::error_code ec, std::size_t length) {
+            if (ec) {
+                on_error(ec);
+                open_ = false;
+                return;
+            }
+            pending_.insert(pending_.end(), read_buffer_.begin(), read_buffer_.begin() + static_cast<std::ptrdiff_t>(length));
+            parse_frames();
+            start_read();
+        }));
+    }
+
+    // Server frames are unmasked; deliver every complete binary frame in pending_.
+    void parse_frames() {
+        size_t offset = 0;
+        while (pending_.size() - offset >= 2) {
+            const uint8_t* header = pending_.data() + offset;
+            uint8_t opcode = header[0] & 0x0F;
+            uint64_t length = header[1] & 0x7F;
+            size_t header_length = 2;
+            if (length == 126) {
+                if (pending_.size() - offset < 4) break;
+                length = (static_cast<uint64_t>(header[2]) << 8) | header[3];
+                header_length = 4;
+            } else if (length == 127) {
+                if (pending_.size() - offset < 10) break;
+                length = 0;
+                for (int i = 0; i < 8; ++i) {
+                    length = (length << 8) | header[2 + i];
+                }
+                header_length = 10;
+            }
+            if (pending_.size() - offset < header_length + length) break;
+            if (opcode == 0x2) {
+                on_audio(header + header_length, static_cast<size_t>(length));
+            }
+            offset += header_length + static_cast<size_t>(length);
+        }
+        pending_.erase(pending_.begin(), pending_.begin() + static_cast<std::ptrdiff_t>(offset));
+    }
+
+    void write(const std::shared_ptr<std::vector<uint8_t>>& bytes) {
+        write_queue_.push_back(bytes);
+        if (write_queue_.size() == 1) {
+            do_write();
+        }
+    }
+
+    void do_write() {
+        auto self(shared_from_this());
+        asio::async_write(socket_, asio::buffer(*write_queue_.front()), strand_.wrap([this, self](std::error_code ec, std::size_t) {
+            if (ec) {
+                on_error(ec);
+                open_ = false;
+                write_queue_.clear();
+                return;
+            }
+            write_queue_.pop_front();
+            if (!write_queue_.empty()) {
+                do_write();
+            }
+        }));
+    }
+
+    asio::ip::tcp::socket socket_;
+    asio::streambuf handshake_buffer_;
+    std::vector<uint8_t> read_buffer_;
+    std::vector<uint8_t> pending_;
+    std::deque<std::shared_ptr<std::vector<uint8_t>>> write_queue_;
+    std::minstd_rand random_{std::random_device{}()};
+    bool open_ = false;
+};
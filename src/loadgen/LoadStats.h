@@ -0,0 +1,69 @@
+//
+// Created by maxim on 15.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using load_clock = std::chrono::steady_clock;
+
+// Per-room probe state. The first client of every room periodically sends a loud frame while
+// all other clients send silence, so any non-zero mix a listener receives carries that probe.
+struct LoadRoom {
+    std::atomic<uint64_t> probe_sequence{0};
+    std::atomic<int64_t> probe_sent_ns{0};
+};
+
+// Counters of one simulated client. Only touched from that client's strand while running and
+// read by the main thread after the pool has stopped.
+struct LoadClientStats {
+    uint64_t frames_sent = 0;
+    uint64_t packets_received = 0;
+    uint64_t bytes_received = 0;
+    uint64_t probes_sent = 0;
+    uint64_t probes_seen = 0;
+    uint64_t errors = 0;
+    std::vector<double> inter_arrival_ms;
+    std::vector<double> latency_ms;
+};
+
+// Measurement window shared by all clients; traffic outside it (warm-up, drain) is not recorded.
+struct LoadWindow {
+    load_clock::time_point start;
+    load_clock::time_point end;
+
+    [[nodiscard]] bool contains(load_clock::time_point t) const { return t >= start && t < end; }
+
+    [[nodiscard]] double seconds() const { return std::chrono::duration<double>(end - start).count(); }
+};
+
+namespace LoadStats
+{
+    inline double percentile(const std::vector<double>& sorted, double q) {
+        if (sorted.empty()) {
+            return 0.0;
+        }
+        auto index = static_cast<size_t>(q * static_cast<double>(sorted.size() - 1) + 0.5);
+        return sorted[std::min(index, sorted.size() - 1)];
+    }
+
+    inline nlohmann::json summarize(std::vector<double> values) {
+        std::sort(values.begin(), values.end());
+        double mean = values.empty() ? 0.0
+                                     : std::accumulate(values.begin(), values.end(), 0.0) / static_cast<double>(values.size());
+        return {
+            {"count", values.size()},
+            {"mean", mean},
+            {"p50", percentile(values, 0.50)},
+            {"p99", percentile(values, 0.99)},
+            {"p999", percentile(values, 0.999)},
+            {"max", values.empty() ? 0.0 : values.back()}
+        };
+    }
+}
@@ -0,0 +1,249 @@
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <asio.hpp>
+#include <nlohmann/json.hpp>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+#include "AsioThreadPool.h"
+#include "Config.h"
+#include "HandshakeStorm.h"
+#include "LoadClient.h"
+#include "LoadStats.h"
+
+// Thousands of clients need as many sockets; lift the soft descriptor limit to the hard one.
+void raise_file_limit() {
+#if !defined(_WIN32)
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+// Connection churn instead of audio: how many WebSocket upgrades per second the server
+// completes, and how long it keeps stalled connections around.
+int run_handshake_storm(const Config& config, const LoadSettings& settings) {
+    int concurrency = config.get<int>("storm_concurrency", 256);
+    int stalled_count = config.get<int>("storm_stalled", 0);
+    int threads = config.get<int>("threads", 0);
+    double warmup_s = config.get<double>("warmup_s", 1.0);
+    double duration_s = config.get<double>("duration_s", 10.0);
+
+    AsioThreadPool thread_pool(threads);
+    auto& io_context = thread_pool.get_io_context();
+    auto start = load_clock::now();
+    LoadWindow window{
+        start + std::chrono::duration_cast<load_clock::duration>(std::chrono::duration<double>(warmup_s)),
+        start + std::chrono::duration_cast<load_clock::duration>(std::chrono::duration<double>(warmup_s + duration_s))
+    };
+
+    std::vector<std::shared_ptr<StalledClient>> stalled;
+    for (int i = 0; i < stalled_count; ++i) {
+        stalled.push_back(std::make_shared<StalledClient>(io_context, settings));
+        stalled.back()->start();
+    }
+    std::vector<std::shared_ptr<StormWorker>> workers;
+    for (int i = 0; i < concurrency; ++i) {
+        workers.push_back(std::make_shared<StormWorker>(io_context, settings, window));
+        workers.back()->start();
+    }
+
+    asio::steady_timer stop_timer(io_context);
+    stop_timer.expires_at(window.end + std::chrono::milliseconds(200));
+    stop_timer.async_wait([&io_context](std::error_code) { io_context.stop(); });
+
+    std::cerr << "Running a handshake storm of " << concurrency << " connections (" << stalled_count
+              << " stalled) for " << warmup_s << "s warm-up + " << duration_s << "s..." << std::endl;
+    thread_pool.run();
+    thread_pool.stop();
+
+    uint64_t handshakes = 0, errors = 0;
+    std::vector<double> handshake_ms, reaped_ms;
+    for (const auto& worker : workers) {
+        handshakes += worker->stats().handshakes;
+        errors += worker->stats().errors;
+        handshake_ms.insert(handshake_ms.end(), worker->stats().handshake_ms.begin(), worker->stats().handshake_ms.end());
+    }
+    for (const auto& client : stalled) {
+        if (client->reaped_ms() >= 0.0) {
+            reaped_ms.push_back(client->reaped_ms());
+        }
+    }
+
+    nlohmann::json report = {
+        {"mode", "handshake_storm"},
+        {"concurrency", concurrency},
+        {"window_s", window.seconds()},
+        {"handshakes", handshakes},
+        {"handshakes_per_s", static_cast<double>(handshakes) / window.seconds()},
+        {"errors", errors},
+        {"handshake_ms", LoadStats::summarize(handshake_ms)},
+        {"stalled", stalled_count},
+        {"stalled_reaped", reaped_ms.size()},
+        {"stalled_reaped_after_ms", LoadStats::summarize(reaped_ms)}
+    };
+    std::cout << report.dump(2) << std::endl;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <config_file>" << std::endl;
+        return 1;
+    }
+    Config config;
+    if (!config.load(argv[1])) {
+        std::cerr << "Failed to load configuration file." << std::endl;
+        return 1;
+    }
+
+    LoadSettings settings;
+    settings.server_ip = config.get<std::string>("server_ip", settings.server_ip);
+    settings.udp_port = config.get<short>("udp_port", settings.udp_port);
+    settings.websocket_port = config.get<short>("websocket_port", settings.websocket_port);
+    settings.frame_ms = config.get<int>("frame_ms", settings.frame_ms);
+    settings.mix_interval_ms = config.get<int>("server_mix_interval_ms", settings.mix_interval_ms);
+    settings.probe_interval_ms = config.get<int>("probe_interval_ms", settings.probe_interval_ms);
+
+    raise_file_limit();
+    if (config.get<std::string>("mode", "audio") == "handshake_storm") {
+        try {
+            return run_handshake_storm(config, settings);
+        } catch (std::exception &e) {
+            std::cerr << "Exception: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    auto transport = config.get<std::string>("transport", "udp");
+    int client_count = config.get<int>("clients", 100);
+    int room_count = std::max(1, config.get<int>("rooms", 10));
+    int threads = config.get<int>("threads", 0);
+    double warmup_s = config.get<double>("warmup_s", 2.0);
+    double duration_s = config.get<double>("duration_s", 10.0);
+
+    if (transport != "udp" && transport != "websocket") {
+        std::cerr << "Unknown transport '" << transport << "' (use udp or websocket)." << std::endl;
+        return 1;
+    }
+    if (client_count < 2 * room_count) {
+        std::cerr << "Warning: rooms with fewer than two clients receive no audio." << std::endl;
+    }
+
+    try {
+        AsioThreadPool thread_pool(threads);
+        auto& io_context = thread_pool.get_io_context();
+
+        auto start = load_clock::now() + std::chrono::milliseconds(200);
+        LoadWindow window{
+            start + std::chrono::duration_cast<load_clock::duration>(std::chrono::duration<double>(warmup_s)),
+            start + std::chrono::duration_cast<load_clock::duration>(std::chrono::duration<double>(warmup_s + duration_s))
+        };
+
+        std::vector<std::shared_ptr<LoadRoom>> rooms;
+        for (int r = 0; r < room_count; ++r) {
+            rooms.push_back(std::make_shared<LoadRoom>());
+        }
+
+        // Spread the first sends across one frame so the server does not see lock-step bursts
+        std::mt19937 random(42);
+        std::uniform_int_distribution<int> phase_us(0, settings.frame_ms * 1000 - 1);
+
+        std::vector<std::shared_ptr<LoadClient>> clients;
+        clients.reserve(client_count);
+        for (int c = 0; c < client_count; ++c) {
+            int r = c % room_count;
+            std::string room = "load-" + std::to_string(r);
+            bool is_probe = c < room_count;
+            std::shared_ptr<LoadClient> client;
+            if (transport == "udp") {
+                client = std::make_shared<UdpLoadClient>(io_context, settings, room, rooms[r], is_probe, window);
+            } else {
+                client = std::make_shared<WebSocketLoadClient>(io_context, settings, room, rooms[r], is_probe, window);
+            }
+            client->start(start + std::chrono::microseconds(phase_us(random)));
+            clients.push_back(std::move(client));
+        }
+
+        asio::steady_timer stop_timer(io_context);
+        stop_timer.expires_at(window.end + std::chrono::milliseconds(200));
+        stop_timer.async_wait([&io_context](std::error_code) { io_context.stop(); });
+
+        std::cerr << "Running " << client_count << " " << transport << " clients in " << room_count
+                  << " rooms for " << warmup_s << "s warm-up + " << duration_s << "s..." << std::endl;
+        thread_pool.run();
+        thread_pool.stop();
+
+        uint64_t frames_sent = 0, packets_received = 0, bytes_received = 0;
+        uint64_t probes_sent = 0, probes_seen = 0, errors = 0;
+        std::vector<double> inter_arrival, jitter, latency, delivered_fps;
+        const double expected_fps = 1000.0 / settings.mix_interval_ms;
+        std::vector<uint64_t> room_members(room_count, 0);
+        for (int c = 0; c < client_count; ++c) {
+            room_members[c % room_count]++;
+        }
+
+        for (int c = 0; c < client_count; ++c) {
+            const auto& stats = clients[c]->stats();
+            frames_sent += stats.frames_sent;
+            packets_received += stats.packets_received;
+            bytes_received += stats.bytes_received;
+            probes_sent += stats.probes_sent;
+            errors += stats.errors;
+            if (c >= room_count) {
+                probes_seen += stats.probes_seen;
+            }
+            delivered_fps.push_back(static_cast<double>(stats.packets_received) / window.seconds());
+            inter_arrival.insert(inter_arrival.end(), stats.inter_arrival_ms.begin(), stats.inter_arrival_ms.end());
+            for (double gap : stats.inter_arrival_ms) {
+                jitter.push_back(std::abs(gap - settings.mix_interval_ms));
+            }
+            latency.insert(latency.end(), stats.latency_ms.begin(), stats.latency_ms.end());
+        }
+
+        // Every listener should see every probe of its room
+        uint64_t probes_expected = 0;
+        for (int c = 0; c < room_count && c < client_count; ++c) {
+            probes_expected += clients[c]->stats().probes_sent * (room_members[c] - 1);
+        }
+
+        double mean_fps = delivered_fps.empty() ? 0.0
+                                                : std::accumulate(delivered_fps.begin(), delivered_fps.end(), 0.0) / delivered_fps.size();
+        nlohmann::json report = {
+            {"transport", transport},
+            {"clients", client_count},
+            {"rooms", room_count},
+            {"frame_ms", settings.frame_ms},
+            {"window_s", window.seconds()},
+            {"frames_sent", frames_sent},
+            {"packets_received", packets_received},
+            {"bytes_received", bytes_received},
+            {"errors", errors},
+            {"expected_fps_per_client", expected_fps},
+            {"delivered_fps_per_client", LoadStats::summarize(delivered_fps)},
+            {"loss", std::max(0.0, 1.0 - mean_fps / expected_fps)},
+            {"inter_arrival_ms", LoadStats::summarize(inter_arrival)},
+            {"jitter_ms", LoadStats::summarize(jitter)},
+            {"latency_ms", LoadStats::summarize(latency)},
+            {"probes_sent", probes_sent},
+            {"probe_loss", probes_expected == 0 ? 0.0
+                                                : 1.0 - static_cast<double>(probes_seen) / static_cast<double>(probes_expected)}
+        };
+        std::cout << report.dump(2) << std::endl;
+    } catch (std::exception &e) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
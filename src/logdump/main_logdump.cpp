@@ -0,0 +1,180 @@
+//
+// Created by maxim on 28.09.2024.
+//
+// Decodes binary log segments written by BinaryLog::Destination, oldest first, optionally
+// filtered by level, time, source file and message text.
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "BinaryLog.h"
+
+using namespace BinaryLog;
+
+namespace
+{
+    const char* LEVEL_NAMES[] = {"DEBUG", "INFO", "WARNING", "ERROR", "FATAL"};
+
+    struct Filter {
+        int min_level = 0;
+        int64_t since_ns = INT64_MIN;
+        int64_t until_ns = INT64_MAX;
+        std::string file;
+        std::string match;
+    };
+
+    std::string formatTime(int64_t unix_ns) {
+        std::time_t seconds = unix_ns / 1000000000;
+        std::tm tm{};
+        gmtime_r(&seconds, &tm);
+        char buffer[64];
+        size_t length = std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &tm);
+        std::snprintf(buffer + length, sizeof(buffer) - length, ".%06lldZ",
+                      static_cast<long long>(unix_ns % 1000000000 / 1000));
+        return buffer;
+    }
+
+    // "2024-09-28T12:00:00", UTC, with or without a trailing Z.
+    bool parseTime(const char* text, int64_t& unix_ns) {
+        std::tm tm{};
+        const char* end = strptime(text, "%Y-%m-%dT%H:%M:%S", &tm);
+        if (end == nullptr || (*end != '\0' && std::strcmp(end, "Z") != 0)) {
+            return false;
+        }
+        unix_ns = static_cast<int64_t>(timegm(&tm)) * 1000000000;
+        return true;
+    }
+
+    bool parseLevel(std::string_view name, int& level) {
+        for (int i = 0; i < static_cast<int>(std::size(LEVEL_NAMES)); ++i) {
+            if (strncasecmp(name.data(), LEVEL_NAMES[i], name.size()) == 0 && name.size() == std::strlen(LEVEL_NAMES[i])) {
+                level = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Prints the segment's entries that pass filter; false if it is not a segment at all.
+    bool dumpSegment(const char* path, const Filter& filter) {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        SegmentHeader segment{};
+        if (data.size() >= sizeof(segment)) {
+            std::memcpy(&segment, data.data(), sizeof(segment));
+        }
+        if (segment.magic != SEGMENT_MAGIC) {
+            std::cerr << "Not a binary log segment: " << path << std::endl;
+            return false;
+        }
+        if (segment.version != SEGMENT_VERSION) {
+            std::cerr << "Unsupported segment version " << segment.version << ": " << path << std::endl;
+            return false;
+        }
+
+        std::vector<std::string> files;
+        size_t offset = sizeof(segment);
+        while (offset + sizeof(RecordHeader) <= data.size()) {
+            RecordHeader header{};
+            std::memcpy(&header, data.data() + offset, sizeof(header));
+            if (header.size == 0) {
+                break;  // End of a segment its writer never closed
+            }
+            if (header.size < sizeof(header) || offset + header.size > data.size() ||
+                header.body_length > header.size - sizeof(header)) {
+                std::cerr << "Corrupt record at offset " << offset << " of " << path << std::endl;
+                break;
+            }
+            auto body = reinterpret_cast<const char*>(data.data() + offset + sizeof(header));
+            const char* body_end = reinterpret_cast<const char*>(data.data() + offset + header.size);
+            offset += header.size;
+
+            if (header.type == RecordType::FileName) {
+                files.resize(std::max<size_t>(files.size(), header.file + 1));
+                files[header.file].assign(body, header.body_length);
+                continue;
+            }
+            if (header.type != RecordType::Entry || header.level < filter.min_level ||
+                header.unix_ns < filter.since_ns || header.unix_ns >= filter.until_ns) {
+                continue;
+            }
+            std::string_view source = header.file < files.size() ? std::string_view(files[header.file]) : "?";
+            std::string_view message(body, header.body_length);
+            if ((!filter.file.empty() && source.find(filter.file) == std::string_view::npos) ||
+                (!filter.match.empty() && message.find(filter.match) == std::string_view::npos)) {
+                continue;
+            }
+
+            std::string line = formatTime(header.unix_ns) + " [" +
+                               (header.level < std::size(LEVEL_NAMES) ? LEVEL_NAMES[header.level] : "UNKNOWN") +
+                               "] [" + std::string(source) + ":" + std::to_string(header.line) + "] " +
+                               std::string(message);
+            if (header.suppressed > 0) {
+                line += " (" + std::to_string(header.suppressed) + " similar suppressed)";
+            }
+            const char* context = body + header.body_length;
+            for (uint8_t i = 0; i < header.context_count && context + 4 <= body_end; ++i) {
+                uint16_t key_length;
+                uint16_t value_length;
+                std::memcpy(&key_length, context, 2);
+                std::memcpy(&value_length, context + 2, 2);
+                if (context + 4 + key_length + value_length > body_end) {
+                    break;
+                }
+                line += (i == 0 ? " {" : ", ") + std::string(context + 4, key_length) + ": " +
+                        std::string(context + 4 + key_length, value_length);
+                context += 4 + key_length + value_length;
+            }
+            if (header.context_count > 0) {
+                line += "}";
+            }
+            std::puts(line.c_str());
+        }
+        return true;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    Filter filter;
+    std::vector<const char*> segments;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view option = argv[i];
+        bool has_value = i + 1 < argc;
+        if (option == "--level" && has_value && parseLevel(argv[i + 1], filter.min_level)) {
+            ++i;
+        } else if (option == "--since" && has_value && parseTime(argv[i + 1], filter.since_ns)) {
+            ++i;
+        } else if (option == "--until" && has_value && parseTime(argv[i + 1], filter.until_ns)) {
+            ++i;
+        } else if (option == "--file" && has_value) {
+            filter.file = argv[++i];
+        } else if (option == "--match" && has_value) {
+            filter.match = argv[++i];
+        } else if (option.starts_with("--")) {
+            segments.clear();
+            break;
+        } else {
+            segments.push_back(argv[i]);
+        }
+    }
+    if (segments.empty()) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--level debug|info|warning|error|fatal] [--since 2024-09-28T12:00:00] [--until ...]"
+                     " [--file text] [--match text] <segment.vcbl>..." << std::endl;
+        return 1;
+    }
+
+    // Segment names sort by creation time, so a shell glob already lists them oldest first
+    bool ok = true;
+    for (const char* segment : segments) {
+        ok = dumpSegment(segment, filter) && ok;
+    }
+    return ok ? 0 : 1;
+}
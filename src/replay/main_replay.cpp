@@ -0,0 +1,230 @@
+//
+// Created by maxim on 30.09.2024.
+//
+// Feeds a traffic capture written by voice_server (capture_file) back into rooms and reports
+// how long their mix ticks took. Events are handed to the rooms in the order and at the times
+// they were captured, and every room ticks each MIX_INTERVAL of capture time, so each tick
+// mixes exactly the packets it did in any run: in real time, N times faster, or with --fast as
+// quickly as the mixer goes on a simulated clock. The digest of what the listeners were sent
+// shows whether a change to the mixer changed its output.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <asio.hpp>
+
+#include "HdrHistogram.h"
+#include "RoomRegistry.h"
+#include "TrafficCapture.h"
+
+namespace
+{
+    using clock = std::chrono::steady_clock;
+
+    // Stands in for a participant: counts what it is sent and hashes it (FNV-1a).
+    class ReplayClient : public Client {
+    public:
+        explicit ReplayClient(std::string id) : id_(std::move(id)) {}
+
+        // As the participant joined with
+        void setFormat(Pcm::Format format) { format_ = format; }
+
+        void send(const AudioPacket& packet, std::function<void()> on_sent = {}) override {
+            ++packets_;
+            bytes_ += packet.size();
+            for (uint8_t byte : packet.bytes()) {
+                digest_ = (digest_ ^ byte) * 0x100000001B3ull;
+            }
+            if (on_sent) {
+                on_sent();
+            }
+        }
+
+        std::string getId() override { return id_; }
+
+        ClientType getType() const override { return ClientType::UDP; }
+
+        Pcm::Format format() const override { return format_; }
+
+        [[nodiscard]] uint64_t packets() const { return packets_; }
+
+        [[nodiscard]] uint64_t bytes() const { return bytes_; }
+
+        [[nodiscard]] uint64_t digest() const { return digest_; }
+
+    private:
+        std::string id_;
+        Pcm::Format format_;
+        uint64_t packets_ = 0;
+        uint64_t bytes_ = 0;
+        uint64_t digest_ = 0xCBF29CE484222325ull;
+    };
+
+    struct Options {
+        double speed = 1.0;
+        bool fast = false;
+        const char* path = nullptr;
+    };
+
+    bool parseOptions(int argc, char* argv[], Options& options) {
+        for (int i = 1; i < argc; ++i) {
+            std::string_view option = argv[i];
+            if (option == "--fast") {
+                options.fast = true;
+            } else if (option == "--speed" && i + 1 < argc) {
+                options.speed = std::atof(argv[++i]);
+                if (options.speed <= 0) {
+                    return false;
+                }
+            } else if (!option.starts_with("--") && options.path == nullptr) {
+                options.path = argv[i];
+            } else {
+                return false;
+            }
+        }
+        return options.path != nullptr;
+    }
+
+    double microseconds(uint64_t ns) {
+        return static_cast<double>(ns) / 1000.0;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " [--speed N | --fast] <capture.vctc>" << std::endl;
+        return 1;
+    }
+    std::vector<TrafficCapture::Event> events;
+    if (!TrafficCapture::read(options.path, events)) {
+        return 1;
+    }
+    // Threads capture concurrently, so the file is only nearly in order
+    std::stable_sort(events.begin(), events.end(),
+                     [](const auto& a, const auto& b) { return a.offset < b.offset; });
+
+    // Never run: the rooms only need it for the timers they do not use here
+    asio::io_context io_context;
+    RoomRegistry registry(io_context, RoomManager::Ticks::Manual);
+    std::map<std::string, std::shared_ptr<ReplayClient>> clients;
+    std::vector<std::shared_ptr<RoomManager>> ticking;
+
+    size_t joins = 0;
+    size_t leaves = 0;
+    size_t packets = 0;
+    size_t orphans = 0;
+    uint64_t payload_bytes = 0;
+    HdrHistogram tick_duration;
+    HdrHistogram tick_lateness;
+
+    auto started = clock::now();
+    // When something at capture offset is due on the wall clock
+    auto wall = [&](std::chrono::nanoseconds offset) {
+        return started + std::chrono::duration_cast<clock::duration>(offset / options.speed);
+    };
+
+    auto apply = [&](const TrafficCapture::Event& event) {
+        switch (event.type) {
+            case TrafficCapture::EventType::Join: {
+                auto& client = clients[event.client];
+                if (!client) {
+                    client = std::make_shared<ReplayClient>(event.client);
+                }
+                client->setFormat(event.format);
+                auto room = registry.joinRoom(client, event.room);
+                if (room && std::find(ticking.begin(), ticking.end(), room) == ticking.end()) {
+                    ticking.push_back(room);
+                }
+                ++joins;
+                break;
+            }
+            case TrafficCapture::EventType::Leave:
+                registry.leaveRoom(event.client);
+                ++leaves;
+                break;
+            case TrafficCapture::EventType::Audio:
+                if (auto room = registry.findClientRoom(event.client)) {
+                    room->processAudio(event.client, AudioPacket::borrow(std::as_bytes(std::span(event.payload))));
+                    ++packets;
+                    payload_bytes += event.payload.size();
+                } else {
+                    ++orphans;
+                }
+                break;
+        }
+    };
+
+    auto tick = [&](std::chrono::nanoseconds offset) {
+        auto due = options.fast ? clock::now() : wall(offset);
+        if (!options.fast) {
+            std::this_thread::sleep_until(due);
+        }
+        for (auto it = ticking.begin(); it != ticking.end();) {
+            auto start = clock::now();
+            tick_lateness.record(static_cast<uint64_t>(std::max<int64_t>(
+                0, std::chrono::duration_cast<std::chrono::nanoseconds>(start - due).count())));
+            bool active = (*it)->tick(due);
+            tick_duration.record(static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count()));
+            // An empty room stops ticking until someone joins it again
+            it = active ? std::next(it) : ticking.erase(it);
+        }
+    };
+
+    std::chrono::nanoseconds next_tick = RoomManager::MIX_INTERVAL;
+    for (const auto& event : events) {
+        while (event.offset >= next_tick) {
+            tick(next_tick);
+            next_tick += RoomManager::MIX_INTERVAL;
+        }
+        if (!options.fast) {
+            std::this_thread::sleep_until(wall(event.offset));
+        }
+        apply(event);
+    }
+    tick(next_tick);  // The packets after the last tick
+    auto elapsed = std::chrono::duration<double>(clock::now() - started).count();
+
+    // Clients in id order, so the digest does not depend on the order rooms sent in
+    uint64_t sent_packets = 0;
+    uint64_t sent_bytes = 0;
+    uint64_t digest = 0xCBF29CE484222325ull;
+    for (const auto& [id, client] : clients) {
+        sent_packets += client->packets();
+        sent_bytes += client->bytes();
+        digest = (digest ^ client->digest()) * 0x100000001B3ull;
+    }
+
+    double captured = std::chrono::duration<double>(next_tick).count();
+    char mode[32] = "fast";
+    if (!options.fast) {
+        std::snprintf(mode, sizeof(mode), "%gx", options.speed);
+    }
+    std::printf("capture     %zu joins, %zu leaves, %zu packets (%llu bytes), %.2fs; %zu packets from clients in no room\n",
+                joins, leaves, packets, static_cast<unsigned long long>(payload_bytes), captured, orphans);
+    std::printf("replay      %s, %.3fs, %.1fx real time, %.0f packets/s\n",
+                mode, elapsed,
+                captured / elapsed, static_cast<double>(packets) / elapsed);
+    std::printf("ticks       %llu, duration mean %.1fus p50 %.1fus p99 %.1fus max %.1fus\n",
+                static_cast<unsigned long long>(tick_duration.count()), tick_duration.mean() / 1000.0,
+                microseconds(tick_duration.percentile(0.5)), microseconds(tick_duration.percentile(0.99)),
+                microseconds(tick_duration.max()));
+    if (!options.fast) {
+        std::printf("lateness    p50 %.1fus p99 %.1fus max %.1fus\n", microseconds(tick_lateness.percentile(0.5)),
+                    microseconds(tick_lateness.percentile(0.99)), microseconds(tick_lateness.max()));
+    }
+    std::printf("sent        %llu packets, %llu bytes to %zu clients, digest %016llx\n",
+                static_cast<unsigned long long>(sent_packets), static_cast<unsigned long long>(sent_bytes),
+                clients.size(), static_cast<unsigned long long>(digest));
+    return 0;
+}
@@ -0,0 +1,91 @@
+//
+// Created by maxim on 26.09.2024.
+//
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <asio.hpp>
+#include <nlohmann/json.hpp>
+
+#include "HashRing.h"
+
+// A voice_server instance behind the router.
+struct Backend {
+    std::string name;
+    asio::ip::udp::endpoint udp;
+    asio::ip::tcp::endpoint websocket;
+};
+
+// The backends and the ring that assigns rooms to them. A table is immutable once built;
+// reloading the configuration builds a new one and the routers switch over to it.
+class BackendTable {
+public:
+    // Parses [{"name": "a", "udp": "10.0.0.1:12345", "websocket": "10.0.0.1:8080"}, ...].
+    // Entries that are not objects of strings or do not resolve are skipped with an error, so a
+    // bad reload never throws.
+    static std::shared_ptr<const BackendTable> fromJson(asio::io_context& io_context, const nlohmann::json& backends,
+                                                        size_t replicas) {
+        auto table = std::make_shared<BackendTable>(replicas);
+        if (!backends.is_array()) {
+            std::cerr << "backends must be an array" << std::endl;
+            return table;
+        }
+        for (const auto& entry : backends) {
+            Backend backend;
+            backend.name = stringField(entry, "name");
+            if (backend.name.empty() || !resolve(io_context, stringField(entry, "udp"), backend.udp) ||
+                !resolve(io_context, stringField(entry, "websocket"), backend.websocket)) {
+                std::cerr << "Skipping backend " << entry.dump() << std::endl;
+                continue;
+            }
+            table->ring_.add(backend.name);
+            table->backends_[backend.name] = std::move(backend);
+        }
+        return table;
+    }
+
+    explicit BackendTable(size_t replicas) : ring_(replicas) {}
+
+    // Backend that hosts room, or nullptr if there are no backends.
+    [[nodiscard]] const Backend* route(std::string_view room) const {
+        const std::string* name = ring_.lookup(room);
+        return name ? &backends_.at(*name) : nullptr;
+    }
+
+    [[nodiscard]] const std::unordered_map<std::string, Backend>& backends() const { return backends_; }
+
+private:
+    // The field if entry is an object holding a string there, "" otherwise
+    static std::string stringField(const nlohmann::json& entry, const char* key) {
+        if (!entry.is_object()) {
+            return "";
+        }
+        auto field = entry.find(key);
+        return field != entry.end() && field->is_string() ? field->get<std::string>() : "";
+    }
+
+    template<typename Endpoint>
+    static bool resolve(asio::io_context& io_context, const std::string& address, Endpoint& endpoint) {
+        auto colon = address.rfind(':');
+        if (colon == std::string::npos) {
+            return false;
+        }
+        typename Endpoint::protocol_type::resolver resolver(io_context);
+        std::error_code ec;
+        auto results = resolver.resolve(Endpoint::protocol_type::v4(), address.substr(0, colon),
+                                        address.substr(colon + 1), ec);
+        if (ec || results.empty()) {
+            std::cerr << "Failed to resolve " << address << ": " << ec.message() << std::endl;
+            return false;
+        }
+        endpoint = results.begin()->endpoint();
+        return true;
+    }
+
+    HashRing ring_;
+    std::unordered_map<std::string, Backend> backends_;
+};
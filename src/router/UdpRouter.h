@@ -0,0 +1,360 @@
+//
+// Created by maxim on 26.09.2024.
+//
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <asio.hpp>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "Backends.h"
+#include "Logger.h"
+#include "RoomProtocol.h"
+#include "TimerWheel.h"
+
+using asio::ip::udp;
+
+// Fixed slots for batched datagram I/O. recvmmsg fills them straight from the kernel and
+// sendmmsg sends them out again, so a datagram is never copied in user space. Elsewhere the
+// same calls degrade to one recvfrom/sendto per datagram.
+struct DatagramBatch {
+    static constexpr size_t CAPACITY = 64;
+    static constexpr size_t MAX_DATAGRAM = 16384;  // as voice_server's receive buffer
+
+    std::array<std::array<uint8_t, MAX_DATAGRAM>, CAPACITY> data{};
+    std::array<sockaddr_in, CAPACITY> peers{};
+    std::array<size_t, CAPACITY> sizes{};
+    size_t count = 0;
+
+    [[nodiscard]] size_t space() const { return CAPACITY - count; }
+
+    // Appends what is queued on fd, up to space() datagrams; returns how many were read.
+    size_t receive(int fd) {
+        size_t free = space();
+#ifdef __linux__
+        std::array<mmsghdr, CAPACITY> messages{};
+        std::array<iovec, CAPACITY> vectors{};
+        for (size_t i = 0; i < free; ++i) {
+            vectors[i] = {data[count + i].data(), MAX_DATAGRAM};
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = &peers[count + i];
+            messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        }
+        int received = ::recvmmsg(fd, messages.data(), static_cast<unsigned>(free), MSG_DONTWAIT, nullptr);
+        if (received < 0) {
+            logError("recvmmsg");
+            return 0;
+        }
+        for (int i = 0; i < received; ++i) {
+            sizes[count + i] = messages[i].msg_len;
+        }
+        count += received;
+        return static_cast<size_t>(received);
+#else
+        size_t received = 0;
+        while (received < free) {
+            socklen_t length = sizeof(sockaddr_in);
+            ssize_t size = ::recvfrom(fd, data[count].data(), MAX_DATAGRAM, MSG_DONTWAIT,
+                                      reinterpret_cast<sockaddr*>(&peers[count]), &length);
+            if (size < 0) {
+                logError("recvfrom");
+                break;
+            }
+            sizes[count++] = static_cast<size_t>(size);
+            ++received;
+        }
+        return received;
+#endif
+    }
+
+    // Sends every datagram to its peer on fd and empties the batch. Datagrams the socket has no
+    // room for are dropped, as the network would.
+    size_t send(int fd) {
+        size_t sent = 0;
+#ifdef __linux__
+        std::array<mmsghdr, CAPACITY> messages{};
+        std::array<iovec, CAPACITY> vectors{};
+        for (size_t i = 0; i < count; ++i) {
+            vectors[i] = {data[i].data(), sizes[i]};
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = &peers[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        }
+        while (sent < count) {
+            int result = ::sendmmsg(fd, messages.data() + sent, static_cast<unsigned>(count - sent), MSG_DONTWAIT);
+            if (result <= 0) {
+                logError("sendmmsg");
+                break;
+            }
+            sent += static_cast<size_t>(result);
+        }
+#else
+        for (size_t i = 0; i < count; ++i) {
+            if (::sendto(fd, data[i].data(), sizes[i], MSG_DONTWAIT,
+                         reinterpret_cast<const sockaddr*>(&peers[i]), sizeof(sockaddr_in)) >= 0) {
+                ++sent;
+            } else {
+                logError("sendto");
+            }
+        }
+#endif
+        count = 0;
+        return sent;
+    }
+
+private:
+    static void logError(const char* call) {
+        // ECONNREFUSED is a backend's port unreachable report, which is also what UDP gives up on
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+            LOG_WARNING_LIMITED("%s failed: %s", call, std::strerror(errno));
+        }
+    }
+};
+
+// Routes UDP clients to the backend that hosts their room. The room comes from the client's
+// join datagram, or is RoomProtocol::DEFAULT_ROOM if its first datagram is audio. Each client
+// gets an upstream socket of its own, so the backend sees one distinct peer per client and
+// its replies can be matched to the client without parsing them.
+//
+// Client datagrams are read in batches and passed upstream unchanged. Replies from all
+// backends are collected into one batch and written back with a single sendmmsg per turn of
+// the event loop. Clients are forgotten after idle_timeout without a datagram, like
+// voice_server does. At most max_clients are routed at once, as each holds a descriptor;
+// datagrams from further addresses are dropped until some go idle. Not thread-safe: everything
+// runs on one io_context thread.
+class UdpRouter : public std::enable_shared_from_this<UdpRouter> {
+public:
+    UdpRouter(asio::io_context& io_context, unsigned short port, std::chrono::milliseconds idle_timeout,
+              size_t max_clients)
+        : io_context_(io_context),
+          socket_(io_context, udp::endpoint(udp::v4(), port)),
+          idle_timeout_(idle_timeout),
+          max_clients_(max_clients),
+          idle_timer_(io_context),
+          inbound_(std::make_unique<DatagramBatch>()),
+          outbound_(std::make_unique<DatagramBatch>()) {
+        socket_.non_blocking(true);
+    }
+
+    void start() {
+        std::cout << "Routing UDP on port " << socket_.local_endpoint().port() << std::endl;
+        start_receive();
+        start_idle_timer();
+    }
+
+    // Switches to a new backend table. Clients whose room now hashes to a different backend are
+    // re-joined there; everyone else keeps their upstream socket.
+    void set_backends(std::shared_ptr<const BackendTable> table) {
+        table_ = std::move(table);
+        size_t moved = 0;
+        for (auto it = sessions_.begin(); it != sessions_.end();) {
+            const Session& session = *it->second;
+            const Backend* backend = table_->route(session.room);
+            if (backend && backend->name == session.backend) {
+                ++it;
+                continue;
+            }
+            ++moved;
+            auto replacement = backend ? connect(session.client, session.room, *backend) : nullptr;
+            close(*it->second);
+            if (!replacement) {
+                liveness_.cancel(it->first);
+                it = sessions_.erase(it);
+                continue;
+            }
+            auto join = RoomProtocol::makeJoin(replacement->room);
+            std::error_code ignored;
+            replacement->upstream.send(asio::buffer(join), 0, ignored);
+            it->second = std::move(replacement);
+            ++it;
+        }
+        if (moved > 0) {
+            std::cout << "Moved " << moved << " UDP clients to new backends" << std::endl;
+        }
+    }
+
+private:
+    struct Session {
+        Session(asio::io_context& io_context, const sockaddr_in& client, std::string room, std::string backend)
+            : client(client), room(std::move(room)), backend(std::move(backend)), upstream(io_context) {}
+
+        sockaddr_in client;
+        std::string room;
+        std::string backend;
+        udp::socket upstream;
+    };
+
+    static constexpr size_t MAX_BATCHES_PER_WAKEUP = 4;
+    static constexpr auto IDLE_TICK = std::chrono::milliseconds(100);
+
+    // The pending wait holds the session; closing the socket cancels it and lets the session go.
+    static void close(Session& session) {
+        std::error_code ignored;
+        session.upstream.close(ignored);
+    }
+
+    static uint64_t client_key(const sockaddr_in& address) {
+        return (static_cast<uint64_t>(address.sin_addr.s_addr) << 16) | address.sin_port;
+    }
+
+    void start_receive() {
+        socket_.async_wait(udp::socket::wait_read, [this, self = shared_from_this()](std::error_code ec) {
+            if (ec) {
+                if (ec == asio::error::operation_aborted) {
+                    return;
+                }
+                LOG_WARNING_LIMITED("Receive error: %s", ec.message());
+            } else {
+                // Bounded, so a flood of client datagrams cannot starve the replies
+                for (size_t batch = 0; batch < MAX_BATCHES_PER_WAKEUP; ++batch) {
+                    size_t received = inbound_->receive(socket_.native_handle());
+                    for (size_t i = 0; i < inbound_->count; ++i) {
+                        forward(inbound_->peers[i], inbound_->data[i].data(), inbound_->sizes[i]);
+                    }
+                    inbound_->count = 0;
+                    if (received < DatagramBatch::CAPACITY) {
+                        break;
+                    }
+                }
+            }
+            start_receive();
+        });
+    }
+
+    void forward(const sockaddr_in& client, const uint8_t* data, size_t size) {
+        uint64_t key = client_key(client);
+        std::string join_room;
+        bool is_join = RoomProtocol::parseJoin(data, size, join_room);
+
+        auto it = sessions_.find(key);
+        Session* session = it != sessions_.end() ? it->second.get() : nullptr;
+        if (session == nullptr || (is_join && session->room != join_room)) {
+            std::string room = is_join ? join_room : RoomProtocol::DEFAULT_ROOM;
+            const Backend* backend = table_ ? table_->route(room) : nullptr;
+            if (backend == nullptr) {
+                return;
+            }
+            if (session != nullptr && session->backend == backend->name) {
+                session->room = room;  // Same backend: the join itself moves the client
+            } else if (session == nullptr && sessions_.size() >= max_clients_) {
+                LOG_WARNING_LIMITED("Dropping a client of room %s, %zu UDP clients are routed already", room,
+                                    sessions_.size());
+                return;
+            } else {
+                // The previous backend, if any, times the client out on its own
+                auto created = connect(client, room, *backend);
+                if (!created) {
+                    return;
+                }
+                session = created.get();
+                auto& slot = sessions_[key];
+                if (slot) {
+                    close(*slot);
+                }
+                slot = std::move(created);
+            }
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + idle_timeout_;
+        if (!liveness_.reschedule(key, deadline)) {
+            liveness_.schedule(key, deadline, true);
+        }
+
+        if (::send(session->upstream.native_handle(), data, size, MSG_DONTWAIT) < 0 &&
+            errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+            LOG_WARNING_LIMITED("Forward to %s failed: %s", session->backend, std::strerror(errno));
+        }
+    }
+
+    std::shared_ptr<Session> connect(const sockaddr_in& client, const std::string& room, const Backend& backend) {
+        auto session = std::make_shared<Session>(io_context_, client, room, backend.name);
+        std::error_code ec;
+        session->upstream.open(udp::v4(), ec);
+        if (!ec) {
+            session->upstream.connect(backend.udp, ec);
+        }
+        if (ec) {
+            LOG_WARNING_LIMITED("Failed to open upstream to %s: %s", backend.name, ec.message());
+            return nullptr;
+        }
+        session->upstream.non_blocking(true);
+        start_upstream_receive(session);
+        return session;
+    }
+
+    // Replies go into the shared outbound batch; it is flushed once the handlers ready in this
+    // turn of the event loop have run, or as soon as it is full.
+    void start_upstream_receive(const std::shared_ptr<Session>& session) {
+        session->upstream.async_wait(udp::socket::wait_read,
+            [this, self = shared_from_this(), session](std::error_code ec) {
+                if (ec) {
+                    return;  // Closed: the client went idle or moved
+                }
+                size_t first = outbound_->count;
+                if (outbound_->space() == 0) {
+                    flush();
+                    first = 0;
+                }
+                outbound_->receive(session->upstream.native_handle());
+                for (size_t i = first; i < outbound_->count; ++i) {
+                    outbound_->peers[i] = session->client;
+                }
+                if (outbound_->space() == 0) {
+                    flush();
+                } else if (outbound_->count > 0 && !flush_pending_) {
+                    flush_pending_ = true;
+                    asio::post(io_context_, [this, self]() {
+                        flush_pending_ = false;
+                        flush();
+                    });
+                }
+                start_upstream_receive(session);
+            });
+    }
+
+    void flush() {
+        if (outbound_->count > 0) {
+            outbound_->send(socket_.native_handle());
+        }
+    }
+
+    void start_idle_timer() {
+        idle_timer_.expires_after(IDLE_TICK);
+        idle_timer_.async_wait([this, self = shared_from_this()](std::error_code ec) {
+            if (ec) {
+                return;
+            }
+            liveness_.advance(std::chrono::steady_clock::now(), [this](uint64_t key, bool&) {
+                auto it = sessions_.find(key);
+                if (it != sessions_.end()) {
+                    close(*it->second);
+                    sessions_.erase(it);
+                }
+            });
+            start_idle_timer();
+        });
+    }
+
+    asio::io_context& io_context_;
+    udp::socket socket_;
+    std::chrono::milliseconds idle_timeout_;
+    size_t max_clients_;
+    asio::steady_timer idle_timer_;
+    std::unique_ptr<DatagramBatch> inbound_;
+    std::unique_ptr<DatagramBatch> outbound_;
+    bool flush_pending_ = false;
+    std::shared_ptr<const BackendTable> table_;
+    std::unordered_map<uint64_t, std::shared_ptr<Session>> sessions_;
+    TimerWheel<uint64_t, bool> liveness_{IDLE_TICK};
+};
@@ -0,0 +1,240 @@
+//
+// Created by maxim on 26.09.2024.
+//
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <asio.hpp>
+
+#include "Backends.h"
+#include "HttpMessage.h"
+#include "Logger.h"
+#include "RoomProtocol.h"
+
+using asio::ip::tcp;
+
+// One client connection passed through to a backend. The request head is read first, to
+// take the room from the upgrade target, then sent on with any bytes that followed it; after
+// that the bytes are relayed both ways untouched. The router does not terminate TLS, so
+// wss:// has to end in front of it.
+class TcpProxy : public std::enable_shared_from_this<TcpProxy> {
+public:
+    // Backend for a room under the router's current table, if there is one.
+    using route_handler = std::function<std::optional<Backend>(const std::string& room)>;
+    using close_handler = std::function<void()>;
+
+    TcpProxy(asio::io_context& io_context, tcp::socket client, std::chrono::milliseconds request_timeout,
+             route_handler route, close_handler on_close)
+        : client_(std::move(client)),
+          upstream_(io_context),
+          deadline_(io_context),
+          request_(MAX_REQUEST_HEAD),
+          request_timeout_(request_timeout),
+          route_(std::move(route)),
+          on_close_(std::move(on_close)) {}
+
+    void start() {
+        auto self(shared_from_this());
+        deadline_.expires_after(request_timeout_);
+        deadline_.async_wait([this, self](std::error_code ec) {
+            if (!ec) {
+                close();  // Never sent a full request head
+            }
+        });
+        asio::async_read_until(client_, request_, "\r\n\r\n",
+            [this, self](std::error_code ec, std::size_t) {
+                deadline_.cancel();
+                if (ec == asio::error::not_found) {
+                    // Answered as voice_server answers a head over its limit
+                    static const std::string too_large = [] {
+                        auto response = HttpResponse::headersTooLarge();
+                        return response.serializeHead() + response.body;
+                    }();
+                    asio::async_write(client_, asio::buffer(too_large),
+                        [this, self](std::error_code, std::size_t) { close(); });
+                    return;
+                }
+                if (ec) {
+                    close();
+                    return;
+                }
+                connect();
+            });
+    }
+
+    [[nodiscard]] const std::string& room() const { return room_; }
+
+    [[nodiscard]] const std::string& backend() const { return backend_; }
+
+    void close() {
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+        std::error_code ignored;
+        deadline_.cancel();
+        client_.shutdown(tcp::socket::shutdown_both, ignored);
+        client_.close(ignored);
+        upstream_.shutdown(tcp::socket::shutdown_both, ignored);
+        upstream_.close(ignored);
+        if (on_close_) {
+            on_close_();
+        }
+    }
+
+private:
+    static constexpr size_t MAX_REQUEST_HEAD = 8192;
+    static constexpr size_t RELAY_BUFFER_SIZE = 16384;
+
+    void connect() {
+        // "GET <target> HTTP/1.1"
+        std::string head(asio::buffers_begin(request_.data()), asio::buffers_end(request_.data()));
+        auto target_start = head.find(' ');
+        auto target_end = target_start == std::string::npos ? target_start : head.find(' ', target_start + 1);
+        room_ = target_end == std::string::npos
+                    ? RoomProtocol::DEFAULT_ROOM
+                    : RoomProtocol::roomFromTarget(head.substr(target_start + 1, target_end - target_start - 1));
+        auto backend = route_(room_);
+        if (!backend) {
+            static const std::string unavailable =
+                "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            asio::async_write(client_, asio::buffer(unavailable),
+                [this, self = shared_from_this()](std::error_code, std::size_t) { close(); });
+            return;
+        }
+        backend_ = backend->name;
+        upstream_.async_connect(backend->websocket, [this, self = shared_from_this()](std::error_code ec) {
+            if (ec) {
+                std::cerr << "Failed to connect to backend " << backend_ << ": " << ec.message() << std::endl;
+                close();
+                return;
+            }
+            std::error_code ignored;
+            client_.set_option(tcp::no_delay(true), ignored);
+            upstream_.set_option(tcp::no_delay(true), ignored);
+            asio::async_write(upstream_, request_.data(), [this, self](std::error_code ec, std::size_t) {
+                if (ec) {
+                    close();
+                    return;
+                }
+                request_.consume(request_.size());
+                relay(client_, upstream_, to_upstream_);
+                relay(upstream_, client_, to_client_);
+            });
+        });
+    }
+
+    // One read in flight per direction; the next read waits for the write, which is the backpressure.
+    void relay(tcp::socket& from, tcp::socket& to, std::array<uint8_t, RELAY_BUFFER_SIZE>& buffer) {
+        from.async_read_some(asio::buffer(buffer),
+            [this, self = shared_from_this(), &from, &to, &buffer](std::error_code ec, std::size_t length) {
+                if (ec) {
+                    close();
+                    return;
+                }
+                asio::async_write(to, asio::buffer(buffer.data(), length),
+                    [this, self, &from, &to, &buffer](std::error_code ec, std::size_t) {
+                        if (ec) {
+                            close();
+                            return;
+                        }
+                        relay(from, to, buffer);
+                    });
+            });
+    }
+
+    tcp::socket client_;
+    tcp::socket upstream_;
+    asio::steady_timer deadline_;
+    asio::streambuf request_;
+    std::chrono::milliseconds request_timeout_;
+    route_handler route_;
+    close_handler on_close_;
+    std::string room_;
+    std::string backend_;
+    bool closed_ = false;
+    std::array<uint8_t, RELAY_BUFFER_SIZE> to_upstream_{};
+    std::array<uint8_t, RELAY_BUFFER_SIZE> to_client_{};
+};
+
+// Accepts WebSocket (and plain HTTP) connections and proxies each to the backend that hosts
+// the room in its request target. Not thread-safe: everything runs on one io_context thread.
+class WebSocketRouter : public std::enable_shared_from_this<WebSocketRouter> {
+public:
+    WebSocketRouter(asio::io_context& io_context, unsigned short port, int backlog,
+                    std::chrono::milliseconds request_timeout)
+        : io_context_(io_context), acceptor_(io_context), request_timeout_(request_timeout) {
+        tcp::endpoint endpoint(tcp::v4(), port);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(tcp::acceptor::reuse_address(true));
+        acceptor_.bind(endpoint);
+        acceptor_.listen(backlog);
+    }
+
+    void start() {
+        std::cout << "Routing WebSocket on port " << acceptor_.local_endpoint().port() << std::endl;
+        accept();
+    }
+
+    // Switches to a new backend table. A TCP stream cannot change backend, so connections whose
+    // room now hashes elsewhere are closed; clients reconnect and land on the new owner.
+    void set_backends(std::shared_ptr<const BackendTable> table) {
+        table_ = std::move(table);
+        std::vector<std::shared_ptr<TcpProxy>> moved;
+        for (const auto& [id, weak_proxy] : proxies_) {
+            auto proxy = weak_proxy.lock();
+            if (!proxy || proxy->backend().empty()) {
+                continue;  // Still reading its request; it will be routed with the new table
+            }
+            const Backend* backend = table_->route(proxy->room());
+            if (!backend || backend->name != proxy->backend()) {
+                moved.push_back(proxy);
+            }
+        }
+        for (const auto& proxy : moved) {
+            proxy->close();
+        }
+        if (!moved.empty()) {
+            std::cout << "Closed " << moved.size() << " WebSocket connections to move them" << std::endl;
+        }
+    }
+
+private:
+    void accept() {
+        acceptor_.async_accept([this, self = shared_from_this()](std::error_code ec, tcp::socket socket) {
+            if (ec == asio::error::operation_aborted) {
+                return;
+            }
+            if (!ec) {
+                uint64_t id = next_id_++;
+                auto proxy = std::make_shared<TcpProxy>(
+                    io_context_, std::move(socket), request_timeout_,
+                    [this, self](const std::string& room) -> std::optional<Backend> {
+                        const Backend* backend = table_ ? table_->route(room) : nullptr;
+                        return backend ? std::optional<Backend>(*backend) : std::nullopt;
+                    },
+                    [this, self, id]() { proxies_.erase(id); });
+                proxies_[id] = proxy;
+                proxy->start();
+            } else if (ec) {
+                LOG_ERROR_LIMITED("Accept error: %s", ec.message());
+            }
+            accept();
+        });
+    }
+
+    asio::io_context& io_context_;
+    tcp::acceptor acceptor_;
+    std::chrono::milliseconds request_timeout_;
+    std::shared_ptr<const BackendTable> table_;
+    std::unordered_map<uint64_t, std::weak_ptr<TcpProxy>> proxies_;
+    uint64_t next_id_ = 0;
+};
@@ -0,0 +1,74 @@
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <asio.hpp>
+
+#include "AsioThreadPool.h"
+#include "Backends.h"
+#include "Config.h"
+#include "UdpRouter.h"
+#include "WebSocketRouter.h"
+
+// Front tier for several voice_servers: every participant of a room, UDP or WebSocket, is sent
+// to the same backend, chosen by consistent hashing of the room id. kill -HUP <pid> re-reads
+// the backends from the config file; only the rooms whose owner changed move.
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <config_file>" << std::endl;
+        return 1;
+    }
+    std::string config_file = argv[1];
+    Config config;
+    if (!config.load(config_file)) {
+        return 1;
+    }
+
+    try {
+        AsioThreadPool thread_pool(1);
+        auto &io_context = thread_pool.get_io_context();
+        auto replicas = config.get<size_t>("ring_replicas", 160);
+
+        auto udp_router = std::make_shared<UdpRouter>(
+            io_context, config.get<unsigned short>("port", 12345),
+            std::chrono::milliseconds(config.get<int>("udp_idle_timeout_ms", 30000)),
+            config.get<size_t>("udp_max_clients", 10000));
+        auto websocket_router = std::make_shared<WebSocketRouter>(
+            io_context, config.get<unsigned short>("websocket_port", 8080), config.get<int>("websocket_backlog", 4096),
+            std::chrono::milliseconds(config.get<int>("websocket_handshake_timeout_ms", 5000)));
+
+        auto apply_backends = [&](const Config &source) {
+            auto table = BackendTable::fromJson(io_context, source.get<nlohmann::json>("backends", nlohmann::json::array()),
+                                                replicas);
+            std::cout << "Routing to " << table->backends().size() << " backends" << std::endl;
+            udp_router->set_backends(table);
+            websocket_router->set_backends(table);
+        };
+        apply_backends(config);
+
+        asio::signal_set reload_signal(io_context, SIGHUP);
+        std::function<void()> wait_for_reload = [&]() {
+            reload_signal.async_wait([&](const std::error_code &ec, int) {
+                if (ec) {
+                    return;
+                }
+                Config reloaded;
+                if (reloaded.load(config_file)) {
+                    apply_backends(reloaded);
+                }
+                wait_for_reload();
+            });
+        };
+        wait_for_reload();
+
+        udp_router->start();
+        websocket_router->start();
+        thread_pool.run();
+    } catch (std::exception &e) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+    }
+
+    return 0;
+}
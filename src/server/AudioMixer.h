@@ -1,3 +1,5 @@
+#pragma once
+
 #include <vector>
 #include <cstdint>
 #include <algorithm>
@@ -6,7 +8,11 @@
 
 class AudioMixer {
 public:
-    static AudioPacket mix(const std::vector<AudioPacket>& packets) {
+    static constexpr float HEADROOM = 0.5f;
+
+    // Per-sample average of the packets, each weighted by its number of sources, times gain.
+    // A partial mix passed on to other nodes uses a gain of 1 so that it stays an average.
+    static AudioPacket mix(const std::vector<AudioPacket>& packets, float gain = HEADROOM) {
         if (packets.empty()) {
             return AudioPacket();
         }
@@ -20,15 +26,18 @@ public:
 
         std::vector<int32_t> mixBuffer(maxSampleCount, 0);
         std::vector<int> sampleCounts(maxSampleCount, 0);
+        int sources = 0;
 
         // Mix all packets
         for (const auto& packet : packets) {
             const int16_t* samples = reinterpret_cast<const int16_t*>(packet.data());
             size_t packetSampleCount = packet.size() / sizeof(int16_t);
+            int weight = packet.sources();
+            sources += weight;
 
             for (size_t i = 0; i < packetSampleCount; ++i) {
-                mixBuffer[i] += static_cast<int32_t>(samples[i]);
-                sampleCounts[i]++;
+                mixBuffer[i] += static_cast<int32_t>(samples[i]) * weight;
+                sampleCounts[i] += weight;
             }
         }
 
@@ -36,15 +45,16 @@ public:
         std::vector<int16_t> outputBuffer(maxSampleCount);
         for (size_t i = 0; i < maxSampleCount; ++i) {
             if (sampleCounts[i] > 0) {
-                int32_t sample = mixBuffer[i] / static_cast<int32_t>(sampleCounts[i]);
-                const float headroom_factor = 0.5f;  // Adjust as needed
-                int32_t scaled_sample = static_cast<int32_t>(sample * headroom_factor);
+                int32_t sample = mixBuffer[i] / sampleCounts[i];
+                int32_t scaled_sample = static_cast<int32_t>(static_cast<float>(sample) * gain);
                 outputBuffer[i] = static_cast<int16_t>(std::clamp(scaled_sample, INT16_MIN, static_cast<int32_t>(INT16_MAX)));
             } else {
                 outputBuffer[i] = 0;
             }
         }
 
-        return AudioPacket(reinterpret_cast<const uint8_t*>(outputBuffer.data()), outputBuffer.size() * sizeof(int16_t));
+        AudioPacket mixed(reinterpret_cast<const uint8_t*>(outputBuffer.data()), outputBuffer.size() * sizeof(int16_t));
+        mixed.set_sources(static_cast<uint16_t>(std::min<int>(sources, UINT16_MAX)));
+        return mixed;
     }
 };
\ No newline at end of file
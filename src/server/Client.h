@@ -9,6 +9,7 @@
 
 #include "Connection.h"
 #include "AudioPacket.h"
+#include "PcmFormat.h"
 enum class ClientType: uint8_t
 {
     WEB_SOCKET,
@@ -20,10 +21,16 @@ class Client {
 public:
     virtual ~Client() = default;
 
-    virtual void send(const AudioPacket& packet) = 0;
+    // on_sent, if set, runs once the packet has been written to the transport.
+    virtual void send(const AudioPacket& packet, std::function<void()> on_sent = {}) = 0;
 
     virtual std::string getId() = 0;
 
+    virtual ClientType getType() const = 0;
+
+    // Layout of the audio the client sends and is sent.
+    virtual Pcm::Format format() const { return {}; }
+
 };
 
 class UDPClient: public Client{
@@ -37,10 +44,12 @@ public:
         : connection_(std::move(connection)), id_(std::move(id)), socket_(socket) {
     }
 
-    void send(const AudioPacket &packet) override {
-        connection_->send(socket_, packet);
+    void send(const AudioPacket &packet, std::function<void()> on_sent = {}) override {
+        connection_->send(socket_, packet, std::move(on_sent));
     }
 
+    ClientType getType() const override { return ClientType::UDP; }
+
     [[nodiscard]] std::string getId() const { return id_; }
 
 private:
@@ -52,19 +61,25 @@ private:
 
 class WebSocketClient: public Client{
 public:
-    WebSocketClient(std::shared_ptr<WebSocketSession> connection, udp::socket& socket, std::string id)
-        : Client(), connection_(std::move(connection)), id_(std::move(id)), socket_(socket)
+    WebSocketClient(std::shared_ptr<WebSocketSession> connection, udp::socket& socket, std::string id,
+                    Pcm::Format format = {})
+        : Client(), connection_(std::move(connection)), id_(std::move(id)), socket_(socket), format_(format)
     {
     }
 
-    void send(const AudioPacket& packet) override {
-        connection_->send(packet.data_vector(), WebSocketOpCode::Binary);
+    void send(const AudioPacket& packet, std::function<void()> on_sent = {}) override {
+        connection_->send(packet.bytes(), WebSocketOpCode::Binary, std::move(on_sent));
     }
 
     [[nodiscard]] std::string getId() override { return id_; }
 
+    ClientType getType() const override { return ClientType::WEB_SOCKET; }
+
+    Pcm::Format format() const override { return format_; }
+
 private:
     std::shared_ptr<WebSocketSession> connection_;
     std::string id_;
     udp::socket& socket_;
+    Pcm::Format format_;
 };
\ No newline at end of file
@@ -4,10 +4,13 @@
 #pragma once
 
 #include <asio.hpp>
+#include <functional>
 #include <iostream>
 #include <string>
 
 #include "AudioPacket.h"
+#include "Logger.h"
+#include "VoiceMetrics.h"
 
 
 using asio::ip::udp;
@@ -16,12 +19,20 @@ public:
     Connection(const udp::endpoint& endpoint)
         : endpoint_(endpoint) {}
 
-    void send(udp::socket& socket, const AudioPacket& packet) {
+    // on_sent, if set, runs when the datagram has been handed to the kernel.
+    void send(udp::socket& socket, const AudioPacket& packet, std::function<void()> on_sent = {}) {
+        auto& metrics = VoiceMetrics::get().udp;
+        metrics.packets_out.inc();
+        metrics.bytes_out.inc(packet.size());
+        // The caller's packet may be gone before the send completes
+        auto payload = std::make_shared<AudioPacket>(packet);
         socket.async_send_to(
-            asio::buffer(packet.data(), packet.size()), endpoint_,
-            [](std::error_code ec, std::size_t bytes_sent) {
+            asio::buffer(payload->data(), payload->size()), endpoint_,
+            [payload, on_sent = std::move(on_sent)](std::error_code ec, std::size_t bytes_sent) {
                 if (ec) {
-                    std::cerr << "Send error: " << ec.message() << std::endl;
+                    LOG_WARNING_LIMITED("Send error: %s", ec.message());
+                } else if (on_sent) {
+                    on_sent();
                 }
             });
     }
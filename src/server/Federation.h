@@ -0,0 +1,218 @@
+//
+// Created by maxim on 25.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <asio.hpp>
+#include <unistd.h>
+
+#include "AudioPacket.h"
+#include "Logger.h"
+#include "RoomRegistry.h"
+#include "VoiceMetrics.h"
+
+using asio::ip::udp;
+
+struct FederationSettings {
+    std::string node_id;             // unique per node; used to drop our own packets
+    unsigned short port = 0;         // trunk UDP port; 0 disables federation
+    std::vector<std::string> peers;  // trunk "host:port" of every other node
+};
+
+// Cascaded mixing between voice_server nodes. Every mix tick, a room mixes the audio of its
+// local participants into one partial mix and sends it to every peer node over the UDP trunk.
+// Peers hosting the same room add it to what their own listeners hear; peers without local
+// participants in that room drop it. Only local audio is ever forwarded, so a node never
+// receives its own contribution back and no echo cancellation is needed downstream. Trunk
+// traffic per room is one stream per node, whatever the number of participants.
+//
+// Datagram: "VCFM", version, room length, sources (uint16 LE), node (uint64 LE), room name,
+// then PCM samples of the partial mix (the weighted average of its sources).
+namespace FederationProtocol
+{
+    inline constexpr std::array<uint8_t, 4> MAGIC = {'V', 'C', 'F', 'M'};
+    inline constexpr uint8_t VERSION = 1;
+    inline constexpr size_t HEADER_SIZE = 16;
+
+    // FNV-1a of the node id; collisions between a handful of nodes are not a concern.
+    inline uint64_t nodeHash(std::string_view node_id) {
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : node_id) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    struct PartialMix {
+        uint64_t node = 0;
+        uint16_t sources = 0;
+        std::string_view room;
+        std::span<const uint8_t> pcm;
+    };
+
+    inline std::vector<uint8_t> encode(uint64_t node, const std::string& room, const AudioPacket& packet) {
+        std::vector<uint8_t> datagram(HEADER_SIZE + room.size() + packet.size());
+        uint8_t* p = datagram.data();
+        std::memcpy(p, MAGIC.data(), MAGIC.size());
+        p[4] = VERSION;
+        p[5] = static_cast<uint8_t>(room.size());
+        p[6] = static_cast<uint8_t>(packet.sources() & 0xFF);
+        p[7] = static_cast<uint8_t>(packet.sources() >> 8);
+        for (int i = 0; i < 8; ++i) {
+            p[8 + i] = static_cast<uint8_t>(node >> (8 * i));
+        }
+        std::memcpy(p + HEADER_SIZE, room.data(), room.size());
+        std::memcpy(p + HEADER_SIZE + room.size(), packet.data(), packet.size());
+        return datagram;
+    }
+
+    inline bool parse(const uint8_t* data, size_t size, PartialMix& mix) {
+        if (size < HEADER_SIZE || std::memcmp(data, MAGIC.data(), MAGIC.size()) != 0 || data[4] != VERSION) {
+            return false;
+        }
+        size_t room_length = data[5];
+        if (room_length == 0 || size < HEADER_SIZE + room_length) {
+            return false;
+        }
+        mix.sources = static_cast<uint16_t>(data[6] | (data[7] << 8));
+        mix.node = 0;
+        for (int i = 0; i < 8; ++i) {
+            mix.node |= static_cast<uint64_t>(data[8 + i]) << (8 * i);
+        }
+        mix.room = {reinterpret_cast<const char*>(data) + HEADER_SIZE, room_length};
+        mix.pcm = {data + HEADER_SIZE + room_length, size - HEADER_SIZE - room_length};
+        return mix.sources > 0;
+    }
+}
+
+class FederationTrunk : public std::enable_shared_from_this<FederationTrunk> {
+public:
+    FederationTrunk(asio::io_context& io_context, const FederationSettings& settings,
+                    std::shared_ptr<RoomRegistry> room_registry)
+        : FederationTrunk(io_context, udp::socket(io_context, udp::endpoint(udp::v4(), settings.port)), settings,
+                          std::move(room_registry)) {}
+
+    // Trunk on a socket inherited from a previous process (see release()).
+    FederationTrunk(asio::io_context& io_context, udp::socket socket, const FederationSettings& settings,
+                    std::shared_ptr<RoomRegistry> room_registry)
+        : socket_(std::move(socket)),
+          node_(FederationProtocol::nodeHash(settings.node_id)),
+          room_registry_(std::move(room_registry)) {
+        udp::resolver resolver(io_context);
+        for (const auto& peer : settings.peers) {
+            auto colon = peer.rfind(':');
+            if (colon == std::string::npos) {
+                std::cerr << "Ignoring federation peer without a port: " << peer << std::endl;
+                continue;
+            }
+            std::error_code ec;
+            auto results = resolver.resolve(udp::v4(), peer.substr(0, colon), peer.substr(colon + 1), ec);
+            if (ec || results.empty()) {
+                std::cerr << "Failed to resolve federation peer " << peer << ": " << ec.message() << std::endl;
+                continue;
+            }
+            peers_.push_back(results.begin()->endpoint());
+        }
+    }
+
+    void start() {
+        std::cout << "Federation trunk on port " << socket_.local_endpoint().port() << " with "
+                  << peers_.size() << " peers" << std::endl;
+        start_receive();
+    }
+
+    // Stops the trunk and returns a duplicate of its socket for a successor process, or -1.
+    int release() {
+        int fd = ::dup(socket_.native_handle());
+        std::error_code ignored;
+        socket_.close(ignored);
+        return fd;
+    }
+
+    // Takes back the socket release() gave up, when the successor did not take it over.
+    void resume(int fd) {
+        std::error_code ec;
+        socket_.assign(udp::v4(), fd, ec);
+        if (ec) {
+            std::cerr << "Failed to resume federation trunk: " << ec.message() << std::endl;
+            ::close(fd);
+            return;
+        }
+        start_receive();
+    }
+
+    // Sends a room's partial mix to every peer; the datagram is encoded once for all of them.
+    void sendPartial(const std::string& room, const AudioPacket& partial) {
+        if (peers_.empty() || room.size() > UINT8_MAX || !socket_.is_open()) {
+            return;
+        }
+        auto datagram = std::make_shared<std::vector<uint8_t>>(FederationProtocol::encode(node_, room, partial));
+        auto& metrics = VoiceMetrics::get().federation;
+        for (const auto& peer : peers_) {
+            metrics.packets_out.inc();
+            metrics.bytes_out.inc(partial.size());
+            socket_.async_send_to(asio::buffer(*datagram), peer,
+                [datagram](std::error_code ec, std::size_t) {
+                    if (ec) {
+                        LOG_WARNING_LIMITED("Federation send error: %s", ec.message());
+                    }
+                });
+        }
+    }
+
+private:
+    void start_receive() {
+        socket_.async_receive_from(asio::buffer(recv_buffer_), sender_,
+            [this, self = shared_from_this()](std::error_code ec, std::size_t length) {
+                if (ec == asio::error::operation_aborted) {
+                    return;
+                }
+                if (!ec) {
+                    handle_receive(length);
+                } else {
+                    LOG_WARNING_LIMITED("Federation receive error: %s", ec.message());
+                }
+                start_receive();
+            });
+    }
+
+    void handle_receive(size_t length) {
+        // Only the configured peers may feed rooms; anyone else reaching the port is ignored
+        if (std::find(peers_.begin(), peers_.end(), sender_) == peers_.end()) {
+            VoiceMetrics::get().federation_rejected.inc();
+            LOG_WARNING_LIMITED("Dropping trunk datagram from %s, not a federation peer", sender_.address().to_string());
+            return;
+        }
+        FederationProtocol::PartialMix mix;
+        if (!FederationProtocol::parse(recv_buffer_.data(), length, mix) || mix.node == node_) {
+            return;
+        }
+        auto& metrics = VoiceMetrics::get().federation;
+        metrics.packets_in.inc();
+        metrics.bytes_in.inc(mix.pcm.size());
+        auto room = room_registry_->findRoom(std::string(mix.room));
+        if (!room) {
+            return;
+        }
+        auto packet = AudioPacket::borrow(std::as_bytes(mix.pcm));
+        packet.set_sources(mix.sources);
+        room->processRemoteMix(mix.node, packet);
+    }
+
+    udp::socket socket_;
+    udp::endpoint sender_;
+    std::array<uint8_t, 16384> recv_buffer_{};
+    uint64_t node_;
+    std::vector<udp::endpoint> peers_;
+    std::shared_ptr<RoomRegistry> room_registry_;
+};
@@ -0,0 +1,108 @@
+//
+// Created by maxim on 01.10.2024.
+//
+#pragma once
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// What each listener of a room wants to hear of each speaker. Sparse: only listeners who
+// changed something have a row, and a row holds only what differs from hearing everyone at
+// full volume. A listener never hears themselves.
+class GainMatrix {
+public:
+    // Per-pair volume, 1 being unchanged; kept across mute and unmute.
+    void setVolume(const std::string& listener, const std::string& speaker, float volume) {
+        if (volume == 1.0f) {
+            if (auto* row = find(listener)) {
+                row->volumes.erase(speaker);
+                prune(listener);
+            }
+            return;
+        }
+        rows_[listener].volumes[speaker] = volume;
+    }
+
+    void setMuted(const std::string& listener, const std::string& speaker, bool muted) {
+        if (muted) {
+            rows_[listener].muted.insert(speaker);
+        } else if (auto* row = find(listener)) {
+            row->muted.erase(speaker);
+            prune(listener);
+        }
+    }
+
+    // Only these speakers are heard, or everyone again with nullopt.
+    void setSubscriptions(const std::string& listener, std::optional<std::vector<std::string>> speakers) {
+        if (speakers) {
+            rows_[listener].subscriptions.emplace(speakers->begin(), speakers->end());
+        } else if (auto* row = find(listener)) {
+            row->subscriptions.reset();
+            prune(listener);
+        }
+    }
+
+    // Forgets the client both as a listener and as a speaker.
+    void remove(const std::string& client) {
+        rows_.erase(client);
+        for (auto it = rows_.begin(); it != rows_.end();) {
+            it->second.volumes.erase(client);
+            it->second.muted.erase(client);
+            it = it->second.empty() ? rows_.erase(it) : std::next(it);
+        }
+    }
+
+    // Whether listener hears everyone, themselves excepted, at full volume.
+    [[nodiscard]] bool isDefault(const std::string& listener) const {
+        return rows_.find(listener) == rows_.end();
+    }
+
+    [[nodiscard]] float gain(const std::string& listener, const std::string& speaker) const {
+        if (listener == speaker) {
+            return 0.0f;
+        }
+        auto it = rows_.find(listener);
+        if (it == rows_.end()) {
+            return 1.0f;
+        }
+        const Row& row = it->second;
+        if ((row.subscriptions && !row.subscriptions->contains(speaker)) || row.muted.contains(speaker)) {
+            return 0.0f;
+        }
+        auto volume = row.volumes.find(speaker);
+        return volume != row.volumes.end() ? volume->second : 1.0f;
+    }
+
+    // Speakers that are not room members (the mixes of federated nodes): heard unless the
+    // listener subscribed to particular speakers.
+    [[nodiscard]] float remoteGain(const std::string& listener) const {
+        auto it = rows_.find(listener);
+        return it != rows_.end() && it->second.subscriptions ? 0.0f : 1.0f;
+    }
+
+private:
+    struct Row {
+        std::unordered_map<std::string, float> volumes;
+        std::unordered_set<std::string> muted;
+        std::optional<std::unordered_set<std::string>> subscriptions;
+
+        [[nodiscard]] bool empty() const { return volumes.empty() && muted.empty() && !subscriptions; }
+    };
+
+    Row* find(const std::string& listener) {
+        auto it = rows_.find(listener);
+        return it != rows_.end() ? &it->second : nullptr;
+    }
+
+    void prune(const std::string& listener) {
+        auto it = rows_.find(listener);
+        if (it != rows_.end() && it->second.empty()) {
+            rows_.erase(it);
+        }
+    }
+
+    std::unordered_map<std::string, Row> rows_;
+};
@@ -0,0 +1,343 @@
+//
+// Created by maxim on 27.09.2024.
+//
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <asio.hpp>
+#include <nlohmann/json.hpp>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "SocketHandoff.h"
+#include "WebSocketSession.h"
+
+// Zero-downtime binary upgrades. A running voice_server listens on upgrade_socket (a Unix domain
+// socket path). A new voice_server started with the same configuration connects to it, and the
+// old process then:
+//   1. stops reading its UDP socket, accepting on its listening sockets and reading its
+//      WebSocket sessions;
+//   2. passes those sockets over with SCM_RIGHTS, together with every UDP client's room and the
+//      unparsed bytes of every WebSocket session;
+//   3. asks the sessions it could not hand over (user-space TLS) to reconnect with 1012, waits
+//      for them and for requests in progress to finish, and exits.
+// If the successor goes away before it has everything, the old process takes the sockets and
+// sessions back, resumes serving and waits for the next successor instead of exiting.
+// The new process resumes everything before its first mix tick. Datagrams and connections that
+// arrive in between wait in the shared sockets' kernel queues, so the audio gap is the time the
+// handoff takes, typically a few milliseconds.
+struct InheritedState {
+    int udp_fd = -1;
+    int federation_fd = -1;
+    std::vector<int> acceptor_fds;
+    std::vector<std::pair<std::string, std::string>> udp_clients;  // client key, room
+    std::vector<WebSocketSession::Handover> websocket_sessions;
+
+    // Descriptors not taken over by a server yet.
+    void close_all() {
+        for (int fd : all_fds()) {
+            ::close(fd);
+        }
+        udp_fd = federation_fd = -1;
+        acceptor_fds.clear();
+        websocket_sessions.clear();
+    }
+
+    [[nodiscard]] std::vector<int> all_fds() const {
+        std::vector<int> fds;
+        for (int fd : {udp_fd, federation_fd}) {
+            if (fd >= 0) {
+                fds.push_back(fd);
+            }
+        }
+        fds.insert(fds.end(), acceptor_fds.begin(), acceptor_fds.end());
+        for (const auto& session : websocket_sessions) {
+            fds.push_back(session.fd);
+        }
+        return fds;
+    }
+};
+
+// The state travels as a series of CBOR messages ending with {"type": "done"}; each message
+// carries at most SocketHandoff::MAX_FDS descriptors and stays under SocketHandoff::MAX_MESSAGE.
+// A session's unparsed bytes beyond UNPARSED_BYTES_PER_MESSAGE (a frame can be half received)
+// follow its message in {"type": "unparsed"} messages that the successor appends to it.
+// The successor answers {"type": "ack"} once it has everything: messages the kernel accepted
+// may still die with the successor, so only the ack hands the state over.
+namespace HotUpgrade
+{
+    inline constexpr size_t UDP_CLIENTS_PER_MESSAGE = 500;
+    inline constexpr size_t SESSIONS_PER_MESSAGE = 200;
+    inline constexpr size_t UNPARSED_BYTES_PER_MESSAGE = 32 * 1024;
+    inline constexpr auto ACK_TIMEOUT = std::chrono::seconds(5);
+
+    inline bool sendMessage(int socket, const nlohmann::json& message, const std::vector<int>& fds = {}) {
+        return SocketHandoff::send(socket, nlohmann::json::to_cbor(message), fds);
+    }
+
+    // Blocks for at most ACK_TIMEOUT.
+    inline bool awaitAck(int socket) {
+        timeval timeout{std::chrono::duration_cast<std::chrono::seconds>(ACK_TIMEOUT).count(), 0};
+        ::setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::vector<uint8_t> bytes;
+        std::vector<int> fds;
+        bool received = SocketHandoff::receive(socket, bytes, fds);
+        for (int fd : fds) {
+            ::close(fd);
+        }
+        auto message = received ? nlohmann::json::from_cbor(bytes, true, false) : nlohmann::json();
+        auto type = message.is_object() ? message.find("type") : message.end();
+        return type != message.end() && *type == "ack";
+    }
+
+    // True only once the successor has acknowledged everything; see awaitAck().
+    inline bool send(int socket, const InheritedState& state) {
+        nlohmann::json listeners = {{"type", "listeners"},
+                                    {"udp", state.udp_fd >= 0},
+                                    {"federation", state.federation_fd >= 0},
+                                    {"acceptors", state.acceptor_fds.size()}};
+        std::vector<int> fds;
+        for (int fd : {state.udp_fd, state.federation_fd}) {
+            if (fd >= 0) {
+                fds.push_back(fd);
+            }
+        }
+        fds.insert(fds.end(), state.acceptor_fds.begin(), state.acceptor_fds.end());
+        if (!sendMessage(socket, listeners, fds)) {
+            return false;
+        }
+
+        for (size_t first = 0; first < state.udp_clients.size(); first += UDP_CLIENTS_PER_MESSAGE) {
+            nlohmann::json clients = nlohmann::json::array();
+            size_t last = std::min(first + UDP_CLIENTS_PER_MESSAGE, state.udp_clients.size());
+            for (size_t i = first; i < last; ++i) {
+                clients.push_back({state.udp_clients[i].first, state.udp_clients[i].second});
+            }
+            if (!sendMessage(socket, {{"type", "udp_clients"}, {"clients", clients}})) {
+                return false;
+            }
+        }
+
+        size_t next = 0;
+        while (next < state.websocket_sessions.size()) {
+            nlohmann::json sessions = nlohmann::json::array();
+            std::vector<int> session_fds;
+            size_t unparsed_bytes = 0;
+            std::span<const uint8_t> rest;  // of the message's last session, sent after it
+            while (next < state.websocket_sessions.size() && session_fds.size() < SESSIONS_PER_MESSAGE &&
+                   rest.empty()) {
+                const auto& session = state.websocket_sessions[next];
+                std::span<const uint8_t> unparsed = session.unparsed;
+                size_t head = std::min(unparsed.size(), UNPARSED_BYTES_PER_MESSAGE);
+                size_t bytes = head + session.uuid.size() + session.request_target.size();
+                if (!session_fds.empty() && unparsed_bytes + bytes > UNPARSED_BYTES_PER_MESSAGE) {
+                    break;
+                }
+                ++next;
+                sessions.push_back({{"uuid", session.uuid},
+                                    {"target", session.request_target},
+                                    {"unparsed", nlohmann::json::binary(std::vector<uint8_t>(
+                                                     unparsed.begin(), unparsed.begin() + head))}});
+                session_fds.push_back(session.fd);
+                unparsed_bytes += bytes;
+                rest = unparsed.subspan(head);
+            }
+            if (!sendMessage(socket, {{"type", "websocket"}, {"sessions", sessions}}, session_fds)) {
+                return false;
+            }
+            for (size_t offset = 0; offset < rest.size(); offset += UNPARSED_BYTES_PER_MESSAGE) {
+                auto chunk = rest.subspan(offset, std::min(rest.size() - offset, UNPARSED_BYTES_PER_MESSAGE));
+                nlohmann::json more = {{"type", "unparsed"},
+                                       {"bytes", nlohmann::json::binary(std::vector<uint8_t>(chunk.begin(), chunk.end()))}};
+                if (!sendMessage(socket, more)) {
+                    return false;
+                }
+            }
+        }
+        return sendMessage(socket, {{"type", "done"}}) && awaitAck(socket);
+    }
+
+    // Reads what send() wrote. On failure every descriptor received so far is closed. A message
+    // with a missing or mistyped field fails the handover like one that is not CBOR at all.
+    inline bool receive(int socket, InheritedState& state) {
+        std::vector<uint8_t> bytes;
+        // The last session of the last "websocket" message, which "unparsed" messages continue
+        std::optional<size_t> continued;
+        while (true) {
+            std::vector<int> fds;
+            bool received = SocketHandoff::receive(socket, bytes, fds);
+            auto message = received ? nlohmann::json::from_cbor(bytes, true, false) : nlohmann::json();
+            auto type_field = message.is_object() ? message.find("type") : message.end();
+            std::string type = type_field != message.end() && type_field->is_string()
+                                   ? type_field->get<std::string>() : "";
+            bool malformed = false;
+            size_t next_fd = 0;
+            auto take_fd = [&]() { return next_fd < fds.size() ? fds[next_fd++] : -1; };
+            // The field, or nullptr if the message lacks it
+            auto field = [](const nlohmann::json& object, const char* key) -> const nlohmann::json* {
+                auto it = object.find(key);
+                return it != object.end() ? &*it : nullptr;
+            };
+
+            if (type == "listeners") {
+                const auto* udp = field(message, "udp");
+                const auto* federation = field(message, "federation");
+                const auto* acceptors = field(message, "acceptors");
+                malformed = !udp || !udp->is_boolean() || !federation || !federation->is_boolean() ||
+                            !acceptors || !acceptors->is_number_unsigned();
+                if (!malformed) {
+                    if (udp->get<bool>()) {
+                        state.udp_fd = take_fd();
+                    }
+                    if (federation->get<bool>()) {
+                        state.federation_fd = take_fd();
+                    }
+                    for (size_t i = 0; i < acceptors->get<size_t>(); ++i) {
+                        if (int fd = take_fd(); fd >= 0) {
+                            state.acceptor_fds.push_back(fd);
+                        }
+                    }
+                }
+            } else if (type == "udp_clients") {
+                const auto* clients = field(message, "clients");
+                malformed = !clients || !clients->is_array();
+                for (size_t i = 0; !malformed && i < clients->size(); ++i) {
+                    const auto& client = (*clients)[i];
+                    malformed = !client.is_array() || client.size() != 2 || !client[0].is_string() ||
+                                !client[1].is_string();
+                    if (!malformed) {
+                        state.udp_clients.emplace_back(client[0].get<std::string>(), client[1].get<std::string>());
+                    }
+                }
+            } else if (type == "websocket") {
+                continued.reset();
+                const auto* sessions = field(message, "sessions");
+                malformed = !sessions || !sessions->is_array();
+                for (size_t i = 0; !malformed && i < sessions->size(); ++i) {
+                    const auto& entry = (*sessions)[i];
+                    const auto* uuid = entry.is_object() ? field(entry, "uuid") : nullptr;
+                    const auto* target = entry.is_object() ? field(entry, "target") : nullptr;
+                    const auto* unparsed = entry.is_object() ? field(entry, "unparsed") : nullptr;
+                    malformed = !uuid || !uuid->is_string() || !target || !target->is_string() ||
+                                !unparsed || !unparsed->is_binary();
+                    if (malformed) {
+                        break;
+                    }
+                    WebSocketSession::Handover session;
+                    session.fd = take_fd();
+                    session.uuid = uuid->get<std::string>();
+                    session.request_target = target->get<std::string>();
+                    session.unparsed = unparsed->get_binary();
+                    continued.reset();
+                    if (session.fd >= 0) {
+                        state.websocket_sessions.push_back(std::move(session));
+                        continued = state.websocket_sessions.size() - 1;
+                    }
+                }
+            } else if (type == "unparsed") {
+                const auto* more = field(message, "bytes");
+                malformed = !more || !more->is_binary();
+                // Dropped along with its session if that came without a descriptor
+                if (!malformed && continued) {
+                    auto& unparsed = state.websocket_sessions[*continued].unparsed;
+                    unparsed.insert(unparsed.end(), more->get_binary().begin(), more->get_binary().end());
+                }
+            } else if (type != "done" && !type.empty()) {
+                std::cerr << "Unexpected upgrade message" << std::endl;
+            }
+            // Anything the message did not account for
+            for (size_t i = next_fd; i < fds.size(); ++i) {
+                ::close(fds[i]);
+            }
+            if (type == "done") {
+                // Without the ack the old process keeps serving, so nothing may be kept
+                if (!sendMessage(socket, {{"type", "ack"}})) {
+                    state.close_all();
+                    return false;
+                }
+                return true;
+            }
+            if (type.empty() || malformed) {
+                if (malformed) {
+                    std::cerr << "Malformed upgrade message" << std::endl;
+                }
+                state.close_all();
+                return false;
+            }
+        }
+    }
+
+    // Connects to a running server's upgrade socket and takes over its state. False, with
+    // nothing inherited, if no server is listening there.
+    inline bool inherit(const std::string& path, InheritedState& state) {
+        asio::io_context io_context;
+        asio::local::seq_packet_protocol::socket socket(io_context);
+        std::error_code ec;
+        socket.connect(asio::local::seq_packet_protocol::endpoint(path), ec);
+        if (ec) {
+            return false;
+        }
+        std::cout << "Taking over from the server at " << path << std::endl;
+        return receive(socket.native_handle(), state);
+    }
+}
+
+// The old process's side: waits for a successor on the upgrade socket, collects the state with
+// export_handler (which may finish asynchronously, e.g. while sessions stop reading), sends it
+// and reports back with finished_handler. If the send fails, finished_handler gets the state
+// back with its descriptors still open, and start() can wait for another successor. Runs on
+// the io_context thread.
+class UpgradeListener : public std::enable_shared_from_this<UpgradeListener> {
+public:
+    using export_handler = std::function<void(std::function<void(InheritedState)> done)>;
+    using finished_handler = std::function<void(bool handed_over, InheritedState unsent)>;
+
+    // Replaces a stale socket file, e.g. the one of the process this one took over from.
+    UpgradeListener(asio::io_context& io_context, const std::string& path, export_handler on_export,
+                    finished_handler on_finished)
+        : acceptor_(io_context), on_export_(std::move(on_export)), on_finished_(std::move(on_finished)) {
+        ::unlink(path.c_str());
+        asio::local::seq_packet_protocol::endpoint endpoint(path);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+    }
+
+    void start() {
+        acceptor_.async_accept([this, self = shared_from_this()](std::error_code ec,
+                                                                  asio::local::seq_packet_protocol::socket socket) {
+            if (ec) {
+                if (ec != asio::error::operation_aborted) {
+                    std::cerr << "Upgrade accept error: " << ec.message() << std::endl;
+                    start();
+                }
+                return;
+            }
+            std::cout << "Handing over to a new server process" << std::endl;
+            auto successor = std::make_shared<asio::local::seq_packet_protocol::socket>(std::move(socket));
+            on_export_([this, self, successor](InheritedState state) {
+                if (HotUpgrade::send(successor->native_handle(), state)) {
+                    // The successor holds its own copies now
+                    state.close_all();
+                    on_finished_(true, {});
+                } else {
+                    on_finished_(false, std::move(state));
+                }
+            });
+        });
+    }
+
+private:
+    asio::local::seq_packet_protocol::acceptor acceptor_;
+    export_handler on_export_;
+    finished_handler on_finished_;
+};
@@ -0,0 +1,149 @@
+//
+// Created by maxim on 18.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include <HdrHistogram.h>
+
+// Sampled per-packet latency through the server pipeline:
+//   receive  kernel receive (SO_TIMESTAMPNS where available) -> enqueued in the room buffer
+//   queue    enqueued -> mix tick start
+//   mix      mix tick start -> the listener's mixed frame is ready
+//   send     mixed frame ready -> send completion
+//   total    kernel receive -> send completion
+// Every stage is recorded into a per-room and a server-wide histogram. Only one in
+// sample_every packets is traced, so the per-packet cost of untraced packets is a counter test.
+// A room's histograms live as long as the room, and only MAX_TRACED_ROOMS rooms at a time get
+// their own; the others count towards the server-wide ones only.
+class LatencyTracer {
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum class Stage : uint8_t { Receive, Queue, Mix, Send, Total, Count };
+
+    struct StageHistograms {
+        std::array<HdrHistogram, static_cast<size_t>(Stage::Count)> stages;
+
+        HdrHistogram& operator[](Stage stage) { return stages[static_cast<size_t>(stage)]; }
+        const HdrHistogram& operator[](Stage stage) const { return stages[static_cast<size_t>(stage)]; }
+    };
+
+    static constexpr size_t MAX_TRACED_ROOMS = 256;
+
+    // Histograms of one room; RoomManager holds on to it so recording needs no lookup.
+    class RoomTrace {
+    public:
+        RoomTrace(LatencyTracer& tracer, std::shared_ptr<StageHistograms> histograms)
+            : tracer_(tracer), histograms_(std::move(histograms)) {}
+
+        void record(Stage stage, clock::duration duration) {
+            auto ns = static_cast<uint64_t>(std::max<int64_t>(
+                0, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+            if (histograms_) {
+                (*histograms_)[stage].record(ns);
+            }
+            tracer_.global_[stage].record(ns);
+        }
+
+    private:
+        LatencyTracer& tracer_;
+        std::shared_ptr<StageHistograms> histograms_;
+    };
+
+    static LatencyTracer& get() {
+        static LatencyTracer instance;
+        return instance;
+    }
+
+    // Trace one in sample_every packets; 0 disables tracing.
+    void setSampleEvery(uint32_t sample_every) {
+        sample_every_.store(sample_every, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] bool enabled() const { return sample_every_.load(std::memory_order_relaxed) != 0; }
+
+    bool sample() {
+        uint32_t every = sample_every_.load(std::memory_order_relaxed);
+        if (every == 0) {
+            return false;
+        }
+        thread_local uint32_t counter = 0;
+        return ++counter % every == 0;
+    }
+
+    std::shared_ptr<RoomTrace> room(const std::string& roomId) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::erase_if(rooms_, [](const auto& entry) { return entry.second.expired(); });
+        auto histograms = rooms_[roomId].lock();
+        if (!histograms && rooms_.size() <= MAX_TRACED_ROOMS) {
+            histograms = std::make_shared<StageHistograms>();
+            rooms_[roomId] = histograms;
+        } else if (!histograms) {
+            rooms_.erase(roomId);
+        }
+        return std::make_shared<RoomTrace>(*this, std::move(histograms));
+    }
+
+    [[nodiscard]] const StageHistograms& global() const { return global_; }
+
+    // Text table of all stages, server-wide and per room, in microseconds.
+    std::string dump() {
+        std::ostringstream out;
+        out << "# latency in microseconds, 1 of " << sample_every_.load(std::memory_order_relaxed)
+            << " packets sampled\n";
+        dumpHistograms(out, "all", global_);
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& [roomId, room] : rooms_) {
+            if (auto histograms = room.lock()) {
+                dumpHistograms(out, roomId, *histograms);
+            }
+        }
+        return out.str();
+    }
+
+    static const char* stageName(Stage stage) {
+        switch (stage) {
+            case Stage::Receive: return "receive";
+            case Stage::Queue: return "queue";
+            case Stage::Mix: return "mix";
+            case Stage::Send: return "send";
+            case Stage::Total: return "total";
+            default: return "unknown";
+        }
+    }
+
+private:
+    LatencyTracer() = default;
+
+    static void dumpHistograms(std::ostringstream& out, const std::string& scope, const StageHistograms& histograms) {
+        for (size_t i = 0; i < static_cast<size_t>(Stage::Count); ++i) {
+            const auto& h = histograms.stages[i];
+            if (h.count() == 0) {
+                continue;
+            }
+            out << scope << " " << stageName(static_cast<Stage>(i))
+                << " count=" << h.count()
+                << " mean=" << h.mean() / 1000.0
+                << " p50=" << static_cast<double>(h.percentile(0.50)) / 1000.0
+                << " p99=" << static_cast<double>(h.percentile(0.99)) / 1000.0
+                << " p999=" << static_cast<double>(h.percentile(0.999)) / 1000.0
+                << " max=" << static_cast<double>(h.max()) / 1000.0 << "\n";
+        }
+    }
+
+    std::atomic<uint32_t> sample_every_{0};
+    StageHistograms global_;
+    std::mutex mutex_;
+    std::map<std::string, std::weak_ptr<StageHistograms>> rooms_;  // held by the rooms' traces
+};
@@ -0,0 +1,351 @@
+//
+// Created by maxim on 01.10.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "AudioMixer.h"
+#include "AudioPacket.h"
+#include "PcmFormat.h"
+
+#if defined(__x86_64__) && defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define MATRIX_MIXER_X86 1
+#include <immintrin.h>
+#else
+#define MATRIX_MIXER_X86 0
+#endif
+
+// Mixes a tick for every listener of a room at once. Each sender's packets become one source
+// frame, in the room's channels whatever their format (see PcmFormat.h): packets shorter than a
+// tick, from clients sending 2.5 to 10ms frames, follow one another in arrival order, and a
+// packet that would run past the tick starts over at its beginning, so that packets of a tick's
+// length are mixed on top of each other as they always were. Each listener is routed
+// the sources they hear with a gain and gets its mix in its own format. Listener l then gets,
+// per sample, AudioMixer::mix() of the packets routed to it with every packet scaled by its gain:
+//
+//     out_l[i] = sum_s g_ls * num_s[i] / sum_s cov_s[i]   (over the sources l hears)
+//
+// where num_s is the source's samples times their weight (number of sources mixed into them)
+// and cov_s the weight of its packets covering sample i. With all gains 1 and packets of a tick
+// or more it matches AudioMixer::mix() sample for sample.
+//
+// mix() makes one pass over the source frames, a tile of samples at a time: each tile of a
+// source is loaded once and multiply-added into the same tile of every listener routed to it,
+// so sources and accumulators stay in cache however many listeners there are. The
+// multiply-add is vectorized (AVX2 or SSE2). Frames of 10 or 20ms, the usual ones, take loops
+// specialized for their length, from converting packets through the sweep to the output.
+//
+// Buffers are kept between ticks, so a room's mixer allocates only while its ticks grow.
+class MatrixMixer {
+    static constexpr size_t LANES = 8;
+    static constexpr size_t TILE = 256;  // samples; one tile of a listener is 1KB
+
+    // Samples a channel of frames takes in the buffers
+    static constexpr size_t padded(size_t frames) { return (frames + LANES - 1) / LANES * LANES; }
+
+public:
+    // Frames a room mixes per tick, see RoomManager::MIX_INTERVAL
+    static constexpr size_t TICK_FRAMES = Pcm::FRAME_20MS;
+
+    // Without specialize every frame takes the loops for any length; for benchmarks.
+    explicit MatrixMixer(bool specialize = true) : specialize_(specialize) {}
+
+    // Starts a tick for listeners, numbered from 0, in a room of channels (1 or 2).
+    void begin(size_t listeners, size_t channels = 1) {
+        sourceCount_ = 0;
+        packets_.clear();
+        listeners_.assign(listeners, Listener{});
+        channels_ = channels;
+    }
+
+    // Adds one sender's packets, all in format, as a source and returns its number. They are
+    // read by mix(), so must stay valid until then.
+    template<typename Packets>
+    size_t addSource(const Packets& packets, Pcm::Format format = {}) {
+        if (sourceCount_ == sources_.size()) {
+            sources_.emplace_back();
+        }
+        Source& source = sources_[sourceCount_];
+        source.routes.clear();  // Keeps its capacity for the next ticks
+        source.format = format;
+        source.first_packet = packets_.size();
+        source.length = 0;
+        source.weight = 0;
+        size_t offset = 0;
+        uint32_t layer_weight = 0;  // of the packets laid out since the last start over
+        for (const auto& packet : packets) {
+            size_t frames = format.frames(packet.size());
+            if (offset > 0 && offset + frames > TICK_FRAMES) {
+                source.weight += layer_weight;
+                offset = 0;
+                layer_weight = 0;
+            }
+            packets_.push_back({&packet, offset});
+            layer_weight = std::max<uint32_t>(layer_weight, packet.sources());
+            source.length = std::max(source.length, offset + frames);
+            offset += frames;
+        }
+        source.weight += layer_weight;
+        source.packet_count = packets_.size() - source.first_packet;
+        return sourceCount_++;
+    }
+
+    // listener hears source at gain; sources not routed to a listener are not heard by it.
+    void route(size_t source, size_t listener, float gain) {
+        if (gain == 0.0f) {
+            return;
+        }
+        sources_[source].routes.push_back({static_cast<uint32_t>(listener), gain});
+        Listener& target = listeners_[listener];
+        target.heard = true;
+        target.weight += sources_[source].weight;
+        target.length = std::max(target.length, sources_[source].length);
+    }
+
+    void mix() {
+        size_t length = 0;
+        for (size_t s = 0; s < sourceCount_; ++s) {
+            length = std::max(length, sources_[s].length);
+        }
+        stride_ = padded(length);
+        block_ = channels_ * stride_;
+        prepareSources(length);
+        prepareListeners();
+        if (block_ == 0) {
+            return;
+        }
+        if (specialize_) {
+            switch (block_) {
+                case padded(Pcm::FRAME_10MS): return sweep<padded(Pcm::FRAME_10MS)>();
+                case padded(Pcm::FRAME_20MS): return sweep<padded(Pcm::FRAME_20MS)>();
+                case 2 * padded(Pcm::FRAME_10MS): return sweep<2 * padded(Pcm::FRAME_10MS)>();
+                case 2 * padded(Pcm::FRAME_20MS): return sweep<2 * padded(Pcm::FRAME_20MS)>();
+                default: break;
+            }
+        }
+        sweep<0>();
+    }
+
+    // Whether the listener was routed any source this tick.
+    [[nodiscard]] bool heard(size_t listener) const { return listeners_[listener].heard; }
+
+    // The listener's mix after mix() in format, scaled by gain and clipped like AudioMixer::mix().
+    [[nodiscard]] AudioPacket output(size_t listener, Pcm::Format format = {},
+                                     float gain = AudioMixer::HEADROOM) const {
+        const Listener& target = listeners_[listener];
+        if (!target.heard) {
+            return AudioPacket();
+        }
+        std::vector<uint8_t> bytes(target.length * format.bytesPerFrame());
+        const float* accumulated = &accumulators_[listener * block_];
+        const float* covered = target.varying ? &coverage_[listener * block_] : nullptr;
+        Pcm::dispatch(format.sample, channels_, format.channels, target.length, specialize_,
+                      [&]<typename Sample, size_t In, size_t Out, size_t Frames>() {
+                          Pcm::encode<Sample, In, Out, Frames>(accumulated, covered,
+                                                               static_cast<float>(target.full_weight), stride_,
+                                                               target.length, gain, bytes.data());
+                      });
+        AudioPacket mixed(std::move(bytes));
+        mixed.set_sources(static_cast<uint16_t>(std::min<uint32_t>(target.weight, UINT16_MAX)));
+        return mixed;
+    }
+
+private:
+    struct Route {
+        uint32_t listener;
+        float gain;
+    };
+
+    struct Source {
+        Pcm::Format format;
+        size_t first_packet = 0;
+        size_t packet_count = 0;
+        size_t length = 0;     // frames its packets span
+        uint32_t weight = 0;   // sum over its layers of packets of their most sources()
+        bool full = false;     // every packet spans the whole tick, so its coverage is weight throughout
+        std::vector<Route> routes;
+    };
+
+    // A packet and the frame of the tick it starts at
+    struct Placed {
+        const AudioPacket* packet;
+        size_t offset;
+    };
+
+    struct Listener {
+        bool heard = false;
+        bool varying = false;  // hears a source that is not full, so needs per-sample coverage
+        uint32_t weight = 0;
+        uint32_t full_weight = 0;
+        size_t length = 0;
+    };
+
+    // Weighted samples of each source in the room's channels, one block of stride per channel,
+    // zero beyond its packets; coverage only for sources whose packets end early.
+    void prepareSources(size_t length) {
+        frames_.assign(sourceCount_ * block_, 0.0f);
+        bool varying = false;
+        for (size_t s = 0; s < sourceCount_; ++s) {
+            Source& source = sources_[s];
+            source.full = true;
+            for (size_t p = 0; p < source.packet_count; ++p) {
+                const Placed& placed = packets_[source.first_packet + p];
+                source.full = source.full && placed.offset == 0 && source.format.frames(placed.packet->size()) == length;
+            }
+            varying = varying || !source.full;
+        }
+        if (varying) {
+            sourceCoverage_.assign(sourceCount_ * block_, 0.0f);
+        }
+        for (size_t s = 0; s < sourceCount_; ++s) {
+            const Source& source = sources_[s];
+            float* frame = &frames_[s * block_];
+            float* covered = source.full ? nullptr : &sourceCoverage_[s * block_];
+            for (size_t p = 0; p < source.packet_count; ++p) {
+                const auto& [packet, offset] = packets_[source.first_packet + p];
+                size_t count = source.format.frames(packet->size());
+                auto weight = static_cast<float>(packet->sources());
+                Pcm::dispatch(source.format.sample, source.format.channels, channels_, count, specialize_,
+                              [&]<typename Sample, size_t In, size_t Out, size_t Frames>() {
+                                  Pcm::accumulate<Sample, In, Out, Frames>(packet->data(), count, weight,
+                                                                           frame + offset, stride_);
+                              });
+                if (covered) {
+                    for (size_t c = 0; c < channels_; ++c) {
+                        std::for_each_n(covered + c * stride_ + offset, count, [weight](float& w) { w += weight; });
+                    }
+                }
+            }
+        }
+    }
+
+    void prepareListeners() {
+        for (size_t s = 0; s < sourceCount_; ++s) {
+            const Source& source = sources_[s];
+            for (const Route& route : source.routes) {
+                Listener& listener = listeners_[route.listener];
+                if (source.full) {
+                    listener.full_weight += source.weight;
+                } else {
+                    listener.varying = true;
+                }
+            }
+        }
+        if (accumulators_.size() < listeners_.size() * block_) {
+            accumulators_.resize(listeners_.size() * block_);
+        }
+        if (coverage_.size() < listeners_.size() * block_) {
+            coverage_.resize(listeners_.size() * block_);
+        }
+    }
+
+    // The pass over all sources, Block being block_ when known at compile time, 0 for any.
+    // Channels are swept as one run of samples, as every channel of a source has the same gain.
+    template<size_t Block>
+    void sweep() {
+        const size_t block = Block ? Block : block_;
+        for (size_t tile = 0; tile < block; tile += TILE) {
+            if constexpr (Block == 0) {
+                sweepTile<0>(tile, std::min(TILE, block - tile));
+            } else if (tile + TILE <= Block) {
+                sweepTile<TILE>(tile, TILE);
+            } else {
+                sweepTile<Block % TILE>(tile, Block % TILE);
+            }
+        }
+    }
+
+    template<size_t N>
+    void sweepTile(size_t tile, size_t n) {
+        for (size_t l = 0; l < listeners_.size(); ++l) {
+            if (listeners_[l].heard) {
+                std::fill_n(&accumulators_[l * block_ + tile], N ? N : n, 0.0f);
+                if (listeners_[l].varying) {
+                    std::fill_n(&coverage_[l * block_ + tile], N ? N : n, 0.0f);
+                }
+            }
+        }
+        for (size_t s = 0; s < sourceCount_; ++s) {
+            const Source& source = sources_[s];
+            const float* samples = &frames_[s * block_ + tile];
+            for (const Route& route : source.routes) {
+                multiplyAdd<N>(&accumulators_[route.listener * block_ + tile], samples, route.gain, n);
+            }
+            if (!source.full) {
+                const float* covered = &sourceCoverage_[s * block_ + tile];
+                for (const Route& route : source.routes) {
+                    multiplyAdd<N>(&coverage_[route.listener * block_ + tile], covered, 1.0f, n);
+                }
+            }
+        }
+    }
+
+    // y += a * x over N floats, or n if N is 0. No fused multiply-add, so every path rounds
+    // the same way.
+    template<size_t N>
+    static void multiplyAdd(float* y, const float* x, float a, size_t n) {
+        if constexpr (N != 0) {
+            n = N;
+        }
+        size_t i = 0;
+#if MATRIX_MIXER_X86
+        if (n >= 8 && hasAvx2()) {
+            i = multiplyAddAvx2<N>(y, x, a, n);
+        }
+        i += multiplyAddSse2(y + i, x + i, a, n - i);
+#endif
+        for (; i < n; ++i) {
+            y[i] += a * x[i];
+        }
+    }
+
+#if MATRIX_MIXER_X86
+    // Vector loops return the number of floats processed.
+    template<size_t N>
+    __attribute__((target("avx2")))
+    static size_t multiplyAddAvx2(float* y, const float* x, float a, size_t n) {
+        if constexpr (N != 0) {
+            n = N;
+        }
+        const __m256 scale = _mm256_set1_ps(a);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256 sum = _mm256_add_ps(_mm256_loadu_ps(y + i), _mm256_mul_ps(scale, _mm256_loadu_ps(x + i)));
+            _mm256_storeu_ps(y + i, sum);
+        }
+        return i;
+    }
+
+    static size_t multiplyAddSse2(float* y, const float* x, float a, size_t n) {
+        const __m128 scale = _mm_set1_ps(a);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128 sum = _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(scale, _mm_loadu_ps(x + i)));
+            _mm_storeu_ps(y + i, sum);
+        }
+        return i;
+    }
+
+    static bool hasAvx2() {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+#endif
+
+    bool specialize_;
+    size_t channels_ = 1;
+    std::vector<Source> sources_;  // the first sourceCount_ are this tick's
+    size_t sourceCount_ = 0;
+    std::vector<Placed> packets_;
+    std::vector<Listener> listeners_;
+    size_t stride_ = 0;  // samples per channel in the buffers
+    size_t block_ = 0;   // per source or listener: channels_ * stride_
+    std::vector<float> frames_;
+    std::vector<float> sourceCoverage_;
+    std::vector<float> accumulators_;
+    std::vector<float> coverage_;
+};
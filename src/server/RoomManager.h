@@ -5,26 +5,50 @@
 
 
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <deque>
+#include <functional>
+#include <optional>
 #include <unordered_map>
 #include <asio.hpp>
 #include "Client.h"
 #include "AudioPacket.h"
-#include "AudioMixer.h"
+#include "FlightRecorder.h"
+#include "GainMatrix.h"
+#include "LatencyTracer.h"
+#include "MatrixMixer.h"
+#include "RoomRecorder.h"
+#include "TrafficCapture.h"
+#include "VoiceMetrics.h"
 
 class RoomManager : public std::enable_shared_from_this<RoomManager> {
 public:
-    RoomManager(asio::io_context& io_context)
-        : timer_(io_context), strand_(io_context) {
+    // Receives the mix of this node's speakers once per tick, for cascading to other nodes.
+    using partial_mix_handler = std::function<void(const std::string& roomId, const AudioPacket& partial)>;
+
+    // What drives the mix: the room's own timer every MIX_INTERVAL, or its owner calling tick()
+    // (voice_replay, on a simulated clock).
+    enum class Ticks { Timer, Manual };
+
+    RoomManager(asio::io_context& io_context, std::string roomId = "default", Ticks ticks = Ticks::Timer)
+        : roomId_(std::move(roomId)), ticks_(ticks), timer_(io_context), strand_(io_context),
+          trace_(LatencyTracer::get().room(roomId_)),
+          label_(FlightRecorder::Recorder::get().label(roomId_)) {
 
     }
 
+    const std::string& getRoomId() const { return roomId_; }
+
     void addClient(std::shared_ptr<Client> client) {
         std::lock_guard<std::mutex> lock(mutex_);
         clients_[client->getId()] = client;
-        if(clients_.size() == 1)
+        FlightRecorder::record(FlightRecorder::EventType::ClientAdded, label_,
+                               FlightRecorder::Recorder::get().label(client->getId()));
+        if (!mixing_ && ticks_ == Ticks::Timer)
         {
+            mixing_ = true;
             startMixingTimer();
         }
     }
@@ -33,6 +57,38 @@ public:
         std::lock_guard<std::mutex> lock(mutex_);
         clients_.erase(clientId);
         audioBuffers_.erase(clientId);
+        tracks_.erase(clientId);
+        gains_.remove(clientId);
+        uint64_t client = FlightRecorder::labelId(clientId);
+        FlightRecorder::record(FlightRecorder::EventType::ClientRemoved, label_, client);
+        FlightRecorder::Recorder::get().retire(client);
+    }
+
+    size_t getClientCount() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return clients_.size();
+    }
+
+    size_t countClients(ClientType type) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t count = 0;
+        for (const auto& [clientId, client] : clients_) {
+            if (client->getType() == type) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    std::vector<std::string> clientIds(ClientType type) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::string> ids;
+        for (const auto& [clientId, client] : clients_) {
+            if (client->getType() == type) {
+                ids.push_back(clientId);
+            }
+        }
+        return ids;
     }
 
     std::shared_ptr<Client> getClient(const std::string& clientId) {
@@ -41,79 +97,324 @@ public:
         return (it != clients_.end()) ? it->second : nullptr;
     }
 
+    void setPartialMixHandler(partial_mix_handler handler) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        partialMixHandler_ = std::move(handler);
+    }
+
+    // Records the room from its next tick on; nullptr stops recording.
+    void setRecorder(std::shared_ptr<RoomRecorder> recorder) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        recorder_ = std::move(recorder);
+        recording_.reset();
+        tracks_.clear();
+    }
+
+    void setCapture(std::shared_ptr<TrafficCapture::Writer> capture) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capture_ = std::move(capture);
+    }
+
+    // How loud listener hears speaker, 1 being as loud as everyone else; from the next tick on.
+    // Both must be in the room; false, and nothing changes, if not or if volume is not finite.
+    bool setVolume(const std::string& listener, const std::string& speaker, float volume) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!std::isfinite(volume) || !isPair(listener, speaker)) {
+            return false;
+        }
+        gains_.setVolume(listener, speaker, std::clamp(volume, 0.0f, MAX_VOLUME));
+        return true;
+    }
+
+    bool setMuted(const std::string& listener, const std::string& speaker, bool muted) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!isPair(listener, speaker)) {
+            return false;
+        }
+        gains_.setMuted(listener, speaker, muted);
+        return true;
+    }
+
+    // listener hears only speakers, or everyone again with nullopt. The speakers must be in
+    // the room, which bounds the set.
+    bool setSubscriptions(const std::string& listener, std::optional<std::vector<std::string>> speakers) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!clients_.contains(listener) ||
+            (speakers && !std::all_of(speakers->begin(), speakers->end(),
+                                      [this](const std::string& speaker) { return clients_.contains(speaker); }))) {
+            return false;
+        }
+        gains_.setSubscriptions(listener, std::move(speakers));
+        return true;
+    }
+
+    // One mix tick due at due, for Ticks::Manual rooms; false once the room is empty.
+    bool tick(std::chrono::steady_clock::time_point due) {
+        return runTick(due);
+    }
+
+    // Partial mix of another node's speakers; every local listener hears it.
+    void processRemoteMix(uint64_t node, const AudioPacket& packet) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (clients_.empty()) {
+            return;
+        }
+        auto& buffer = remoteMixes_[node];
+        buffer.push_back(packet);
+        if (buffer.size() > MAX_BUFFER_SIZE) {
+            buffer.pop_front();
+            VoiceMetrics::get().dropped_frames.inc();
+        }
+    }
+
     void processAudio(const std::string& senderId, const AudioPacket& packet) {
         std::lock_guard<std::mutex> lock(mutex_);
+        if (clients_.find(senderId) == clients_.end()) {
+            return;  // Left or evicted while the packet was on its way
+        }
+
+        if (capture_) {
+            capture_->audio(senderId, packet.bytes());
+        }
 
         // Add the new audio packet to the buffer for this client
-        audioBuffers_[senderId].push_back(packet);
+        auto& buffer = audioBuffers_[senderId];
+        buffer.push_back(packet);
+        if (packet.traced()) {
+            auto enqueued = std::chrono::steady_clock::now();
+            buffer.back().set_enqueued(enqueued);
+            trace_->record(LatencyTracer::Stage::Receive, enqueued - packet.timestamp());
+        }
 
         // Limit the buffer size to prevent excessive memory usage
         if (audioBuffers_[senderId].size() > MAX_BUFFER_SIZE) {
             audioBuffers_[senderId].pop_front();
+            VoiceMetrics::get().dropped_frames.inc();
+            FlightRecorder::record(FlightRecorder::EventType::QueueOverflow, label_,
+                                   FlightRecorder::labelId(senderId));
         }
-
-        // Update last activity timestamp for this client
-        clientLastActivity_[senderId] = std::chrono::steady_clock::now();
     }
 
+    static constexpr auto MIX_INTERVAL = std::chrono::milliseconds(20); // Mix every 20ms
+
 private:
     static constexpr size_t MAX_BUFFER_SIZE = 50; // Adjust based on your needs
-    static constexpr auto ACTIVITY_TIMEOUT = std::chrono::seconds(5);
-    static constexpr auto MIX_INTERVAL = std::chrono::milliseconds(20); // Mix every 20ms
+    static constexpr float MAX_VOLUME = 4.0f;
 
+    std::string roomId_;
+    Ticks ticks_;
     std::unordered_map<std::string, std::shared_ptr<Client>> clients_;
     std::unordered_map<std::string, std::deque<AudioPacket>> audioBuffers_;
-    std::unordered_map<std::string, std::chrono::steady_clock::time_point> clientLastActivity_;
+    std::unordered_map<uint64_t, std::deque<AudioPacket>> remoteMixes_;
+    partial_mix_handler partialMixHandler_;
     std::mutex mutex_;
     asio::steady_timer timer_;
     asio::io_context::strand strand_;
+    bool mixing_ = false;
+    std::shared_ptr<LatencyTracer::RoomTrace> trace_;
+    uint64_t label_;
+    std::shared_ptr<RoomRecorder> recorder_;
+    std::unique_ptr<RoomRecorder::Track> recording_;  // the room's mix, while it is running
+    std::unordered_map<std::string, std::unique_ptr<RoomRecorder::Track>> tracks_;  // participants who spoke
+    std::shared_ptr<TrafficCapture::Writer> capture_;
+    GainMatrix gains_;
+    MatrixMixer mixer_;
+    // Per mixer source: the speaker (null for a remote mix) and the arrival of its oldest traced packet
+    std::vector<std::pair<const std::string*, std::optional<AudioPacket::clock::time_point>>> sources_;
+    std::vector<std::optional<AudioPacket::clock::time_point>> listenersTracedSince_;
+
+    // Two different clients of the room; call with mutex_ held.
+    bool isPair(const std::string& listener, const std::string& speaker) const {
+        return listener != speaker && clients_.contains(listener) && clients_.contains(speaker);
+    }
 
     void startMixingTimer() {
         auto self(shared_from_this());
         timer_.expires_after(MIX_INTERVAL);
         timer_.async_wait(strand_.wrap([this, self](std::error_code ec) {
-            if (!ec) {
-                mixAndSendAudio();
+            if (!ec && runTick(timer_.expiry())) {
                 startMixingTimer(); // Reschedule the timer
             }
         }));
     }
 
+    // Mixes and sends, timing the tick against due; false if the room is empty and stops ticking.
+    bool runTick(std::chrono::steady_clock::time_point due) {
+        auto& metrics = VoiceMetrics::get();
+        auto start = std::chrono::steady_clock::now();
+        auto lateness = start - due;
+        metrics.mix_tick_lateness.observe(std::chrono::duration<double>(lateness).count());
+        FlightRecorder::record(FlightRecorder::EventType::TickStarted, label_, nanoseconds(lateness));
+        mixAndSendAudio();
+        auto finish = std::chrono::steady_clock::now();
+        metrics.mix_tick_duration.observe(std::chrono::duration<double>(finish - start).count());
+        FlightRecorder::record(FlightRecorder::EventType::TickFinished, label_, nanoseconds(finish - start));
+        // The tick should be done before the next one is due
+        auto deadline = due + MIX_INTERVAL;
+        if (finish > deadline) {
+            FlightRecorder::record(FlightRecorder::EventType::TickOverrun, label_, nanoseconds(finish - deadline));
+            FlightRecorder::Recorder::get().dumpOnAnomaly("tick-overrun");
+        }
+        // An empty room stops ticking; addClient() starts it again
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (clients_.empty()) {
+            mixing_ = false;
+            // The next participant starts a new recording
+            recording_.reset();
+            tracks_.clear();
+            return false;
+        }
+        return true;
+    }
+
+    Pcm::Format formatOf(const std::string& clientId) const {
+        auto it = clients_.find(clientId);
+        return it != clients_.end() ? it->second->format() : Pcm::Format{};
+    }
+
+    static uint64_t nanoseconds(std::chrono::steady_clock::duration duration) {
+        return static_cast<uint64_t>(std::max<int64_t>(
+            0, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+    }
+
+    // Queues this tick's audio for the recorder: mixed, what a listener hearing everyone gets,
+    // and with tracks on, each speaker's own packets in order. Only copies into its ring.
+    // Recordings are mono int16 whatever the room and its participants send. A file that could
+    // not be started, the ring being full, is tried again on the next tick.
+    void record(std::chrono::steady_clock::time_point now, const AudioPacket& mixed) {
+        if (!recording_ || !recording_->isOpen()) {
+            recording_ = RoomRecorder::openRoom(recorder_, roomId_);
+        }
+        if (!mixed.empty()) {
+            recording_->write({reinterpret_cast<const int16_t*>(mixed.data()), mixed.size() / sizeof(int16_t)}, now);
+        }
+
+        if (!recorder_->tracks()) {
+            return;
+        }
+        for (const auto& [clientId, buffer] : audioBuffers_) {
+            if (buffer.empty()) {
+                continue;
+            }
+            auto& track = tracks_[clientId];
+            if (!track || !track->isOpen()) {
+                track = RoomRecorder::openTrack(recorder_, roomId_, clientId);
+            }
+            auto format = formatOf(clientId);
+            for (const auto& packet : buffer) {
+                if (format == Pcm::Format{}) {
+                    track->write({reinterpret_cast<const int16_t*>(packet.data()), packet.size() / sizeof(int16_t)}, now);
+                } else {
+                    track->write(Pcm::toMonoInt16(packet.data(), packet.size(), format), now);
+                }
+            }
+        }
+    }
+
     void mixAndSendAudio() {
         std::lock_guard<std::mutex> lock(mutex_);
         auto now = std::chrono::steady_clock::now();
 
+        for (const auto& [bufferId, buffer] : audioBuffers_) {
+            for (const auto& packet : buffer) {
+                if (packet.traced()) {
+                    trace_->record(LatencyTracer::Stage::Queue, now - packet.enqueued());
+                }
+            }
+        }
+
+        // The room is stereo while anyone in it is
+        size_t channels = 1;
         for (const auto& [clientId, client] : clients_) {
-            std::vector<AudioPacket> packetsToMix;
+            channels = std::max<size_t>(channels, client->format().channels);
+        }
 
-            for (const auto& [bufferId, buffer] : audioBuffers_) {
-                auto lastActivity = clientLastActivity_[bufferId];
-                if (bufferId != clientId && !buffer.empty()) {
-                    if (now - lastActivity <= ACTIVITY_TIMEOUT) {
-                        packetsToMix.insert(packetsToMix.end(), buffer.begin(), buffer.end());
+        // Every listener's mix in one pass, and after the participants' those of two listeners
+        // hearing everyone: other nodes (local speakers only) and the recorder. Only senders
+        // heard since the last tick are sources, as buffers are emptied every tick
+        const size_t cascade = clients_.size();
+        const size_t recording = cascade + 1;
+        mixer_.begin(clients_.size() + 2, channels);
+        sources_.clear();
+        for (const auto& [bufferId, buffer] : audioBuffers_) {
+            if (!buffer.empty()) {
+                mixer_.addSource(buffer, formatOf(bufferId));
+                // Arrival of its oldest traced packet, if any
+                std::optional<AudioPacket::clock::time_point> traced_since;
+                for (const auto& packet : buffer) {
+                    if (packet.traced() && (!traced_since || packet.timestamp() < *traced_since)) {
+                        traced_since = packet.timestamp();
                     }
                 }
+                sources_.push_back({&bufferId, traced_since});
             }
-
-            if (!packetsToMix.empty()) {
-                AudioPacket mixedPacket = AudioMixer::mix(packetsToMix);
-                client->send(mixedPacket);
+        }
+        for (const auto& [node, buffer] : remoteMixes_) {
+            if (!buffer.empty()) {
+                mixer_.addSource(buffer);
+                sources_.push_back({nullptr, std::nullopt});
+            }
+        }
+        listenersTracedSince_.assign(clients_.size(), std::nullopt);
+        size_t listener = 0;
+        for (const auto& [clientId, client] : clients_) {
+            bool everyone = gains_.isDefault(clientId);
+            auto& traced_since = listenersTracedSince_[listener];
+            for (size_t source = 0; source < sources_.size(); ++source) {
+                const auto& [speaker, source_traced] = sources_[source];
+                float gain = speaker == nullptr ? gains_.remoteGain(clientId)
+                             : everyone         ? (*speaker == clientId ? 0.0f : 1.0f)
+                                                : gains_.gain(clientId, *speaker);
+                mixer_.route(source, listener, gain);
+                if (gain != 0.0f && source_traced && (!traced_since || *source_traced < *traced_since)) {
+                    traced_since = source_traced;
+                }
             }
+            ++listener;
         }
+        for (size_t source = 0; source < sources_.size(); ++source) {
+            bool local = sources_[source].first != nullptr;
+            mixer_.route(source, cascade, partialMixHandler_ && local ? 1.0f : 0.0f);
+            mixer_.route(source, recording, recorder_ ? 1.0f : 0.0f);
+        }
+        mixer_.mix();
 
-        // Clear processed packets
-        for (auto& [bufferId, buffer] : audioBuffers_) {
-            buffer.clear();
+        // Federation and recordings take mono int16, the cascade at full scale: the receiving
+        // node applies headroom when it mixes this in
+        if (mixer_.heard(cascade)) {
+            partialMixHandler_(roomId_, mixer_.output(cascade, {}, 1.0f));
         }
 
-        // Clean up inactive clients
-        for (auto it = clientLastActivity_.begin(); it != clientLastActivity_.end();) {
-            if (now - it->second > ACTIVITY_TIMEOUT) {
-                audioBuffers_.erase(it->first);
-                it = clientLastActivity_.erase(it);
+        listener = 0;
+        for (const auto& [clientId, client] : clients_) {
+            size_t index = listener++;
+            if (!mixer_.heard(index)) {
+                continue;
+            }
+            AudioPacket mixedPacket = mixer_.output(index, client->format());
+            FlightRecorder::record(FlightRecorder::EventType::SendQueued,
+                                   FlightRecorder::labelId(clientId), mixedPacket.size());
+            if (const auto& traced_since = listenersTracedSince_[index]) {
+                auto ready = std::chrono::steady_clock::now();
+                trace_->record(LatencyTracer::Stage::Mix, ready - now);
+                client->send(mixedPacket, [trace = trace_, ready, received = *traced_since]() {
+                    auto sent = std::chrono::steady_clock::now();
+                    trace->record(LatencyTracer::Stage::Send, sent - ready);
+                    trace->record(LatencyTracer::Stage::Total, sent - received);
+                });
             } else {
-                ++it;
+                client->send(mixedPacket);
             }
         }
+
+        if (recorder_) {
+            record(now, mixer_.output(recording));
+        }
+
+        // Clear processed packets; buffers of departed clients go with removeClient()
+        for (auto& [bufferId, buffer] : audioBuffers_) {
+            buffer.clear();
+        }
+        remoteMixes_.clear();
     }
 };
\ No newline at end of file
@@ -0,0 +1,411 @@
+//
+// Created by maxim on 29.09.2024.
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Logger.h"
+#include "MpscRing.h"
+#include "VoiceMetrics.h"
+#include "WavFile.h"
+
+struct RecordingSettings {
+    std::string directory = "recordings";
+    std::vector<std::string> rooms;  // rooms to record; "*" records all of them
+    bool tracks = false;             // also each participant on their own, besides the room's mix
+    uint32_t sample_rate = 44100;
+    size_t queue_frames = 4096;      // of FRAME_SAMPLES each
+    size_t buffer_size = 1024 * 1024;  // per file, rounded to whole pages; one write each time it fills
+    bool direct_io = true;           // O_DIRECT where the file system allows it
+};
+
+// Records rooms to WAV files without the mix tick ever touching the disk. A room opens a Track
+// per file and writes the samples of each tick to it, which only copies them into a lock-free
+// ring; a writer thread gathers each file's samples into a page-aligned buffer and writes it
+// out once it is full, bypassing the page cache where O_DIRECT is available.
+//
+// Every frame carries its sample position in the file, so gaps (a room with nobody talking, or
+// frames dropped while the ring was full) come out as silence and the recording keeps time.
+class RoomRecorder {
+public:
+    static constexpr size_t FRAME_SAMPLES = 1024;
+
+    // One file being recorded. Not thread-safe: a room writes its tracks under its own lock.
+    class Track {
+    public:
+        Track(const Track&) = delete;
+        Track& operator=(const Track&) = delete;
+
+        ~Track() {
+            if (stream_ != 0) {
+                recorder_->pushClose(stream_);
+            }
+        }
+
+        // False if the writer never heard of the file (the ring was full); open a new one.
+        [[nodiscard]] bool isOpen() const { return stream_ != 0; }
+
+        // Appends samples at now. When the track has fallen behind the clock by more than
+        // MAX_JITTER, it skips ahead and the writer fills the gap with silence.
+        void write(std::span<const int16_t> samples, std::chrono::steady_clock::time_point now) {
+            if (stream_ == 0) {
+                return;
+            }
+            // A track opened during a tick is younger than that tick's now
+            auto elapsed = std::max(0.0, std::chrono::duration<double>(now - opened_).count());
+            auto due = static_cast<uint64_t>(elapsed * recorder_->settings_.sample_rate);
+            auto jitter = std::chrono::duration<double>(MAX_JITTER).count() * recorder_->settings_.sample_rate;
+            if (due > position_ + static_cast<uint64_t>(jitter)) {
+                position_ = due;
+            }
+            for (size_t offset = 0; offset < samples.size(); offset += FRAME_SAMPLES) {
+                auto count = std::min(FRAME_SAMPLES, samples.size() - offset);
+                bool queued = recorder_->ring_.push([&](Frame& frame) {
+                    frame.stream = stream_;
+                    frame.kind = Frame::Kind::Audio;
+                    frame.position = position_;
+                    frame.length = static_cast<uint32_t>(count);
+                    std::memcpy(frame.samples, samples.data() + offset, count * sizeof(int16_t));
+                });
+                if (!queued) {
+                    VoiceMetrics::get().recording_dropped_frames.inc();
+                }
+                position_ += count;
+            }
+        }
+
+    private:
+        friend class RoomRecorder;
+
+        static constexpr auto MAX_JITTER = std::chrono::milliseconds(200);
+
+        Track(std::shared_ptr<RoomRecorder> recorder, uint64_t stream)
+            : recorder_(std::move(recorder)), stream_(stream), opened_(std::chrono::steady_clock::now()) {}
+
+        std::shared_ptr<RoomRecorder> recorder_;
+        uint64_t stream_;  // 0 if the file could not be announced to the writer
+        std::chrono::steady_clock::time_point opened_;
+        uint64_t position_ = 0;
+    };
+
+    explicit RoomRecorder(RecordingSettings settings)
+        : settings_(std::move(settings)), ring_(settings_.queue_frames) {
+        settings_.buffer_size = std::max<size_t>((settings_.buffer_size + PAGE - 1) / PAGE * PAGE, PAGE);
+        std::error_code ec;
+        std::filesystem::create_directories(settings_.directory, ec);
+        writer_ = std::thread(&RoomRecorder::writerThread, this);
+    }
+
+    // Waits for the writer to finish every file still open.
+    ~RoomRecorder() {
+        stop_.store(true, std::memory_order_release);
+        writer_.join();
+    }
+
+    RoomRecorder(const RoomRecorder&) = delete;
+    RoomRecorder& operator=(const RoomRecorder&) = delete;
+
+    [[nodiscard]] bool wants(const std::string& roomId) const {
+        return std::any_of(settings_.rooms.begin(), settings_.rooms.end(),
+                           [&](const std::string& room) { return room == "*" || room == roomId; });
+    }
+
+    [[nodiscard]] bool tracks() const { return settings_.tracks; }
+
+    // The room's mix: <room>-<UTC time>.wav
+    static std::unique_ptr<Track> openRoom(const std::shared_ptr<RoomRecorder>& recorder, const std::string& roomId) {
+        return recorder->open(recorder, sanitize(roomId) + "-" + timestamp());
+    }
+
+    // One participant: <room>-<UTC time>-<client>.wav
+    static std::unique_ptr<Track> openTrack(const std::shared_ptr<RoomRecorder>& recorder, const std::string& roomId,
+                                            const std::string& clientId) {
+        return recorder->open(recorder, sanitize(roomId) + "-" + timestamp() + "-" + sanitize(clientId));
+    }
+
+private:
+    static constexpr size_t PAGE = 4096;  // O_DIRECT alignment of buffers, offsets and lengths
+    static constexpr auto POLL_INTERVAL = std::chrono::milliseconds(10);
+
+    struct Frame {
+        enum class Kind : uint8_t { Open, Audio, Close };
+
+        uint64_t stream;
+        Kind kind;
+        uint32_t length;    // Open: of the file name in samples' bytes; Audio: samples
+        uint64_t position;  // Audio: of the first sample in the file
+        int16_t samples[FRAME_SAMPLES];
+    };
+
+    // Writer side of one file. The buffer holds the file from offset on; the first one starts
+    // with room for the header, which is written for real on close.
+    struct Stream {
+        int fd = -1;
+        bool direct = false;
+        std::string path;
+        uint8_t* buffer = nullptr;
+        size_t filled = 0;
+        uint64_t offset = 0;
+        uint64_t samples = 0;
+    };
+
+    std::unique_ptr<Track> open(const std::shared_ptr<RoomRecorder>& self, std::string name) {
+        uint64_t stream = nextStream_.fetch_add(1, std::memory_order_relaxed);
+        name = (std::filesystem::path(settings_.directory) / (name + ".wav")).string();
+        name.resize(std::min(name.size(), sizeof(Frame::samples)));
+        bool queued = ring_.push([&](Frame& frame) {
+            frame.stream = stream;
+            frame.kind = Frame::Kind::Open;
+            frame.length = static_cast<uint32_t>(name.size());
+            std::memcpy(frame.samples, name.data(), name.size());
+        });
+        if (!queued) {
+            VoiceMetrics::get().recording_dropped_frames.inc();
+            LOG_WARNING_LIMITED("Recording queue full, could not start %s", name);
+            stream = 0;
+        }
+        return std::unique_ptr<Track>(new Track(self, stream));
+    }
+
+    // A close must not be lost, or its file would stay open without its header; with the ring
+    // full it goes to the side, which takes a lock only in that case. It remembers how far the
+    // ring was claimed, so the writer applies it only after the stream's last frames.
+    void pushClose(uint64_t stream) {
+        bool queued = ring_.push([&](Frame& frame) {
+            frame.stream = stream;
+            frame.kind = Frame::Kind::Close;
+        });
+        if (!queued) {
+            std::lock_guard<std::mutex> lock(overflowMutex_);
+            overflowCloses_.push_back({stream, ring_.claimed()});
+        }
+    }
+
+    static std::string sanitize(std::string_view name) {
+        std::string result(name);
+        for (char& c : result) {
+            if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_' && c != '.') {
+                c = '_';
+            }
+        }
+        return result.empty() ? "_" : result;
+    }
+
+    static std::string timestamp() {
+        auto now = std::chrono::system_clock::now();
+        std::time_t seconds = std::chrono::system_clock::to_time_t(now);
+        std::tm tm{};
+        gmtime_r(&seconds, &tm);
+        char stamp[32];
+        size_t length = std::strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%S", &tm);
+        auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+        std::snprintf(stamp + length, sizeof(stamp) - length, ".%03dZ", static_cast<int>(millis));
+        return stamp;
+    }
+
+    void writerThread() {
+        auto& metrics = VoiceMetrics::get();
+        while (true) {
+            bool stopping = stop_.load(std::memory_order_acquire);
+            while (ring_.pop([this](Frame& frame) { handle(frame); })) {
+            }
+            // The drain stops at a slot claimed but not yet filled; closes queued behind it wait
+            std::vector<OverflowClose> closes;
+            {
+                std::lock_guard<std::mutex> lock(overflowMutex_);
+                auto pending = std::partition(overflowCloses_.begin(), overflowCloses_.end(),
+                                              [this](const OverflowClose& close) { return close.after > ring_.consumed(); });
+                closes.assign(pending, overflowCloses_.end());
+                overflowCloses_.erase(pending, overflowCloses_.end());
+            }
+            for (const auto& overflow : closes) {
+                close(overflow.stream);
+            }
+            metrics.recording_backlog.set(static_cast<int64_t>(ring_.size()));
+            if (stopping) {
+                break;
+            }
+            std::this_thread::sleep_for(POLL_INTERVAL);
+        }
+        for (auto& [id, stream] : streams_) {
+            finish(stream);
+        }
+        streams_.clear();
+    }
+
+    void handle(const Frame& frame) {
+        switch (frame.kind) {
+            case Frame::Kind::Open:
+                openStream(frame.stream, std::string(reinterpret_cast<const char*>(frame.samples), frame.length));
+                break;
+            case Frame::Kind::Audio:
+                if (auto it = streams_.find(frame.stream); it != streams_.end()) {
+                    append(it->second, frame);
+                }
+                break;
+            case Frame::Kind::Close:
+                close(frame.stream);
+                break;
+        }
+    }
+
+    void openStream(uint64_t id, std::string path) {
+        Stream stream;
+        stream.path = std::move(path);
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        if (settings_.direct_io) {
+            stream.fd = ::open(stream.path.c_str(), flags | O_DIRECT, 0644);
+            stream.direct = stream.fd >= 0;
+        }
+        if (stream.fd < 0) {
+            // Not every file system takes O_DIRECT (tmpfs does not)
+            stream.fd = ::open(stream.path.c_str(), flags, 0644);
+        }
+        void* buffer = nullptr;
+        if (stream.fd < 0 || ::posix_memalign(&buffer, PAGE, settings_.buffer_size) != 0) {
+            std::cerr << "Failed to open recording " << stream.path << ": " << std::strerror(errno) << std::endl;
+            if (stream.fd >= 0) {
+                ::close(stream.fd);
+            }
+            return;
+        }
+        stream.buffer = static_cast<uint8_t*>(buffer);
+        stream.filled = WavFile::HEADER_SIZE;
+        std::memset(stream.buffer, 0, WavFile::HEADER_SIZE);
+        streams_.emplace(id, std::move(stream));
+    }
+
+    void append(Stream& stream, const Frame& frame) {
+        if (frame.position < stream.samples) {
+            return;  // Overlaps what is written already; the producer never goes back, so not expected
+        }
+        // Silence up to the frame, then the frame
+        uint64_t silence = frame.position - stream.samples;
+        copy(stream, nullptr, silence * sizeof(int16_t));
+        copy(stream, frame.samples, frame.length * sizeof(int16_t));
+        stream.samples = frame.position + frame.length;
+    }
+
+    // Appends bytes (zeros if data is null) to the buffer, writing it out each time it fills.
+    void copy(Stream& stream, const void* data, uint64_t bytes) {
+        auto source = static_cast<const uint8_t*>(data);
+        while (bytes > 0 && stream.buffer != nullptr) {
+            size_t count = std::min<uint64_t>(bytes, settings_.buffer_size - stream.filled);
+            if (source != nullptr) {
+                std::memcpy(stream.buffer + stream.filled, source, count);
+                source += count;
+            } else {
+                std::memset(stream.buffer + stream.filled, 0, count);
+            }
+            stream.filled += count;
+            bytes -= count;
+            if (stream.filled == settings_.buffer_size) {
+                flush(stream);
+            }
+        }
+    }
+
+    // Writes the buffer at the stream's offset: whole pages at page-aligned offsets except for
+    // the tail on close, which is written after O_DIRECT is turned off.
+    bool flush(Stream& stream) {
+        auto& metrics = VoiceMetrics::get();
+        size_t done = 0;
+        while (done < stream.filled) {
+            auto start = std::chrono::steady_clock::now();
+            ssize_t written = ::pwrite(stream.fd, stream.buffer + done, stream.filled - done,
+                                       static_cast<off_t>(stream.offset + done));
+            metrics.recording_write_duration.observe(
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            if (written < 0 && errno == EINVAL && stream.direct) {
+                // The file system refused the direct write after all
+                setDirect(stream, false);
+                continue;
+            }
+            if (written <= 0) {
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Failed to write recording " << stream.path << ": " << std::strerror(errno) << std::endl;
+                ::free(stream.buffer);
+                stream.buffer = nullptr;  // Dropped from here on; close() still fixes the header
+                return false;
+            }
+            done += static_cast<size_t>(written);
+            metrics.recording_bytes_written.inc(static_cast<uint64_t>(written));
+        }
+        stream.offset += stream.filled;
+        stream.filled = 0;
+        return true;
+    }
+
+    void setDirect(Stream& stream, bool direct) {
+        int flags = ::fcntl(stream.fd, F_GETFL);
+        if (flags >= 0 && ::fcntl(stream.fd, F_SETFL, direct ? flags | O_DIRECT : flags & ~O_DIRECT) == 0) {
+            stream.direct = direct;
+        }
+    }
+
+    void close(uint64_t id) {
+        auto it = streams_.find(id);
+        if (it != streams_.end()) {
+            finish(it->second);
+            streams_.erase(it);
+        }
+    }
+
+    // Writes what is left and the header with the final sizes.
+    void finish(Stream& stream) {
+        if (stream.direct) {
+            setDirect(stream, false);
+        }
+        if (stream.buffer != nullptr && stream.filled > 0) {
+            flush(stream);
+        }
+        uint64_t data_bytes = stream.buffer != nullptr
+                                  ? stream.samples * sizeof(int16_t)
+                                  : std::max<uint64_t>(stream.offset, WavFile::HEADER_SIZE) - WavFile::HEADER_SIZE;
+        auto header = WavFile::header({1, settings_.sample_rate}, data_bytes);
+        if (stream.direct || ::pwrite(stream.fd, header.data(), header.size(), 0) != static_cast<ssize_t>(header.size())) {
+            std::cerr << "Failed to finish recording " << stream.path << ": " << std::strerror(errno) << std::endl;
+        }
+        ::close(stream.fd);
+        ::free(stream.buffer);
+        stream.buffer = nullptr;
+    }
+
+    RecordingSettings settings_;
+    MpscRing<Frame> ring_;
+    std::atomic<uint64_t> nextStream_{1};
+    std::atomic<bool> stop_{false};
+    struct OverflowClose {
+        uint64_t stream;
+        uint64_t after;  // ring position its stream's frames are all before
+    };
+
+    std::mutex overflowMutex_;
+    std::vector<OverflowClose> overflowCloses_;
+    std::unordered_map<uint64_t, Stream> streams_;  // writer thread only
+    std::thread writer_;
+};
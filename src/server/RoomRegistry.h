@@ -0,0 +1,174 @@
+//
+// Created by maxim on 15.09.2024.
+//
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <asio.hpp>
+
+#include "RoomManager.h"
+
+// Owns every room on this server and remembers which room each client is in. Room names come
+// from clients, so a room only exists while someone is in it, and at most max rooms at once.
+class RoomRegistry {
+public:
+    static constexpr size_t DEFAULT_MAX_ROOMS = 10000;
+
+    explicit RoomRegistry(asio::io_context& io_context, RoomManager::Ticks ticks = RoomManager::Ticks::Timer)
+        : io_context_(io_context), ticks_(ticks) {}
+
+    // Rooms beyond max are not created; existing ones are kept.
+    void setMaxRooms(size_t max) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        maxRooms_ = max;
+    }
+
+    // nullptr if the room does not exist and the registry is full.
+    std::shared_ptr<RoomManager> getOrCreateRoom(const std::string& roomId) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return getOrCreateRoomLocked(roomId);
+    }
+
+    // Existing room, or nullptr; unlike getOrCreateRoom() this never creates one.
+    std::shared_ptr<RoomManager> findRoom(const std::string& roomId) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = rooms_.find(roomId);
+        return (it != rooms_.end()) ? it->second : nullptr;
+    }
+
+    // Installed on every room, current and future.
+    void setPartialMixHandler(RoomManager::partial_mix_handler handler) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        partialMixHandler_ = std::move(handler);
+        for (const auto& [roomId, room] : rooms_) {
+            room->setPartialMixHandler(partialMixHandler_);
+        }
+    }
+
+    // Rooms the recorder wants(), current and future, are recorded; nullptr stops all recording.
+    void setRecorder(std::shared_ptr<RoomRecorder> recorder) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        recorder_ = std::move(recorder);
+        for (const auto& [roomId, room] : rooms_) {
+            room->setRecorder(recorder_ && recorder_->wants(roomId) ? recorder_ : nullptr);
+        }
+    }
+
+    // Captures joins, leaves and the audio of every room, current and future; nullptr stops.
+    void setCapture(std::shared_ptr<TrafficCapture::Writer> capture) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capture_ = std::move(capture);
+        for (const auto& [roomId, room] : rooms_) {
+            room->setCapture(capture_);
+        }
+        // A capture starts with who is where already
+        if (capture_) {
+            for (const auto& [clientId, room] : clientRooms_) {
+                auto client = room->getClient(clientId);
+                capture_->join(clientId, room->getRoomId(), client ? client->format() : Pcm::Format{});
+            }
+        }
+    }
+
+    // Room the client currently belongs to, or nullptr if it has not joined one.
+    std::shared_ptr<RoomManager> findClientRoom(const std::string& clientId) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = clientRooms_.find(clientId);
+        return (it != clientRooms_.end()) ? it->second : nullptr;
+    }
+
+    // Adds the client to roomId, leaving its previous room if it had one. nullptr, with the
+    // client where it was, if roomId does not exist and the registry is full.
+    std::shared_ptr<RoomManager> joinRoom(const std::shared_ptr<Client>& client, const std::string& roomId) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto room = getOrCreateRoomLocked(roomId);
+        if (!room) {
+            return nullptr;
+        }
+        auto& current = clientRooms_[client->getId()];
+        if (current == room) {
+            return room;
+        }
+        if (current) {
+            current->removeClient(client->getId());
+            removeIfEmptyLocked(current);
+        }
+        current = room;
+        room->addClient(client);
+        if (capture_) {
+            capture_->join(client->getId(), roomId, client->format());
+        }
+        return room;
+    }
+
+    void leaveRoom(const std::string& clientId) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = clientRooms_.find(clientId);
+        if (it != clientRooms_.end()) {
+            it->second->removeClient(clientId);
+            removeIfEmptyLocked(it->second);
+            clientRooms_.erase(it);
+            if (capture_) {
+                capture_->leave(clientId);
+            }
+        }
+    }
+
+    std::vector<std::shared_ptr<RoomManager>> getRooms() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::shared_ptr<RoomManager>> rooms;
+        rooms.reserve(rooms_.size());
+        for (const auto& [roomId, room] : rooms_) {
+            rooms.push_back(room);
+        }
+        return rooms;
+    }
+
+private:
+    std::shared_ptr<RoomManager> getOrCreateRoomLocked(const std::string& roomId) {
+        if (!rooms_.contains(roomId) && rooms_.size() >= maxRooms_) {
+            LOG_WARNING_LIMITED("Not creating room %s, %zu rooms exist already", roomId, rooms_.size());
+            return nullptr;
+        }
+        auto& room = rooms_[roomId];
+        if (!room) {
+            room = std::make_shared<RoomManager>(io_context_, roomId, ticks_);
+            if (partialMixHandler_) {
+                room->setPartialMixHandler(partialMixHandler_);
+            }
+            if (recorder_ && recorder_->wants(roomId)) {
+                room->setRecorder(recorder_);
+            }
+            if (capture_) {
+                room->setCapture(capture_);
+            }
+        }
+        return room;
+    }
+
+    // Forgets a room its last client has left; its timer lets go of it on its next tick.
+    void removeIfEmptyLocked(const std::shared_ptr<RoomManager>& room) {
+        if (room->getClientCount() != 0) {
+            return;
+        }
+        auto it = rooms_.find(room->getRoomId());
+        if (it != rooms_.end() && it->second == room) {
+            rooms_.erase(it);
+            FlightRecorder::Recorder::get().retire(FlightRecorder::labelId(room->getRoomId()));
+        }
+    }
+
+    asio::io_context& io_context_;
+    RoomManager::Ticks ticks_;
+    size_t maxRooms_ = DEFAULT_MAX_ROOMS;
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<RoomManager>> rooms_;
+    std::unordered_map<std::string, std::shared_ptr<RoomManager>> clientRooms_;
+    RoomManager::partial_mix_handler partialMixHandler_;
+    std::shared_ptr<RoomRecorder> recorder_;
+    std::shared_ptr<TrafficCapture::Writer> capture_;
+};
@@ -1,3 +1,4 @@
+#include <charconv>
 #include <iostream>
 #include <string>
 #include <memory>
@@ -6,70 +7,476 @@
 #include <utility>
 #include <WebSocketServer.h>
 
+#ifdef __linux__
+#include <sys/socket.h>
+#include <cstring>
+#include <ctime>
+#endif
+#include <unistd.h>
+
 #include "AsioThreadPool.h"
+#include "BinaryLog.h"
 #include "Config.h"
-#include "RoomManager.h"
+#include "Federation.h"
+#include "FlightRecorder.h"
+#include "HotUpgrade.h"
+#include "LatencyTracer.h"
+#include "Logger.h"
+#include "RoomProtocol.h"
+#include "RoomRegistry.h"
+#include "TimerWheel.h"
 
 
 using asio::ip::udp;
 
+// When clients count as gone. Any datagram or WebSocket frame counts as activity.
+struct LivenessSettings {
+    std::chrono::milliseconds udp_idle_timeout{30000};
+    std::chrono::milliseconds websocket_ping_interval{15000};  // idle time before a ping
+    std::chrono::milliseconds websocket_pong_timeout{10000};   // then the session is closed
+};
+
 class VoiceChatServer : public std::enable_shared_from_this<VoiceChatServer> {
 public:
-    VoiceChatServer(asio::io_context &io_context, short port)
-        : io_context_(io_context), socket_(io_context, udp::endpoint(udp::v4(), port)) {
-        room_manager_ = std::make_shared<RoomManager>(io_context);
+    VoiceChatServer(asio::io_context &io_context, short port, const LivenessSettings &liveness = {})
+        : VoiceChatServer(io_context, udp::socket(io_context, udp::endpoint(udp::v4(), port)), liveness) {}
+
+    // Serves on a UDP socket inherited from a previous process (see release_udp()).
+    VoiceChatServer(asio::io_context &io_context, udp::socket socket, const LivenessSettings &liveness = {})
+        : io_context_(io_context), socket_(std::move(socket)),
+          liveness_settings_(liveness), liveness_timer_(io_context) {
+        room_registry_ = std::make_shared<RoomRegistry>(io_context);
+        register_metrics();
     }
 
     void start() {
         std::cout << "Voice Chat Server started. Waiting for clients..." << std::endl;
         start_receive();
+        start_liveness_timer();
+    }
+
+    // Records the rooms recorder wants() to disk.
+    void set_recorder(std::shared_ptr<RoomRecorder> recorder) {
+        room_registry_->setRecorder(std::move(recorder));
+    }
+
+    // Writes what the rooms receive to a traffic capture for voice_replay.
+    void set_capture(std::shared_ptr<TrafficCapture::Writer> capture) {
+        room_registry_->setCapture(std::move(capture));
+    }
+
+    void set_max_rooms(size_t max_rooms) {
+        room_registry_->setMaxRooms(max_rooms);
+    }
+
+    // Cascades this node's rooms to the federation peers and mixes theirs in. inherited_fd is the
+    // trunk socket of a previous process, if there was one.
+    void start_federation(const FederationSettings &settings, int inherited_fd = -1) {
+        if (inherited_fd >= 0) {
+            federation_ = std::make_shared<FederationTrunk>(
+                io_context_, udp::socket(io_context_, udp::v4(), inherited_fd), settings, room_registry_);
+        } else {
+            federation_ = std::make_shared<FederationTrunk>(io_context_, settings, room_registry_);
+        }
+        std::weak_ptr<FederationTrunk> weak_trunk = federation_;
+        room_registry_->setPartialMixHandler([weak_trunk](const std::string &room_id, const AudioPacket &partial) {
+            if (auto trunk = weak_trunk.lock()) {
+                trunk->sendPartial(room_id, partial);
+            }
+        });
+        federation_->start();
+    }
+
+    // Stops serving UDP for a successor process: returns a duplicate of the socket, or -1, and
+    // fills clients with each UDP client's key and room. The clients leave their rooms here.
+    int release_udp(std::vector<std::pair<std::string, std::string>> &clients) {
+        for (const auto &room : room_registry_->getRooms()) {
+            for (const auto &client_key : room->clientIds(ClientType::UDP)) {
+                clients.emplace_back(client_key, room->getRoomId());
+            }
+        }
+        for (const auto &[client_key, room_id] : clients) {
+            room_registry_->leaveRoom(client_key);
+        }
+        int fd = ::dup(socket_.native_handle());
+        std::error_code ignored;
+        socket_.close(ignored);
+        return fd;
+    }
+
+    int release_federation() {
+        return federation_ ? federation_->release() : -1;
+    }
+
+    // Serves again on the socket release_udp() gave up, with its clients back in their rooms,
+    // when the successor process did not take them over.
+    void resume_udp(int fd, const std::vector<std::pair<std::string, std::string>> &clients) {
+        std::error_code ec;
+        socket_.assign(udp::v4(), fd, ec);
+        if (ec) {
+            std::cerr << "Failed to resume UDP socket: " << ec.message() << std::endl;
+            ::close(fd);
+            return;
+        }
+        for (const auto &[client_key, room_id] : clients) {
+            restore_udp_client(client_key, room_id);
+        }
+        start_receive();
+    }
+
+    void resume_federation(int fd) {
+        if (federation_) {
+            federation_->resume(fd);
+        } else {
+            ::close(fd);
+        }
+    }
+
+    // Puts a UDP client of the previous process back in its room, as if it had just sent a join.
+    void restore_udp_client(const std::string &client_key, const std::string &room_id) {
+        auto colon = client_key.rfind(':');
+        std::error_code ec;
+        auto address = asio::ip::make_address(client_key.substr(0, colon), ec);
+        // The port must be the whole suffix and a valid one; the handover is acked already, so
+        // a bad key only loses its client
+        unsigned int port = 0;
+        bool valid = colon != std::string::npos && !ec;
+        if (valid) {
+            const char *end = client_key.data() + client_key.size();
+            auto parsed = std::from_chars(client_key.data() + colon + 1, end, port);
+            valid = parsed.ec == std::errc() && parsed.ptr == end && port >= 1 && port <= 65535;
+        }
+        if (!valid) {
+            std::cerr << "Ignoring inherited client " << client_key << std::endl;
+            return;
+        }
+        udp::endpoint endpoint(address, static_cast<unsigned short>(port));
+        auto client = std::make_shared<UDPClient>(std::make_shared<Connection>(endpoint), socket_, client_key);
+        if (!room_registry_->joinRoom(client, room_id)) {
+            std::cerr << "No room for inherited client " << client_key << std::endl;
+            return;
+        }
+        std::lock_guard<std::mutex> lock(liveness_mutex_);
+        liveness_.schedule(client_key, std::chrono::steady_clock::now() + liveness_settings_.udp_idle_timeout, {});
     }
 
     void add_websocket_user(const std::shared_ptr<WebSocketSession> &connection) {
-        auto client = std::make_shared<WebSocketClient>(connection, socket_, connection->getUuid());
-        room_manager_->addClient(client);
-        std::cout << "New client connected: " << client->getId() << std::endl;
+        auto format = RoomProtocol::formatFromTarget(connection->getRequestTarget());
+        auto client = std::make_shared<WebSocketClient>(connection, socket_, connection->getUuid(), format);
+        auto room_id = RoomProtocol::roomFromTarget(connection->getRequestTarget());
+        if (!room_registry_->joinRoom(client, room_id)) {
+            connection->sendClose(1013);  // Try again later
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(liveness_mutex_);
+            liveness_.schedule(connection->getUuid(),
+                               std::chrono::steady_clock::now() + liveness_settings_.websocket_ping_interval,
+                               {connection, true, false});
+        }
+        std::cout << "New client connected: " << client->getId() << " (room " << room_id << ", "
+                  << format.name() << ")" << std::endl;
     }
 
-    void handle_receive_websocket(const std::string &client_key, const std::vector<uint8_t> &bytes) const {
-        const AudioPacket packet(bytes.data(), bytes.size());
-        room_manager_->processAudio(client_key, packet);
+    void remove_websocket_user(const std::shared_ptr<WebSocketSession> &connection) {
+        {
+            std::lock_guard<std::mutex> lock(liveness_mutex_);
+            liveness_.cancel(connection->getUuid());
+        }
+        room_registry_->leaveRoom(connection->getUuid());
+    }
+
+    // bytes points into the session's receive buffer; the room's buffer keeps the only copy.
+    // Every frame, pongs included, keeps the session alive; binary frames carry audio and text
+    // frames control messages.
+    void handle_receive_websocket(const std::string &client_key, WebSocketOpCode opcode, std::span<const std::byte> bytes) {
+        {
+            std::lock_guard<std::mutex> lock(liveness_mutex_);
+            if (auto *liveness = liveness_.reschedule(
+                    client_key, std::chrono::steady_clock::now() + liveness_settings_.websocket_ping_interval)) {
+                liveness->ping_sent = false;
+            }
+        }
+        if (opcode != WebSocketOpCode::Binary && opcode != WebSocketOpCode::Text) {
+            return;
+        }
+        auto room = room_registry_->findClientRoom(client_key);
+        if (!room) {
+            return;
+        }
+        if (opcode == WebSocketOpCode::Text) {
+            handle_control(*room, client_key, bytes);
+            return;
+        }
+        FlightRecorder::record(FlightRecorder::EventType::PacketReceived,
+                               FlightRecorder::labelId(client_key), bytes.size());
+        auto packet = AudioPacket::borrow(bytes);
+        if (LatencyTracer::get().sample()) {
+            packet.set_timestamp(AudioPacket::clock::now());
+            packet.set_traced(true);
+        }
+        room->processAudio(client_key, packet);
     }
 
 private:
+    // A control message of RoomProtocol; the sender is always the listener, so a client can
+    // only change what it hears itself.
+    void handle_control(RoomManager &room, const std::string &client_key, std::span<const std::byte> bytes) {
+        std::string_view text(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+        auto control = RoomProtocol::parseControl(text);
+        bool applied = false;
+        if (control) {
+            switch (control->type) {
+                case RoomProtocol::Control::Type::Volume:
+                    applied = room.setVolume(client_key, control->speaker, control->volume);
+                    break;
+                case RoomProtocol::Control::Type::Mute:
+                    applied = room.setMuted(client_key, control->speaker, control->muted);
+                    break;
+                case RoomProtocol::Control::Type::Subscribe:
+                    applied = room.setSubscriptions(client_key, std::move(control->speakers));
+                    break;
+            }
+        }
+        if (!applied) {
+            LOG_WARNING_LIMITED("Ignoring control message from %s: %s", client_key,
+                                std::string(text.substr(0, 200)));
+        }
+    }
+
     void start_receive() {
+#ifdef __linux__
+        if (LatencyTracer::get().enabled()) {
+            // Kernel receive timestamps, so the receive stage includes time spent in the socket queue
+            int enable = 1;
+            if (::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) == 0) {
+                socket_.non_blocking(true);
+                start_receive_timestamped();
+                return;
+            }
+            std::cerr << "SO_TIMESTAMPNS unavailable, tracing with user-space receive times" << std::endl;
+        }
+#endif
+        start_receive_untimestamped();
+    }
+
+    void start_receive_untimestamped() {
         socket_.async_receive_from(
             asio::buffer(recv_buffer_), remote_endpoint_,
             [this, self = shared_from_this()](std::error_code ec, std::size_t bytes_recvd) {
+                if (ec == asio::error::operation_aborted) {
+                    return;  // Released to a successor process
+                }
                 if (!ec && bytes_recvd > 0) {
-                    handle_receive(bytes_recvd);
+                    handle_receive(bytes_recvd, AudioPacket::clock::now());
+                } else {
+                    LOG_WARNING_LIMITED("Receive error: %s", ec.message());
+                }
+                start_receive_untimestamped();
+            });
+    }
+
+#ifdef __linux__
+    void start_receive_timestamped() {
+        socket_.async_wait(udp::socket::wait_read,
+            [this, self = shared_from_this()](std::error_code ec) {
+                if (ec == asio::error::operation_aborted) {
+                    return;  // Released to a successor process
+                }
+                if (ec) {
+                    LOG_WARNING_LIMITED("Receive error: %s", ec.message());
                 } else {
-                    std::cerr << "Receive error: " << ec.message() << std::endl;
+                    // Drain what is queued, bounded so one busy socket cannot starve the other handlers
+                    for (int i = 0; i < MAX_DATAGRAMS_PER_WAKEUP && receive_timestamped(); ++i) {
+                    }
+                }
+                start_receive_timestamped();
+            });
+    }
+
+    bool receive_timestamped() {
+        iovec iov{recv_buffer_.data(), recv_buffer_.size()};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(timespec))];
+        msghdr msg{};
+        msg.msg_name = remote_endpoint_.data();
+        msg.msg_namelen = static_cast<socklen_t>(remote_endpoint_.capacity());
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t bytes_recvd = ::recvmsg(socket_.native_handle(), &msg, MSG_DONTWAIT);
+        if (bytes_recvd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_WARNING_LIMITED("Receive error: %s", std::strerror(errno));
+            }
+            return false;
+        }
+        remote_endpoint_.resize(msg.msg_namelen);
+
+        auto received = AudioPacket::clock::now();
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                timespec kernel_time{};
+                std::memcpy(&kernel_time, CMSG_DATA(cmsg), sizeof(kernel_time));
+                // The kernel stamps CLOCK_REALTIME; shift it onto the steady clock by its age
+                timespec realtime_now{};
+                ::clock_gettime(CLOCK_REALTIME, &realtime_now);
+                auto age = std::chrono::seconds(realtime_now.tv_sec - kernel_time.tv_sec) +
+                           std::chrono::nanoseconds(realtime_now.tv_nsec - kernel_time.tv_nsec);
+                received -= std::chrono::duration_cast<AudioPacket::clock::duration>(age);
+            }
+        }
+        if (bytes_recvd > 0) {
+            handle_receive(static_cast<std::size_t>(bytes_recvd), received);
+        }
+        return true;
+    }
+#endif
+
+    void register_metrics() {
+        std::weak_ptr<RoomRegistry> weak_registry = room_registry_;
+        Metrics::registry().addCollector("voice_connected_clients", "Clients currently in a room", "gauge",
+            [weak_registry]() {
+                std::vector<std::pair<Metrics::Labels, double>> samples;
+                size_t udp = 0, websocket = 0;
+                if (auto registry = weak_registry.lock()) {
+                    for (const auto& room : registry->getRooms()) {
+                        udp += room->countClients(ClientType::UDP);
+                        websocket += room->countClients(ClientType::WEB_SOCKET);
+                    }
+                }
+                samples.push_back({{{"transport", "udp"}}, static_cast<double>(udp)});
+                samples.push_back({{{"transport", "websocket"}}, static_cast<double>(websocket)});
+                return samples;
+            });
+        Metrics::registry().addCollector("voice_room_participants", "Participants per room", "gauge",
+            [weak_registry]() {
+                std::vector<std::pair<Metrics::Labels, double>> samples;
+                if (auto registry = weak_registry.lock()) {
+                    for (const auto& room : registry->getRooms()) {
+                        samples.push_back({{{"room", room->getRoomId()}}, static_cast<double>(room->getClientCount())});
+                    }
                 }
-                start_receive();
+                return samples;
             });
     }
 
-    void handle_receive(std::size_t bytes_recvd) {
+    void handle_receive(std::size_t bytes_recvd, AudioPacket::clock::time_point received) {
+        auto& metrics = VoiceMetrics::get().udp;
+        metrics.packets_in.inc();
+        metrics.bytes_in.inc(bytes_recvd);
+
         std::string client_key = remote_endpoint_.address().to_string() + ":" +
                                  std::to_string(remote_endpoint_.port());
 
-        if (room_manager_->getClient(client_key) == nullptr) {
-            std::cout << "New client connected: " << client_key << std::endl;
-            auto connection = std::make_shared<Connection>(remote_endpoint_);
-            auto client = std::make_shared<UDPClient>(connection, socket_, client_key);
-            room_manager_->addClient(client);
+        FlightRecorder::record(FlightRecorder::EventType::PacketReceived,
+                               FlightRecorder::labelId(client_key), bytes_recvd);
+
+        std::string join_room;
+        bool is_join = RoomProtocol::parseJoin(recv_buffer_.data(), bytes_recvd, join_room);
+
+        auto room = room_registry_->findClientRoom(client_key);
+        if (room == nullptr || (is_join && room->getRoomId() != join_room)) {
+            std::shared_ptr<Client> client = room ? room->getClient(client_key) : nullptr;
+            if (client == nullptr) {
+                std::cout << "New client connected: " << client_key << std::endl;
+                auto connection = std::make_shared<Connection>(remote_endpoint_);
+                client = std::make_shared<UDPClient>(connection, socket_, client_key);
+            }
+            auto joined = room_registry_->joinRoom(client, is_join ? join_room : RoomProtocol::DEFAULT_ROOM);
+            // With the registry full, a client that has a room stays there
+            if (!joined && !room) {
+                return;
+            }
+            room = joined ? joined : room;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(liveness_mutex_);
+            auto deadline = received + liveness_settings_.udp_idle_timeout;
+            if (!liveness_.reschedule(client_key, deadline)) {
+                liveness_.schedule(client_key, deadline, {});
+            }
+        }
+
+        if (is_join) {
+            return;
         }
 
-        AudioPacket packet(recv_buffer_.data(), bytes_recvd);
-        room_manager_->processAudio(client_key, packet);
+        auto packet = AudioPacket::borrow(std::as_bytes(std::span(recv_buffer_.data(), bytes_recvd)));
+        packet.set_timestamp(received);
+        packet.set_traced(LatencyTracer::get().sample());
+        room->processAudio(client_key, packet);
     }
 
+    // Fires due liveness timers: idle UDP clients leave their room, idle WebSocket sessions get
+    // a ping and are closed if the pong timeout passes without any frame from them. The wheel
+    // makes this cost proportional to the timers that fire, not to the number of clients.
+    void start_liveness_timer() {
+        liveness_timer_.expires_after(LIVENESS_TICK);
+        liveness_timer_.async_wait([this, self = shared_from_this()](std::error_code ec) {
+            if (ec) {
+                return;
+            }
+            auto now = std::chrono::steady_clock::now();
+            std::vector<std::string> idle;
+            std::vector<std::shared_ptr<WebSocketSession>> to_ping;
+            std::vector<std::shared_ptr<WebSocketSession>> to_close;
+            {
+                std::lock_guard<std::mutex> lock(liveness_mutex_);
+                liveness_.advance(now, [&](const std::string &key, Liveness &liveness) {
+                    auto session = liveness.session.lock();
+                    if (!liveness.websocket || !session) {
+                        idle.push_back(key);
+                    } else if (!liveness.ping_sent) {
+                        to_ping.push_back(session);
+                        liveness.ping_sent = true;
+                        liveness_.schedule(key, now + liveness_settings_.websocket_pong_timeout, liveness);
+                    } else {
+                        to_close.push_back(session);
+                    }
+                });
+            }
+            // Sessions and rooms are called without the liveness lock, as their close path takes it
+            auto &metrics = VoiceMetrics::get();
+            for (const auto &key : idle) {
+                std::cout << "Client timed out: " << key << std::endl;
+                metrics.evicted_udp_idle.inc();
+                room_registry_->leaveRoom(key);
+            }
+            for (const auto &session : to_ping) {
+                metrics.websocket_pings.inc();
+                session->send(std::string(), WebSocketOpCode::Ping);
+            }
+            for (const auto &session : to_close) {
+                std::cout << "Client did not answer ping: " << session->getUuid() << std::endl;
+                metrics.evicted_pong_timeout.inc();
+                session->close();
+            }
+            start_liveness_timer();
+        });
+    }
+
+    struct Liveness {
+        std::weak_ptr<WebSocketSession> session;
+        bool websocket = false;
+        bool ping_sent = false;
+    };
+
+    static constexpr int MAX_DATAGRAMS_PER_WAKEUP = 64;
+    static constexpr auto LIVENESS_TICK = std::chrono::milliseconds(100);
+
     udp::socket socket_;
     udp::endpoint remote_endpoint_;
     std::array<uint8_t, 16384> recv_buffer_{};
     asio::io_context &io_context_;
-    std::shared_ptr<RoomManager> room_manager_;
+    std::shared_ptr<RoomRegistry> room_registry_;
+    std::shared_ptr<FederationTrunk> federation_;
+    LivenessSettings liveness_settings_;
+    std::mutex liveness_mutex_;
+    TimerWheel<std::string, Liveness> liveness_{LIVENESS_TICK};
+    asio::steady_timer liveness_timer_;
 };
 
 int main(int argc, char *argv[]) {
@@ -80,26 +487,219 @@ int main(int argc, char *argv[]) {
     Config config;
     config.load(argv[1]);
 
+    AsyncLogger::getInstance().setLogLevel(AsyncLogger::parseLogLevel(config.get<std::string>("log_level", "info")));
+    // Binary segments for voice_logdump instead of console lines
+    auto binary_log_dir = config.get<std::string>("binary_log_dir", "");
+    if (!binary_log_dir.empty()) {
+        BinaryLog::Settings binary_log;
+        binary_log.directory = binary_log_dir;
+        binary_log.segment_size = config.get<size_t>("binary_log_segment_mb", 64) * 1024 * 1024;
+        binary_log.rotate_interval = std::chrono::seconds(config.get<int>("binary_log_rotate_s", 3600));
+        binary_log.max_segments = config.get<size_t>("binary_log_max_segments", 24);
+        AsyncLogger::getInstance().addDestination(std::make_shared<BinaryLog::Destination>(binary_log));
+    }
+
+    // Register all metrics up front, outside any room lock
+    VoiceMetrics::get();
+    LatencyTracer::get().setSampleEvery(config.get<uint32_t>("trace_sample_every", 100));
+    FlightRecorder::Recorder::get().setDirectory(config.get<std::string>("flight_recorder_dir", "."));
+
     try {
         AsioThreadPool thread_pool(1);
 
-        auto server = std::make_shared<VoiceChatServer>(thread_pool.get_io_context(), config.get<short>("port", 12345));
+        LivenessSettings liveness;
+        liveness.udp_idle_timeout = std::chrono::milliseconds(
+            config.get<int>("udp_idle_timeout_ms", static_cast<int>(liveness.udp_idle_timeout.count())));
+        liveness.websocket_ping_interval = std::chrono::milliseconds(
+            config.get<int>("websocket_ping_interval_ms", static_cast<int>(liveness.websocket_ping_interval.count())));
+        liveness.websocket_pong_timeout = std::chrono::milliseconds(
+            config.get<int>("websocket_pong_timeout_ms", static_cast<int>(liveness.websocket_pong_timeout.count())));
+
+        // Hot upgrades are opt-in: with upgrade_socket set (empty, the default, turns them off), a
+        // server already listening there is replaced: this process takes over its sockets and
+        // clients, and it exits once its remaining connections are gone. Give each server its own
+        // path, or a second one started by mistake takes over the first
+        auto upgrade_socket = config.get<std::string>("upgrade_socket", "");
+        InheritedState inherited;
+        if (!upgrade_socket.empty() && HotUpgrade::inherit(upgrade_socket, inherited)) {
+            std::cout << "Inherited " << inherited.udp_clients.size() << " UDP clients and "
+                      << inherited.websocket_sessions.size() << " WebSocket sessions" << std::endl;
+        }
+
+        auto &io_context = thread_pool.get_io_context();
+        auto server = inherited.udp_fd >= 0
+                          ? std::make_shared<VoiceChatServer>(io_context, udp::socket(io_context, udp::v4(), inherited.udp_fd),
+                                                              liveness)
+                          : std::make_shared<VoiceChatServer>(io_context, config.get<short>("port", 12345), liveness);
 
-        const auto web_socket_server = std::make_shared<WebSocketServer>(thread_pool.get_io_context(), 8080, false);
+        TlsSettings tls;
+        tls.certificate_chain_file = config.get<std::string>("tls_certificate_chain", "");
+        tls.private_key_file = config.get<std::string>("tls_private_key", "");
+        tls.dh_params_file = config.get<std::string>("tls_dh_params", "");
+        tls.session_cache_size = config.get<long>("tls_session_cache_size", tls.session_cache_size);
+        tls.session_timeout_s = config.get<long>("tls_session_timeout_s", tls.session_timeout_s);
+        tls.ktls = config.get<bool>("tls_ktls", tls.ktls);
+        tls.handshake_threads = config.get<size_t>("tls_handshake_threads", tls.handshake_threads);
+
+        AcceptSettings accept;
+        accept.backlog = config.get<int>("websocket_backlog", accept.backlog);
+        accept.acceptors = config.get<size_t>("websocket_acceptors", accept.acceptors);
+        accept.max_accepts_per_wakeup = config.get<size_t>("websocket_max_accepts_per_wakeup", accept.max_accepts_per_wakeup);
+        accept.handshake_timeout = std::chrono::milliseconds(
+            config.get<int>("websocket_handshake_timeout_ms", static_cast<int>(accept.handshake_timeout.count())));
+
+        const auto web_socket_server =
+            inherited.acceptor_fds.empty()
+                ? std::make_shared<WebSocketServer>(io_context, config.get<short>("websocket_port", 8080),
+                                                    config.get<bool>("use_ssl", false), tls, accept)
+                : std::make_shared<WebSocketServer>(io_context, inherited.acceptor_fds, config.get<bool>("use_ssl", false),
+                                                    tls, accept);
+        WebSocketSession::SendPolicy send_policy;
+        send_policy.max_queued_bytes = config.get<size_t>("websocket_max_queued_bytes", send_policy.max_queued_bytes);
+        send_policy.max_queue_age = std::chrono::milliseconds(
+            config.get<int>("websocket_max_queue_ms", static_cast<int>(send_policy.max_queue_age.count())));
+        web_socket_server->set_send_policy(send_policy);
 
         web_socket_server->set_new_client_handler([server](const std::shared_ptr<WebSocketSession> &session) {
             server->add_websocket_user(session);
         });
-        web_socket_server->set_message_handler(
+        web_socket_server->set_close_handler([server](const std::shared_ptr<WebSocketSession> &session) {
+            server->remove_websocket_user(session);
+        });
+        web_socket_server->set_span_message_handler(
             [server](const std::shared_ptr<WebSocketSession> &session, const WebSocketOpCode opcode,
-                     const std::string &message) {
-                if (opcode == WebSocketOpCode::Binary) {
-                    const std::vector<uint8_t> data(message.begin(), message.end());
-                    server->handle_receive_websocket(session->getUuid(), data);
+                     std::span<const std::byte> payload) {
+                server->handle_receive_websocket(session->getUuid(), opcode, payload);
+            });
+
+        web_socket_server->set_http_handler([](const HttpRequest &request, HttpResponse &response) {
+            if (request.method != "GET" || request.target != "/debug/latency") {
+                return false;
+            }
+            response.headers.emplace_back("Content-Type", "text/plain");
+            response.body = LatencyTracer::get().dump();
+            return true;
+        });
+
+        // The browser client, served on the same port as its WebSocket
+        std::string static_dir = config.get<std::string>("static_dir", "");
+        if (!static_dir.empty()) {
+            web_socket_server->set_static_directory(static_dir);
+        }
+
+        // kill -USR1 <pid> writes the flight recorder rings for post-mortem analysis
+        asio::signal_set dump_signal(thread_pool.get_io_context(), SIGUSR1);
+        std::function<void()> wait_for_dump_signal = [&]() {
+            dump_signal.async_wait([&](const std::error_code &ec, int) {
+                if (ec) {
+                    return;
+                }
+                std::string path = FlightRecorder::Recorder::get().dump("sigusr1");
+                if (!path.empty()) {
+                    std::cout << "Flight recorder dumped to " << path << std::endl;
                 }
+                wait_for_dump_signal();
             });
+        };
+        wait_for_dump_signal();
 
+        // Compliance recordings, written by their own thread
+        auto recording_dir = config.get<std::string>("recording_dir", "");
+        auto recording_rooms = config.get<std::vector<std::string>>("recording_rooms", {});
+        if (!recording_dir.empty() && !recording_rooms.empty()) {
+            RecordingSettings recording;
+            recording.directory = recording_dir;
+            recording.rooms = recording_rooms;
+            recording.tracks = config.get<bool>("recording_tracks", recording.tracks);
+            recording.sample_rate = config.get<uint32_t>("recording_sample_rate", recording.sample_rate);
+            recording.queue_frames = config.get<size_t>("recording_queue_frames", recording.queue_frames);
+            recording.buffer_size = config.get<size_t>("recording_buffer_kb", recording.buffer_size / 1024) * 1024;
+            recording.direct_io = config.get<bool>("recording_direct_io", recording.direct_io);
+            server->set_recorder(std::make_shared<RoomRecorder>(recording));
+        }
+
+        auto capture_file = config.get<std::string>("capture_file", "");
+        if (!capture_file.empty()) {
+            server->set_capture(std::make_shared<TrafficCapture::Writer>(
+                capture_file, config.get<size_t>("capture_queue_records", 1024)));
+        }
+
+        server->set_max_rooms(config.get<size_t>("max_rooms", RoomRegistry::DEFAULT_MAX_ROOMS));
         server->start();
+
+        FederationSettings federation;
+        federation.port = config.get<unsigned short>("federation_port", 0);
+        if (federation.port != 0) {
+            federation.node_id = config.get<std::string>(
+                "federation_node_id", asio::ip::host_name() + ":" + std::to_string(federation.port));
+            federation.peers = config.get<std::vector<std::string>>("federation_peers", {});
+            server->start_federation(federation, inherited.federation_fd);
+        } else if (inherited.federation_fd >= 0) {
+            ::close(inherited.federation_fd);
+        }
+
+        for (const auto &[client_key, room_id] : inherited.udp_clients) {
+            server->restore_udp_client(client_key, room_id);
+        }
+        for (auto &session : inherited.websocket_sessions) {
+            web_socket_server->resume_session(io_context, std::move(session));
+        }
+
+        std::shared_ptr<UpgradeListener> upgrade_listener;
+        asio::steady_timer drain_timer(io_context);
+        auto drain_deadline = std::chrono::steady_clock::now();
+        std::function<void()> drain = [&]() {
+            if (web_socket_server->sessions().size() == 0 || std::chrono::steady_clock::now() >= drain_deadline) {
+                std::cout << "Handover complete, exiting" << std::endl;
+                thread_pool.stop();
+                return;
+            }
+            drain_timer.expires_after(std::chrono::milliseconds(50));
+            drain_timer.async_wait([&](const std::error_code &ec) {
+                if (!ec) {
+                    drain();
+                }
+            });
+        };
+        if (!upgrade_socket.empty()) {
+            upgrade_listener = std::make_shared<UpgradeListener>(
+                io_context, upgrade_socket,
+                [server, web_socket_server](std::function<void(InheritedState)> done) {
+                    InheritedState state;
+                    state.udp_fd = server->release_udp(state.udp_clients);
+                    state.acceptor_fds = web_socket_server->release_acceptors();
+                    state.federation_fd = server->release_federation();
+                    web_socket_server->release_sessions(
+                        [state = std::move(state), done](std::vector<WebSocketSession::Handover> sessions) mutable {
+                            state.websocket_sessions = std::move(sessions);
+                            done(std::move(state));
+                        });
+                },
+                [&](bool handed_over, InheritedState unsent) {
+                    if (!handed_over) {
+                        // Carry on as before; only the sessions asked to reconnect are lost
+                        std::cerr << "Handover to the new process failed, resuming service" << std::endl;
+                        if (unsent.udp_fd >= 0) {
+                            server->resume_udp(unsent.udp_fd, unsent.udp_clients);
+                        }
+                        if (unsent.federation_fd >= 0) {
+                            server->resume_federation(unsent.federation_fd);
+                        }
+                        web_socket_server->resume_acceptors(io_context, unsent.acceptor_fds);
+                        for (auto &session : unsent.websocket_sessions) {
+                            web_socket_server->resume_session(io_context, std::move(session));
+                        }
+                        upgrade_listener->start();
+                        return;
+                    }
+                    // Sessions asked to reconnect still have their close to finish
+                    drain_deadline = std::chrono::steady_clock::now() +
+                                     std::chrono::milliseconds(config.get<int>("upgrade_drain_timeout_ms", 5000));
+                    drain();
+                });
+            upgrade_listener->start();
+        }
+
         thread_pool.run();
     } catch (std::exception &e) {
         std::cerr << "Exception: " << e.what() << std::endl;
@@ -1,3 +1,6 @@
+// Audio travels as float32 planar (every sample of channel 0, then of channel 1), the layout
+// Web Audio already uses, so nothing is converted on the way in or out. The page asks the
+// server for it with format=float32 in the WebSocket URL.
 class VoiceProcessor extends AudioWorkletProcessor {
     constructor(options) {
         super();
@@ -5,9 +8,13 @@ class VoiceProcessor extends AudioWorkletProcessor {
         this.channels = options.processorOptions.channels;
         this.packetInterval = options.processorOptions.packetInterval;
         this.sampleRate = sampleRate;
-        this.inputBuffer = new Int16Array(this.framesPerBuffer * this.channels);
+        this.inputBuffers = [];
+        this.outputBuffers = [];
+        for (let channel = 0; channel < this.channels; channel++) {
+            this.inputBuffers.push(new Float32Array(this.framesPerBuffer));
+            this.outputBuffers.push(new Float32Array(this.framesPerBuffer));
+        }
         this.inputBufferIndex = 0;
-        this.outputBuffer = new Float32Array(this.framesPerBuffer * this.channels);
         this.outputBufferIndex = 0;
         this.lastPacketTime = 0;
 
@@ -15,10 +22,14 @@ class VoiceProcessor extends AudioWorkletProcessor {
     }
 
     handleRemoteAudio(event) {
-        const remoteAudio = new Int16Array(event.data);
-        for (let i = 0; i < remoteAudio.length; i++) {
-            this.outputBuffer[this.outputBufferIndex++] = remoteAudio[i] / 32768;
-            if (this.outputBufferIndex >= this.outputBuffer.length) {
+        const remoteAudio = new Float32Array(event.data);
+        const frames = remoteAudio.length / this.channels;
+        for (let i = 0; i < frames; i++) {
+            for (let channel = 0; channel < this.channels; channel++) {
+                this.outputBuffers[channel][this.outputBufferIndex] = remoteAudio[channel * frames + i];
+            }
+            this.outputBufferIndex++;
+            if (this.outputBufferIndex >= this.framesPerBuffer) {
                 this.outputBufferIndex = 0;
             }
         }
@@ -27,13 +38,16 @@ class VoiceProcessor extends AudioWorkletProcessor {
     process(inputs, outputs, parameters) {
         const input = inputs[0];
         const output = outputs[0];
-        const currentTime = globalThis.currentTime;;
+        const currentTime = globalThis.currentTime;
 
-        // Handle input
+        // Handle input; a mono microphone feeds every channel
         if (input.length > 0 && input[0].length > 0) {
             for (let i = 0; i < input[0].length; i++) {
-                this.inputBuffer[this.inputBufferIndex++] = Math.floor(input[0][i] * 32767);
-                if (this.inputBufferIndex >= this.inputBuffer.length) {
+                for (let channel = 0; channel < this.channels; channel++) {
+                    this.inputBuffers[channel][this.inputBufferIndex] = input[Math.min(channel, input.length - 1)][i];
+                }
+                this.inputBufferIndex++;
+                if (this.inputBufferIndex >= this.framesPerBuffer) {
                     this.sendInputBuffer();
                     this.inputBufferIndex = 0;
                 }
@@ -43,14 +57,16 @@ class VoiceProcessor extends AudioWorkletProcessor {
         // Handle output
         for (let channel = 0; channel < this.channels; channel++) {
             for (let i = 0; i < output[channel].length; i++) {
-                output[channel][i] = this.outputBuffer[i];
+                output[channel][i] = this.outputBuffers[channel][i];
             }
         }
 
         // Apply smoothing to reduce clicking
         const smoothingFactor = 0.1;
-        for (let i = 1; i < output[0].length; i++) {
-            output[0][i] = output[0][i-1] + smoothingFactor * (output[0][i] - output[0][i-1]);
+        for (let channel = 0; channel < this.channels; channel++) {
+            for (let i = 1; i < output[channel].length; i++) {
+                output[channel][i] = output[channel][i-1] + smoothingFactor * (output[channel][i] - output[channel][i-1]);
+            }
         }
 
         // Send any remaining input buffer if enough time has passed
@@ -66,8 +82,13 @@ class VoiceProcessor extends AudioWorkletProcessor {
     }
 
     sendInputBuffer() {
-        this.port.postMessage(this.inputBuffer.slice(0, this.inputBufferIndex).buffer, [this.inputBuffer.slice(0, this.inputBufferIndex).buffer]);
+        const frames = this.inputBufferIndex;
+        const packet = new Float32Array(frames * this.channels);
+        for (let channel = 0; channel < this.channels; channel++) {
+            packet.set(this.inputBuffers[channel].subarray(0, frames), channel * frames);
+        }
+        this.port.postMessage(packet.buffer, [packet.buffer]);
     }
 }
 
-registerProcessor('voice-processor', VoiceProcessor);
\ No newline at end of file
+registerProcessor('voice-processor', VoiceProcessor);